@@ -0,0 +1,11 @@
+// allocation storm: objects are dropped right after created
+class AllocationStorm {
+    public static int main(String[] args) {
+        int n = 0;
+        for (int i = 0; i < 20000; i++) {
+            new AllocationStorm();
+            n++;
+        }
+        return n;
+    }
+}
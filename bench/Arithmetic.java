@@ -0,0 +1,10 @@
+// arithmetic loop on locals
+class Arithmetic {
+    public static int main(String[] args) {
+        int sum = 0;
+        for (int i = 0; i < 30000; i++) {
+            sum = sum + i * i % 7 - i / 3;
+        }
+        return sum;
+    }
+}
@@ -0,0 +1,16 @@
+// field-heavy: short-lived objects whose fields are read and written
+class FieldChurn {
+    int x;
+    int y;
+
+    public static int main(String[] args) {
+        int sum = 0;
+        for (int i = 0; i < 5000; i++) {
+            FieldChurn f = new FieldChurn();
+            f.x = i;
+            f.y = f.x + 1;
+            sum = sum + f.y - f.x;
+        }
+        return sum;
+    }
+}
@@ -0,0 +1,13 @@
+// invoke-heavy: recursive static calls
+class Recursion {
+    static int fib(int n) {
+        if (n < 2) {
+            return n;
+        }
+        return fib(n - 1) + fib(n - 2);
+    }
+
+    public static int main(String[] args) {
+        return fib(20);
+    }
+}
@@ -0,0 +1,11 @@
+// static field counter in a loop
+class StaticCounter {
+    static int count;
+
+    public static int main(String[] args) {
+        for (int i = 0; i < 30000; i++) {
+            count = count + 1;
+        }
+        return count;
+    }
+}
@@ -0,0 +1,225 @@
+//
+// Microbenchmarks of the interpreter.
+// Each workload is run (like `run`) repeatedly after warmup, and the summary is written as JSON.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../main.h"
+
+struct workload {
+    char *name;
+    char *class_name;
+    int expected; // return value of main
+};
+
+static struct workload workloads[] = {
+        {"recursion", "Recursion.class", 6765},
+        {"field_churn", "FieldChurn.class", 5000},
+        {"static_counter", "StaticCounter.class", 30000},
+        {"allocation_storm", "AllocationStorm.class", 20000},
+        {"arithmetic", "Arithmetic.class", -149925001},
+};
+
+#define WORKLOAD_NUM ((int) (sizeof(workloads) / sizeof(workloads[0])))
+
+struct summary {
+    long long bytecodes; // per run, counted with statistics (where callees are not inlined)
+    double median_ns;
+    double p99_ns;
+    double mean_ns;
+    double min_ns;
+    double max_ns;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Run the workload once on a new VM and measure run_vm (creation and destruction of the VM are not measured).
+ * Return 0 if main returned the expected value, return -1 otherwise.
+ */
+static int run_once(struct workload *workload, double *ns) {
+    struct vm *vm;
+    double start;
+    int retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return -1;
+    }
+    start = now_ns();
+    retval = run_vm(vm, &workload->class_name, 1);
+    *ns = now_ns() - start;
+    destroy_vm(vm);
+
+    if (retval != workload->expected) {
+        fprintf(stderr, "%s: expect %d but actual %d\n", workload->name, workload->expected, retval);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Count the instructions of a run of the workload, which are counted only with statistics enabled.
+ * Return the count, or -1 if failed.
+ */
+static long long count_bytecodes(struct workload *workload) {
+    struct vm *vm;
+    long long bytecodes;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return -1;
+    }
+    if (enable_stats(vm, "/dev/null") != 0 || run_vm(vm, &workload->class_name, 1) != workload->expected) {
+        destroy_vm(vm);
+        return -1;
+    }
+    bytecodes = get_executed_bytecodes(vm);
+    destroy_vm(vm);
+    return bytecodes;
+}
+
+static int measure(struct workload *workload, int warmup, int iterations, struct summary *summary) {
+    double *samples, ns, sum = 0;
+    int i;
+
+    // counted apart from timed runs, since statistics slow the interpreter down
+    summary->bytecodes = count_bytecodes(workload);
+    if (summary->bytecodes < 0) {
+        return -1;
+    }
+    for (i = 0; i < warmup; i++) {
+        if (run_once(workload, &ns) != 0) {
+            return -1;
+        }
+    }
+
+    samples = calloc(iterations, sizeof(double));
+    if (samples == NULL) {
+        return -1;
+    }
+    for (i = 0; i < iterations; i++) {
+        if (run_once(workload, &samples[i]) != 0) {
+            free(samples);
+            return -1;
+        }
+        sum += samples[i];
+    }
+
+    qsort(samples, iterations, sizeof(double), compare_double);
+    summary->median_ns = iterations % 2 == 1
+            ? samples[iterations / 2]
+            : (samples[iterations / 2 - 1] + samples[iterations / 2]) / 2;
+    // nearest rank
+    summary->p99_ns = samples[(iterations * 99 + 99) / 100 - 1];
+    summary->mean_ns = sum / iterations;
+    summary->min_ns = samples[0];
+    summary->max_ns = samples[iterations - 1];
+
+    free(samples);
+    return 0;
+}
+
+static void write_json(FILE *out, struct workload *workload, int warmup, int iterations, struct summary *summary, int last) {
+    fprintf(out, "    {\n");
+    fprintf(out, "      \"name\": \"%s\",\n", workload->name);
+    fprintf(out, "      \"class\": \"%s\",\n", workload->class_name);
+    fprintf(out, "      \"warmup\": %d,\n", warmup);
+    fprintf(out, "      \"iterations\": %d,\n", iterations);
+    fprintf(out, "      \"bytecodes\": %lld,\n", summary->bytecodes);
+    fprintf(out, "      \"median_ns\": %.0f,\n", summary->median_ns);
+    fprintf(out, "      \"p99_ns\": %.0f,\n", summary->p99_ns);
+    fprintf(out, "      \"mean_ns\": %.0f,\n", summary->mean_ns);
+    fprintf(out, "      \"min_ns\": %.0f,\n", summary->min_ns);
+    fprintf(out, "      \"max_ns\": %.0f,\n", summary->max_ns);
+    // an op is a run of main (including loading of the class of the workload)
+    fprintf(out, "      \"ns_per_op\": %.0f,\n", summary->median_ns);
+    fprintf(out, "      \"bytecodes_per_sec\": %.0f\n", summary->bytecodes / (summary->median_ns / 1e9));
+    fprintf(out, "    }%s\n", last ? "" : ",");
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "usage: %s [--warmup N] [--iterations N] [--output FILE] [WORKLOAD ...]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    struct summary summaries[WORKLOAD_NUM];
+    int selected[WORKLOAD_NUM];
+    int warmup = 3, iterations = 20, selected_num = 0;
+    char *output = NULL;
+    FILE *out;
+    int i, j, k, failed = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            for (j = 0; j < WORKLOAD_NUM && strcmp(workloads[j].name, argv[i]) != 0; j++);
+            if (j == WORKLOAD_NUM) {
+                fprintf(stderr, "unknown workload: %s\n", argv[i]);
+                return 1;
+            }
+            for (k = 0; k < selected_num && selected[k] != j; k++);
+            if (k < selected_num) {
+                fprintf(stderr, "duplicate workload: %s\n", argv[i]);
+                return 1;
+            }
+            selected[selected_num++] = j;
+        }
+    }
+    if (warmup < 0 || iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (selected_num == 0) {
+        for (j = 0; j < WORKLOAD_NUM; j++) {
+            selected[selected_num++] = j;
+        }
+    }
+
+    for (i = 0; i < selected_num; i++) {
+        fprintf(stderr, "%s...\n", workloads[selected[i]].name);
+        if (measure(&workloads[selected[i]], warmup, iterations, &summaries[i]) != 0) {
+            fprintf(stderr, "%s failed\n", workloads[selected[i]].name);
+            failed = 1;
+            selected_num = i;
+            break;
+        }
+    }
+
+    out = output == NULL ? stdout : fopen(output, "w");
+    if (out == NULL) {
+        perror("fopen");
+        return 1;
+    }
+    fprintf(out, "{\n  \"benchmarks\": [\n");
+    for (i = 0; i < selected_num; i++) {
+        write_json(out, &workloads[selected[i]], warmup, iterations, &summaries[i], i == selected_num - 1);
+    }
+    fprintf(out, "  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return failed;
+}
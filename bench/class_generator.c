@@ -0,0 +1,159 @@
+//
+// Generator of synthetic class files for benchmarks of class loading.
+// ref. 4.1 The ClassFile Structure
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "class_generator.h"
+
+#define CONSTANT_UTF8 1
+#define CONSTANT_CLASS 7
+#define CONSTANT_METHODREF 10
+#define CONSTANT_NAME_AND_TYPE 12
+
+#define ACC_PUBLIC 0x0001
+#define ACC_STATIC 0x0008
+#define ACC_SUPER 0x0020
+
+// fixed entries of constant pool
+#define CP_THIS_NAME 1
+#define CP_THIS_CLASS 2
+#define CP_SUPER_NAME 3
+#define CP_SUPER_CLASS 4
+#define CP_CODE 5
+#define CP_INT_DESCRIPTOR 6
+#define CP_MAIN_NAME 7
+#define CP_MAIN_DESCRIPTOR 8
+#define CP_FIXED_NUM 8
+
+static void write8(FILE *f, int v) {
+    fputc(v & 0xff, f);
+}
+
+static void write16(FILE *f, int v) {
+    write8(f, v >> 8);
+    write8(f, v);
+}
+
+static void write32(FILE *f, long v) {
+    write16(f, (int) (v >> 16));
+    write16(f, (int) v);
+}
+
+static void write_utf8(FILE *f, char *str) {
+    write8(f, CONSTANT_UTF8);
+    write16(f, (int) strlen(str));
+    fwrite(str, 1, strlen(str), f);
+}
+
+/**
+ * Write a method whose code is `iconst_0; ireturn`.
+ */
+static void write_method(FILE *f, int access_flags, int name_index, int descriptor_index, int max_locals) {
+    static const unsigned char code[] = {0x03, 0xac};
+
+    write16(f, access_flags);
+    write16(f, name_index);
+    write16(f, descriptor_index);
+    write16(f, 1); // attributes_count
+
+    // Code attribute
+    write16(f, CP_CODE);
+    write32(f, 2 + 2 + 4 + sizeof(code) + 2 + 2);
+    write16(f, 1); // max_stack
+    write16(f, max_locals);
+    write32(f, sizeof(code));
+    fwrite(code, 1, sizeof(code), f);
+    write16(f, 0); // exception_table_length
+    write16(f, 0); // attributes_count
+}
+
+int min_cp_entries(int methods) {
+    return CP_FIXED_NUM + methods;
+}
+
+long write_synthetic_class(char *path, char *name, struct class_shape *shape) {
+    FILE *f;
+    char buf[64];
+    int i, index;
+    long size;
+
+    if (shape->cp_entries < min_cp_entries(shape->methods) || shape->cp_entries > 65534
+            || shape->methods < 0 || shape->methods > 65534) {
+        fprintf(stderr, "invalid shape: cp_entries=%d, methods=%d\n", shape->cp_entries, shape->methods);
+        return -1;
+    }
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    write32(f, 0xcafebabe);
+    write16(f, 0);  // minor_version
+    write16(f, 52); // major_version
+    write16(f, shape->cp_entries + 1);
+
+    // fixed entries
+    write_utf8(f, name);
+    write8(f, CONSTANT_CLASS);
+    write16(f, CP_THIS_NAME);
+    write_utf8(f, "java/lang/Object");
+    write8(f, CONSTANT_CLASS);
+    write16(f, CP_SUPER_NAME);
+    write_utf8(f, "Code");
+    write_utf8(f, "()I");
+    write_utf8(f, "main");
+    write_utf8(f, "([Ljava/lang/String;)I");
+
+    // names of methods
+    for (i = 0; i < shape->methods; i++) {
+        snprintf(buf, sizeof(buf), "m%d", i);
+        write_utf8(f, buf);
+    }
+
+    // padding by groups of Utf8, Class, NameAndType and Methodref (as a call to another class)
+    index = min_cp_entries(shape->methods) + 1;
+    while (index <= shape->cp_entries) {
+        if (index + 3 <= shape->cp_entries) {
+            snprintf(buf, sizeof(buf), "Pad%d", index);
+            write_utf8(f, buf);
+            write8(f, CONSTANT_CLASS);
+            write16(f, index);
+            write8(f, CONSTANT_NAME_AND_TYPE);
+            write16(f, CP_MAIN_NAME);
+            write16(f, CP_INT_DESCRIPTOR);
+            write8(f, CONSTANT_METHODREF);
+            write16(f, index + 1);
+            write16(f, index + 2);
+            index += 4;
+        } else {
+            snprintf(buf, sizeof(buf), "pad%d", index);
+            write_utf8(f, buf);
+            index++;
+        }
+    }
+
+    write16(f, ACC_SUPER);
+    write16(f, CP_THIS_CLASS);
+    write16(f, CP_SUPER_CLASS);
+    write16(f, 0); // interfaces_count
+    write16(f, 0); // fields_count
+
+    write16(f, shape->methods + 1);
+    write_method(f, ACC_PUBLIC | ACC_STATIC, CP_MAIN_NAME, CP_MAIN_DESCRIPTOR, 1);
+    for (i = 0; i < shape->methods; i++) {
+        write_method(f, ACC_STATIC, CP_FIXED_NUM + 1 + i, CP_INT_DESCRIPTOR, 0);
+    }
+
+    write16(f, 0); // attributes_count
+
+    size = ftell(f);
+    if (fclose(f) != 0) {
+        perror("fclose");
+        return -1;
+    }
+    return size;
+}
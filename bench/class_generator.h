@@ -0,0 +1,27 @@
+//
+// Generator of synthetic class files for benchmarks of class loading.
+//
+
+#ifndef MIN_JVM_CLASS_GENERATOR_H
+#define MIN_JVM_CLASS_GENERATOR_H
+
+// Shape of a synthetic class
+struct class_shape {
+    int cp_entries; // constant_pool_count - 1 (at least the entries needed by methods)
+    int methods;    // static methods other than main
+};
+
+/**
+ * Write a class file of the class named name (e.g. "synthetic/Synth0") with the shape.
+ * The class has `static int main(String[])` returning 0, and methods `static int m<i>()` returning 0.
+ * The rest of the constant pool is filled with Utf8, Class, NameAndType and Methodref entries.
+ * Return size of the written file, or -1 if failed.
+ */
+long write_synthetic_class(char *path, char *name, struct class_shape *shape);
+
+/**
+ * Return the minimum number of constant pool entries for the number of methods.
+ */
+int min_cp_entries(int methods);
+
+#endif //MIN_JVM_CLASS_GENERATOR_H
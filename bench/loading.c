@@ -0,0 +1,266 @@
+//
+// Benchmark of class loading with synthetic classes.
+// Parse time, memory footprint and time-to-main are measured separately for each shape.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include "../main.h"
+#include "class_generator.h"
+
+struct loading_shape {
+    char *name;
+    int classes;
+    struct class_shape shape;
+};
+
+static struct loading_shape default_shapes[] = {
+        {"cp_10k", 1, {10000, 10}},
+        {"methods_500", 1, {1000, 500}},
+        {"classes_1000", 1000, {64, 4}},
+};
+
+#define DEFAULT_SHAPE_NUM ((int) (sizeof(default_shapes) / sizeof(default_shapes[0])))
+
+struct loading_result {
+    long class_file_bytes; // total of all classes
+    double create_vm_ns;   // median (stdlib is loaded)
+    double parse_ns;       // median to load all classes
+    double parse_p99_ns;
+    double time_to_main_ns; // median of create_vm and run_vm of an empty main
+    double time_to_main_p99_ns;
+    long memory_bytes;     // heap used by loaded classes
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long heap_in_use(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return (long) mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+    return (long) mallinfo().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double median(double *samples, int n) {
+    qsort(samples, n, sizeof(double), compare_double);
+    return n % 2 == 1 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+}
+
+// samples must be sorted
+static double p99(double *samples, int n) {
+    return samples[(n * 99 + 99) / 100 - 1];
+}
+
+/**
+ * Generate class files of the shape into synthetic/<shape name>/.
+ * Return names of the files, or NULL if failed.
+ */
+static char **generate_classes(struct loading_shape *shape, long *total_bytes) {
+    char dir[256], name[512], **file_names;
+    long size;
+    int i;
+
+    snprintf(dir, sizeof(dir), "synthetic/%s", shape->name);
+    mkdir("synthetic", 0755);
+    mkdir(dir, 0755);
+
+    file_names = calloc(shape->classes, sizeof(char *));
+    if (file_names == NULL) {
+        return NULL;
+    }
+    *total_bytes = 0;
+    for (i = 0; i < shape->classes; i++) {
+        // the class is in the package of the directory, so that the name matches the path
+        snprintf(name, sizeof(name), "%s/Synth%d", dir, i);
+        file_names[i] = malloc(strlen(name) + sizeof(".class"));
+        if (file_names[i] == NULL) {
+            return NULL;
+        }
+        sprintf(file_names[i], "%s.class", name);
+        size = write_synthetic_class(file_names[i], name, &shape->shape);
+        if (size < 0) {
+            return NULL;
+        }
+        *total_bytes += size;
+    }
+    return file_names;
+}
+
+static int measure(struct loading_shape *shape, char **file_names, int iterations, struct loading_result *result) {
+    double *create_samples, *parse_samples, *main_samples, start;
+    long before;
+    struct vm *vm;
+    int i, j, failed = 0;
+
+    create_samples = calloc(iterations, sizeof(double));
+    parse_samples = calloc(iterations, sizeof(double));
+    main_samples = calloc(iterations, sizeof(double));
+    if (create_samples == NULL || parse_samples == NULL || main_samples == NULL) {
+        failed = 1;
+        goto end;
+    }
+
+    for (i = 0; i < iterations && !failed; i++) {
+        // parse (synthetic classes have no <clinit>, so loading is reading and parsing)
+        start = now_ns();
+        vm = create_vm();
+        if (vm == NULL) {
+            failed = 1;
+            break;
+        }
+        create_samples[i] = now_ns() - start;
+
+        before = heap_in_use();
+        start = now_ns();
+        for (j = 0; j < shape->classes; j++) {
+            if (load_class(vm, file_names[j]) == NULL) {
+                failed = 1;
+                break;
+            }
+        }
+        parse_samples[i] = now_ns() - start;
+        result->memory_bytes = heap_in_use() - before;
+        destroy_vm(vm);
+
+        // time-to-main: everything before main, which returns at once
+        start = now_ns();
+        vm = create_vm();
+        if (vm == NULL || run_vm(vm, file_names, shape->classes) != 0) {
+            failed = 1;
+        }
+        main_samples[i] = now_ns() - start;
+        if (vm != NULL) {
+            destroy_vm(vm);
+        }
+    }
+
+    if (!failed) {
+        result->create_vm_ns = median(create_samples, iterations);
+        result->parse_ns = median(parse_samples, iterations);
+        result->parse_p99_ns = p99(parse_samples, iterations);
+        result->time_to_main_ns = median(main_samples, iterations);
+        result->time_to_main_p99_ns = p99(main_samples, iterations);
+    }
+
+end:
+    free(create_samples);
+    free(parse_samples);
+    free(main_samples);
+    return failed ? -1 : 0;
+}
+
+static void write_json(FILE *out, struct loading_shape *shape, int iterations, struct loading_result *result, int last) {
+    fprintf(out, "    {\n");
+    fprintf(out, "      \"name\": \"%s\",\n", shape->name);
+    fprintf(out, "      \"classes\": %d,\n", shape->classes);
+    fprintf(out, "      \"cp_entries\": %d,\n", shape->shape.cp_entries);
+    fprintf(out, "      \"methods\": %d,\n", shape->shape.methods);
+    fprintf(out, "      \"iterations\": %d,\n", iterations);
+    fprintf(out, "      \"class_file_bytes\": %ld,\n", result->class_file_bytes);
+    fprintf(out, "      \"create_vm_ns\": %.0f,\n", result->create_vm_ns);
+    fprintf(out, "      \"parse_ns\": %.0f,\n", result->parse_ns);
+    fprintf(out, "      \"parse_p99_ns\": %.0f,\n", result->parse_p99_ns);
+    fprintf(out, "      \"parse_ns_per_class\": %.0f,\n", result->parse_ns / shape->classes);
+    fprintf(out, "      \"parse_bytes_per_sec\": %.0f,\n", result->class_file_bytes / (result->parse_ns / 1e9));
+    fprintf(out, "      \"memory_bytes\": %ld,\n", result->memory_bytes);
+    fprintf(out, "      \"time_to_main_ns\": %.0f,\n", result->time_to_main_ns);
+    fprintf(out, "      \"time_to_main_p99_ns\": %.0f\n", result->time_to_main_p99_ns);
+    fprintf(out, "    }%s\n", last ? "" : ",");
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "usage: %s [--iterations N] [--output FILE] [--classes N --cp-entries N --methods N]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    struct loading_shape custom = {"custom", 0, {0, 0}}, *shapes = default_shapes;
+    struct loading_result *results;
+    int shape_num = DEFAULT_SHAPE_NUM, iterations = 5;
+    char *output = NULL, **file_names;
+    FILE *out;
+    int i, j, failed = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--classes") == 0 && i + 1 < argc) {
+            custom.classes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cp-entries") == 0 && i + 1 < argc) {
+            custom.shape.cp_entries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--methods") == 0 && i + 1 < argc) {
+            custom.shape.methods = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (custom.classes > 0 || custom.shape.cp_entries > 0 || custom.shape.methods > 0) {
+        if (custom.classes == 0) {
+            custom.classes = 1;
+        }
+        if (custom.shape.cp_entries < min_cp_entries(custom.shape.methods)) {
+            custom.shape.cp_entries = min_cp_entries(custom.shape.methods);
+        }
+        shapes = &custom;
+        shape_num = 1;
+    }
+    if (iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    results = calloc(shape_num, sizeof(struct loading_result));
+    if (results == NULL) {
+        return 1;
+    }
+
+    for (i = 0; i < shape_num; i++) {
+        fprintf(stderr, "%s...\n", shapes[i].name);
+        file_names = generate_classes(&shapes[i], &results[i].class_file_bytes);
+        if (file_names == NULL || measure(&shapes[i], file_names, iterations, &results[i]) != 0) {
+            fprintf(stderr, "%s failed\n", shapes[i].name);
+            failed = 1;
+            shape_num = i;
+        }
+        for (j = 0; file_names != NULL && j < shapes[i].classes; j++) {
+            free(file_names[j]);
+        }
+        free(file_names);
+    }
+
+    out = output == NULL ? stdout : fopen(output, "w");
+    if (out == NULL) {
+        perror("fopen");
+        return 1;
+    }
+    fprintf(out, "{\n  \"loading\": [\n");
+    for (i = 0; i < shape_num; i++) {
+        write_json(out, &shapes[i], iterations, &results[i], i == shape_num - 1);
+    }
+    fprintf(out, "  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    free(results);
+    return failed;
+}
@@ -0,0 +1,114 @@
+//
+// Dump or aggregate a recording of the event recorder (see recording.h).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "recording.h"
+
+static const char *record_type_names[RECORD_TYPE_NUM] = {
+        NULL, "class-load", "class-init", "resolve", "native-bind", "allocation", "gc", "shutdown", "optimize", "osr",
+};
+
+struct type_summary {
+    long count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t value;
+};
+
+static void usage(char *name) {
+    fprintf(stderr, "usage: %s [--summary] RECORDING\n", name);
+}
+
+static const char *get_type_name(uint32_t type) {
+    return type < RECORD_TYPE_NUM && record_type_names[type] != NULL ? record_type_names[type] : "unknown";
+}
+
+int main(int argc, char *argv[]) {
+    struct recording_header header;
+    struct recording_chunk chunk;
+    struct record record;
+    struct type_summary summary[RECORD_TYPE_NUM];
+    bool summarize = false;
+    uint64_t origin = 0;
+    long chunk_num = 0;
+    uint32_t i;
+    FILE *f;
+
+    if (argc == 3 && strcmp(argv[1], "--summary") == 0) {
+        summarize = true;
+    } else if (argc != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    f = fopen(argv[argc - 1], "r");
+    if (f == NULL) {
+        perror("fopen");
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 || strcmp(header.magic, RECORDING_MAGIC) != 0) {
+        fprintf(stderr, "not a recording: %s\n", argv[argc - 1]);
+        fclose(f);
+        return 1;
+    }
+    if (header.version != RECORDING_VERSION || header.record_size != sizeof(struct record)) {
+        fprintf(stderr, "unsupported version of recording: %u\n", header.version);
+        fclose(f);
+        return 1;
+    }
+
+    memset(summary, 0, sizeof(summary));
+    if (!summarize) {
+        printf("%12s %12s %-12s %8s %12s %s\n", "start(ms)", "duration(us)", "event", "tid", "value", "name");
+    }
+    while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+        if (chunk.magic != RECORDING_CHUNK_MAGIC) {
+            fprintf(stderr, "broken chunk at %ld\n", ftell(f));
+            break;
+        }
+        if (chunk_num++ == 0) {
+            origin = chunk.start_ns;
+        }
+        for (i = 0; i < chunk.record_num; i++) {
+            // the last chunk may be cut off if the VM crashed while writing it
+            if (fread(&record, sizeof(record), 1, f) != 1) {
+                fprintf(stderr, "truncated chunk\n");
+                break;
+            }
+            record.name[RECORD_NAME_LEN - 1] = '\0';
+            if (summarize) {
+                if (record.type < RECORD_TYPE_NUM) {
+                    summary[record.type].count++;
+                    summary[record.type].total_ns += record.duration_ns;
+                    if (record.duration_ns > summary[record.type].max_ns) {
+                        summary[record.type].max_ns = record.duration_ns;
+                    }
+                    summary[record.type].value += record.value;
+                }
+            } else {
+                printf("%12.3f %12.3f %-12s %8d %12llu %s\n", (double) (int64_t) (record.start_ns - origin) / 1e6,
+                        (double) record.duration_ns / 1e3, get_type_name(record.type), record.tid,
+                        (unsigned long long) record.value, record.name);
+            }
+        }
+    }
+    fclose(f);
+
+    if (summarize) {
+        printf("%-12s %8s %14s %14s %12s\n", "event", "count", "total(us)", "max(us)", "value");
+        for (i = 1; i < RECORD_TYPE_NUM; i++) {
+            if (summary[i].count == 0) {
+                continue;
+            }
+            printf("%-12s %8ld %14.3f %14.3f %12llu\n", get_type_name(i), summary[i].count,
+                    (double) summary[i].total_ns / 1e3, (double) summary[i].max_ns / 1e3,
+                    (unsigned long long) summary[i].value);
+        }
+        printf("%ld chunks\n", chunk_num);
+    }
+    return 0;
+}
@@ -0,0 +1,261 @@
+//
+// Command line launcher of the VM.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "main.h"
+
+// options of running a program
+struct run_options {
+    bool perf;
+    bool stats;
+    char *stats_file; // NULL for stderr
+    bool profile;
+    char *profile_file; // NULL for stderr
+    int profile_frequency; // Hz
+    char *record_file; // NULL if not recorded
+    bool alloc_profile;
+    char *alloc_profile_file; // NULL for stderr
+    long alloc_sample_bytes; // 0 to count every allocation
+    char *heap_dump_file; // NULL if not dumped
+    bool perf_map;
+    char *jitdump_dir; // NULL if not written
+    bool startup_timings;
+    bool startup_timings_json;
+    char *agent_path; // NULL if no agent
+    char *agent_options;
+    int inline_size; // -1 for the default of the VM
+    int inline_depth; // -1 for the default of the VM
+    long tier_profile; // -1 for the default of the VM
+    long tier_optimize; // -1 for the default of the VM
+    bool method_profiles;
+    bool trace;
+};
+
+static void usage(char *name) {
+    fprintf(stderr, "usage: %s [--perf] [--stats[=FILE]] [--profile[=FILE]] [--profile-frequency=HZ]\n"
+                    "           [--record=FILE] [--alloc-profile[=FILE]] [--alloc-sample-bytes=N]\n"
+                    "           [--heap-dump=FILE] [--perf-map] [--jitdump=DIR] [--startup-timings[=json]]\n"
+                    "           [--agentpath=LIB[=OPTIONS]] [--inline-size=BYTES] [--inline-depth=N]\n"
+                    "           [--tier-thresholds=PROFILE,OPTIMIZE] [--method-profiles] [--trace]\n"
+                    "           Main.class [Other.class ...]\n", name);
+    fprintf(stderr, "       %s --server SOCKET [Preloaded.class ...]\n", name);
+    fprintf(stderr, "       %s --client SOCKET Main.class [Other.class ...]\n", name);
+    fprintf(stderr, "       %s --stop SOCKET\n", name);
+    fprintf(stderr, "       %s --snapshot IMAGE Main.class [Other.class ...]\n", name);
+    fprintf(stderr, "       %s --restore IMAGE Main.class\n", name);
+}
+
+static int snapshot(char *image_path, char *class_name[], int len) {
+    struct vm *vm;
+    int i, retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    for (i = 0; i < len; i++) {
+        if (load_class(vm, class_name[i]) == NULL) {
+            destroy_vm(vm);
+            return 1;
+        }
+    }
+
+    retval = save_snapshot(vm, image_path);
+    destroy_vm(vm);
+    return retval == 0 ? 0 : 1;
+}
+
+static int restore(char *image_path, char *class_name[], int len) {
+    struct vm *vm;
+    int retval;
+
+    // classes are already initialized in the image
+    vm = restore_vm(image_path);
+    if (vm == NULL) {
+        return 1;
+    }
+
+    retval = run_vm(vm, class_name, len);
+    destroy_vm(vm);
+    return retval;
+}
+
+/**
+ * Run program with options.
+ * Performance counters, startup timings and tiers of methods are printed to stderr, and statistics and profiles are reported when the VM is destroyed.
+ */
+static int run_with_options(struct run_options *options, char *class_name[], int len) {
+    struct vm *vm;
+    int retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    if (options->agent_path != NULL && load_agent(vm, options->agent_path, options->agent_options) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+    set_trace(vm, options->trace);
+    set_inlining(vm, options->inline_size, options->inline_depth);
+    set_tier_thresholds(vm, options->tier_profile, options->tier_optimize);
+    if (options->perf) {
+        enable_perf_counters(vm);
+    }
+    if (options->stats && enable_stats(vm, options->stats_file) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+    if (options->record_file != NULL && enable_recorder(vm, options->record_file) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+    if ((options->perf_map || options->jitdump_dir != NULL) && enable_perf_map(vm, options->jitdump_dir) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+    if (options->heap_dump_file != NULL && enable_heap_dump(vm, options->heap_dump_file) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+    if (options->alloc_profile
+            && enable_allocation_profiler(vm, options->alloc_sample_bytes, options->alloc_profile_file) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+    if (options->profile && enable_profiler(vm, options->profile_frequency, options->profile_file) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+
+    retval = run_vm(vm, class_name, len);
+    if (options->perf) {
+        print_perf_counters(vm, stderr);
+    }
+    if (options->startup_timings) {
+        print_startup_timings(vm, stderr, options->startup_timings_json);
+    }
+    if (options->method_profiles) {
+        print_method_profiles(vm, stderr);
+    }
+    destroy_vm(vm);
+    return retval;
+}
+
+static int serve(char *socket_path, char *class_name[], int len) {
+    struct vm *vm;
+    int i, retval;
+
+    // classes are loaded and initialized once, and shared by all requests
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    for (i = 0; i < len; i++) {
+        if (load_class(vm, class_name[i]) == NULL) {
+            destroy_vm(vm);
+            return 1;
+        }
+    }
+
+    retval = serve_vm(vm, socket_path);
+    destroy_vm(vm);
+    return retval == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct run_options options = {false, false, NULL, false, NULL, 1000, NULL, false, NULL, 0, NULL, false, NULL, false, false, NULL, NULL, -1, -1, -1, -1, false, false};
+    int i;
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "--server") == 0 && argc >= 3) {
+        return serve(argv[2], argv + 3, argc - 3);
+    } else if (strcmp(argv[1], "--client") == 0 && argc >= 4) {
+        return request_run(argv[2], argv + 3, argc - 3);
+    } else if (strcmp(argv[1], "--stop") == 0 && argc == 3) {
+        return request_stop(argv[2]) == 0 ? 0 : 1;
+    } else if (strcmp(argv[1], "--snapshot") == 0 && argc >= 4) {
+        return snapshot(argv[2], argv + 3, argc - 3);
+    } else if (strcmp(argv[1], "--restore") == 0 && argc >= 4) {
+        return restore(argv[2], argv + 3, argc - 3);
+    }
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            options.perf = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options.stats = true;
+        } else if (strncmp(argv[i], "--stats=", strlen("--stats=")) == 0) {
+            options.stats = true;
+            options.stats_file = argv[i] + strlen("--stats=");
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            options.profile = true;
+        } else if (strncmp(argv[i], "--profile=", strlen("--profile=")) == 0) {
+            options.profile = true;
+            options.profile_file = argv[i] + strlen("--profile=");
+        } else if (strncmp(argv[i], "--profile-frequency=", strlen("--profile-frequency=")) == 0) {
+            options.profile_frequency = atoi(argv[i] + strlen("--profile-frequency="));
+        } else if (strncmp(argv[i], "--record=", strlen("--record=")) == 0) {
+            options.record_file = argv[i] + strlen("--record=");
+        } else if (strcmp(argv[i], "--alloc-profile") == 0) {
+            options.alloc_profile = true;
+        } else if (strncmp(argv[i], "--alloc-profile=", strlen("--alloc-profile=")) == 0) {
+            options.alloc_profile = true;
+            options.alloc_profile_file = argv[i] + strlen("--alloc-profile=");
+        } else if (strncmp(argv[i], "--alloc-sample-bytes=", strlen("--alloc-sample-bytes=")) == 0) {
+            options.alloc_sample_bytes = atol(argv[i] + strlen("--alloc-sample-bytes="));
+        } else if (strncmp(argv[i], "--heap-dump=", strlen("--heap-dump=")) == 0) {
+            options.heap_dump_file = argv[i] + strlen("--heap-dump=");
+        } else if (strcmp(argv[i], "--perf-map") == 0) {
+            options.perf_map = true;
+        } else if (strncmp(argv[i], "--jitdump=", strlen("--jitdump=")) == 0) {
+            options.jitdump_dir = argv[i] + strlen("--jitdump=");
+        } else if (strcmp(argv[i], "--startup-timings") == 0) {
+            options.startup_timings = true;
+        } else if (strcmp(argv[i], "--startup-timings=json") == 0) {
+            options.startup_timings = true;
+            options.startup_timings_json = true;
+        } else if (strncmp(argv[i], "--agentpath=", strlen("--agentpath=")) == 0) {
+            // e.g. --agentpath=./libtracer.so=verbose
+            options.agent_path = argv[i] + strlen("--agentpath=");
+            options.agent_options = strchr(options.agent_path, '=');
+            if (options.agent_options != NULL) {
+                *options.agent_options++ = '\0';
+            }
+        } else if (strncmp(argv[i], "--inline-size=", strlen("--inline-size=")) == 0) {
+            options.inline_size = atoi(argv[i] + strlen("--inline-size="));
+        } else if (strncmp(argv[i], "--inline-depth=", strlen("--inline-depth=")) == 0) {
+            options.inline_depth = atoi(argv[i] + strlen("--inline-depth="));
+        } else if (strncmp(argv[i], "--tier-thresholds=", strlen("--tier-thresholds=")) == 0) {
+            // e.g. --tier-thresholds=200,5000
+            if (sscanf(argv[i] + strlen("--tier-thresholds="), "%ld,%ld", &options.tier_profile,
+                       &options.tier_optimize) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--method-profiles") == 0) {
+            options.method_profiles = true;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            options.trace = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (i == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (i == 1) {
+        return run(argv + 1, argc - 1);
+    }
+    return run_with_options(&options, argv + i, argc - i);
+}
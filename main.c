@@ -1,12 +1,43 @@
+#define _GNU_SOURCE // for RTLD_DEFAULT
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
 #include <dlfcn.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/perf_event.h>
 #include "main.h"
+#include "jni.h"
+#include "recording.h"
+
+// print parsed class files and executed instructions of a VM (see set_trace)
+#define TRACE_IF(enabled, ...) do { if (enabled) { printf(__VA_ARGS__); } } while (0)
+#define TRACE(vm, ...) TRACE_IF((vm)->trace, __VA_ARGS__)
+
+// nanoseconds of CLOCK_MONOTONIC
+static u_int64_t get_monotonic_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * 1000000000ULL + (u_int64_t) ts.tv_nsec;
+}
 
 static int read_utf8(char *str, struct constant_utf8_info *cp);
-static char *get_method_name(struct method_info *method, struct class_file *class);
+static char *get_method_name(char *name, struct method_info *method, struct class_file *class);
 
 static struct constant_fieldref_info *find_cp_fieldref(int index, struct class_file *class);
 static struct constant_methodref_info *find_cp_methodref(int index, struct class_file *class);
@@ -14,19 +45,30 @@ static struct constant_class_info *find_cp_class(int index, struct class_file *c
 static struct constant_name_and_type_info *find_cp_name_and_type(int index, struct class_file *class);
 static struct constant_utf8_info *find_cp_utf8(int index, struct class_file *class);
 
-static char *get_field_name(struct field_info *field, struct class_file *class);
-static char *get_field_descriptor(struct field_info *field, struct class_file *class);
+static char *get_field_name(char *name, struct field_info *field, struct class_file *class);
+static char *get_field_descriptor(char *descriptor, struct field_info *field, struct class_file *class);
 static struct field_info *find_field(char *name, struct class_file *class);
 static struct method_info *find_method(char *target_name, struct class_file *class);
 
 static struct constant_utf8_info *get_this_class(struct class_file *class);
 
+struct vm;
 struct class_loader;
 struct native_loader;
 
-static int exec_method(struct method_info *current_method, struct code_attribute *current_code,
-                       struct frame *prev_frame, struct class_file *current_class, struct class_loader *loader,
-                       struct native_loader *native_loader);
+// Result of resolving a symbolic reference in the constant pool.
+// It is cached in the class so that each reference is resolved only once in the VM.
+struct cp_cache_entry {
+    struct class_file *class;   // Class, or class of Fieldref and Methodref
+    struct field_info *field;   // Fieldref
+    int field_index;            // index of the field in the class (and in its instances)
+    struct method_info *method; // Methodref
+};
+
+static int exec_method(struct vm *vm, struct method_info *current_method, struct code_attribute *current_code,
+                       struct frame *prev_frame, struct class_file *current_class);
+static int interpret_method(struct vm *vm, struct method_info *current_method, struct code_attribute *current_code,
+                            struct frame *prev_frame, struct class_file *current_class);
 
 
 //
@@ -35,10 +77,18 @@ static int exec_method(struct method_info *current_method, struct code_attribute
 
 struct class_loader {
     int class_num;
-    struct class_file *classes;
+    int class_cap;
+    struct class_file **classes;
 };
 
-static int initialize_class(struct class_file *class, struct class_loader *loader, struct native_loader *native_loader) {
+static int parse_class_file(struct class_file *main_class, FILE *main_file, bool trace);
+static int check_max_stack(struct method_info *method, struct class_file *class);
+static void free_class(struct class_file *class);
+static void free_attributes(struct attribute_info **attributes, int attributes_count, struct class_file *class);
+
+static int initialize_class(struct vm *vm, struct class_file *class) {
+    int retval;
+
     // find <clinit> method
     struct method_info *method = find_method("<clinit>", class);
     if (method == NULL) {
@@ -54,43 +104,94 @@ static int initialize_class(struct class_file *class, struct class_loader *loade
     struct frame *frame = initialize_frame(code->max_stack, code->max_locals);
 
     // exec <clinit>
-    return exec_method(method, code, frame, class, loader, native_loader);
+    retval = exec_method(vm, method, code, frame, class);
+    free_frame(frame);
+    return retval;
 }
 
-static int initialize_class_loader(struct class_loader *loader, char *class_names[], int len, struct native_loader *native_loader) {
+/**
+ * Parse the class file and add it to the class loader. What is parsed is printed if trace is true.
+ * Return the class, or NULL if failed.
+ */
+static struct class_file *define_class(struct class_loader *loader, char *class_file_name, bool trace) {
     FILE *f;
+    struct class_file *class, **classes;
+    struct stat st;
+    u_int64_t start, opened;
+    char *buf;
     int i;
-    struct class_file *class_files;
 
-    class_files = calloc(sizeof(struct class_file), len);
-    if (class_files == NULL) {
-        return -1;
+    if (loader->class_num >= loader->class_cap) {
+        int cap = loader->class_cap == 0 ? 16 : loader->class_cap * 2;
+        classes = realloc(loader->classes, cap * sizeof(struct class_file *));
+        if (classes == NULL) {
+            return NULL;
+        }
+        loader->classes = classes;
+        loader->class_cap = cap;
     }
 
-    loader->class_num = len;
-    loader->classes = class_files;
-
-    for (i = 0; i < len; i++) {
-        f = fopen(class_names[i], "r");
-        if (f == NULL) {
-            perror("fopen");
-            return -1;
-        }
+    start = get_monotonic_time();
+    f = fopen(class_file_name, "r");
+    if (f == NULL) {
+        perror("fopen");
+        return NULL;
+    }
+    opened = get_monotonic_time();
 
-        // Parse class
-        // After parsing, initialize class by executing `<clinit>`
-        parse_class(&class_files[i], f);
+    // the whole file is read before parsing to tell the time of I/O from the one of parsing
+    if (fstat(fileno(f), &st) != 0) {
+        perror("fstat");
+        fclose(f);
+        return NULL;
+    }
+    buf = malloc(st.st_size + 1);
+    if (buf == NULL || fread(buf, 1, st.st_size, f) != (size_t) st.st_size) {
+        fprintf(stderr, "failed to read %s\n", class_file_name);
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
 
-        if (initialize_class(&class_files[i], loader, native_loader) != 0) {
-            return -1;
+    class = calloc(1, sizeof(struct class_file));
+    if (class == NULL) {
+        free(buf);
+        return NULL;
+    }
+    class->timings.open = opened - start;
+    class->timings.read = get_monotonic_time() - opened;
+
+    f = fmemopen(buf, st.st_size, "r");
+    if (f == NULL || parse_class_file(class, f, trace) != 0) {
+        fprintf(stderr, "failed to parse %s\n", class_file_name);
+        free_class(class);
+        if (f != NULL) {
+            fclose(f);
         }
+        free(buf);
+        return NULL;
+    }
+    fclose(f);
+    free(buf);
 
-        if (fclose(f) != 0) {
-            perror("fclose");
-            return -1;
+    // the interpreter trusts max_stack of each method
+    for (i = 0; i < class->methods_count; i++) {
+        if (check_max_stack(class->methods[i], class) != 0) {
+            fprintf(stderr, "operand stack of a method exceeds its max_stack or underflows in %s\n", class_file_name);
+            free_class(class);
+            return NULL;
         }
     }
 
+    loader->classes[loader->class_num++] = class;
+    return class;
+}
+
+static int initialize_class_loader(struct class_loader *loader) {
+    loader->class_num = 0;
+    loader->class_cap = 0;
+    loader->classes = NULL;
     return 0;
 }
 
@@ -105,7 +206,7 @@ struct class_file *get_class(struct class_loader *loader, char *name) {
     char buf[1024];
 
     for (i = 0; i < loader->class_num; i++) {
-        class = &loader->classes[i];
+        class = loader->classes[i];
         utf8 = get_this_class(class);
         if (utf8 != NULL) {
             read_utf8(buf, utf8);
@@ -119,6 +220,15 @@ struct class_file *get_class(struct class_loader *loader, char *name) {
 }
 
 int tear_down_class_loader(struct class_loader *loader) {
+    int i;
+
+    for (i = 0; i < loader->class_num; i++) {
+        free_class(loader->classes[i]);
+    }
+    free(loader->classes);
+    loader->classes = NULL;
+    loader->class_num = 0;
+    loader->class_cap = 0;
     return 0;
 }
 
@@ -126,27 +236,137 @@ int tear_down_class_loader(struct class_loader *loader) {
 // Native Loader
 //
 
-#define LIB_JAVA "libjava.so"
+#define MAX_NATIVE_LIBRARIES 16
+
+struct registered_native {
+    char *class_name;
+    char *name;
+    char *signature;
+    void *fn_ptr;
+    int critical;
+};
+
+// JNIEnv passed to native methods.
+// functions must be the first member so that this can be used as JNIEnv.
+struct jni_env {
+    const struct JNINativeInterface_ *functions;
+    struct vm *vm;
+};
+
+static const struct JNINativeInterface_ jni_functions;
 
 struct native_loader {
-    void *handler;
+    int library_num;
+    void *libraries[MAX_NATIVE_LIBRARIES];
+    u_int64_t dlopen_time; // of all libraries
+    int registered_num;
+    int registered_cap;
+    struct registered_native *registered;
+    struct jni_env env;
 };
 
-static int exec_native_method(struct method_info *pInfo, struct frame *pFrame, struct class_file *class, struct native_loader *loader);
+static int exec_native_method(struct vm *vm, struct method_info *pInfo, struct frame *pFrame, struct class_file *class);
+
+static int initialize_native_loader(struct native_loader *loader, struct vm *vm) {
+    loader->library_num = 0;
+    loader->dlopen_time = 0;
+    loader->registered_num = 0;
+    loader->registered_cap = 0;
+    loader->registered = NULL;
+
+    loader->env.functions = &jni_functions;
+    loader->env.vm = vm;
+
+    // stdlib natives are linked statically, so there is no need to dlopen libjava.so
+    if (register_builtin_natives(loader) != 0) {
+        fprintf(stderr, "failed to register builtin natives\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static char *strdup_or_null(const char *str) {
+    char *copy;
+
+    if (str == NULL) {
+        return NULL;
+    }
+    copy = malloc(strlen(str) + 1);
+    if (copy != NULL) {
+        strcpy(copy, str);
+    }
+    return copy;
+}
+
+int register_natives(struct native_loader *loader, char *class_name, struct native_method *methods, int len) {
+    int i;
+    struct registered_native *entry;
+
+    if (loader->registered_num + len > loader->registered_cap) {
+        int cap = loader->registered_cap == 0 ? 16 : loader->registered_cap;
+        while (cap < loader->registered_num + len) {
+            cap *= 2;
+        }
+        entry = realloc(loader->registered, cap * sizeof(struct registered_native));
+        if (entry == NULL) {
+            fprintf(stderr, "failed to prepare registered natives\n");
+            return -1;
+        }
+        loader->registered = entry;
+        loader->registered_cap = cap;
+    }
+
+    // names are copied because they may be passed from JNI (RegisterNatives)
+    for (i = 0; i < len; i++) {
+        entry = &loader->registered[loader->registered_num++];
+        entry->class_name = strdup_or_null(class_name);
+        entry->name = strdup_or_null(methods[i].name);
+        entry->signature = strdup_or_null(methods[i].signature);
+        entry->fn_ptr = methods[i].fn_ptr;
+        entry->critical = methods[i].critical;
+    }
+
+    return 0;
+}
 
-static int initialize_native_loader(struct native_loader *loader) {
+int load_library(struct native_loader *loader, char *name) {
+    char file_name[1024];
     void *handler;
+    u_int64_t start;
 
-    handler = dlopen(LIB_JAVA, RTLD_LAZY);
+    if (loader->library_num >= MAX_NATIVE_LIBRARIES) {
+        fprintf(stderr, "too many native libraries\n");
+        return -1;
+    }
+
+    snprintf(file_name, sizeof(file_name), "lib%s.so", name);
+    start = get_monotonic_time();
+    handler = dlopen(file_name, RTLD_LAZY);
+    loader->dlopen_time += get_monotonic_time() - start;
     if (handler == NULL) {
-        fprintf(stderr, "failed to load %s\n", LIB_JAVA);
+        fprintf(stderr, "failed to load %s\n", file_name);
         return -1;
     }
 
-    loader->handler = handler;
+    loader->libraries[loader->library_num++] = handler;
     return 0;
 }
 
+static void tear_down_native_loader(struct native_loader *loader) {
+    int i;
+
+    for (i = 0; i < loader->library_num; i++) {
+        dlclose(loader->libraries[i]);
+    }
+    for (i = 0; i < loader->registered_num; i++) {
+        free(loader->registered[i].class_name);
+        free(loader->registered[i].name);
+        free(loader->registered[i].signature);
+    }
+    free(loader->registered);
+}
+
 //
 // Instance Creation
 //
@@ -156,6 +376,10 @@ static int initialize_native_loader(struct native_loader *loader) {
 
 #define REFERENCE_NULL -1
 
+// references passed to natives, agents and the host (0 is null)
+#define TO_JOBJECT(ref) ((jobject) (intptr_t) ((ref) + 1))
+#define FROM_JOBJECT(obj) ((int32_t) ((intptr_t) (obj) - 1))
+
 struct class_instance_field {
     char *name;
     char *descriptor;
@@ -171,7 +395,7 @@ struct class_instance {
 };
 
 static int create_instance_field(struct class_instance_field **field, char *name, char *descriptor) {
-    char *field_name;
+    char *field_name, *field_descriptor;
     int name_len;
 
     (*field) = malloc(sizeof(struct class_instance_field));
@@ -181,14 +405,17 @@ static int create_instance_field(struct class_instance_field **field, char *name
     strcpy(field_name, name);
     (*field)->name = field_name;
 
+    field_descriptor = malloc(strlen(descriptor) + 1);
+    strcpy(field_descriptor, descriptor);
+
     switch (descriptor[0]) {
         case FIELD_DESCRIPTOR_INT:
-            (*field)->descriptor = descriptor;
+            (*field)->descriptor = field_descriptor;
             (*field)->data = malloc(sizeof(u_int32_t));
             *((u_int32_t *) (*field)->data) = 0;
             break;
         case FIELD_DESCRIPTOR_OBJECT:
-            (*field)->descriptor = descriptor;
+            (*field)->descriptor = field_descriptor;
             (*field)->data = malloc(sizeof(int));
             *((int *) (*field)->data) = REFERENCE_NULL;
             break;
@@ -200,1475 +427,7979 @@ static int create_instance_field(struct class_instance_field **field, char *name
     return 0;
 }
 
-// FIXME: Remove limit for number of objects
-#define MAX_INSTANCES 1024
-static struct class_instance *instances[MAX_INSTANCES];
-static int instance_count = 0;
+//
+// Performance Counters
+//
 
-/**
- * Create a new instance of the specified class.
- * Return index to reference the created object.
- * Return -1 if failed to create.
- */
-static int create_instance(
-        struct constant_class_info *cp_class, struct class_file *class, struct class_loader *loader) {
-    int field_i, instance_i;
+// Hardware counters by perf_event_open(2) read around phases and method executions.
+// Counters count the thread which enabled them (user space only).
+// Events not supported by the CPU (or not permitted) are skipped.
 
-    if (instance_count >= MAX_INSTANCES) {
-        return -1;
-    }
+struct perf_event_def {
+    char *name;
+    u_int32_t type;
+    u_int64_t config;
+};
+
+#define PERF_HW_CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct perf_event_def perf_events[] = {
+        {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {"L1-dcache-load-misses", PERF_TYPE_HW_CACHE, PERF_HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+        {"LLC-load-misses", PERF_TYPE_HW_CACHE, PERF_HW_CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+        {"dTLB-load-misses", PERF_TYPE_HW_CACHE, PERF_HW_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+};
 
-    instance_i = instance_count;
-    instances[instance_i] = calloc(1, sizeof(struct class_instance));
-    instances[instance_i]->class = class;
-    instances[instance_i]->field_num = class->fields_count;
-    instances[instance_i]->fields = calloc(class->fields_count, sizeof(struct class_instance_field *));
+#define PERF_EVENT_NUM ((int) (sizeof(perf_events) / sizeof(perf_events[0])))
 
-    // initialize fields
-    for (field_i = 0; field_i < class->fields_count; field_i++) {
-        char *field_name = get_field_name(class->fields[field_i], class);
-        char *field_descriptor = get_field_descriptor(class->fields[field_i], class);
-        if (create_instance_field(&instances[instance_i]->fields[field_i], field_name, field_descriptor) != 0) {
-            fprintf(stderr, "failed to initialize field\n");
-            return -1;
+enum perf_phase {
+    PERF_PHASE_PARSE,
+    PERF_PHASE_INIT,
+    PERF_PHASE_MAIN,
+    PERF_PHASE_NUM,
+};
+
+static const char *perf_phase_names[PERF_PHASE_NUM] = {"parse", "init", "main"};
+
+struct perf_values {
+    u_int64_t v[PERF_EVENT_NUM];
+};
+
+// counters of a method (allocated when the method is measured first)
+struct method_perf {
+    long calls;
+    struct perf_values total; // including methods called by it
+    struct perf_values self;
+};
+
+// a method execution being measured (on the C stack of exec_method)
+struct perf_activation {
+    struct perf_values start;
+    struct perf_values children;
+    struct perf_activation *parent;
+};
+
+struct perf_counters {
+    bool enabled;
+    int fds[PERF_EVENT_NUM]; // -1 if not available
+    struct perf_values phases[PERF_PHASE_NUM];
+    struct perf_activation *current;
+};
+
+/**
+ * Open counters of all events available.
+ * Return the number of opened counters.
+ */
+static int open_perf_counters(struct perf_counters *perf) {
+    struct perf_event_attr attr;
+    int i, opened = 0;
+
+    for (i = 0; i < PERF_EVENT_NUM; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (perf->fds[i] >= 0) {
+            opened++;
         }
     }
-
-    instance_count++;
-    return instance_i;
+    perf->enabled = opened > 0;
+    return opened;
 }
 
-static struct class_instance *get_instance(int index) {
-    if (index >= instance_count || index < 0) {
-        return NULL;
+static void close_perf_counters(struct perf_counters *perf) {
+    int i;
+
+    if (!perf->enabled) {
+        return;
+    }
+    for (i = 0; i < PERF_EVENT_NUM; i++) {
+        if (perf->fds[i] >= 0) {
+            close(perf->fds[i]);
+        }
     }
-    return instances[index];
+    perf->enabled = false;
 }
 
-static int get_instance_field(struct class_instance *instance, const char *name, void *value) {
+static void read_perf_values(struct perf_counters *perf, struct perf_values *values) {
     int i;
-    struct class_instance_field *field;
 
-    for (i = 0; i < instance->field_num; i++) {
-        field = instance->fields[i];
-        if (strcmp(field->name, name) == 0) {
-            switch (field->descriptor[0]) {
-                case FIELD_DESCRIPTOR_INT:
-                    *((int *) value) = *((int *) field->data);
-                    return 0;
-                case FIELD_DESCRIPTOR_OBJECT:
-                    fprintf(stderr, "not yet implemented for FIELD_DESCRIPTOR_OBJECT\n");
-                    return -1;
-                default:
-                    return -1;
-            }
+    for (i = 0; i < PERF_EVENT_NUM; i++) {
+        if (perf->fds[i] < 0 || read(perf->fds[i], &values->v[i], sizeof(u_int64_t)) != sizeof(u_int64_t)) {
+            values->v[i] = 0;
         }
     }
+}
 
-    return -1;
+static void perf_phase_begin(struct perf_counters *perf, struct perf_values *start) {
+    if (perf->enabled) {
+        read_perf_values(perf, start);
+    }
 }
 
-static int put_instance_field(struct class_instance *instance, const char *name, void *value) {
+static void perf_phase_end(struct perf_counters *perf, enum perf_phase phase, struct perf_values *start) {
+    struct perf_values end;
     int i;
-    struct class_instance_field *field;
 
-    for (i = 0; i < instance->field_num; i++) {
-        field = instance->fields[i];
-        if (strcmp(field->name, name) == 0) {
-            switch (field->descriptor[0]) {
-                case FIELD_DESCRIPTOR_INT:
-                    *((int *) field->data) = *((int *) value);
-                    return 0;
-                case FIELD_DESCRIPTOR_OBJECT:
-                    fprintf(stderr, "not yet implemented for FIELD_DESCRIPTOR_OBJECT\n");
-                    return -1;
-                default:
-                    return -1;
-            }
-        }
+    if (!perf->enabled) {
+        return;
+    }
+    read_perf_values(perf, &end);
+    for (i = 0; i < PERF_EVENT_NUM; i++) {
+        perf->phases[phase].v[i] += end.v[i] - start->v[i];
     }
+}
 
-    return -1;
+static void perf_method_enter(struct perf_counters *perf, struct perf_activation *activation) {
+    memset(&activation->children, 0, sizeof(struct perf_values));
+    activation->parent = perf->current;
+    perf->current = activation;
+    read_perf_values(perf, &activation->start);
 }
 
-/**
- * Return length of str.
- * The format is described in 4.4.7 The CONSTANT_Utf8_info Structure
- */
-static int read_utf8(char *str, struct constant_utf8_info *cp) {
-    // TODO: current implementation cannot handle unicode higher than \u007F
+static void perf_method_exit(struct perf_counters *perf, struct method_info *method, struct perf_activation *activation) {
+    struct perf_values end;
+    u_int64_t total;
     int i;
 
-    for (i = 0; i < cp->length; i++) {
-        if (cp->bytes[i] > 0x007f) {
-            fprintf(stderr, "read_utf8 not yet implemented other than ASCII characters\n");
-            return -1;
+    read_perf_values(perf, &end);
+    perf->current = activation->parent;
+    if (method->perf == NULL) {
+        method->perf = calloc(1, sizeof(struct method_perf));
+        if (method->perf == NULL) {
+            return;
+        }
+    }
+
+    method->perf->calls++;
+    for (i = 0; i < PERF_EVENT_NUM; i++) {
+        total = end.v[i] - activation->start.v[i];
+        method->perf->total.v[i] += total;
+        method->perf->self.v[i] += total - activation->children.v[i];
+        if (activation->parent != NULL) {
+            activation->parent->children.v[i] += total;
         }
-        str[i] = cp->bytes[i];
     }
-    str[i] = '\0';
-    return i;
 }
 
 //
-// read data from class file in big endian
+// Statistics
 //
 
-static u_int8_t read8(FILE *main_file) {
-    u_int8_t x;
-    fread(&x, 1, 1, main_file);
-    return x;
+// Counters updated by the interpreter for the report at VM exit (see enable_stats).
+
+// Table 7.1 Opcode Mnemonics by Opcode
+static const char *opcode_names[256] = {
+        "nop", "aconst_null", "iconst_m1", "iconst_0", "iconst_1", "iconst_2", "iconst_3", "iconst_4",
+        "iconst_5", "lconst_0", "lconst_1", "fconst_0", "fconst_1", "fconst_2", "dconst_0", "dconst_1",
+        "bipush", "sipush", "ldc", "ldc_w", "ldc2_w", "iload", "lload", "fload",
+        "dload", "aload", "iload_0", "iload_1", "iload_2", "iload_3", "lload_0", "lload_1",
+        "lload_2", "lload_3", "fload_0", "fload_1", "fload_2", "fload_3", "dload_0", "dload_1",
+        "dload_2", "dload_3", "aload_0", "aload_1", "aload_2", "aload_3", "iaload", "laload",
+        "faload", "daload", "aaload", "baload", "caload", "saload", "istore", "lstore",
+        "fstore", "dstore", "astore", "istore_0", "istore_1", "istore_2", "istore_3", "lstore_0",
+        "lstore_1", "lstore_2", "lstore_3", "fstore_0", "fstore_1", "fstore_2", "fstore_3", "dstore_0",
+        "dstore_1", "dstore_2", "dstore_3", "astore_0", "astore_1", "astore_2", "astore_3", "iastore",
+        "lastore", "fastore", "dastore", "aastore", "bastore", "castore", "sastore", "pop",
+        "pop2", "dup", "dup_x1", "dup_x2", "dup2", "dup2_x1", "dup2_x2", "swap",
+        "iadd", "ladd", "fadd", "dadd", "isub", "lsub", "fsub", "dsub",
+        "imul", "lmul", "fmul", "dmul", "idiv", "ldiv", "fdiv", "ddiv",
+        "irem", "lrem", "frem", "drem", "ineg", "lneg", "fneg", "dneg",
+        "ishl", "lshl", "ishr", "lshr", "iushr", "lushr", "iand", "land",
+        "ior", "lor", "ixor", "lxor", "iinc", "i2l", "i2f", "i2d",
+        "l2i", "l2f", "l2d", "f2i", "f2l", "f2d", "d2i", "d2l",
+        "d2f", "i2b", "i2c", "i2s", "lcmp", "fcmpl", "fcmpg", "dcmpl",
+        "dcmpg", "ifeq", "ifne", "iflt", "ifge", "ifgt", "ifle", "if_icmpeq",
+        "if_icmpne", "if_icmplt", "if_icmpge", "if_icmpgt", "if_icmple", "if_acmpeq", "if_acmpne", "goto",
+        "jsr", "ret", "tableswitch", "lookupswitch", "ireturn", "lreturn", "freturn", "dreturn",
+        "areturn", "return", "getstatic", "putstatic", "getfield", "putfield", "invokevirtual", "invokespecial",
+        "invokestatic", "invokeinterface", "invokedynamic", "new", "newarray", "anewarray", "arraylength", "athrow",
+        "checkcast", "instanceof", "monitorenter", "monitorexit", "wide", "multianewarray", "ifnull", "ifnonnull",
+        "goto_w", "jsr_w",
+};
+
+struct vm_stats {
+    FILE *out;
+    bool close_out;
+    long long opcodes[256];
+    long frames;
+    long native_calls;
+    long class_lookups;  // by name (resolution and load_class)
+    long method_lookups; // by name (resolution)
+    long field_lookups;  // by name (resolution)
+    long long callee_bytecodes; // bytecodes executed by methods called from the current method
+};
+
+// counters of a method (allocated when the method is invoked first)
+struct method_stats {
+    long invocations;
+    long long bytecodes; // executed in the method itself
+};
+
+// counters of an activation of a method (on the C stack of exec_method)
+struct stats_activation {
+    long long start;
+    long long callee_bytecodes;
+};
+
+static void stats_method_enter(struct vm_stats *stats, long long executed_bytecodes, struct stats_activation *activation) {
+    stats->frames++;
+    activation->start = executed_bytecodes;
+    activation->callee_bytecodes = stats->callee_bytecodes;
+    stats->callee_bytecodes = 0;
 }
 
-static u_int16_t read16(FILE *main_file) {
-    u_int16_t x;
-    fread(&x, 2, 1, main_file);
-    return ((x & 0x00ff) << 8 | (x >> 8));
+static void stats_method_exit(struct vm_stats *stats, long long executed_bytecodes, struct method_info *method,
+        struct stats_activation *activation) {
+    long long total = executed_bytecodes - activation->start;
+
+    if (method->stats == NULL) {
+        method->stats = calloc(1, sizeof(struct method_stats));
+    }
+    if (method->stats != NULL) {
+        method->stats->invocations++;
+        method->stats->bytecodes += total - stats->callee_bytecodes;
+    }
+    stats->callee_bytecodes = activation->callee_bytecodes + total;
 }
 
-static u_int32_t read32(FILE *main_file) {
-    u_int32_t x;
-    fread(&x, 4, 1, main_file);
-    return (((x & 0x000000ff) << 24) | ((x & 0x0000ff00) << 8) | ((x & 0x00ff0000) >> 8) | ((x & 0xff000000) >> 24));
+//
+// Sampling Profiler
+//
+
+// Samples the Java frames of the thread which enabled the profiler on a timer signal (see enable_profiler).
+// The timer counts CPU time of the thread, so an idle VM is not sampled.
+// The handler only copies the frame chain into buffers allocated beforehand (no malloc, no locks),
+// and samples are mapped to source lines and folded when the report is written.
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define PROFILER_MAX_DEPTH 128
+#define PROFILER_MAX_SAMPLES (1 << 18)
+#define PROFILER_MAX_FRAMES (1 << 21)
+
+// a method execution (on the frame stack of the VM), linked from the innermost one
+struct java_frame {
+    struct method_info *method;
+    u_int8_t *code;
+    u_int8_t *volatile pc; // updated before each instruction
+    struct java_frame *prev;
+
+    // used by the interpreter only
+    u_int8_t *code_end;
+    u_int8_t *return_pc; // where the method continues after its callee returns
+    struct class_file *class;
+    struct frame frame;  // locals are before the java_frame, and the operand stack follows it
+    char *prev_stack_top; // of the frame stack before this frame
+    struct perf_activation perf;
+    struct stats_activation stats;
+};
+
+struct sample_frame {
+    struct method_info *method;
+    u_int8_t *code; // run by the frame, which may have callees inlined (NULL if pc is in the original code)
+    int pc;
+};
+
+static int get_source_frames(struct method_info *method, u_int8_t *code, int pc, struct sample_frame *frames,
+        int max);
+
+struct sample {
+    int depth;
+    bool truncated; // deeper frames than PROFILER_MAX_DEPTH are dropped
+};
+
+struct profiler {
+    struct java_frame *volatile *top_frame; // of the VM
+    timer_t timer;
+    FILE *out;
+    bool close_out;
+
+    // frames of samples (innermost first) in the order of samples
+    struct sample_frame *frames;
+    int frame_num;
+    struct sample *samples;
+    int sample_num;
+    long dropped; // samples not recorded because buffers are full
+};
+
+static void profiler_handler(int sig, siginfo_t *info, void *context) {
+    struct profiler *profiler;
+    struct java_frame *frame;
+    struct sample_frame *frames;
+    int depth = 0;
+
+    if (info->si_code != SI_TIMER) {
+        return;
+    }
+    profiler = info->si_value.sival_ptr;
+    if (profiler->sample_num == PROFILER_MAX_SAMPLES
+            || profiler->frame_num + PROFILER_MAX_DEPTH > PROFILER_MAX_FRAMES) {
+        profiler->dropped++;
+        return;
+    }
+
+    frames = profiler->frames + profiler->frame_num;
+    for (frame = *profiler->top_frame; frame != NULL && depth < PROFILER_MAX_DEPTH; frame = frame->prev) {
+        frames[depth].method = frame->method;
+        frames[depth].code = frame->code;
+        frames[depth].pc = (int) (frame->pc - frame->code);
+        depth++;
+    }
+    profiler->samples[profiler->sample_num].depth = depth;
+    profiler->samples[profiler->sample_num].truncated = frame != NULL;
+    profiler->frame_num += depth;
+    profiler->sample_num++;
 }
 
-static size_t readn(void *dst, int n, FILE *main_file) {
-    return fread(dst, 1, n, main_file);
+/**
+ * Start sampling the calling thread every 1/frequency seconds of its CPU time.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int start_profiler(struct profiler *profiler, int frequency) {
+    struct sigaction action;
+    struct sigevent event;
+    struct itimerspec spec;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = profiler_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        perror("sigaction");
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_value.sival_ptr = profiler;
+    event.sigev_notify_thread_id = (pid_t) syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &profiler->timer) != 0) {
+        perror("timer_create");
+        return -1;
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = 1000000000L / frequency;
+    spec.it_value = spec.it_interval;
+    if (timer_settime(profiler->timer, 0, &spec, NULL) != 0) {
+        perror("timer_settime");
+        timer_delete(profiler->timer);
+        return -1;
+    }
+    return 0;
 }
 
-int parse_cp_info(struct cp_info **cp_info, FILE *main_file) {
-    u_int8_t tag;
-    u_int16_t len;
+/**
+ * Return the source line of the pc in the method, or -1 if there is no LineNumberTable.
+ */
+static int get_line_number(struct method_info *method, int pc) {
+    struct code_attribute *code;
+    struct line_number_table_attribute *table;
+    struct constant_utf8_info *attr_name;
+    char name[1024];
+    int i, j, start_pc = -1, line = -1;
 
-    tag = read8(main_file);
-    switch (tag) {
-        case CONSTANT_CLASS:
-            *cp_info = (struct cp_info *) malloc(sizeof(struct constant_class_info));
-            if (*cp_info == NULL) {
-                fprintf(stderr, "failed to prepare CONSTANT_CLASS cp_info\n");
-                return -1;
+    code = get_code(method, method->class);
+    if (code == NULL) {
+        return -1;
+    }
+    // there may be multiple tables in any order (4.7.12)
+    for (i = 0; i < code->attributes_count; i++) {
+        attr_name = find_cp_utf8(code->attributes[i]->attribute_name_index, method->class);
+        if (attr_name == NULL || read_utf8(name, attr_name) < 0 || strcmp(name, ATTR_LINE_NUMBER_TABLE) != 0) {
+            continue;
+        }
+        table = ATTR_LINE_NUMBER_TABLE_INFO(code->attributes[i]);
+        for (j = 0; j < table->line_number_table_length; j++) {
+            if (table->line_number_table[j].start_pc <= pc && table->line_number_table[j].start_pc > start_pc) {
+                start_pc = table->line_number_table[j].start_pc;
+                line = table->line_number_table[j].line_number;
             }
-            ((struct constant_class_info *) *cp_info)->tag = tag;
-            ((struct constant_class_info *) *cp_info)->name_index = read16(main_file);
-            return 0;
-        case CONSTANT_FIELDREF:
-            *cp_info = (struct cp_info *) malloc(sizeof(struct constant_fieldref_info));
-            if (*cp_info == NULL) {
-                fprintf(stderr, "failed to prepare CONSTANT_FIELDREF cp_info\n");
-                return -1;
+        }
+    }
+    return line;
+}
+
+/**
+ * Write the method and the source line of the pc (e.g. "Main.main:3") into out.
+ */
+static void write_frame_name(FILE *out, struct method_info *method, int pc) {
+    char class_name[1024], method_name[1024];
+    int line;
+
+    read_utf8(class_name, get_this_class(method->class));
+    get_method_name(method_name, method, method->class);
+    line = get_line_number(method, pc);
+    if (line >= 0) {
+        fprintf(out, "%s.%s:%d", class_name, method_name, line);
+    } else {
+        fprintf(out, "%s.%s", class_name, method_name);
+    }
+}
+
+/**
+ * Write a sample as a folded stack (outermost first) into out.
+ * Callees inlined into a frame are written as frames of their own.
+ */
+static void write_folded_stack(FILE *out, struct sample *sample, struct sample_frame *frames) {
+    struct sample_frame source[PROFILER_MAX_DEPTH];
+    int i, j, n;
+
+    if (sample->depth == 0) {
+        fprintf(out, "[no Java frames]");
+        return;
+    }
+    if (sample->truncated) {
+        fprintf(out, "[truncated];");
+    }
+    for (i = sample->depth - 1; i >= 0; i--) {
+        n = get_source_frames(frames[i].method, frames[i].code, frames[i].pc, source, PROFILER_MAX_DEPTH);
+        for (j = n - 1; j >= 0; j--) {
+            write_frame_name(out, source[j].method, source[j].pc);
+            if (i > 0 || j > 0) {
+                fprintf(out, ";");
             }
-            ((struct constant_fieldref_info *) *cp_info)->tag = tag;
-            ((struct constant_fieldref_info *) *cp_info)->class_index = read16(main_file);
-            ((struct constant_fieldref_info *) *cp_info)->name_and_type_index = read16(main_file);
-            return 0;
-        case CONSTANT_METHODREF:
+        }
+    }
+}
+
+static int compare_stacks(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+//
+// Event Recorder
+//
+
+// Records of VM events (see recording.h) are buffered in the VM and written to the file in chunks.
+// A VM runs on one thread at a time (see enter_vm), so the buffer is used without locks.
+// A chunk is written when the buffer is full, or at a safepoint after RECORDER_FLUSH_INTERVAL_NS,
+// which a timer of the recorder requests every interval while the program runs.
+
+#define RECORDER_BUFFER_RECORDS 1024
+#define RECORDER_FLUSH_INTERVAL_NS 1000000000ULL
+#define RECORDER_ALLOCATION_BURST 1024
+
+struct recorder {
+    FILE *out;
+    struct record records[RECORDER_BUFFER_RECORDS];
+    int record_num;
+    u_int64_t chunk_start;
+    timer_t timer;
+
+    // the thread which entered the VM last (see enter_vm)
+    int32_t tid;
+
+    // allocations not recorded yet
+    u_int64_t allocations;
+    u_int64_t allocation_start;
+};
+
+/**
+ * Write the buffered records as a chunk.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int flush_recorder(struct recorder *recorder) {
+    struct recording_chunk chunk;
+    int retval = 0;
+
+    if (recorder->record_num == 0) {
+        return 0;
+    }
+    chunk.magic = RECORDING_CHUNK_MAGIC;
+    chunk.record_num = recorder->record_num;
+    chunk.start_ns = recorder->chunk_start;
+    chunk.end_ns = get_monotonic_time();
+    if (fwrite(&chunk, sizeof(chunk), 1, recorder->out) != 1
+            || fwrite(recorder->records, sizeof(struct record), recorder->record_num, recorder->out)
+                    != (size_t) recorder->record_num
+            || fflush(recorder->out) != 0) {
+        fprintf(stderr, "failed to write recording\n");
+        retval = -1;
+    }
+    recorder->record_num = 0;
+    return retval;
+}
+
+/**
+ * Record an event from start to now.
+ */
+static void record_event(struct recorder *recorder, enum record_type type, u_int64_t start, u_int64_t value,
+        const char *name) {
+    struct record *record;
+    u_int64_t now = get_monotonic_time();
+
+    if (recorder->record_num == 0) {
+        recorder->chunk_start = start;
+    }
+    record = &recorder->records[recorder->record_num++];
+    memset(record, 0, sizeof(struct record));
+    record->start_ns = start;
+    record->duration_ns = now - start;
+    record->value = value;
+    record->type = type;
+    record->tid = recorder->tid;
+    if (name != NULL) {
+        strncpy(record->name, name, RECORD_NAME_LEN - 1);
+    }
+
+    if (recorder->record_num == RECORDER_BUFFER_RECORDS) {
+        flush_recorder(recorder);
+    }
+}
+
+static void record_allocations(struct recorder *recorder) {
+    if (recorder->allocations > 0) {
+        record_event(recorder, RECORD_ALLOCATION, recorder->allocation_start, recorder->allocations, NULL);
+        recorder->allocations = 0;
+    }
+}
+
+/**
+ * Count an allocation. Allocations are recorded by bursts of RECORDER_ALLOCATION_BURST objects.
+ */
+static void record_allocation(struct recorder *recorder) {
+    if (recorder->allocations == 0) {
+        recorder->allocation_start = get_monotonic_time();
+    }
+    if (++recorder->allocations == RECORDER_ALLOCATION_BURST) {
+        record_allocations(recorder);
+    }
+}
+
+//
+// Allocation Profiler
+//
+
+// Allocation sites (method and pc of the innermost Java frame, and the class) of created objects
+// (see enable_allocation_profiler). Every allocation is counted, or one is sampled every N bytes
+// and the report scales the samples up to the total.
+// The report is also written on SIGUSR2 at the next safepoint (see run_safepoint).
+
+#define ALLOCATION_REPORT_SIGNAL SIGUSR2
+#define ALLOCATION_REPORT_TOP 20
+
+struct allocation_site {
+    struct method_info *method; // NULL if allocated by the host (e.g. NewObject of JNI)
+    int pc;
+    struct class_file *class;
+    long long count;
+    long long bytes;
+};
+
+struct allocation_profiler {
+    FILE *out;
+    bool close_out;
+    long sample_bytes; // 0 to count every allocation
+    long until_sample;
+
+    // open addressing (the capacity is a power of 2)
+    struct allocation_site *sites;
+    int site_num;
+    int site_cap;
+
+    long long total_count;
+    long long total_bytes;
+    long long sampled_bytes;
+    int handled_requests;
+};
+
+// incremented by the signal handler, and compared with handled_requests of each profiler
+static volatile sig_atomic_t allocation_report_requests = 0;
+
+static void arm_all_safepoints(void);
+
+static void allocation_report_handler(int sig) {
+    allocation_report_requests++;
+    arm_all_safepoints();
+}
+
+/**
+ * Return the bytes allocated for the instance and its fields.
+ */
+static size_t get_instance_size(struct class_instance *instance) {
+    size_t size = sizeof(struct class_instance) + instance->field_num * sizeof(struct class_instance_field *);
+    int i;
+
+    for (i = 0; i < instance->field_num; i++) {
+        if (instance->fields[i] != NULL) {
+            size += sizeof(struct class_instance_field) + sizeof(int32_t)
+                    + strlen(instance->fields[i]->name) + 1 + strlen(instance->fields[i]->descriptor) + 1;
+        }
+    }
+    return size;
+}
+
+static unsigned int hash_allocation_site(struct method_info *method, int pc, struct class_file *class) {
+    uintptr_t h = (uintptr_t) method * 31 + (uintptr_t) class;
+
+    h = h * 31 + (unsigned int) pc;
+    return (unsigned int) (h ^ (h >> 16));
+}
+
+/**
+ * Return the site of the method, pc and class (added if not found), or NULL if failed to grow the table.
+ */
+static struct allocation_site *find_allocation_site(struct allocation_profiler *profiler,
+        struct method_info *method, int pc, struct class_file *class) {
+    struct allocation_site *sites, *site;
+    int i, j, cap;
+
+    if ((profiler->site_num + 1) * 2 > profiler->site_cap) {
+        cap = profiler->site_cap == 0 ? 64 : profiler->site_cap * 2;
+        sites = calloc(cap, sizeof(struct allocation_site));
+        if (sites == NULL) {
+            return NULL;
+        }
+        for (i = 0; i < profiler->site_cap; i++) {
+            site = &profiler->sites[i];
+            if (site->class == NULL) {
+                continue;
+            }
+            for (j = hash_allocation_site(site->method, site->pc, site->class) & (cap - 1);
+                    sites[j].class != NULL; j = (j + 1) & (cap - 1));
+            sites[j] = *site;
+        }
+        free(profiler->sites);
+        profiler->sites = sites;
+        profiler->site_cap = cap;
+    }
+
+    for (i = hash_allocation_site(method, pc, class) & (profiler->site_cap - 1);; i = (i + 1) & (profiler->site_cap - 1)) {
+        site = &profiler->sites[i];
+        if (site->class == NULL) {
+            site->method = method;
+            site->pc = pc;
+            site->class = class;
+            profiler->site_num++;
+            return site;
+        }
+        if (site->method == method && site->pc == pc && site->class == class) {
+            return site;
+        }
+    }
+}
+
+static void print_allocation_sites_of(struct allocation_profiler *profiler, FILE *out);
+
+static void profile_allocation(struct allocation_profiler *profiler, struct java_frame *frame,
+        struct class_instance *instance) {
+    struct allocation_site *site;
+    struct sample_frame source;
+    size_t size = get_instance_size(instance);
+
+    profiler->total_count++;
+    profiler->total_bytes += size;
+    if (profiler->sample_bytes > 0) {
+        profiler->until_sample -= size;
+    }
+    if (profiler->until_sample <= 0) {
+        profiler->until_sample += profiler->sample_bytes;
+        profiler->sampled_bytes += size;
+        // the site in a callee inlined into the frame is the one in the callee
+        source.method = NULL;
+        source.pc = 0;
+        if (frame != NULL) {
+            get_source_frames(frame->method, frame->code, (int) (frame->pc - frame->code), &source, 1);
+        }
+        site = find_allocation_site(profiler, source.method, source.pc, instance->class);
+        if (site != NULL) {
+            site->count++;
+            site->bytes += size;
+        }
+    }
+}
+
+static int compare_allocation_count(const void *a, const void *b) {
+    const struct allocation_site *x = *(struct allocation_site * const *) a, *y = *(struct allocation_site * const *) b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+static int compare_allocation_bytes(const void *a, const void *b) {
+    const struct allocation_site *x = *(struct allocation_site * const *) a, *y = *(struct allocation_site * const *) b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+static void print_allocation_site_list(struct allocation_profiler *profiler, FILE *out,
+        struct allocation_site **sites, int site_num) {
+    char class_name[1024];
+    double scale = 1.0;
+    int i;
+
+    if (profiler->sampled_bytes > 0) {
+        scale = (double) profiler->total_bytes / (double) profiler->sampled_bytes;
+    }
+    for (i = 0; i < site_num && i < ALLOCATION_REPORT_TOP; i++) {
+        read_utf8(class_name, get_this_class(sites[i]->class));
+        fprintf(out, "%14lld %14lld %s ", (long long) (sites[i]->count * scale + 0.5),
+                (long long) (sites[i]->bytes * scale + 0.5), class_name);
+        if (sites[i]->method != NULL) {
+            write_frame_name(out, sites[i]->method, sites[i]->pc);
+            fprintf(out, " (pc %d)\n", sites[i]->pc);
+        } else {
+            fprintf(out, "(host)\n");
+        }
+    }
+}
+
+static void print_allocation_sites_of(struct allocation_profiler *profiler, FILE *out) {
+    struct allocation_site **sites;
+    int i, site_num = 0;
+
+    sites = calloc(profiler->site_num + 1, sizeof(struct allocation_site *));
+    if (sites == NULL) {
+        return;
+    }
+    for (i = 0; i < profiler->site_cap; i++) {
+        if (profiler->sites[i].class != NULL) {
+            sites[site_num++] = &profiler->sites[i];
+        }
+    }
+
+    fprintf(out, "== allocation sites by count (objects, bytes%s) ==\n",
+            profiler->sample_bytes > 0 ? ", estimated from samples" : "");
+    qsort(sites, site_num, sizeof(struct allocation_site *), compare_allocation_count);
+    print_allocation_site_list(profiler, out, sites, site_num);
+    fprintf(out, "== allocation sites by bytes (objects, bytes%s) ==\n",
+            profiler->sample_bytes > 0 ? ", estimated from samples" : "");
+    qsort(sites, site_num, sizeof(struct allocation_site *), compare_allocation_bytes);
+    print_allocation_site_list(profiler, out, sites, site_num);
+    fprintf(out, "%14lld %14lld total\n", profiler->total_count, profiler->total_bytes);
+    fflush(out);
+
+    free(sites);
+}
+
+//
+// Perf Map
+//
+
+// Each Java method gets its own entry, a small trampoline calling the interpreter (keeping the frame pointer),
+// so that native profilers such as perf see a frame per Java method instead of only interpret_method.
+// Entries are named in /tmp/perf-<pid>.map and, if enabled, in jit-<pid>.dump for `perf inject --jit`.
+// The files are shared by all VMs in the process and never closed.
+
+typedef int (*method_entry)(struct vm *vm, struct method_info *method, struct code_attribute *code,
+        struct frame *prev_frame, struct class_file *class);
+
+#define CODE_BLOCK_SIZE (64 * 1024)
+#define METHOD_ENTRY_SIZE 32
+
+// jitdump format (tools/perf/Documentation/jitdump-specification.txt)
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_CODE_LOAD 0
+
+struct jitdump_header {
+    u_int32_t magic;
+    u_int32_t version;
+    u_int32_t total_size;
+    u_int32_t elf_mach;
+    u_int32_t pad1;
+    u_int32_t pid;
+    u_int64_t timestamp;
+    u_int64_t flags;
+};
+
+struct jitdump_code_load {
+    u_int32_t id;
+    u_int32_t total_size;
+    u_int64_t timestamp;
+    u_int32_t pid;
+    u_int32_t tid;
+    u_int64_t vma;
+    u_int64_t code_addr;
+    u_int64_t code_size;
+    u_int64_t code_index;
+    // followed by the name (NUL-terminated) and the code
+};
+
+// executable memory of entries (mapped writable only while an entry is written)
+struct code_block {
+    u_int8_t *code;
+    size_t used;
+    struct code_block *next;
+};
+
+struct perf_map {
+    struct code_block *blocks; // the current one first
+};
+
+static pthread_mutex_t perf_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *perf_map_file = NULL;
+static FILE *jitdump_file = NULL;
+static u_int64_t jitdump_code_index = 0;
+
+/**
+ * Open the files of the process if not opened yet.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int open_perf_map_files(char *jitdump_dir) {
+    struct jitdump_header header;
+    char path[1024];
+    int retval = 0;
+
+    pthread_mutex_lock(&perf_map_lock);
+    if (perf_map_file == NULL) {
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+        perf_map_file = fopen(path, "a");
+        if (perf_map_file == NULL) {
+            perror("fopen");
+            retval = -1;
+        }
+    }
+
+    if (retval == 0 && jitdump_dir != NULL && jitdump_file == NULL) {
+        snprintf(path, sizeof(path), "%s/jit-%d.dump", jitdump_dir, (int) getpid());
+        jitdump_file = fopen(path, "w+");
+        if (jitdump_file == NULL) {
+            perror("fopen");
+            retval = -1;
+        } else {
+            memset(&header, 0, sizeof(header));
+            header.magic = JITDUMP_MAGIC;
+            header.version = JITDUMP_VERSION;
+            header.total_size = sizeof(header);
+#if defined(__x86_64__)
+            header.elf_mach = 62; // EM_X86_64
+#elif defined(__aarch64__)
+            header.elf_mach = 183; // EM_AARCH64
+#endif
+            header.pid = (u_int32_t) getpid();
+            header.timestamp = get_monotonic_time();
+            fwrite(&header, sizeof(header), 1, jitdump_file);
+            fflush(jitdump_file);
+            // perf record finds the file by this executable mapping
+            if (mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(jitdump_file), 0)
+                    == MAP_FAILED) {
+                perror("mmap");
+            }
+        }
+    }
+    pthread_mutex_unlock(&perf_map_lock);
+    return retval;
+}
+
+static void write_perf_map_entry(void *code, size_t size, char *name) {
+    struct jitdump_code_load record;
+
+    pthread_mutex_lock(&perf_map_lock);
+    fprintf(perf_map_file, "%lx %lx %s\n", (unsigned long) (uintptr_t) code, (unsigned long) size, name);
+    fflush(perf_map_file);
+
+    if (jitdump_file != NULL) {
+        record.id = JITDUMP_CODE_LOAD;
+        record.total_size = sizeof(record) + strlen(name) + 1 + size;
+        record.timestamp = get_monotonic_time();
+        record.pid = (u_int32_t) getpid();
+        record.tid = (u_int32_t) syscall(SYS_gettid);
+        record.vma = (u_int64_t) (uintptr_t) code;
+        record.code_addr = (u_int64_t) (uintptr_t) code;
+        record.code_size = size;
+        record.code_index = jitdump_code_index++;
+        fwrite(&record, sizeof(record), 1, jitdump_file);
+        fwrite(name, 1, strlen(name) + 1, jitdump_file);
+        fwrite(code, 1, size, jitdump_file);
+        fflush(jitdump_file);
+    }
+    pthread_mutex_unlock(&perf_map_lock);
+}
+
+/**
+ * Write the trampoline calling target into code.
+ * Return the size, or 0 if not supported on this architecture.
+ */
+static size_t write_trampoline(u_int8_t *code, void *target) {
+#if defined(__x86_64__)
+    // push %rbp; mov %rsp,%rbp; movabs $target,%rax; call *%rax; pop %rbp; ret
+    static const u_int8_t head[] = {0x55, 0x48, 0x89, 0xe5, 0x48, 0xb8};
+    static const u_int8_t tail[] = {0xff, 0xd0, 0x5d, 0xc3};
+    u_int64_t address = (u_int64_t) (uintptr_t) target;
+
+    memcpy(code, head, sizeof(head));
+    memcpy(code + sizeof(head), &address, sizeof(address));
+    memcpy(code + sizeof(head) + sizeof(address), tail, sizeof(tail));
+    return sizeof(head) + sizeof(address) + sizeof(tail);
+#elif defined(__aarch64__)
+    // stp x29,x30,[sp,#-16]!; mov x29,sp; ldr x16,target; blr x16; ldp x29,x30,[sp],#16; ret; target
+    static const u_int32_t insts[] = {0xa9bf7bfd, 0x910003fd, 0x58000090, 0xd63f0200, 0xa8c17bfd, 0xd65f03c0};
+    u_int64_t address = (u_int64_t) (uintptr_t) target;
+
+    memcpy(code, insts, sizeof(insts));
+    memcpy(code + sizeof(insts), &address, sizeof(address));
+    return sizeof(insts) + sizeof(address);
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Create the entry of the method and name it in the perf map.
+ * Return the entry, or NULL if failed (then the method is interpreted directly).
+ */
+static method_entry create_method_entry(struct perf_map *perf_map, struct method_info *method) {
+    struct code_block *block = perf_map->blocks;
+    char class_name[1024], method_name[1024], descriptor[1024], name[3072];
+    u_int8_t *code;
+    size_t size;
+
+    if (block == NULL || block->used + METHOD_ENTRY_SIZE > CODE_BLOCK_SIZE) {
+        block = calloc(1, sizeof(struct code_block));
+        if (block == NULL) {
+            return NULL;
+        }
+        block->code = mmap(NULL, CODE_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block->code == MAP_FAILED) {
+            perror("mmap");
+            free(block);
+            return NULL;
+        }
+        block->next = perf_map->blocks;
+        perf_map->blocks = block;
+    } else if (mprotect(block->code, CODE_BLOCK_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        perror("mprotect");
+        return NULL;
+    }
+
+    code = block->code + block->used;
+    size = write_trampoline(code, (void *) interpret_method);
+    if (mprotect(block->code, CODE_BLOCK_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        perror("mprotect");
+        return NULL;
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    __builtin___clear_cache((char *) code, (char *) code + size);
+    block->used += METHOD_ENTRY_SIZE;
+
+    // e.g. Main.fib(I)I
+    read_utf8(class_name, get_this_class(method->class));
+    get_method_name(method_name, method, method->class);
+    read_utf8(descriptor, find_cp_utf8(method->descriptor_index, method->class));
+    snprintf(name, sizeof(name), "%s.%s%s", class_name, method_name, descriptor);
+    write_perf_map_entry(code, size, name);
+
+    method->entry = (void *) code;
+    return (method_entry) code;
+}
+
+static void free_perf_map(struct perf_map *perf_map) {
+    struct code_block *block, *next;
+
+    for (block = perf_map->blocks; block != NULL; block = next) {
+        next = block->next;
+        munmap(block->code, CODE_BLOCK_SIZE);
+        free(block);
+    }
+    free(perf_map);
+}
+
+//
+// VM
+//
+
+// Everything needed to run a program. Each VM is independent from others.
+struct vm {
+    int status;
+    // class of the error stopping the last run_vm or call_method (NULL if none, see throw_vm_error)
+    const char *error;
+    struct class_loader loader;
+    struct native_loader native_loader;
+
+    // Heap. A reference is an index of instances and freed slots are reused.
+    struct class_instance **instances;
+    int instance_count; // number of slots (including freed ones)
+    int instance_cap;
+    int *free_slots;
+    int free_slot_num;
+    int allocated_since_gc;
+    int live_after_gc;
+
+    // snapshot mapped by restore_vm, holding its classes and objects (NULL unless restored)
+    char *image;
+    size_t image_size;
+
+    // references pinned by the host (global references)
+    int *global_refs;
+    int global_ref_num;
+    int global_ref_cap;
+
+    // number of calls from the host running now. GC runs only when it is 0.
+    int active_calls;
+    // the thread of the calls (valid while active_calls > 0)
+    pthread_t thread;
+    // held by the thread running the program (see enter_vm). Recursive, since natives may call the VM again.
+    pthread_mutex_t running;
+
+    // read by the interpreter at safepoints, and unreadable while operations are queued (see submit_vm_operation)
+    void *polling_page;
+    // set by the handler of a faulting poll, and cleared when the requests are run after the poll
+    volatile sig_atomic_t safepoint_pending;
+    struct safepoint *safepoint;
+    struct vm_operation *volatile operations; // the last queued first
+
+    // print parsed class files and executed instructions (see set_trace)
+    bool trace;
+
+    // number of instructions executed while statistics are enabled
+    long long executed_bytecodes;
+    // number of created objects
+    long long allocated_objects;
+
+    struct perf_counters perf;
+
+    // NULL unless enabled by enable_stats
+    struct vm_stats *stats;
+
+    // the innermost method execution (read by the sampling profiler)
+    struct java_frame *volatile top_frame;
+
+    // number of calls of exec_method running now (see MAX_NESTED_CALLS)
+    int nested_calls;
+
+    // memory of java frames, growing up to frame_stack_limit (see push_java_frame)
+    char *frame_stack;
+    char *frame_stack_top;
+    char *frame_stack_limit;
+
+    // NULL unless enabled by enable_profiler
+    struct profiler *profiler;
+
+    // NULL unless enabled by enable_recorder
+    struct recorder *recorder;
+
+    // NULL unless enabled by enable_allocation_profiler
+    struct allocation_profiler *allocation_profiler;
+
+    // written on allocation failures and on request by the signal (NULL unless enabled by enable_heap_dump)
+    char *heap_dump_path;
+    int handled_heap_dumps;
+
+    // entries of methods named for native profilers (NULL unless enabled by enable_perf_map)
+    struct perf_map *perf_map;
+
+    // of the last run_vm (see print_startup_timings)
+    u_int64_t main_lookup_time;
+    u_int64_t main_time;
+
+    // runs Java methods (see update_method_dispatch)
+    method_entry exec;
+
+    // limits of callees inlined into methods (see set_inlining)
+    int inline_max_size;
+    int inline_max_depth;
+    // counts promoting methods to the profiled and the optimized tiers (see set_tier_thresholds)
+    long tier_profile_threshold;
+    long tier_optimize_threshold;
+
+    // events reported to the agent (see set_agent_callbacks)
+    struct agent_callbacks agent;
+    void *agent_library; // NULL unless loaded by load_agent
+};
+
+/**
+ * Stop the program by the error, like an uncaught exception (exception handlers are not supported).
+ * error is the binary name of its class, e.g. "java/lang/ArithmeticException".
+ */
+static void throw_vm_error(struct vm *vm, const char *error, const char *message) {
+    const char *c;
+
+    vm->error = error;
+    vm->status = 1;
+    fprintf(stderr, "Exception in thread \"main\" ");
+    for (c = error; *c != '\0'; c++) {
+        fputc(*c == '/' ? '.' : *c, stderr);
+    }
+    fprintf(stderr, ": %s\n", message);
+}
+
+/**
+ * Make room for a new slot at the end of the heap.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int grow_heap(struct vm *vm) {
+    struct class_instance **instances;
+    int cap;
+
+    if (vm->instance_count < vm->instance_cap) {
+        return 0;
+    }
+    cap = vm->instance_cap == 0 ? 1024 : vm->instance_cap * 2;
+    instances = realloc(vm->instances, cap * sizeof(struct class_instance *));
+    if (instances == NULL) {
+        return -1;
+    }
+    vm->instances = instances;
+    vm->instance_cap = cap;
+    return 0;
+}
+
+// incremented by the signal handler, and compared with handled_heap_dumps of each VM (see enable_heap_dump)
+static volatile sig_atomic_t heap_dump_requests = 0;
+
+/**
+ * Create a new instance of the specified class.
+ * Return index to reference the created object.
+ * Return -1 if failed to create.
+ */
+static int create_instance(struct vm *vm, struct constant_class_info *cp_class, struct class_file *class) {
+    int field_i, instance_i;
+    char field_name[1024], field_descriptor[1024];
+    struct class_instance *instance;
+
+    instance = calloc(1, sizeof(struct class_instance));
+    if (instance != NULL) {
+        instance->fields = calloc(class->fields_count + 1, sizeof(struct class_instance_field *));
+    }
+    if (instance == NULL || instance->fields == NULL || (vm->free_slot_num == 0 && grow_heap(vm) != 0)) {
+        fprintf(stderr, "failed to allocate instance\n");
+        if (instance != NULL) {
+            free(instance->fields);
+        }
+        free(instance);
+        if (vm->heap_dump_path != NULL) {
+            dump_heap(vm, vm->heap_dump_path);
+        }
+        return -1;
+    }
+    if (vm->free_slot_num > 0) {
+        instance_i = vm->free_slots[--vm->free_slot_num];
+    } else {
+        instance_i = vm->instance_count++;
+    }
+
+    instance->class = class;
+    instance->field_num = class->fields_count;
+    vm->instances[instance_i] = instance;
+    vm->allocated_since_gc++;
+    vm->allocated_objects++;
+    if (vm->stats != NULL) {
+        class->created_instances++;
+    }
+    if (vm->recorder != NULL) {
+        record_allocation(vm->recorder);
+    }
+
+    // initialize fields
+    for (field_i = 0; field_i < class->fields_count; field_i++) {
+        get_field_name(field_name, class->fields[field_i], class);
+        get_field_descriptor(field_descriptor, class->fields[field_i], class);
+        if (create_instance_field(&instance->fields[field_i], field_name, field_descriptor) != 0) {
+            fprintf(stderr, "failed to initialize field\n");
+            return -1;
+        }
+    }
+    if (vm->allocation_profiler != NULL) {
+        profile_allocation(vm->allocation_profiler, vm->top_frame, instance);
+    }
+    if (vm->agent.object_alloc != NULL) {
+        vm->agent.object_alloc(vm, TO_JOBJECT(instance_i), (jclass) class);
+    }
+
+    return instance_i;
+}
+
+static struct class_instance *get_instance(struct vm *vm, int index) {
+    if (index >= vm->instance_count || index < 0) {
+        return NULL;
+    }
+    return vm->instances[index];
+}
+
+/**
+ * Return data of the field in the instance.
+ * Return NULL if not found.
+ */
+static int *get_instance_field_data(struct class_instance *instance, struct field_info *field) {
+    int i;
+
+    if (instance == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < instance->field_num; i++) {
+        if (instance->class->fields[i] == field) {
+            return (int *) instance->fields[i]->data;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Return true if the memory is in the snapshot the VM is restored from (see restore_vm).
+ * It is freed by unmapping the snapshot, not by free.
+ */
+static bool is_in_image(struct vm *vm, const void *p) {
+    return vm->image != NULL && (const char *) p >= vm->image && (const char *) p < vm->image + vm->image_size;
+}
+
+static void free_instance(struct vm *vm, struct class_instance *instance) {
+    int i;
+
+    if (is_in_image(vm, instance)) {
+        return;
+    }
+    for (i = 0; i < instance->field_num; i++) {
+        if (instance->fields[i] != NULL) {
+            free(instance->fields[i]->name);
+            free(instance->fields[i]->descriptor);
+            free(instance->fields[i]->data);
+            free(instance->fields[i]);
+        }
+    }
+    free(instance->fields);
+    free(instance);
+}
+
+//
+// Garbage Collection
+//
+
+// Objects are collected only when no Java frame is active (between calls from the host),
+// because values on operand stacks and locals are not known to be references or not.
+// Roots are static fields, global references and references passed by the host.
+
+#define GC_MIN_ALLOCATION 1024
+
+static bool is_static_field(struct field_info *field);
+
+static void mark_instance(struct vm *vm, bool *marked, int *stack, int ref) {
+    struct class_instance *instance;
+    int sp = 0, i;
+
+    if (get_instance(vm, ref) == NULL || marked[ref]) {
+        return;
+    }
+    marked[ref] = true;
+    stack[sp++] = ref;
+
+    while (sp > 0) {
+        instance = vm->instances[stack[--sp]];
+        for (i = 0; i < instance->field_num; i++) {
+            if (instance->fields[i] != NULL && instance->fields[i]->descriptor[0] == FIELD_DESCRIPTOR_OBJECT) {
+                ref = *((int *) instance->fields[i]->data);
+                if (get_instance(vm, ref) != NULL && !marked[ref]) {
+                    marked[ref] = true;
+                    stack[sp++] = ref;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Free objects not reachable from roots.
+ * extra_roots are references which should survive in addition to usual roots.
+ * Return the number of freed objects, or -1 if failed.
+ */
+static int collect_garbage(struct vm *vm, const int *extra_roots, int extra_root_num) {
+    bool *marked;
+    int *stack, *free_slots;
+    int i, j, freed = 0;
+    struct class_file *class;
+    char descriptor[1024];
+    u_int64_t start = vm->recorder != NULL ? get_monotonic_time() : 0;
+
+    marked = calloc(vm->instance_count + 1, sizeof(bool));
+    stack = malloc((vm->instance_count + 1) * sizeof(int));
+    free_slots = malloc((vm->instance_count + 1) * sizeof(int));
+    if (marked == NULL || stack == NULL || free_slots == NULL) {
+        free(marked);
+        free(stack);
+        free(free_slots);
+        return -1;
+    }
+
+    // mark
+    for (i = 0; i < vm->loader.class_num; i++) {
+        class = vm->loader.classes[i];
+        for (j = 0; j < class->fields_count; j++) {
+            if (is_static_field(class->fields[j])
+                    && get_field_descriptor(descriptor, class->fields[j], class) != NULL
+                    && descriptor[0] == FIELD_DESCRIPTOR_OBJECT) {
+                mark_instance(vm, marked, stack, *class->fields[j]->data);
+            }
+        }
+    }
+    for (i = 0; i < vm->global_ref_num; i++) {
+        mark_instance(vm, marked, stack, vm->global_refs[i]);
+    }
+    for (i = 0; i < extra_root_num; i++) {
+        mark_instance(vm, marked, stack, extra_roots[i]);
+    }
+
+    // sweep
+    vm->free_slot_num = 0;
+    for (i = vm->instance_count - 1; i >= 0; i--) {
+        if (vm->instances[i] != NULL && !marked[i]) {
+            free_instance(vm, vm->instances[i]);
+            vm->instances[i] = NULL;
+            freed++;
+        }
+        if (vm->instances[i] == NULL) {
+            free_slots[vm->free_slot_num++] = i;
+        }
+    }
+
+    free(vm->free_slots);
+    vm->free_slots = free_slots;
+    vm->live_after_gc = vm->instance_count - vm->free_slot_num;
+    vm->allocated_since_gc = 0;
+
+    free(marked);
+    free(stack);
+    if (vm->recorder != NULL) {
+        record_event(vm->recorder, RECORD_GC, start, freed, NULL);
+    }
+    return freed;
+}
+
+/**
+ * Collect garbage if enough objects have been allocated since the last collection.
+ */
+static void maybe_collect_garbage(struct vm *vm, const int *extra_roots, int extra_root_num) {
+    int threshold;
+
+    if (vm->active_calls > 0) {
+        return;
+    }
+    threshold = vm->live_after_gc > GC_MIN_ALLOCATION ? vm->live_after_gc : GC_MIN_ALLOCATION;
+
+    if (vm->allocated_since_gc >= threshold) {
+        collect_garbage(vm, extra_roots, extra_root_num);
+    }
+}
+
+//
+// Safepoint
+//
+
+// The interpreter polls at backward branches and method returns by reading the polling page of the VM,
+// which costs one load while nothing is requested. A request (see submit_vm_operation) makes the page unreadable
+// by mprotect, so the next poll faults into the handler of SIGSEGV. The handler only makes the page readable again
+// and marks the VM, since nothing else it could do is async-signal-safe. The poll is retried, and the interpreter
+// finds the mark and runs queued operations (and requested heap dumps and allocation reports) on the thread of the VM.
+// Polling pages are kept in a list which is never freed, so that signal handlers can walk it without locks.
+// A page is reused by later VMs, and is never unmapped, so arming a page of a destroyed VM is harmless.
+
+struct vm_operation {
+    void (*run)(struct vm *vm, void *arg);
+    void *arg;
+    struct vm_operation *next;
+};
+
+struct safepoint {
+    void *page;
+    struct vm *volatile vm; // NULL if free
+    struct safepoint *next;
+};
+
+static struct safepoint *volatile safepoints = NULL;
+static struct sigaction previous_segv_action;
+static pthread_once_t safepoint_handler_once = PTHREAD_ONCE_INIT;
+static long page_size;
+
+// True if the program is stopped by a request run at the poll (e.g. request_shutdown).
+// The compiler fence keeps the check of the mark after the read, which may run the handler.
+// Only the read and the check of the mark are left while nothing is requested.
+#define SAFEPOINT_POLL(vm) ( \
+        (void) *(volatile int32_t *) (vm)->polling_page, \
+        __atomic_signal_fence(__ATOMIC_SEQ_CST), \
+        (vm)->safepoint_pending && run_safepoint(vm))
+
+static void run_vm_operations(struct vm *vm) {
+    struct vm_operation *op, *next, *ops = NULL;
+
+    // reverse to run in the order of submission
+    op = __atomic_exchange_n(&vm->operations, NULL, __ATOMIC_ACQ_REL);
+    while (op != NULL) {
+        next = op->next;
+        op->next = ops;
+        ops = op;
+        op = next;
+    }
+    for (op = ops; op != NULL; op = next) {
+        next = op->next;
+        op->run(vm, op->arg);
+        free(op);
+    }
+}
+
+/**
+ * Free operations still queued without running them.
+ */
+static void discard_vm_operations(struct vm *vm) {
+    struct vm_operation *op, *next;
+
+    for (op = __atomic_exchange_n(&vm->operations, NULL, __ATOMIC_ACQ_REL); op != NULL; op = next) {
+        next = op->next;
+        free(op);
+    }
+}
+
+/**
+ * Run the requests found by a poll on the thread of the VM.
+ * Return true if the program is stopped by them.
+ */
+static bool run_safepoint(struct vm *vm) {
+    // cleared before taking the queue, so that an operation queued meanwhile marks the VM again
+    vm->safepoint_pending = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (vm->heap_dump_path != NULL && vm->handled_heap_dumps != heap_dump_requests) {
+        vm->handled_heap_dumps = heap_dump_requests;
+        dump_heap(vm, vm->heap_dump_path);
+    }
+    if (vm->allocation_profiler != NULL && vm->allocation_profiler->handled_requests != allocation_report_requests) {
+        vm->allocation_profiler->handled_requests = allocation_report_requests;
+        print_allocation_sites_of(vm->allocation_profiler, vm->allocation_profiler->out);
+    }
+    if (vm->recorder != NULL && vm->recorder->record_num > 0
+            && get_monotonic_time() - vm->recorder->chunk_start >= RECORDER_FLUSH_INTERVAL_NS) {
+        flush_recorder(vm->recorder);
+    }
+    run_vm_operations(vm);
+    return vm->status != 0;
+}
+
+static void safepoint_handler(int sig, siginfo_t *info, void *context) {
+    struct safepoint *safepoint;
+    struct sigaction default_action;
+    struct vm *vm;
+    int saved_errno = errno;
+
+    for (safepoint = safepoints; safepoint != NULL; safepoint = safepoint->next) {
+        if (safepoint->page != info->si_addr) {
+            continue;
+        }
+        mprotect(safepoint->page, page_size, PROT_READ);
+        vm = safepoint->vm;
+        if (vm != NULL) {
+            vm->safepoint_pending = 1;
+        }
+        errno = saved_errno;
+        return;
+    }
+
+    // not a poll: pass the fault to the previous handler
+    if (previous_segv_action.sa_flags & SA_SIGINFO) {
+        previous_segv_action.sa_sigaction(sig, info, context);
+    } else if (previous_segv_action.sa_handler != SIG_DFL && previous_segv_action.sa_handler != SIG_IGN) {
+        previous_segv_action.sa_handler(sig);
+    } else {
+        // the default action is taken when the fault is retried, which ends the process
+        memset(&default_action, 0, sizeof(default_action));
+        default_action.sa_handler = SIG_DFL;
+        sigemptyset(&default_action.sa_mask);
+        sigaction(SIGSEGV, &default_action, NULL);
+    }
+    errno = saved_errno;
+}
+
+static void install_safepoint_handler(void) {
+    struct sigaction action;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = safepoint_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &previous_segv_action) != 0) {
+        perror("sigaction");
+    }
+}
+
+/**
+ * Make all polling pages fault at the next poll (async-signal-safe).
+ */
+static void arm_all_safepoints(void) {
+    struct safepoint *safepoint;
+
+    for (safepoint = safepoints; safepoint != NULL; safepoint = safepoint->next) {
+        if (safepoint->vm != NULL) {
+            mprotect(safepoint->page, page_size, PROT_NONE);
+        }
+    }
+}
+
+/**
+ * Assign a polling page to the VM.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int attach_safepoint(struct vm *vm) {
+    struct safepoint *safepoint;
+    struct vm *free_vm;
+
+    pthread_once(&safepoint_handler_once, install_safepoint_handler);
+
+    for (safepoint = safepoints; safepoint != NULL; safepoint = safepoint->next) {
+        free_vm = NULL;
+        if (__atomic_compare_exchange_n(&safepoint->vm, &free_vm, vm, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    if (safepoint == NULL) {
+        safepoint = malloc(sizeof(struct safepoint));
+        if (safepoint == NULL) {
+            return -1;
+        }
+        safepoint->page = mmap(NULL, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (safepoint->page == MAP_FAILED) {
+            perror("mmap");
+            free(safepoint);
+            return -1;
+        }
+        safepoint->vm = vm;
+        safepoint->next = safepoints;
+        while (!__atomic_compare_exchange_n(&safepoints, &safepoint->next, safepoint, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        }
+    }
+    vm->safepoint = safepoint;
+    vm->polling_page = safepoint->page;
+    return 0;
+}
+
+static void detach_safepoint(struct vm *vm) {
+    mprotect(vm->polling_page, page_size, PROT_READ);
+    __atomic_store_n(&vm->safepoint->vm, NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * Return length of str.
+ * The format is described in 4.4.7 The CONSTANT_Utf8_info Structure
+ */
+static int read_utf8(char *str, struct constant_utf8_info *cp) {
+    // TODO: current implementation cannot handle unicode higher than \u007F
+    int i;
+
+    for (i = 0; i < cp->length; i++) {
+        if (cp->bytes[i] > 0x007f) {
+            fprintf(stderr, "read_utf8 not yet implemented other than ASCII characters\n");
+            return -1;
+        }
+        str[i] = cp->bytes[i];
+    }
+    str[i] = '\0';
+    return i;
+}
+
+//
+// read data from class file in big endian
+//
+
+static u_int8_t read8(FILE *main_file) {
+    u_int8_t x;
+    fread(&x, 1, 1, main_file);
+    return x;
+}
+
+static u_int16_t read16(FILE *main_file) {
+    u_int16_t x;
+    fread(&x, 2, 1, main_file);
+    return ((x & 0x00ff) << 8 | (x >> 8));
+}
+
+static u_int32_t read32(FILE *main_file) {
+    u_int32_t x;
+    fread(&x, 4, 1, main_file);
+    return (((x & 0x000000ff) << 24) | ((x & 0x0000ff00) << 8) | ((x & 0x00ff0000) >> 8) | ((x & 0xff000000) >> 24));
+}
+
+static size_t readn(void *dst, int n, FILE *main_file) {
+    return fread(dst, 1, n, main_file);
+}
+
+int parse_cp_info(struct cp_info **cp_info, FILE *main_file) {
+    u_int8_t tag;
+    u_int16_t len;
+
+    tag = read8(main_file);
+    switch (tag) {
+        case CONSTANT_CLASS:
+            *cp_info = (struct cp_info *) malloc(sizeof(struct constant_class_info));
+            if (*cp_info == NULL) {
+                fprintf(stderr, "failed to prepare CONSTANT_CLASS cp_info\n");
+                return -1;
+            }
+            ((struct constant_class_info *) *cp_info)->tag = tag;
+            ((struct constant_class_info *) *cp_info)->name_index = read16(main_file);
+            return 0;
+        case CONSTANT_FIELDREF:
+            *cp_info = (struct cp_info *) malloc(sizeof(struct constant_fieldref_info));
+            if (*cp_info == NULL) {
+                fprintf(stderr, "failed to prepare CONSTANT_FIELDREF cp_info\n");
+                return -1;
+            }
+            ((struct constant_fieldref_info *) *cp_info)->tag = tag;
+            ((struct constant_fieldref_info *) *cp_info)->class_index = read16(main_file);
+            ((struct constant_fieldref_info *) *cp_info)->name_and_type_index = read16(main_file);
+            return 0;
+        case CONSTANT_METHODREF:
             *cp_info = (struct cp_info *) malloc(sizeof(struct constant_methodref_info));
             if (*cp_info == NULL) {
                 fprintf(stderr, "failed to prepare CONSTANT_METHODREF cp_info\n");
                 return -1;
             }
-            ((struct constant_methodref_info *) *cp_info)->tag = tag;
-            ((struct constant_methodref_info *) *cp_info)->class_index = read16(main_file);
-            ((struct constant_methodref_info *) *cp_info)->name_and_type_index = read16(main_file);
-            return 0;
-        case CONSTANT_INTERFACE_METHODREF:
-            fprintf(stderr, "not yet implemented cp_info: CONSTANT_INTERFACE\n");
-            return -1;
-        case CONSTANT_STRING:
-            fprintf(stderr, "not yet implemented cp_info: CONSTANT_STRING\n");
-            return -1;
-        case CONSTANT_INTEGER:
-            fprintf(stderr, "not yet implemented cp_info: CONSTANT_INTEGER\n");
-            return -1;
-        case CONSTANT_FLOAT:
-            fprintf(stderr, "not yet implemented cp_info: CONSTANT_FLOAT\n");
-            return -1;
-        case CONSTANT_LONG:
-            fprintf(stderr, "not yet implemented cp_info: CONSTANT_LONG\n");
+            ((struct constant_methodref_info *) *cp_info)->tag = tag;
+            ((struct constant_methodref_info *) *cp_info)->class_index = read16(main_file);
+            ((struct constant_methodref_info *) *cp_info)->name_and_type_index = read16(main_file);
+            return 0;
+        case CONSTANT_INTERFACE_METHODREF:
+            fprintf(stderr, "not yet implemented cp_info: CONSTANT_INTERFACE\n");
+            return -1;
+        case CONSTANT_STRING:
+            fprintf(stderr, "not yet implemented cp_info: CONSTANT_STRING\n");
+            return -1;
+        case CONSTANT_INTEGER:
+            fprintf(stderr, "not yet implemented cp_info: CONSTANT_INTEGER\n");
+            return -1;
+        case CONSTANT_FLOAT:
+            fprintf(stderr, "not yet implemented cp_info: CONSTANT_FLOAT\n");
+            return -1;
+        case CONSTANT_LONG:
+            fprintf(stderr, "not yet implemented cp_info: CONSTANT_LONG\n");
+            return -1;
+        case CONSTANT_DOUBLE:
+            fprintf(stderr, "not yet implemented cp_info: CONSTANT_DOUBLE\n");
+            return -1;
+        case CONSTANT_NAME_AND_TYPE:
+            *cp_info = (struct cp_info *) malloc(sizeof(struct constant_name_and_type_info));
+            if (*cp_info == NULL) {
+                fprintf(stderr, "failed to prepare CONSTANT_NAME_AND_TYPE cp_info\n");
+                return -1;
+            }
+            ((struct constant_name_and_type_info *) *cp_info)->tag = tag;
+            ((struct constant_name_and_type_info *) *cp_info)->name_index = read16(main_file);
+            ((struct constant_name_and_type_info *) *cp_info)->descriptor_index = read16(main_file);
+            return 0;
+        case CONSTANT_UTF8:
+            *cp_info = (struct cp_info *) malloc(sizeof(struct constant_utf8_info));
+            if (*cp_info == NULL) {
+                fprintf(stderr, "failed to prepare CONSTANT_UTF8 cp_info\n");
+                return -1;
+            }
+            ((struct constant_utf8_info *) *cp_info)->tag = tag;
+            len = read16(main_file);
+            ((struct constant_utf8_info *) *cp_info)->length = len;
+            ((struct constant_utf8_info *) *cp_info)->bytes = (u_int8_t *) malloc(len);
+            readn(((struct constant_utf8_info *) *cp_info)->bytes, len, main_file);
+            return 0;
+        case CONSTANT_METHOD_HANDLE:
+            fprintf(stderr, "not yet implemented cp_info: CONSTANT_METHOD_HANDLE\n");
+            return -1;
+        case CONSTANT_METHOD_TYPE:
+            fprintf(stderr, "not yet implemented cp_info: CONSTANT_METHOD_TYPE\n");
+            return -1;
+        case CONSTANT_INVOKE_DYNAMIC:
+            fprintf(stderr, "not yet implemented cp_info: CONSTANT_INVOKE_DYNAMIC\n");
+            return -1;
+        default:
+            fprintf(stderr, "unexpected tag: %d\n", tag);
+            return -1;
+    }
+}
+
+int parse_attribute(struct attribute_info **attr, struct class_file *main_class, FILE *main_file) {
+    struct constant_utf8_info *cp;
+    u_int16_t attr_name_index;
+    u_int32_t attr_length;
+    char attr_name[1024]; // FIXME: there is no limit in spec?
+    int attr_len;
+    int i;
+
+    attr_name_index = read16(main_file);
+    attr_length = read32(main_file);
+
+    cp = (struct constant_utf8_info *) main_class->constant_pool[attr_name_index-1];
+    attr_len = read_utf8(attr_name, cp);
+    if (attr_len < 0) {
+        return -1;
+    }
+    if (strncmp(attr_name, ATTR_CODE, attr_len) == 0) {
+        *attr = (struct attribute_info *) malloc(sizeof(struct code_attribute));
+        (*attr)->attribute_name_index = attr_name_index;
+        (*attr)->attribute_length = attr_length;
+
+        ATTR_CODE_INFO((*attr))->max_stack = read16(main_file);
+        ATTR_CODE_INFO((*attr))->max_locals = read16(main_file);
+
+        // code
+        ATTR_CODE_INFO((*attr))->code_length = read32(main_file);
+        if (ATTR_CODE_INFO((*attr))->code_length > 0) {
+            ATTR_CODE_INFO((*attr))->code = (u_int8_t *) malloc(ATTR_CODE_INFO((*attr))->code_length);
+        }
+        readn((ATTR_CODE_INFO((*attr)))->code, ATTR_CODE_INFO((*attr))->code_length, main_file);
+
+        // exception_table
+        ATTR_CODE_INFO((*attr))->exception_table_length = read16(main_file);
+        if (ATTR_CODE_INFO((*attr))->exception_table_length > 0) {
+            ATTR_CODE_INFO((*attr))->exception_table = calloc(
+                    ATTR_CODE_INFO((*attr))->exception_table_length,
+                    sizeof(struct exception_table_entry));
+        }
+        for (i = 0; i < ATTR_CODE_INFO((*attr))->exception_table_length; i++) {
+            ATTR_CODE_INFO((*attr))->exception_table[i].start_pc = read16(main_file);
+            ATTR_CODE_INFO((*attr))->exception_table[i].end_pc = read16(main_file);
+            ATTR_CODE_INFO((*attr))->exception_table[i].handler_pc = read16(main_file);
+            ATTR_CODE_INFO((*attr))->exception_table[i].catch_type = read16(main_file);
+        }
+
+        // attributes
+        ATTR_CODE_INFO((*attr))->attributes_count = read16(main_file);
+        if (ATTR_CODE_INFO((*attr))->attributes_count > 0) {
+            /*
+            ATTR_CODE_INFO((*attr))->attributes = malloc(
+                    ATTR_CODE_INFO((*attr))->attributes_count * sizeof(void *));
+             */
+            ATTR_CODE_INFO((*attr))->attributes = (struct attribute_info **) calloc(
+                    ATTR_CODE_INFO((*attr))->attributes_count,
+                    sizeof(void *));
+        }
+        for (i = 0; i < ATTR_CODE_INFO((*attr))->attributes_count; i++) {
+            if (parse_attribute(&ATTR_CODE_INFO((*attr))->attributes[i], main_class, main_file) != 0) {
+                return -1;
+            }
+        }
+
+        return 0;
+    } else if (strncmp(attr_name, ATTR_SOURCE_FILE, attr_len) == 0) {
+        *attr = (struct attribute_info *) malloc(sizeof(struct source_file_attribute));
+        (*attr)->attribute_name_index = attr_name_index;
+        (*attr)->attribute_length = attr_length;
+
+        ((struct source_file_attribute *) (*attr))->sourcefile_index = read16(main_file);
+        return 0;
+    } else if (strncmp(attr_name, ATTR_LINE_NUMBER_TABLE, attr_len) == 0) {
+        *attr = (struct attribute_info *) malloc(sizeof(struct line_number_table_attribute));
+        (*attr)->attribute_name_index = attr_name_index;
+        (*attr)->attribute_length = attr_length;
+
+        ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table_length = read16(main_file);
+        ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table = calloc(
+                ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table_length,
+                sizeof(struct line_number_table_entry));
+        for (i = 0; i < ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table_length; i++) {
+            ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table[i].start_pc = read16(main_file);
+            ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table[i].line_number = read16(main_file);
+        }
+        return 0;
+    } else {
+        fprintf(stderr, "not yet implemented for attr_name: %s\n", attr_name);
+        return -1;
+    }
+}
+
+int parse_field(struct field_info **field, struct class_file *main_class, FILE *main_file) {
+    u_int16_t access_flags, name_index, descriptor_index, attributes_count;
+    int i;
+    struct attribute_info **attributes;
+
+    access_flags = read16(main_file);
+    name_index = read16(main_file);
+    descriptor_index = read16(main_file);
+
+    attributes_count = read16(main_file);
+    attributes = (struct attribute_info **) calloc(attributes_count, sizeof(void *));
+    for (i = 0; i < attributes_count; i++) {
+        if (parse_attribute(&attributes[i], main_class, main_file) != 0) {
+            free_attributes(attributes, attributes_count, main_class);
+            return -1;
+        }
+    }
+
+    // 4 u_int16_t fields, attributes pointers, and data
+    *field = (struct field_info *) malloc(sizeof(u_int16_t) * 4 + sizeof(void **) + sizeof(int *));
+    (*field)->access_flags = access_flags;
+    (*field)->name_index = name_index;
+    (*field)->descriptor_index = descriptor_index;
+    (*field)->attributes_count = attributes_count;
+    (*field)->attributes = attributes;
+    (*field)->data = calloc(1, sizeof(int *));
+
+    return 0;
+}
+
+int parse_method(struct method_info **method, struct class_file *main_class, FILE *main_file) {
+    u_int16_t access_flags, name_index, descriptor_index, attributes_count;
+    int i;
+    struct attribute_info **attributes;
+
+    access_flags = read16(main_file);
+    name_index = read16(main_file);
+    descriptor_index = read16(main_file);
+
+    attributes_count = read16(main_file);
+    attributes = (struct attribute_info **) calloc(attributes_count, sizeof(void *));
+    for (i = 0; i < attributes_count; i++) {
+        if (parse_attribute(&attributes[i], main_class, main_file) != 0) {
+            free_attributes(attributes, attributes_count, main_class);
+            return -1;
+        }
+    }
+
+    *method = (struct method_info *) malloc(sizeof(struct method_info));
+    (*method)->access_flags = access_flags;
+    (*method)->name_index = name_index;
+    (*method)->descriptor_index = descriptor_index;
+    (*method)->attributes_count = attributes_count;
+    (*method)->attributes = attributes;
+    (*method)->class = main_class;
+    (*method)->native_func = NULL;
+    (*method)->native_stub = NULL;
+    (*method)->perf = NULL;
+    (*method)->stats = NULL;
+    (*method)->entry = NULL;
+    (*method)->arg_units = -1;
+    (*method)->inlined = NULL;
+    (*method)->profile = NULL;
+
+    return 0;
+}
+
+/**
+ * Parse the class file, printing what is parsed if trace is true.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int parse_class_file(struct class_file *main_class, FILE *main_file, bool trace) {
+    unsigned char buf[256];
+    int i;
+    static unsigned char magic[4] = {0xca, 0xfe, 0xba, 0xbe};
+    u_int64_t start = get_monotonic_time(), end;
+
+    // parse magic
+    fread(main_class->magic, 1, 4, main_file);
+    TRACE_IF(trace, "%d\n", main_class->magic[0]);
+    TRACE_IF(trace, "%d\n", main_class->magic[1]);
+    TRACE_IF(trace, "%d\n", main_class->magic[2]);
+    TRACE_IF(trace, "%d\n", main_class->magic[3]);
+    if (memcmp(main_class->magic, magic, 4) != 0) {
+        fprintf(stderr, "magic is illegal\n");
+        return -1;
+    }
+
+    // parse minor_version and major_version
+    main_class->minor_version = read16(main_file);
+    main_class->major_version = read16(main_file);
+    TRACE_IF(trace, "version: %d.%d\n", main_class->major_version, main_class->minor_version);
+
+    // parse constant_pool_count
+    main_class->constant_pool_count = read16(main_file);
+    main_class->constant_pool = (struct cp_info **) calloc(main_class->constant_pool_count, sizeof(void *));
+    if (main_class->constant_pool == NULL) {
+        fprintf(stderr, "failed to prepare constant_pool\n");
+        return -1;
+    }
+
+    main_class->cp_cache = calloc(main_class->constant_pool_count, sizeof(struct cp_cache_entry));
+    if (main_class->cp_cache == NULL) {
+        fprintf(stderr, "failed to prepare cp_cache\n");
+        return -1;
+    }
+
+    // parse constant_pool
+    for (i = 0; i < main_class->constant_pool_count - 1; i++) {
+        if (parse_cp_info(&main_class->constant_pool[i], main_file) != 0) {
+            return -1;
+        }
+        if (main_class->constant_pool[i] != NULL) {
+            TRACE_IF(trace, "tag: %d\n", ((struct constant_class_info *) main_class->constant_pool[i])->tag);
+        }
+    }
+    end = get_monotonic_time();
+    main_class->timings.constant_pool = end - start;
+    start = end;
+
+    // parse access_flags
+    main_class->access_flags = read16(main_file);
+    TRACE_IF(trace, "access_flags: %d\n", main_class->access_flags);
+
+    // parse this_class
+    main_class->this_class = read16(main_file);
+    TRACE_IF(trace, "this_class: %d\n", main_class->this_class);
+
+    // parse super_class
+    main_class->super_class = read16(main_file);
+    TRACE_IF(trace, "super_class: %d\n", main_class->super_class);
+
+    // parse interfaces_count
+    main_class->interfaces_count = read16(main_file);
+    TRACE_IF(trace, "interfaces_count: %d\n", main_class->interfaces_count);
+
+    // parse interfaces
+    // TODO
+    if (main_class->interfaces_count > 0) {
+        fprintf(stderr, "not yet implemented to parse interfaces\n");
+        return -1;
+    }
+
+    // parse fields_count
+    main_class->fields_count = read16(main_file);
+    TRACE_IF(trace, "fields_count: %d\n", main_class->fields_count);
+
+    // parse fields
+    main_class->fields = calloc(main_class->fields_count, sizeof(void *));
+    if (main_class->fields == NULL) {
+        fprintf(stderr, "failed to prepare fields\n");
+        return -1;
+    }
+    for (i = 0; i < main_class->fields_count; i++) {
+        if (parse_field(&main_class->fields[i], main_class, main_file) != 0) {
+            return -1;
+        }
+    }
+    end = get_monotonic_time();
+    main_class->timings.fields = end - start;
+    start = end;
+
+    // parse methods_count
+    main_class->methods_count = read16(main_file);
+    TRACE_IF(trace, "methods_count: %d\n", main_class->methods_count);
+
+    // parse methods
+    main_class->methods = calloc(main_class->methods_count, sizeof(void *));
+    if (main_class->methods == NULL) {
+        fprintf(stderr, "failed to prepare methods\n");
+        return -1;
+    }
+    for (i = 0; i < main_class->methods_count; i++) {
+        if (parse_method(&main_class->methods[i], main_class, main_file) != 0) {
+            return -1;
+        }
+    }
+    end = get_monotonic_time();
+    main_class->timings.methods = end - start;
+    start = end;
+
+    // parse attributes_count
+    main_class->attributes_count = read16(main_file);
+    TRACE_IF(trace, "attributes_count: %d\n", main_class->attributes_count);
+
+    // parse attributes
+    main_class->attributes = calloc(main_class->attributes_count, sizeof(void *));
+    if (main_class->attributes == NULL) {
+        fprintf(stderr, "failed to prepare methods\n");
+        return -1;
+    }
+    for (i = 0; i < main_class->attributes_count; i++) {
+        if (parse_attribute(&main_class->attributes[i], main_class, main_file) != 0) {
+            return -1;
+        }
+    }
+    main_class->timings.attributes = get_monotonic_time() - start;
+
+    return 0;
+}
+
+int parse_class(struct class_file *main_class, FILE *main_file) {
+    return parse_class_file(main_class, main_file, false);
+}
+
+static void free_attribute(struct attribute_info *attr, struct class_file *class) {
+    char attr_name[1024];
+
+    if (attr == NULL) {
+        return;
+    }
+    read_utf8(attr_name, (struct constant_utf8_info *) class->constant_pool[attr->attribute_name_index-1]);
+    if (strcmp(attr_name, ATTR_CODE) == 0) {
+        if (ATTR_CODE_INFO(attr)->code_length > 0) {
+            free(ATTR_CODE_INFO(attr)->code);
+        }
+        if (ATTR_CODE_INFO(attr)->exception_table_length > 0) {
+            free(ATTR_CODE_INFO(attr)->exception_table);
+        }
+        if (ATTR_CODE_INFO(attr)->attributes_count > 0) {
+            free_attributes(ATTR_CODE_INFO(attr)->attributes, ATTR_CODE_INFO(attr)->attributes_count, class);
+        }
+    } else if (strcmp(attr_name, ATTR_LINE_NUMBER_TABLE) == 0) {
+        free(ATTR_LINE_NUMBER_TABLE_INFO(attr)->line_number_table);
+    }
+    free(attr);
+}
+
+static void free_inlined_code(struct inlined_code *inlined);
+static void free_method_profile(struct method_profile *profile);
+
+/**
+ * Free what is attached to the method while running.
+ */
+static void free_method_data(struct method_info *method) {
+    free(method->native_stub);
+    free(method->perf);
+    free(method->stats);
+    free_inlined_code(method->inlined);
+    free_method_profile(method->profile);
+}
+
+/**
+ * Free the array of attributes, whose entries are NULL after the one failed to be parsed.
+ */
+static void free_attributes(struct attribute_info **attributes, int attributes_count, struct class_file *class) {
+    int i;
+
+    for (i = 0; attributes != NULL && i < attributes_count; i++) {
+        free_attribute(attributes[i], class);
+    }
+    free(attributes);
+}
+
+/**
+ * Free the class and everything parsed into it.
+ * Attributes are freed before constant_pool because their names are needed.
+ * The class may be parsed partially: counts are read before their arrays are allocated,
+ * and the entries of an array are NULL after the one failed to be parsed.
+ */
+static void free_class(struct class_file *class) {
+    struct cp_info *cp;
+    int i;
+
+    for (i = 0; class->fields != NULL && i < class->fields_count && class->fields[i] != NULL; i++) {
+        free_attributes(class->fields[i]->attributes, class->fields[i]->attributes_count, class);
+        free(class->fields[i]->data);
+        free(class->fields[i]);
+    }
+    free(class->fields);
+
+    for (i = 0; class->methods != NULL && i < class->methods_count && class->methods[i] != NULL; i++) {
+        free_attributes(class->methods[i]->attributes, class->methods[i]->attributes_count, class);
+        free_method_data(class->methods[i]);
+        free(class->methods[i]);
+    }
+    free(class->methods);
+
+    free_attributes(class->attributes, class->attributes_count, class);
+
+    for (i = 0; class->constant_pool != NULL && i < class->constant_pool_count - 1; i++) {
+        cp = class->constant_pool[i];
+        if (cp != NULL && cp->tag == CONSTANT_UTF8) {
+            free(((struct constant_utf8_info *) cp)->bytes);
+        }
+        free(cp);
+    }
+    free(class->constant_pool);
+    free(class->interfaces);
+    free(class->cp_cache);
+    free(class);
+}
+
+/**
+ * Read name of the field into name.
+ * Return name, or NULL if not found.
+ */
+static char *get_field_name(char *name, struct field_info *field, struct class_file *class) {
+    // TODO: should not limit the length of field name
+    u_int16_t name_index;
+    struct constant_utf8_info *utf8_info;
+
+    name_index = field->name_index;
+    utf8_info = find_cp_utf8(name_index, class);
+    if (utf8_info == NULL) {
+        return NULL;
+    }
+
+    read_utf8(name, utf8_info);
+    return name;
+}
+
+/**
+ * Read descriptor of the field into descriptor.
+ * Return descriptor, or NULL if not found.
+ */
+static char *get_field_descriptor(char *descriptor, struct field_info *field, struct class_file *class) {
+    u_int16_t descriptor_index;
+    struct constant_utf8_info *utf8_info;
+
+    descriptor_index = field->descriptor_index;
+    utf8_info = find_cp_utf8(descriptor_index, class);
+    if (utf8_info == NULL) {
+        return NULL;
+    }
+
+    read_utf8(descriptor, utf8_info);
+    return descriptor;
+}
+
+/**
+ * Find field_info from fields.
+ * Return NULL if not found.
+ */
+static struct field_info *find_field(char *target_name, struct class_file *class) {
+    // TODO: Check field descriptor as well as name
+    int i;
+    int target_name_len;
+    char buf[1024], *name;
+    int name_len;
+
+    target_name_len = strlen(target_name);
+    for (i = 0; i < class->fields_count; i++) {
+        name = get_field_name(buf, class->fields[i], class);
+        if (name != NULL) {
+            name_len = strlen(name);
+            if (target_name_len == name_len && strncmp(name, target_name, name_len) == 0) {
+                return (struct field_info *) class->fields[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Find method_info from methods.
+ * Return NULL if not found.
+ */
+static struct method_info *find_method(char *target_name, struct class_file *class) {
+    // TODO: Check method signature as well as name
+    int i;
+    int target_name_len;
+    char buf[1024], *name;
+    int name_len;
+
+    target_name_len = strlen(target_name);
+    for (i = 0; i < class->methods_count; i++) {
+        name = get_method_name(buf, class->methods[i], class);
+        if (name != NULL) {
+            name_len = strlen(name);
+            if (target_name_len == name_len && strncmp(name, target_name, name_len) == 0) {
+                return (struct method_info *) class->methods[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Find method_info by its name and descriptor (e.g. "(I)V") from methods, so that overloads are told apart.
+ * Return NULL if not found.
+ */
+static struct method_info *find_method_by_descriptor(char *target_name, char *target_descriptor,
+        struct class_file *class) {
+    struct constant_utf8_info *utf8_info;
+    char name[1024], descriptor[1024];
+    int i;
+
+    for (i = 0; i < class->methods_count; i++) {
+        utf8_info = find_cp_utf8(class->methods[i]->descriptor_index, class);
+        if (get_method_name(name, class->methods[i], class) == NULL || utf8_info == NULL) {
+            continue;
+        }
+        read_utf8(descriptor, utf8_info);
+        if (strcmp(name, target_name) == 0 && strcmp(descriptor, target_descriptor) == 0) {
+            return (struct method_info *) class->methods[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Find field_info by its name and descriptor (e.g. "I") from fields.
+ * Return NULL if not found.
+ */
+static struct field_info *find_field_by_descriptor(char *target_name, char *target_descriptor,
+        struct class_file *class) {
+    char name[1024], descriptor[1024];
+    int i;
+
+    for (i = 0; i < class->fields_count; i++) {
+        if (get_field_name(name, class->fields[i], class) == NULL
+                || get_field_descriptor(descriptor, class->fields[i], class) == NULL) {
+            continue;
+        }
+        if (strcmp(name, target_name) == 0 && strcmp(descriptor, target_descriptor) == 0) {
+            return (struct field_info *) class->fields[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Return code_attribute of the passed method_info.
+ * Return NULL if not found.
+ */
+struct code_attribute *get_code(struct method_info *method, struct class_file *class) {
+    int j;
+    int attr_name_index;
+    char name[1024];
+
+    for (j = 0; j < method->attributes_count; j++) {
+        attr_name_index = method->attributes[j]->attribute_name_index;
+        read_utf8(name, (struct constant_utf8_info *) class->constant_pool[attr_name_index-1]);
+        if (strncmp(name, ATTR_CODE, 4) == 0) {
+            return (struct code_attribute *) method->attributes[j];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Read name of the method into name.
+ * Return name, or NULL if not found.
+ */
+static char *get_method_name(char *name, struct method_info *method, struct class_file *class) {
+    // TODO: should not limit the length of methods
+    u_int16_t name_index;
+    struct cp_info *cp_info;
+    struct constant_utf8_info *utf8_info;
+
+    name_index = method->name_index;
+    if (name_index > class->constant_pool_count) {
+        return NULL;
+    }
+
+    cp_info = class->constant_pool[name_index - 1];
+    if (cp_info->tag != CONSTANT_UTF8) {
+        return NULL;
+    }
+    utf8_info = (struct constant_utf8_info *) cp_info;
+
+    read_utf8(name, utf8_info);
+
+    return name;
+}
+
+#define MAX_METHOD_ARGS 255
+
+struct method_descriptor {
+    int num;                    // number of arguments
+    int units;                  // operand stack units of arguments
+    char args[MAX_METHOD_ARGS]; // type of each argument ('L' for objects and '[' for arrays)
+    char ret;                   // type of return value ('V' for void)
+};
+
+static int get_operand_stack_units(char c);
+
+/**
+ * Parse method descriptor and store it to descriptor.
+ * The format of method descriptor is defined in 4.3.3.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int parse_method_descriptor(struct method_descriptor *descriptor, const char *desc) {
+    const char *p;
+
+    descriptor->num = 0;
+    descriptor->units = 0;
+
+    p = desc;
+    if (*p != '(') {
+        return -1;
+    }
+    p++;
+    while (*p != ')') {
+        if (descriptor->num >= MAX_METHOD_ARGS) {
+            fprintf(stderr, "too many arguments in method descriptor\n");
+            return -1;
+        }
+        switch(*p) {
+            case 'B':
+            case 'C':
+            case 'D':
+            case 'F':
+            case 'I':
+            case 'J':
+            case 'S':
+            case 'Z':
+                descriptor->args[descriptor->num++] = *p;
+                descriptor->units += get_operand_stack_units(*p);
+                break;
+            case 'L':
+                descriptor->args[descriptor->num++] = *p;
+                descriptor->units++;
+                while (*p != ';') {
+                    p++;
+                }
+                break;
+            case '[':
+                descriptor->args[descriptor->num++] = *p;
+                descriptor->units++;
+                while (*p == '[') {
+                    p++;
+                }
+                if (*p == 'L') {
+                    while (*p != ';') {
+                        p++;
+                    }
+                }
+                break;
+            default:
+                fprintf(stderr, "unexpected character appears in method descriptor\n");
+                return -1;
+        }
+        p++;
+    }
+    p++;
+
+    // ReturnDescriptor
+    descriptor->ret = *p;
+    if (descriptor->ret == '\0') {
+        fprintf(stderr, "not found return descriptor\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Parse method descriptor of the method and store it to descriptor.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int get_method_descriptor(struct method_descriptor *descriptor, struct method_info *current_method, struct class_file *class) {
+    char desc[1024];
+    struct constant_utf8_info *utf8 = find_cp_utf8(current_method->descriptor_index, class);
+    read_utf8(desc, utf8);
+
+    return parse_method_descriptor(descriptor, desc);
+}
+
+#define ACC_PUBLIC       0x0001
+#define ACC_PRIVATE      0x0002
+#define ACC_PROTECTED    0x0004
+#define ACC_STATIC       0x0008
+#define ACC_FINAL        0x0010
+#define ACC_SYNCHRONIZED 0x0020
+#define ACC_BRIDGE       0x0040
+#define ACC_VARARGS      0x0080
+#define ACC_NATIVE       0x0100
+#define ACC_ABSTRACT     0x0400
+#define ACC_STRICT       0x0800
+#define ACC_SYNTHETIC    0x1000
+
+static bool is_static_method(struct method_info *method) {
+    return ((method->access_flags & ACC_STATIC) != 0);
+}
+
+static bool is_native_method(struct method_info *method) {
+    return ((method->access_flags & ACC_NATIVE) != 0);
+}
+
+static bool is_static_field(struct field_info *field) {
+    return ((field->access_flags & ACC_STATIC) != 0);
+}
+
+/**
+ * Return this class name representing by constant_utf8_info.
+ * This should not return NULL.
+ */
+static struct constant_utf8_info *get_this_class(struct class_file *class) {
+    u_int16_t this_class_index = class->this_class;
+    struct constant_class_info *cp_class = find_cp_class(this_class_index, class);
+    if (cp_class == NULL) {
+        return NULL;
+    }
+    return find_cp_utf8(cp_class->name_index, class);
+}
+
+/**
+ * Return constant_class_info at the specified index of constant pool.
+ * Return NULL if the item is not Class.
+ */
+static struct constant_class_info *find_cp_class(int index, struct class_file *class) {
+    struct cp_info *cp_info;
+
+    if (index > class->constant_pool_count) {
+        return NULL;
+    }
+
+    cp_info = class->constant_pool[index-1];
+    if (cp_info->tag != CONSTANT_CLASS) {
+        return NULL;
+    }
+
+    return (struct constant_class_info *) cp_info;
+}
+
+/**
+ * Return constant_fieldref_info at the specified index of constant pool.
+ * Return NULL if the item is not Fieldred.
+ */
+static struct constant_fieldref_info *find_cp_fieldref(int index, struct class_file *class) {
+    struct cp_info *cp_info;
+
+    if (index > class->constant_pool_count) {
+        return NULL;
+    }
+
+    cp_info = class->constant_pool[index-1];
+    if (cp_info->tag != CONSTANT_FIELDREF) {
+        return NULL;
+    }
+
+    return (struct constant_fieldref_info *) cp_info;
+}
+
+/**
+ * Return constant_methodref_info at the specified index of constant pool.
+ * Return NULL if the item is not Methodref.
+ */
+static struct constant_methodref_info *find_cp_methodref(int index, struct class_file *class) {
+    struct cp_info *cp_info;
+
+    if (index > class->constant_pool_count) {
+        return NULL;
+    }
+
+    cp_info = class->constant_pool[index-1];
+    if (cp_info->tag != CONSTANT_METHODREF) {
+        return NULL;
+    }
+
+    return (struct constant_methodref_info *) cp_info;
+}
+
+/**
+ * Return constant_name_and_type_info at the specified index of constant pool.
+ * Return NULL if the item is not NameAndType
+ */
+static struct constant_name_and_type_info *find_cp_name_and_type(int index, struct class_file *class) {
+    struct cp_info *cp_info;
+
+    if (index > class->constant_pool_count) {
+        return NULL;
+    }
+
+    cp_info = class->constant_pool[index-1];
+    if (cp_info->tag != CONSTANT_NAME_AND_TYPE) {
+        return NULL;
+    }
+
+    return (struct constant_name_and_type_info *) cp_info;
+}
+
+/**
+ * Return constant_utf8_info at the specified index of constant pool.
+ * Return NULL if the item is not Utf8.
+ */
+static struct constant_utf8_info *find_cp_utf8(int index, struct class_file *class) {
+    struct cp_info *cp_info;
+
+    if (index > class->constant_pool_count) {
+        return NULL;
+    }
+
+    cp_info = class->constant_pool[index-1];
+    if (cp_info->tag != CONSTANT_UTF8) {
+        return NULL;
+    }
+
+    return (struct constant_utf8_info *) cp_info;
+}
+
+/**
+ * Allocate and initialize frame.
+ * Return NULL if failed to initialize.
+ */
+struct frame *initialize_frame(int max_stack, int max_locals) {
+    struct frame *f = (struct frame *) malloc(sizeof(struct frame));
+    if (f == NULL) {
+        return NULL;
+    }
+    f->max_stack = max_stack;
+    f->stack_i = 0;
+    f->stack = (int32_t *) calloc(max_stack, sizeof(u_int32_t));
+    if (max_stack > 0 && f->stack == NULL) {
+        free(f);
+        return NULL;
+    }
+    f->max_locals = max_locals;
+    f->locals = (int32_t *) calloc(max_locals, sizeof(u_int32_t));
+    if (max_locals > 0 && f->locals == NULL) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+/**
+ * Free allocated frame.
+ */
+void free_frame(struct frame *frame) {
+    free(frame->stack);
+    free(frame->locals);
+    free(frame);
+}
+
+#define DESC_INT ('I')
+
+/**
+ * Return how many units are necessary for descriptor c
+ */
+static int get_operand_stack_units(char c) {
+    switch (c) {
+        case 'V':
+            return 0;
+        case 'B':
+        case 'C':
+        case 'F':
+        case 'I':
+        case 'L':
+        case 'S':
+        case 'Z':
+        case '[':
+            return 1;
+        case 'D':
+        case 'J':
+            return 2;
+        default:
+            fprintf(stderr, "not yet implemented for %c in get_operand_stack_units\n", c);
+            return -1;
+    }
+}
+
+// TODO: support other types than int
+int push_operand_stack(int32_t item, struct frame *frame) {
+    if (frame->stack_i >= frame->max_stack) {
+        return -1;
+    }
+    frame->stack[frame->stack_i] = item;
+    frame->stack_i++;
+    return 0;
+}
+
+// TODO: support other types than int
+int pop_operand_stack(int32_t *item, struct frame *frame) {
+    if (frame->stack_i == 0) {
+        return -1;
+    }
+    frame->stack_i--;
+    *item = frame->stack[frame->stack_i];
+    return 0;
+}
+
+// long and double use two units of operand stack
+
+static int push_operand_stack_long(int64_t item, struct frame *frame) {
+    if (frame->stack_i + 2 > frame->max_stack) {
+        return -1;
+    }
+    memcpy(&frame->stack[frame->stack_i], &item, sizeof(int64_t));
+    frame->stack_i += 2;
+    return 0;
+}
+
+static int pop_operand_stack_long(int64_t *item, struct frame *frame) {
+    if (frame->stack_i < 2) {
+        return -1;
+    }
+    frame->stack_i -= 2;
+    memcpy(item, &frame->stack[frame->stack_i], sizeof(int64_t));
+    return 0;
+}
+
+//
+// Resolution
+//
+
+/**
+ * Resolve Class at the index of constant pool of current_class.
+ * Return NULL if failed.
+ */
+static struct cp_cache_entry *resolve_class(struct vm *vm, int index, struct class_file *current_class) {
+    struct cp_cache_entry *entry;
+    struct constant_class_info *cp_class;
+    struct constant_utf8_info *cp_utf8;
+    char buf[1024];
+    u_int64_t start;
+
+    if (index < 1 || index > current_class->constant_pool_count) {
+        fprintf(stderr, "invalid index of constant pool: %d\n", index);
+        return NULL;
+    }
+    entry = &current_class->cp_cache[index - 1];
+    if (entry->class != NULL) {
+        return entry;
+    }
+    start = vm->recorder != NULL ? get_monotonic_time() : 0;
+
+    cp_class = find_cp_class(index, current_class);
+    if (cp_class == NULL) {
+        fprintf(stderr, "Class is not found in constant pool\n");
+        return NULL;
+    }
+    cp_utf8 = find_cp_utf8(cp_class->name_index, current_class);
+    if (cp_utf8 == NULL) {
+        fprintf(stderr, "Utf8 is not found in constant pool\n");
+        return NULL;
+    }
+    read_utf8(buf, cp_utf8);
+
+    if (vm->stats != NULL) {
+        vm->stats->class_lookups++;
+    }
+    entry->class = get_class(&vm->loader, buf);
+    if (entry->class == NULL) {
+        fprintf(stderr, "class not found: %s\n", buf);
+        return NULL;
+    }
+    if (entry->class->initialization_failed) {
+        fprintf(stderr, "could not initialize class: %s\n", buf);
+        entry->class = NULL;
+        return NULL;
+    }
+    if (vm->recorder != NULL) {
+        record_event(vm->recorder, RECORD_RESOLVE, start, index, buf);
+    }
+    return entry;
+}
+
+/**
+ * Resolve Fieldref at the index of constant pool of current_class.
+ * Return NULL if failed.
+ */
+static struct cp_cache_entry *resolve_field(struct vm *vm, int index, struct class_file *current_class) {
+    struct cp_cache_entry *entry, *class_entry;
+    struct constant_fieldref_info *cp_fieldref;
+    struct constant_name_and_type_info *cp_name_and_type;
+    struct constant_utf8_info *cp_utf8;
+    char buf[1024];
+    u_int64_t start;
+    int i;
+
+    if (index < 1 || index > current_class->constant_pool_count) {
+        fprintf(stderr, "invalid index of constant pool: %d\n", index);
+        return NULL;
+    }
+    entry = &current_class->cp_cache[index - 1];
+    if (entry->field != NULL) {
+        return entry;
+    }
+    start = vm->recorder != NULL ? get_monotonic_time() : 0;
+
+    cp_fieldref = find_cp_fieldref(index, current_class);
+    if (cp_fieldref == NULL) {
+        fprintf(stderr, "Fieldref is not found in constant pool\n");
+        return NULL;
+    }
+
+    // check class having field
+    class_entry = resolve_class(vm, cp_fieldref->class_index, current_class);
+    if (class_entry == NULL) {
+        return NULL;
+    }
+
+    cp_name_and_type = find_cp_name_and_type(cp_fieldref->name_and_type_index, current_class);
+    if (cp_name_and_type == NULL) {
+        fprintf(stderr, "NameAndType is not found in constant pool\n");
+        return NULL;
+    }
+    cp_utf8 = find_cp_utf8(cp_name_and_type->name_index, current_class);
+    if (cp_utf8 == NULL) {
+        fprintf(stderr, "Utf8 is not found in constant pool\n");
+        return NULL;
+    }
+    read_utf8(buf, cp_utf8);
+
+    if (vm->stats != NULL) {
+        vm->stats->field_lookups++;
+    }
+    entry->field = find_field(buf, class_entry->class);
+    if (entry->field == NULL) {
+        fprintf(stderr, "field %s is not found.\n", buf);
+        return NULL;
+    }
+    entry->class = class_entry->class;
+    for (i = 0; i < entry->class->fields_count; i++) {
+        if (entry->class->fields[i] == entry->field) {
+            entry->field_index = i;
+        }
+    }
+    if (vm->recorder != NULL) {
+        record_event(vm->recorder, RECORD_RESOLVE, start, index, buf);
+    }
+    return entry;
+}
+
+/**
+ * Resolve Methodref at the index of constant pool of current_class.
+ * Return NULL if failed.
+ */
+static struct cp_cache_entry *resolve_method(struct vm *vm, int index, struct class_file *current_class) {
+    struct cp_cache_entry *entry, *class_entry;
+    struct constant_methodref_info *cp_methodref;
+    struct constant_name_and_type_info *cp_name_and_type;
+    struct constant_utf8_info *cp_utf8;
+    char buf[1024];
+    u_int64_t start;
+
+    if (index < 1 || index > current_class->constant_pool_count) {
+        fprintf(stderr, "invalid index of constant pool: %d\n", index);
+        return NULL;
+    }
+    entry = &current_class->cp_cache[index - 1];
+    if (entry->method != NULL) {
+        return entry;
+    }
+    start = vm->recorder != NULL ? get_monotonic_time() : 0;
+
+    cp_methodref = find_cp_methodref(index, current_class);
+    if (cp_methodref == NULL) {
+        fprintf(stderr, "Methodref is not found in constant pool\n");
+        return NULL;
+    }
+
+    // check class having method
+    class_entry = resolve_class(vm, cp_methodref->class_index, current_class);
+    if (class_entry == NULL) {
+        return NULL;
+    }
+
+    cp_name_and_type = find_cp_name_and_type(cp_methodref->name_and_type_index, current_class);
+    if (cp_name_and_type == NULL) {
+        fprintf(stderr, "NameAndType is not found in constant pool\n");
+        return NULL;
+    }
+    cp_utf8 = find_cp_utf8(cp_name_and_type->name_index, current_class);
+    if (cp_utf8 == NULL) {
+        fprintf(stderr, "Utf8 is not found in constant pool\n");
+        return NULL;
+    }
+    read_utf8(buf, cp_utf8);
+
+    if (vm->stats != NULL) {
+        vm->stats->method_lookups++;
+    }
+    entry->method = find_method(buf, class_entry->class);
+    if (entry->method == NULL) {
+        fprintf(stderr, "not found method: %s\n", buf);
+        return NULL;
+    }
+    entry->class = class_entry->class;
+    if (vm->recorder != NULL) {
+        record_event(vm->recorder, RECORD_RESOLVE, start, index, buf);
+    }
+    return entry;
+}
+
+/**
+ * Return the slot of the resolved field in the instance.
+ * Return NULL if the instance does not have the field.
+ */
+static int *get_instance_field_slot(struct class_instance *instance, struct cp_cache_entry *resolved) {
+    if (instance->class == resolved->class) {
+        return (int *) instance->fields[resolved->field_index]->data;
+    }
+    return get_instance_field_data(instance, resolved->field);
+}
+
+//
+// Inliner
+//
+
+// Bodies of small callees bound at compile time are spliced into the code of a method when it is first run,
+// so calls of accessors, constructors and helpers cost no frame. The code is rewritten at the level of bytecode:
+// arguments are stored into locals after the ones of the caller, the final return of a callee is dropped,
+// and branches of the method are relocated. Only straight-line callees (no branches, one return at the end)
+// are inlined, so their operand stack is always the one of the call site when they return.
+// Callees of other classes are inlined only if they do not refer to their constant pool,
+// since the code is run with the constant pool of the method.
+// Each pc of the code is mapped to its scope (the method or an inlined callee) and the pc in the original code,
+// so profiles see the frames of inlined callees (see get_source_frames).
+
+#define INLINE_MAX_SIZE 35 // bytes of code of a callee (like MaxInlineSize of HotSpot)
+#define INLINE_MAX_DEPTH 9 // levels of nested callees (like MaxInlineLevel)
+
+// a callee spliced into the code
+struct inline_scope {
+    struct method_info *method;
+    int parent;  // index of the enclosing scope, -1 if it is the method itself
+    int call_pc; // pc of the invocation in the original code of the enclosing scope
+};
+
+// code of a method with callees spliced in, which is the original code if nothing is inlined
+struct inlined_code {
+    struct code_attribute code;
+    struct inline_scope *scopes;
+    int scope_num;
+    // for each pc of the code, the scope (-1 for the method itself) and the pc in the original code of the scope
+    int *scope_of_pc;
+    int *original_pc;
+};
+
+struct inliner {
+    struct vm *vm;
+    struct method_info *method;
+    struct class_file *class; // its constant pool is used by all the code
+
+    u_int8_t *code;
+    int code_len;
+    int code_cap;
+    int *scope_of_pc;
+    int *original_pc;
+    struct inline_scope *scopes;
+    int scope_num;
+    int scope_cap;
+    int max_stack;
+    int max_locals;
+
+    // branches of the method to relocate: pcs in the code, and pcs of their targets in the original code
+    int *branches;
+    int *targets;
+    int branch_num;
+    // pcs in the code of each pc in the original code of the method
+    int *new_pc;
+};
+
+/**
+ * Return the length of the instruction at the pc, or -1 if the interpreter does not run it.
+ */
+static int get_instruction_length(u_int8_t *code, int pc) {
+    u_int8_t op = code[pc];
+
+    if ((op >= 0x01 && op <= 0x08) || (op >= 0x1a && op <= 0x1d) || (op >= 0x2a && op <= 0x2d)
+            || (op >= 0x3b && op <= 0x3e) || (op >= 0x4b && op <= 0x4e) || op == 0x57 || op == 0x59
+            || op == 0x60 || op == 0x64 || op == 0x68 || op == 0x6c || op == 0x70 || op == 0x74
+            || op == 0xac || op == 0xb0 || op == 0xb1) {
+        return 1;
+    }
+    if (op == 0x10 || op == 0x15 || op == 0x19 || op == 0x36 || op == 0x3a) {
+        return 2;
+    }
+    if (op == 0x11 || op == 0x84 || (op >= 0x99 && op <= 0xa4) || op == 0xa7 || op == 0xc6 || op == 0xc7
+            || (op >= 0xb2 && op <= 0xb8) || op == 0xbb) {
+        return 3;
+    }
+    return -1;
+}
+
+static bool is_branch(u_int8_t op) {
+    return (op >= 0x99 && op <= 0xa7) || op == 0xc6 || op == 0xc7;
+}
+
+static bool is_return(u_int8_t op) {
+    return op == 0xac || op == 0xb0 || op == 0xb1;
+}
+
+/**
+ * Store units popped from and pushed to the operand stack by the instruction of get_instruction_length.
+ * The units of invocations are taken from the descriptor in the constant pool, so nothing is resolved.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int get_stack_change(u_int8_t *code, int pc, struct class_file *class, int *pops, int *pushes) {
+    struct constant_methodref_info *methodref;
+    struct constant_name_and_type_info *name_and_type;
+    struct constant_utf8_info *utf8;
+    struct method_descriptor descriptor;
+    char desc[1024];
+    u_int8_t op = code[pc];
+
+    *pops = 0;
+    *pushes = 0;
+    if ((op >= 0x01 && op <= 0x11) || op == 0x15 || op == 0x19 || (op >= 0x1a && op <= 0x2d) || op == 0xb2
+            || op == 0xbb) {
+        *pushes = 1;
+    } else if (op == 0x36 || op == 0x3a || (op >= 0x3b && op <= 0x4e) || op == 0x57 || (op >= 0x99 && op <= 0x9e)
+            || op == 0xc6 || op == 0xc7 || op == 0xac || op == 0xb0 || op == 0xb3) {
+        *pops = 1;
+    } else if (op == 0x59) {
+        *pops = 1;
+        *pushes = 2;
+    } else if (op == 0x60 || op == 0x64 || op == 0x68 || op == 0x6c || op == 0x70) {
+        *pops = 2;
+        *pushes = 1;
+    } else if (op == 0x74 || op == 0xb4) {
+        *pops = 1;
+        *pushes = 1;
+    } else if ((op >= 0x9f && op <= 0xa4) || op == 0xb5) {
+        *pops = 2;
+    } else if (op >= 0xb6 && op <= 0xb8) {
+        methodref = find_cp_methodref((code[pc + 1] << 8) | code[pc + 2], class);
+        name_and_type = methodref == NULL ? NULL : find_cp_name_and_type(methodref->name_and_type_index, class);
+        utf8 = name_and_type == NULL ? NULL : find_cp_utf8(name_and_type->descriptor_index, class);
+        if (utf8 == NULL || utf8->length >= sizeof(desc) || read_utf8(desc, utf8) < 0
+                || parse_method_descriptor(&descriptor, desc) != 0) {
+            return -1;
+        }
+        *pops = descriptor.units + (op == 0xb8 ? 0 : 1);
+        *pushes = descriptor.ret == 'V' ? 0 : get_operand_stack_units(descriptor.ret);
+    }
+    return 0;
+}
+
+/**
+ * Check that the operand stack of the method stays within 0 and max_stack units on every path (4.9.2),
+ * since the interpreter trusts max_stack on each push. Each instruction must be reached with one depth.
+ * A path ends at an instruction which the interpreter does not run, since the program stops there.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int check_max_stack(struct method_info *method, struct class_file *class) {
+    struct code_attribute *code;
+    int *depths, *pending, pending_num = 0, succ[2], succ_num, pc, len, pops, pushes, depth, i;
+    bool valid = true;
+
+    code = get_code(method, class);
+    if (code == NULL || code->code_length == 0) {
+        return 0;
+    }
+    depths = malloc(code->code_length * sizeof(int));
+    pending = malloc(code->code_length * sizeof(int));
+    if (depths == NULL || pending == NULL) {
+        free(depths);
+        free(pending);
+        return -1;
+    }
+    for (pc = 0; pc < (int) code->code_length; pc++) {
+        depths[pc] = -1;
+    }
+    depths[0] = 0;
+    pending[pending_num++] = 0;
+
+    while (valid && pending_num > 0) {
+        pc = pending[--pending_num];
+        len = get_instruction_length(code->code, pc);
+        if (len < 0) {
+            continue;
+        }
+        if (pc + len > (int) code->code_length || get_stack_change(code->code, pc, class, &pops, &pushes) != 0
+                || depths[pc] < pops || depths[pc] - pops + pushes > code->max_stack) {
+            valid = false;
+            break;
+        }
+        depth = depths[pc] - pops + pushes;
+
+        succ_num = 0;
+        if (is_branch(code->code[pc])) {
+            succ[succ_num++] = pc + (int16_t) ((code->code[pc + 1] << 8) | code->code[pc + 2]);
+        }
+        // running off the end of the code returns from the method
+        if (code->code[pc] != 0xa7 && !is_return(code->code[pc]) && pc + len < (int) code->code_length) {
+            succ[succ_num++] = pc + len;
+        }
+        for (i = 0; i < succ_num && valid; i++) {
+            if (succ[i] < 0 || succ[i] >= (int) code->code_length) {
+                valid = false;
+            } else if (depths[succ[i]] < 0) {
+                depths[succ[i]] = depth;
+                pending[pending_num++] = succ[i];
+            } else if (depths[succ[i]] != depth) {
+                valid = false;
+            }
+        }
+    }
+
+    free(depths);
+    free(pending);
+    return valid ? 0 : -1;
+}
+
+/**
+ * Append the instruction from the scope at the pc of its original code.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int emit_instruction(struct inliner *inliner, const u_int8_t *bytes, int len, int scope, int pc) {
+    u_int8_t *code;
+    int *scope_of_pc, *original_pc;
+    int cap, i;
+
+    if (inliner->code_len + len > inliner->code_cap) {
+        cap = inliner->code_cap == 0 ? 256 : inliner->code_cap * 2;
+        code = realloc(inliner->code, cap);
+        if (code == NULL) {
+            return -1;
+        }
+        inliner->code = code;
+        scope_of_pc = realloc(inliner->scope_of_pc, cap * sizeof(int));
+        if (scope_of_pc == NULL) {
+            return -1;
+        }
+        inliner->scope_of_pc = scope_of_pc;
+        original_pc = realloc(inliner->original_pc, cap * sizeof(int));
+        if (original_pc == NULL) {
+            return -1;
+        }
+        inliner->original_pc = original_pc;
+        inliner->code_cap = cap;
+    }
+    for (i = 0; i < len; i++) {
+        inliner->code[inliner->code_len] = bytes[i];
+        inliner->scope_of_pc[inliner->code_len] = scope;
+        inliner->original_pc[inliner->code_len] = pc;
+        inliner->code_len++;
+    }
+    return 0;
+}
+
+/**
+ * Append a load or store of the local, where op is iload, aload, istore or astore.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int emit_local(struct inliner *inliner, u_int8_t op, int local, int scope, int pc) {
+    u_int8_t bytes[2];
+
+    if (local <= 3) {
+        switch (op) {
+            case 0x15: bytes[0] = 0x1a + local; break;
+            case 0x19: bytes[0] = 0x2a + local; break;
+            case 0x36: bytes[0] = 0x3b + local; break;
+            default: bytes[0] = 0x4b + local; break;
+        }
+        return emit_instruction(inliner, bytes, 1, scope, pc);
+    }
+    bytes[0] = op;
+    bytes[1] = local;
+    return emit_instruction(inliner, bytes, 2, scope, pc);
+}
+
+/**
+ * Return the change of the depth of the operand stack by the instruction, or INT_MIN if it is unknown.
+ */
+static int get_stack_effect(struct inliner *inliner, u_int8_t *code, int pc) {
+    struct cp_cache_entry *resolved;
+    struct method_descriptor descriptor;
+    u_int8_t op = code[pc];
+
+    // only instructions of get_instruction_length are expected
+    if ((op >= 0x01 && op <= 0x11) || op == 0x15 || op == 0x19 || (op >= 0x1a && op <= 0x2d) || op == 0x59
+            || op == 0xb2 || op == 0xbb) {
+        return 1;
+    }
+    if (op == 0x36 || op == 0x3a || (op >= 0x3b && op <= 0x4e) || op == 0x57 || op == 0x60 || op == 0x64
+            || op == 0x68 || op == 0x6c || op == 0x70 || op == 0xac || op == 0xb0 || op == 0xb3) {
+        return -1;
+    }
+    if (op == 0x74 || op == 0x84 || op == 0xb1 || op == 0xb4) {
+        return 0;
+    }
+    if (op == 0xb5) {
+        return -2;
+    }
+    if (op >= 0xb6 && op <= 0xb8) {
+        resolved = resolve_method(inliner->vm, (code[pc + 1] << 8) | code[pc + 2], inliner->class);
+        if (resolved == NULL || get_method_descriptor(&descriptor, resolved->method, resolved->class) != 0) {
+            return INT_MIN;
+        }
+        return -descriptor.units - (is_static_method(resolved->method) ? 0 : 1)
+               + (descriptor.ret == 'V' ? 0 : get_operand_stack_units(descriptor.ret));
+    }
+    return INT_MIN;
+}
+
+/**
+ * Return true if the code is straight-line code which ends with the only return leaving ret_units on the stack,
+ * and it can be run with the constant pool of the method.
+ */
+static bool is_inlinable_code(struct inliner *inliner, struct code_attribute *code, struct class_file *class,
+        int ret_units) {
+    int pc, len, effect, depth = 0;
+
+    for (pc = 0; pc < code->code_length; pc += len) {
+        len = get_instruction_length(code->code, pc);
+        if (len < 0 || pc + len > code->code_length || is_branch(code->code[pc])) {
+            return false;
+        }
+        if (class != inliner->class && code->code[pc] >= 0xb2 && code->code[pc] <= 0xbb) {
+            return false;
+        }
+        if (is_return(code->code[pc])) {
+            return pc + len == code->code_length && depth == ret_units && (code->code[pc] == 0xb1) == (ret_units == 0);
+        }
+        effect = get_stack_effect(inliner, code->code, pc);
+        if (effect == INT_MIN || depth + effect < 0) {
+            return false;
+        }
+        depth += effect;
+    }
+    return false;
+}
+
+static int emit_code(struct inliner *inliner, struct method_info *method, struct code_attribute *code,
+        int scope, int depth, int local_base, int stack_base);
+
+/**
+ * Splice the callee invoked at the pc of the scope, if it is small and bound at compile time.
+ * Return 1 if inlined, 0 if not, or -1 if failed.
+ */
+static int inline_call(struct inliner *inliner, struct code_attribute *code, int pc, int scope, int depth,
+        int local_base, int stack_base) {
+    struct cp_cache_entry *resolved;
+    struct method_info *callee;
+    struct code_attribute *callee_code;
+    struct method_descriptor descriptor;
+    struct inline_scope *scopes;
+    int callee_base, units, arg, cap, i, s;
+    bool reference;
+    u_int8_t op = code->code[pc];
+
+    if (depth >= inliner->vm->inline_max_depth) {
+        return 0;
+    }
+    resolved = resolve_method(inliner->vm, (code->code[pc + 1] << 8) | code->code[pc + 2], inliner->class);
+    if (resolved == NULL) {
+        return 0;
+    }
+    callee = resolved->method;
+    if (op == 0xb8 && !is_static_method(callee)) {
+        return 0;
+    }
+    // invokevirtual is bound at compile time only if the method cannot be overridden
+    if (op == 0xb6 && (callee->access_flags & (ACC_PRIVATE | ACC_FINAL)) == 0
+            && (resolved->class->access_flags & ACC_FINAL) == 0) {
+        return 0;
+    }
+    if ((callee->access_flags & (ACC_NATIVE | ACC_ABSTRACT | ACC_SYNCHRONIZED)) != 0) {
+        return 0;
+    }
+    // a recursive callee is left to calls
+    if (callee == inliner->method) {
+        return 0;
+    }
+    for (s = scope; s >= 0; s = inliner->scopes[s].parent) {
+        if (inliner->scopes[s].method == callee) {
+            return 0;
+        }
+    }
+    callee_code = get_code(callee, resolved->class);
+    if (callee_code == NULL || callee_code->code_length > inliner->vm->inline_max_size
+            || callee_code->exception_table_length > 0) {
+        return 0;
+    }
+    // arguments are int or references (one unit each), and locals are in the range of an index of one byte
+    if (get_method_descriptor(&descriptor, callee, resolved->class) != 0 || descriptor.units != descriptor.num
+            || (descriptor.ret != 'V' && get_operand_stack_units(descriptor.ret) != 1)) {
+        return 0;
+    }
+    units = descriptor.units + (is_static_method(callee) ? 0 : 1);
+    callee_base = local_base + code->max_locals;
+    if (callee_code->max_locals < units || callee_base + callee_code->max_locals > 256) {
+        return 0;
+    }
+    if (!is_inlinable_code(inliner, callee_code, resolved->class, descriptor.ret == 'V' ? 0 : 1)) {
+        return 0;
+    }
+
+    if (inliner->scope_num == inliner->scope_cap) {
+        cap = inliner->scope_cap == 0 ? 8 : inliner->scope_cap * 2;
+        scopes = realloc(inliner->scopes, cap * sizeof(struct inline_scope));
+        if (scopes == NULL) {
+            return -1;
+        }
+        inliner->scopes = scopes;
+        inliner->scope_cap = cap;
+    }
+    s = inliner->scope_num++;
+    inliner->scopes[s].method = callee;
+    inliner->scopes[s].parent = scope;
+    inliner->scopes[s].call_pc = pc;
+
+    // the arguments on the operand stack (the last one on the top) are stored into the locals of the callee
+    for (i = units - 1; i >= 0; i--) {
+        // 'this' is the first local of instance methods
+        arg = is_static_method(callee) ? i : i - 1;
+        reference = arg < 0 || descriptor.args[arg] == 'L' || descriptor.args[arg] == '[';
+        if (emit_local(inliner, reference ? 0x3a : 0x36, callee_base + i, scope, pc) != 0) {
+            return -1;
+        }
+    }
+    if (emit_code(inliner, callee, callee_code, s, depth + 1, callee_base, stack_base + code->max_stack) != 0) {
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Append the code of the scope with its locals from local_base and its operand stack from stack_base.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int emit_code(struct inliner *inliner, struct method_info *method, struct code_attribute *code,
+        int scope, int depth, int local_base, int stack_base) {
+    u_int8_t *p, bytes[3];
+    int pc, len, retval;
+
+    if (local_base + code->max_locals > inliner->max_locals) {
+        inliner->max_locals = local_base + code->max_locals;
+    }
+    if (stack_base + code->max_stack > inliner->max_stack) {
+        inliner->max_stack = stack_base + code->max_stack;
+    }
+    for (pc = 0; pc < code->code_length; pc += len) {
+        p = code->code + pc;
+        len = get_instruction_length(code->code, pc);
+        if (len < 0 || pc + len > code->code_length) {
+            return -1;
+        }
+        if (scope < 0) {
+            inliner->new_pc[pc] = inliner->code_len;
+        }
+
+        if (*p == 0xb6 || *p == 0xb7 || *p == 0xb8) {
+            retval = inline_call(inliner, code, pc, scope, depth, local_base, stack_base);
+            if (retval < 0) {
+                return -1;
+            }
+            if (retval > 0) {
+                continue;
+            }
+            retval = emit_instruction(inliner, p, len, scope, pc);
+        } else if (*p == 0x15 || *p == 0x19 || *p == 0x36 || *p == 0x3a) {
+            retval = emit_local(inliner, *p, local_base + p[1], scope, pc);
+        } else if ((*p >= 0x1a && *p <= 0x1d) || (*p >= 0x2a && *p <= 0x2d)
+                || (*p >= 0x3b && *p <= 0x3e) || (*p >= 0x4b && *p <= 0x4e)) {
+            // iload_<n> (0x1a), aload_<n> (0x2a), istore_<n> (0x3b) and astore_<n> (0x4b)
+            if (*p <= 0x1d) {
+                retval = emit_local(inliner, 0x15, local_base + *p - 0x1a, scope, pc);
+            } else if (*p <= 0x2d) {
+                retval = emit_local(inliner, 0x19, local_base + *p - 0x2a, scope, pc);
+            } else if (*p <= 0x3e) {
+                retval = emit_local(inliner, 0x36, local_base + *p - 0x3b, scope, pc);
+            } else {
+                retval = emit_local(inliner, 0x3a, local_base + *p - 0x4b, scope, pc);
+            }
+        } else if (*p == 0x84) {
+            bytes[0] = *p;
+            bytes[1] = local_base + p[1];
+            bytes[2] = p[2];
+            retval = emit_instruction(inliner, bytes, 3, scope, pc);
+        } else if (is_return(*p) && scope >= 0) {
+            // the value is left on the operand stack of the caller
+            retval = 0;
+        } else if (is_branch(*p)) {
+            // only the method has branches
+            inliner->branches[inliner->branch_num] = inliner->code_len;
+            inliner->targets[inliner->branch_num] = pc + (int16_t) ((p[1] << 8) | p[2]);
+            inliner->branch_num++;
+            retval = emit_instruction(inliner, p, len, scope, pc);
+        } else {
+            retval = emit_instruction(inliner, p, len, scope, pc);
+        }
+        if (retval != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int replace_objects(struct inliner *inliner);
+
+static void free_inlined_code(struct inlined_code *inlined) {
+    if (inlined == NULL) {
+        return;
+    }
+    if (inlined->original_pc != NULL) {
+        free(inlined->code.code);
+    }
+    free(inlined->scopes);
+    free(inlined->scope_of_pc);
+    free(inlined->original_pc);
+    free(inlined);
+}
+
+/**
+ * Build the code of the method with its small callees spliced in, and objects which do not escape it replaced.
+ * Return the code, which is the original one if nothing is inlined, or NULL if failed.
+ */
+static struct inlined_code *inline_method(struct vm *vm, struct method_info *method, struct class_file *class) {
+    struct inliner inliner;
+    struct inlined_code *inlined;
+    struct code_attribute *code;
+    int i, offset, replaced = 0, retval = -1;
+
+    code = get_code(method, class);
+    if (code == NULL) {
+        return NULL;
+    }
+    inlined = calloc(1, sizeof(struct inlined_code));
+    if (inlined == NULL) {
+        return NULL;
+    }
+    inlined->code = *code;
+    if (code->exception_table_length > 0) {
+        return inlined;
+    }
+
+    memset(&inliner, 0, sizeof(inliner));
+    inliner.vm = vm;
+    inliner.method = method;
+    inliner.class = class;
+    inliner.branches = malloc(code->code_length * sizeof(int));
+    inliner.targets = malloc(code->code_length * sizeof(int));
+    inliner.new_pc = malloc(code->code_length * sizeof(int));
+    if (inliner.branches != NULL && inliner.targets != NULL && inliner.new_pc != NULL
+            && emit_code(&inliner, method, code, -1, 0, 0, 0) == 0) {
+        retval = 0;
+        for (i = 0; i < inliner.branch_num; i++) {
+            if (inliner.targets[i] < 0 || inliner.targets[i] >= code->code_length) {
+                retval = -1;
+                break;
+            }
+            offset = inliner.new_pc[inliner.targets[i]] - inliner.branches[i];
+            if (offset < INT16_MIN || offset > INT16_MAX) {
+                retval = -1;
+                break;
+            }
+            inliner.code[inliner.branches[i] + 1] = (u_int16_t) offset >> 8;
+            inliner.code[inliner.branches[i] + 2] = (u_int16_t) offset & 0xff;
+        }
+    }
+    free(inliner.branches);
+    free(inliner.targets);
+    free(inliner.new_pc);
+
+    // allocations are kept while they are observed
+    if (retval == 0 && vm->allocation_profiler == NULL && vm->recorder == NULL && vm->agent.object_alloc == NULL) {
+        replaced = replace_objects(&inliner);
+    }
+
+    // the original code is run if nothing is inlined or replaced, or the code cannot be rewritten
+    if (retval != 0 || (inliner.scope_num == 0 && replaced <= 0)) {
+        free(inliner.code);
+        free(inliner.scope_of_pc);
+        free(inliner.original_pc);
+        free(inliner.scopes);
+        return inlined;
+    }
+    inlined->code.code = inliner.code;
+    inlined->code.code_length = inliner.code_len;
+    inlined->code.max_stack = inliner.max_stack;
+    inlined->code.max_locals = inliner.max_locals;
+    inlined->code.attributes_count = 0;
+    inlined->code.attributes = NULL;
+    inlined->scopes = inliner.scopes;
+    inlined->scope_num = inliner.scope_num;
+    inlined->scope_of_pc = inliner.scope_of_pc;
+    inlined->original_pc = inliner.original_pc;
+    return inlined;
+}
+
+/**
+ * Return the code of the method with its callees inlined, which is built at the first call.
+ * Return the original code if it cannot be built, or NULL if the method has no code.
+ */
+static struct code_attribute *get_inlined_code(struct vm *vm, struct method_info *method, struct class_file *class) {
+    if (method->inlined == NULL) {
+        method->inlined = inline_method(vm, method, class);
+        if (method->inlined == NULL) {
+            return get_code(method, class);
+        }
+    }
+    return &method->inlined->code;
+}
+
+/**
+ * Store the frames of the source running at the pc of the code (innermost first) into at most max frames,
+ * which are the frame of the method and the ones of callees inlined into the code.
+ * Return the number of frames.
+ */
+static int get_source_frames(struct method_info *method, u_int8_t *code, int pc, struct sample_frame *frames,
+        int max) {
+    struct inlined_code *inlined = method->inlined;
+    int scope, n;
+
+    if (inlined == NULL || inlined->original_pc == NULL || code != inlined->code.code
+            || pc < 0 || pc >= inlined->code.code_length) {
+        frames[0].method = method;
+        frames[0].code = code;
+        frames[0].pc = pc;
+        return 1;
+    }
+    scope = inlined->scope_of_pc[pc];
+    pc = inlined->original_pc[pc];
+    for (n = 0; n < max; n++) {
+        frames[n].method = scope >= 0 ? inlined->scopes[scope].method : method;
+        frames[n].code = NULL;
+        frames[n].pc = pc;
+        if (scope < 0) {
+            return n + 1;
+        }
+        pc = inlined->scopes[scope].call_pc;
+        scope = inlined->scopes[scope].parent;
+    }
+    return n;
+}
+
+//
+// Escape Analysis
+//
+
+// Objects created by the code of a method with its callees inlined (see inline_method) are replaced by locals,
+// one for each field (scalar replacement), if they do not escape: their references stay in the locals and
+// the operand stack of the frame, and are only used to get and put their fields. Such objects are not created.
+// `new` stores the initial values of the fields into their locals and pushes null in place of the reference,
+// and getfield and putfield of the objects load and store the locals.
+// References are tracked by abstract interpretation of the code. An object escapes if its reference is passed to
+// a method, stored into a field, returned or compared, or if it meets another value at a join of the control flow
+// where it is live. An object whose instance of the previous iteration of a loop is still live when it is created
+// escapes too, since both would share the locals, and so does an object live at a loop header, since a frame running
+// the original code may continue there with objects it created (see enter_optimized_code).
+
+#define ESCAPE_MAX_CODE 4096 // bytes of code analyzed, since the analysis keeps the slots of each pc
+
+struct escape_analysis {
+    struct inliner *inliner;
+    int slots;      // locals and then the operand stack
+    int *depth;     // of the operand stack at each pc, -1 if the pc is not reached yet
+    int *values;    // of the slots at each pc: the pc of the `new` plus one for its objects, or 0 for other values
+    u_int8_t *live; // locals live at each pc
+    bool *escapes;  // at each pc of `new`
+    bool *entries;  // loop headers, where frames running the original code may enter the code
+    int *objects;   // at each pc of getfield and putfield, the value of the object
+    struct class_file **classes; // at each pc of `new`, the class of the object
+};
+
+// a field of an object replaced by a local
+struct scalar {
+    int object;
+    struct field_info *field;
+    char type;
+    int local;
+};
+
+static void escape(struct escape_analysis *ea, int value) {
+    if (value > 0) {
+        ea->escapes[value - 1] = true;
+    }
+}
+
+/**
+ * Store the pcs which may run after the instruction at the pc.
+ * Return the number of them.
+ */
+static int get_successors(u_int8_t *code, int pc, int len, int code_len, int *successors) {
+    int n = 0;
+
+    if (is_branch(code[pc])) {
+        successors[n++] = pc + (int16_t) ((code[pc + 1] << 8) | code[pc + 2]);
+    }
+    if (code[pc] != 0xa7 && !is_return(code[pc]) && pc + len < code_len) {
+        successors[n++] = pc + len;
+    }
+    return n;
+}
+
+/**
+ * Return the local loaded by the instruction (iload, aload and iinc), or -1.
+ */
+static int get_loaded_local(u_int8_t *p) {
+    if (*p == 0x15 || *p == 0x19 || *p == 0x84) {
+        return p[1];
+    }
+    if (*p >= 0x1a && *p <= 0x1d) {
+        return *p - 0x1a;
+    }
+    if (*p >= 0x2a && *p <= 0x2d) {
+        return *p - 0x2a;
+    }
+    return -1;
+}
+
+/**
+ * Return the local stored by the instruction (istore, astore and iinc), or -1.
+ */
+static int get_stored_local(u_int8_t *p) {
+    if (*p == 0x36 || *p == 0x3a || *p == 0x84) {
+        return p[1];
+    }
+    if (*p >= 0x3b && *p <= 0x3e) {
+        return *p - 0x3b;
+    }
+    if (*p >= 0x4b && *p <= 0x4e) {
+        return *p - 0x4b;
+    }
+    return -1;
+}
+
+/**
+ * Compute the locals live at each instruction (read before written on some path from it).
+ */
+static void compute_liveness(struct escape_analysis *ea, int *starts, int start_num) {
+    struct inliner *inliner = ea->inliner;
+    u_int8_t live[256];
+    int i, j, k, pc, local, successors[2], successor_num;
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+        for (i = start_num - 1; i >= 0; i--) {
+            pc = starts[i];
+            memset(live, 0, inliner->max_locals);
+            successor_num = get_successors(inliner->code, pc, get_instruction_length(inliner->code, pc),
+                                           inliner->code_len, successors);
+            for (j = 0; j < successor_num; j++) {
+                for (k = 0; k < inliner->max_locals; k++) {
+                    live[k] |= ea->live[successors[j] * inliner->max_locals + k];
+                }
+            }
+            if ((local = get_stored_local(inliner->code + pc)) >= 0) {
+                live[local] = 0;
+            }
+            if ((local = get_loaded_local(inliner->code + pc)) >= 0) {
+                live[local] = 1;
+            }
+            if (memcmp(live, ea->live + pc * inliner->max_locals, inliner->max_locals) != 0) {
+                memcpy(ea->live + pc * inliner->max_locals, live, inliner->max_locals);
+                changed = true;
+            }
+        }
+    }
+}
+
+/**
+ * Join the values after an instruction into the ones at the pc.
+ * Return 1 if the values at the pc are changed, 0 if not, or -1 if the depths of the operand stack differ.
+ */
+static int join_values(struct escape_analysis *ea, int pc, const int *values, int depth) {
+    struct inliner *inliner = ea->inliner;
+    int *joined = ea->values + pc * ea->slots;
+    int i, value;
+    bool changed = false;
+
+    if (ea->depth[pc] >= 0 && ea->depth[pc] != depth) {
+        return -1;
+    }
+    for (i = 0; i < inliner->max_locals + depth; i++) {
+        value = values[i];
+        if (i < inliner->max_locals && !ea->live[pc * inliner->max_locals + i]) {
+            value = 0;
+        } else if (ea->entries[pc]) {
+            // a frame of the original code may enter here with its objects (see enter_optimized_code)
+            escape(ea, value);
+            value = 0;
+        }
+        if (ea->depth[pc] < 0) {
+            joined[i] = value;
+        } else if (joined[i] != value) {
+            escape(ea, joined[i]);
+            escape(ea, value);
+            if (joined[i] != 0) {
+                joined[i] = 0;
+                changed = true;
+            }
+        }
+    }
+    if (ea->depth[pc] < 0) {
+        ea->depth[pc] = depth;
+        return 1;
+    }
+    return changed ? 1 : 0;
+}
+
+/**
+ * Check the field accessed by getfield or putfield at the pc of the object.
+ */
+static void check_field_access(struct escape_analysis *ea, int pc, int object) {
+    struct cp_cache_entry *resolved;
+    char descriptor[1024];
+
+    ea->objects[pc] = object;
+    if (object <= 0) {
+        return;
+    }
+    // fields are created only for int and references (see create_instance_field)
+    resolved = resolve_field(ea->inliner->vm, (ea->inliner->code[pc + 1] << 8) | ea->inliner->code[pc + 2],
+                             ea->inliner->class);
+    if (resolved == NULL || resolved->class != ea->classes[object - 1] || is_static_field(resolved->field)) {
+        escape(ea, object);
+        return;
+    }
+    get_field_descriptor(descriptor, resolved->field, resolved->class);
+    if (descriptor[0] != FIELD_DESCRIPTOR_INT && descriptor[0] != FIELD_DESCRIPTOR_OBJECT) {
+        escape(ea, object);
+    }
+}
+
+/**
+ * Run the instruction at the pc on the values, and store the depth of the operand stack after it.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int run_abstract_instruction(struct escape_analysis *ea, int pc, int *values, int *depth) {
+    struct inliner *inliner = ea->inliner;
+    struct cp_cache_entry *resolved;
+    struct method_descriptor descriptor;
+    u_int8_t *p = inliner->code + pc;
+    int sp = inliner->max_locals + *depth, local, value, units, i;
+
+#define ABSTRACT_POP() (sp > inliner->max_locals ? values[--sp] : (sp = -1, 0))
+#define ABSTRACT_PUSH(v) do { if (sp >= 0 && sp < ea->slots) { values[sp++] = (v); } else { sp = -1; } } while (0)
+
+    if (*p == 0x19 || (*p >= 0x2a && *p <= 0x2d)) {
+        ABSTRACT_PUSH(values[get_loaded_local(p)]);
+    } else if (*p == 0x36 || *p == 0x3a || (*p >= 0x3b && *p <= 0x3e) || (*p >= 0x4b && *p <= 0x4e)) {
+        local = get_stored_local(p);
+        value = ABSTRACT_POP();
+        values[local] = value;
+    } else if ((*p >= 0x01 && *p <= 0x11) || *p == 0x15 || (*p >= 0x1a && *p <= 0x1d) || *p == 0xb2) {
+        ABSTRACT_PUSH(0);
+    } else if (*p == 0x57) {
+        ABSTRACT_POP();
+    } else if (*p == 0x59) {
+        value = ABSTRACT_POP();
+        ABSTRACT_PUSH(value);
+        ABSTRACT_PUSH(value);
+    } else if (*p == 0x60 || *p == 0x64 || *p == 0x68 || *p == 0x6c || *p == 0x70) {
+        escape(ea, ABSTRACT_POP());
+        escape(ea, ABSTRACT_POP());
+        ABSTRACT_PUSH(0);
+    } else if (*p == 0x74) {
+        escape(ea, ABSTRACT_POP());
+        ABSTRACT_PUSH(0);
+    } else if ((*p >= 0x99 && *p <= 0x9e) || *p == 0xc6 || *p == 0xc7 || *p == 0xac || *p == 0xb0 || *p == 0xb3) {
+        escape(ea, ABSTRACT_POP());
+    } else if (*p >= 0x9f && *p <= 0xa4) {
+        escape(ea, ABSTRACT_POP());
+        escape(ea, ABSTRACT_POP());
+    } else if (*p == 0xb4) {
+        check_field_access(ea, pc, ABSTRACT_POP());
+        ABSTRACT_PUSH(0);
+    } else if (*p == 0xb5) {
+        escape(ea, ABSTRACT_POP());
+        check_field_access(ea, pc, ABSTRACT_POP());
+    } else if (*p >= 0xb6 && *p <= 0xb8) {
+        resolved = resolve_method(inliner->vm, (p[1] << 8) | p[2], inliner->class);
+        if (resolved == NULL || get_method_descriptor(&descriptor, resolved->method, resolved->class) != 0
+                || (descriptor.ret != 'V' && get_operand_stack_units(descriptor.ret) != 1)) {
             return -1;
-        case CONSTANT_DOUBLE:
-            fprintf(stderr, "not yet implemented cp_info: CONSTANT_DOUBLE\n");
+        }
+        units = descriptor.units + (is_static_method(resolved->method) ? 0 : 1);
+        for (i = 0; i < units; i++) {
+            escape(ea, ABSTRACT_POP());
+        }
+        if (descriptor.ret != 'V') {
+            ABSTRACT_PUSH(0);
+        }
+    } else if (*p == 0xbb) {
+        // the object of the previous iteration is still live
+        for (i = 0; i < sp; i++) {
+            if (values[i] == pc + 1 && (i >= inliner->max_locals || ea->live[pc * inliner->max_locals + i])) {
+                escape(ea, pc + 1);
+            }
+        }
+        resolved = resolve_class(inliner->vm, (p[1] << 8) | p[2], inliner->class);
+        if (resolved == NULL) {
+            escape(ea, pc + 1);
+        } else {
+            ea->classes[pc] = resolved->class;
+        }
+        ABSTRACT_PUSH(pc + 1);
+    }
+    // iinc, goto and return change no reference
+
+#undef ABSTRACT_POP
+#undef ABSTRACT_PUSH
+
+    if (sp < 0) {
+        return -1;
+    }
+    *depth = sp - inliner->max_locals;
+    return 0;
+}
+
+/**
+ * Find the objects which do not escape the code.
+ * Return 0 if success, return -1 if the code cannot be analyzed.
+ */
+static int analyze_escapes(struct escape_analysis *ea) {
+    struct inliner *inliner = ea->inliner;
+    int *worklist, *values;
+    bool *queued;
+    int work_num = 0, pc, depth, successors[2], successor_num, i, changed, retval = -1;
+
+    worklist = malloc(inliner->code_len * sizeof(int));
+    queued = calloc(inliner->code_len, sizeof(bool));
+    values = malloc(ea->slots * sizeof(int));
+    if (worklist == NULL || queued == NULL || values == NULL) {
+        goto out;
+    }
+
+    // arguments are not objects created by the code
+    memset(values, 0, ea->slots * sizeof(int));
+    join_values(ea, 0, values, 0);
+    worklist[work_num++] = 0;
+    queued[0] = true;
+    while (work_num > 0) {
+        pc = worklist[--work_num];
+        queued[pc] = false;
+        memcpy(values, ea->values + pc * ea->slots, ea->slots * sizeof(int));
+        depth = ea->depth[pc];
+        if (run_abstract_instruction(ea, pc, values, &depth) != 0) {
+            goto out;
+        }
+        successor_num = get_successors(inliner->code, pc, get_instruction_length(inliner->code, pc),
+                                       inliner->code_len, successors);
+        for (i = 0; i < successor_num; i++) {
+            changed = join_values(ea, successors[i], values, depth);
+            if (changed < 0) {
+                goto out;
+            }
+            if (changed > 0 && !queued[successors[i]]) {
+                worklist[work_num++] = successors[i];
+                queued[successors[i]] = true;
+            }
+        }
+    }
+    retval = 0;
+
+out:
+    free(worklist);
+    free(queued);
+    free(values);
+    return retval;
+}
+
+/**
+ * Assign locals from first_local to the fields of objects which do not escape.
+ * Objects whose fields do not fit in locals of one byte index escape.
+ * Return the number of scalars stored in scalars (of code_len at most).
+ */
+static int assign_scalars(struct escape_analysis *ea, int *starts, int start_num, int first_local,
+        struct scalar *scalars) {
+    struct inliner *inliner = ea->inliner;
+    struct cp_cache_entry *resolved;
+    char descriptor[1024];
+    int scalar_num, object, pc, i, j;
+    bool retry = true;
+
+    while (retry) {
+        retry = false;
+        scalar_num = 0;
+        for (i = 0; i < start_num && !retry; i++) {
+            pc = starts[i];
+            object = ea->objects[pc];
+            if ((inliner->code[pc] != 0xb4 && inliner->code[pc] != 0xb5) || object <= 0 || ea->escapes[object - 1]) {
+                continue;
+            }
+            resolved = resolve_field(inliner->vm, (inliner->code[pc + 1] << 8) | inliner->code[pc + 2], inliner->class);
+            for (j = 0; j < scalar_num; j++) {
+                if (scalars[j].object == object && scalars[j].field == resolved->field) {
+                    break;
+                }
+            }
+            if (j < scalar_num) {
+                continue;
+            }
+            if (first_local + scalar_num >= 256) {
+                escape(ea, object);
+                retry = true;
+                break;
+            }
+            get_field_descriptor(descriptor, resolved->field, resolved->class);
+            scalars[scalar_num].object = object;
+            scalars[scalar_num].field = resolved->field;
+            scalars[scalar_num].type = descriptor[0];
+            scalars[scalar_num].local = first_local + scalar_num;
+            scalar_num++;
+        }
+    }
+    return scalar_num;
+}
+
+/**
+ * Find the scalar of the field accessed by getfield or putfield at the pc.
+ */
+static struct scalar *find_scalar(struct escape_analysis *ea, struct scalar *scalars, int scalar_num, int pc) {
+    struct cp_cache_entry *resolved;
+    int i;
+
+    resolved = &ea->inliner->class->cp_cache[((ea->inliner->code[pc + 1] << 8) | ea->inliner->code[pc + 2]) - 1];
+    for (i = 0; i < scalar_num; i++) {
+        if (scalars[i].object == ea->objects[pc] && scalars[i].field == resolved->field) {
+            return &scalars[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Rewrite the code of the inliner with objects replaced by the locals of their fields.
+ * Return 0 if success, return -1 otherwise (the code is left as it is).
+ */
+static int emit_replaced_code(struct escape_analysis *ea, int *starts, int start_num, struct scalar *scalars,
+        int scalar_num) {
+    struct inliner *inliner = ea->inliner, out;
+    struct scalar *scalar;
+    u_int8_t *p, bytes[1];
+    int *new_pc, *branches, *targets;
+    int branch_num = 0, pc, len, scope, original_pc, object, offset, i, retval = -1;
+
+    memset(&out, 0, sizeof(out));
+    new_pc = malloc(inliner->code_len * sizeof(int));
+    branches = malloc(inliner->code_len * sizeof(int));
+    targets = malloc(inliner->code_len * sizeof(int));
+    if (new_pc == NULL || branches == NULL || targets == NULL) {
+        goto out;
+    }
+
+    for (i = 0; i < start_num; i++) {
+        pc = starts[i];
+        p = inliner->code + pc;
+        len = get_instruction_length(inliner->code, pc);
+        scope = inliner->scope_of_pc[pc];
+        original_pc = inliner->original_pc[pc];
+        object = *p == 0xbb ? pc + 1 : *p == 0xb4 || *p == 0xb5 ? ea->objects[pc] : 0;
+        new_pc[pc] = out.code_len;
+
+        if (object > 0 && !ea->escapes[object - 1] && *p == 0xbb) {
+            // fields are initialized as create_instance_field does, and null is the reference
+            for (offset = 0; offset < scalar_num; offset++) {
+                if (scalars[offset].object != object) {
+                    continue;
+                }
+                bytes[0] = scalars[offset].type == FIELD_DESCRIPTOR_OBJECT ? 0x01 : 0x03;
+                if (emit_instruction(&out, bytes, 1, scope, original_pc) != 0
+                        || emit_local(&out, scalars[offset].type == FIELD_DESCRIPTOR_OBJECT ? 0x3a : 0x36,
+                                      scalars[offset].local, scope, original_pc) != 0) {
+                    goto out;
+                }
+            }
+            bytes[0] = 0x01;
+            if (emit_instruction(&out, bytes, 1, scope, original_pc) != 0) {
+                goto out;
+            }
+        } else if (object > 0 && !ea->escapes[object - 1] && *p == 0xb4) {
+            // the reference is dropped and the value is loaded
+            scalar = find_scalar(ea, scalars, scalar_num, pc);
+            bytes[0] = 0x57;
+            if (emit_instruction(&out, bytes, 1, scope, original_pc) != 0
+                    || emit_local(&out, scalar->type == FIELD_DESCRIPTOR_OBJECT ? 0x19 : 0x15, scalar->local,
+                                  scope, original_pc) != 0) {
+                goto out;
+            }
+        } else if (object > 0 && !ea->escapes[object - 1] && *p == 0xb5) {
+            // the value is stored and the reference is dropped
+            scalar = find_scalar(ea, scalars, scalar_num, pc);
+            bytes[0] = 0x57;
+            if (emit_local(&out, scalar->type == FIELD_DESCRIPTOR_OBJECT ? 0x3a : 0x36, scalar->local,
+                           scope, original_pc) != 0
+                    || emit_instruction(&out, bytes, 1, scope, original_pc) != 0) {
+                goto out;
+            }
+        } else {
+            if (is_branch(*p)) {
+                branches[branch_num] = out.code_len;
+                targets[branch_num] = pc + (int16_t) ((p[1] << 8) | p[2]);
+                branch_num++;
+            }
+            if (emit_instruction(&out, p, len, scope, original_pc) != 0) {
+                goto out;
+            }
+        }
+    }
+    for (i = 0; i < branch_num; i++) {
+        offset = new_pc[targets[i]] - branches[i];
+        if (offset < INT16_MIN || offset > INT16_MAX) {
+            goto out;
+        }
+        out.code[branches[i] + 1] = (u_int16_t) offset >> 8;
+        out.code[branches[i] + 2] = (u_int16_t) offset & 0xff;
+    }
+
+    free(inliner->code);
+    free(inliner->scope_of_pc);
+    free(inliner->original_pc);
+    inliner->code = out.code;
+    inliner->code_len = out.code_len;
+    inliner->code_cap = out.code_cap;
+    inliner->scope_of_pc = out.scope_of_pc;
+    inliner->original_pc = out.original_pc;
+    out.code = NULL;
+    out.scope_of_pc = NULL;
+    out.original_pc = NULL;
+    retval = 0;
+
+out:
+    free(out.code);
+    free(out.scope_of_pc);
+    free(out.original_pc);
+    free(new_pc);
+    free(branches);
+    free(targets);
+    return retval;
+}
+
+/**
+ * Replace objects which do not escape the code of the inliner by locals.
+ * Return the number of replaced allocations (in the code), or -1 if the code is left as it is.
+ */
+static int replace_objects(struct inliner *inliner) {
+    struct escape_analysis ea;
+    struct scalar *scalars = NULL;
+    int *starts = NULL;
+    int start_num = 0, scalar_num, replaced = 0, pc, len, i, retval = -1;
+
+    if (inliner->code_len > ESCAPE_MAX_CODE) {
+        return -1;
+    }
+    memset(&ea, 0, sizeof(ea));
+    ea.inliner = inliner;
+    ea.slots = inliner->max_locals + inliner->max_stack;
+    ea.depth = malloc(inliner->code_len * sizeof(int));
+    ea.values = malloc(inliner->code_len * ea.slots * sizeof(int));
+    ea.live = calloc(inliner->code_len * inliner->max_locals + 1, 1);
+    ea.escapes = calloc(inliner->code_len, sizeof(bool));
+    ea.entries = calloc(inliner->code_len, sizeof(bool));
+    ea.objects = calloc(inliner->code_len, sizeof(int));
+    ea.classes = calloc(inliner->code_len, sizeof(struct class_file *));
+    starts = malloc(inliner->code_len * sizeof(int));
+    scalars = malloc(inliner->code_len * sizeof(struct scalar));
+    if (ea.depth == NULL || ea.values == NULL || ea.live == NULL || ea.escapes == NULL || ea.entries == NULL
+            || ea.objects == NULL || ea.classes == NULL || starts == NULL || scalars == NULL) {
+        goto out;
+    }
+
+    for (pc = 0; pc < inliner->code_len; pc++) {
+        ea.depth[pc] = -2;
+    }
+    for (pc = 0; pc < inliner->code_len; pc += len) {
+        len = get_instruction_length(inliner->code, pc);
+        if (len < 0 || pc + len > inliner->code_len) {
+            goto out;
+        }
+        if (inliner->code[pc] == 0xbb) {
+            replaced++;
+        }
+        ea.depth[pc] = -1;
+        starts[start_num++] = pc;
+    }
+    // the code is expected to be valid: branches to the start of instructions in the code.
+    // targets of backward branches are loop headers.
+    for (i = 0; i < start_num; i++) {
+        pc = starts[i];
+        if (is_branch(inliner->code[pc])) {
+            len = pc + (int16_t) ((inliner->code[pc + 1] << 8) | inliner->code[pc + 2]);
+            if (len < 0 || len >= inliner->code_len || ea.depth[len] != -1) {
+                goto out;
+            }
+            if (len <= pc) {
+                ea.entries[len] = true;
+            }
+        }
+    }
+    if (replaced == 0) {
+        retval = 0;
+        goto out;
+    }
+
+    compute_liveness(&ea, starts, start_num);
+    if (analyze_escapes(&ea) != 0) {
+        goto out;
+    }
+    scalar_num = assign_scalars(&ea, starts, start_num, inliner->max_locals, scalars);
+
+    replaced = 0;
+    for (i = 0; i < start_num; i++) {
+        pc = starts[i];
+        if (inliner->code[pc] == 0xbb && ea.depth[pc] >= 0 && !ea.escapes[pc]) {
+            replaced++;
+        }
+    }
+    if (replaced == 0) {
+        retval = 0;
+        goto out;
+    }
+    if (emit_replaced_code(&ea, starts, start_num, scalars, scalar_num) != 0) {
+        goto out;
+    }
+    inliner->max_locals += scalar_num;
+    retval = replaced;
+
+out:
+    free(ea.depth);
+    free(ea.values);
+    free(ea.live);
+    free(ea.escapes);
+    free(ea.entries);
+    free(ea.objects);
+    free(ea.classes);
+    free(starts);
+    free(scalars);
+    return retval;
+}
+
+//
+// Tiered Execution
+//
+
+// Methods are promoted through tiers by their counters. A method starts interpreted (TIER_INTERPRETED), where it only
+// counts its invocations and backedges (branches taken to a lower pc, one for each iteration of a loop).
+// After profile_threshold invocations it is profiled (TIER_PROFILED): its conditional branches count how often they
+// are taken, and its invokevirtual records the classes of receivers. After optimize_threshold invocations and
+// backedges, it runs the code with its callees inlined and objects replaced (TIER_OPTIMIZED) from the next invocation.
+// The counters are in a profile allocated at the first invocation, and the counts of the profiled tier are allocated
+// when the method is promoted to it, so methods run a few times cost a few words.
+// A method may be promoted by the backedges of a loop which never returns to its caller, like the one of main
+// running a whole batch. Then the frame running the loop continues in the optimized code
+// at the loop header (on-stack replacement, see enter_optimized_code).
+
+#define TIER_PROFILE_THRESHOLD 200   // invocations (like Tier3InvocationThreshold of HotSpot)
+#define TIER_OPTIMIZE_THRESHOLD 5000 // invocations and backedges (like Tier4InvocationThreshold)
+#define RECEIVER_TYPES 2             // classes recorded at each call site (like TypeProfileWidth)
+
+enum tier {
+    TIER_INTERPRETED,
+    TIER_PROFILED,
+    TIER_OPTIMIZED,
+};
+
+static const char *tier_names[] = {"interpreted", "profiled", "optimized"};
+
+// how often a conditional branch is taken
+struct branch_profile {
+    long taken;
+    long not_taken;
+};
+
+// classes of receivers at a call site
+struct receiver_profile {
+    struct class_file *classes[RECEIVER_TYPES];
+    long counts[RECEIVER_TYPES];
+    long others; // receivers of other classes
+};
+
+struct method_profile {
+    enum tier tier;
+    long invocations;
+    long backedges;
+    // the optimized code could not be built, so the method stays in its tier (see optimize_method)
+    bool optimization_failed;
+    // indexed by pc of the original code. NULL until the method is profiled.
+    int code_length;
+    struct branch_profile *branches;
+    struct receiver_profile *receivers;
+};
+
+static void free_method_profile(struct method_profile *profile) {
+    if (profile == NULL) {
+        return;
+    }
+    free(profile->branches);
+    free(profile->receivers);
+    free(profile);
+}
+
+/**
+ * Promote the method to the optimized tier after its optimized code is built (see get_inlined_code).
+ * If it cannot be built, the failure is recorded and the method is not tried again.
+ * Return true if the method is optimized.
+ */
+static bool optimize_method(struct vm *vm, struct method_info *method, struct class_file *class) {
+    struct method_profile *profile = method->profile;
+    u_int64_t start = vm->recorder != NULL ? get_monotonic_time() : 0;
+    char name[1024];
+
+    if (method->inlined == NULL) {
+        method->inlined = inline_method(vm, method, class);
+    }
+    if (vm->recorder != NULL && profile->tier != TIER_OPTIMIZED) {
+        record_event(vm->recorder, RECORD_OPTIMIZE, start, method->inlined == NULL,
+                     get_method_name(name, method, class));
+    }
+    if (method->inlined == NULL) {
+        profile->optimization_failed = true;
+        return false;
+    }
+    profile->tier = TIER_OPTIMIZED;
+    return true;
+}
+
+/**
+ * Promote the method to the tier of its counters.
+ * It is optimized only if optimizing is true.
+ */
+static void update_tier(struct vm *vm, struct method_info *method, struct class_file *class, bool optimizing) {
+    struct method_profile *profile = method->profile;
+    struct code_attribute *code;
+
+    if (profile->tier == TIER_INTERPRETED && profile->invocations >= vm->tier_profile_threshold) {
+        code = get_code(method, class);
+        if (code != NULL) {
+            profile->code_length = code->code_length;
+            profile->branches = calloc(code->code_length, sizeof(struct branch_profile));
+            profile->receivers = calloc(code->code_length, sizeof(struct receiver_profile));
+        }
+        // the method stays interpreted if the counts cannot be allocated
+        if (profile->branches != NULL && profile->receivers != NULL) {
+            profile->tier = TIER_PROFILED;
+        } else {
+            free(profile->branches);
+            free(profile->receivers);
+            profile->branches = NULL;
+            profile->receivers = NULL;
+        }
+    }
+    if (profile->tier != TIER_OPTIMIZED && optimizing && !profile->optimization_failed
+            && profile->invocations + profile->backedges >= vm->tier_optimize_threshold) {
+        optimize_method(vm, method, class);
+    }
+}
+
+/**
+ * Count an invocation of the method, and return the code of its tier.
+ * The code with callees inlined is run only if optimizing is true.
+ * Return NULL if failed.
+ */
+static struct code_attribute *get_tiered_code(struct vm *vm, struct method_info *method, struct class_file *class,
+        bool optimizing) {
+    struct method_profile *profile = method->profile;
+
+    if (profile == NULL) {
+        profile = method->profile = calloc(1, sizeof(struct method_profile));
+        if (profile == NULL) {
+            fprintf(stderr, "failed to allocate profile\n");
+            return NULL;
+        }
+    }
+    profile->invocations++;
+    if (profile->tier != TIER_OPTIMIZED) {
+        update_tier(vm, method, class, optimizing);
+    }
+    return profile->tier == TIER_OPTIMIZED && optimizing ? get_inlined_code(vm, method, class)
+                                                         : get_code(method, class);
+}
+
+static struct java_frame *replace_java_frame(struct vm *vm, struct java_frame *frame, struct code_attribute *code,
+                                             int pc);
+
+/**
+ * Return the pc in the optimized code where the method continues from the pc of its original code, or -1 if none.
+ */
+static int get_osr_pc(struct inlined_code *inlined, int pc) {
+    int i;
+
+    if (inlined->original_pc == NULL) {
+        return -1;
+    }
+    // the first instruction of the ones replacing the instruction at the pc
+    for (i = 0; i < inlined->code.code_length; i++) {
+        if (inlined->scope_of_pc[i] < 0 && inlined->original_pc[i] == pc) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Promote the method of the frame to the optimized tier, and replace the frame running the original code
+ * by one running the optimized code from the loop header at p (on-stack replacement).
+ * Locals and the operand stack of the frame are moved to the new frame, which is the same in the optimized code
+ * at loop headers of the method, since callees are inlined only between them (see inline_call)
+ * and objects live at them are not replaced (see join_values).
+ * Return the new frame, or NULL if the frame is left as it is. The method is still optimized from its next
+ * invocation if only the frame cannot be replaced (e.g. p is not a loop header of the optimized code).
+ */
+static struct java_frame *enter_optimized_code(struct vm *vm, struct java_frame *frame, u_int8_t *p) {
+    struct method_info *method = frame->method;
+    struct code_attribute *code;
+    struct java_frame *replaced;
+    u_int64_t start = vm->recorder != NULL ? get_monotonic_time() : 0;
+    char name[1024];
+    int pc, original_pc = (int) (p - frame->code);
+
+    if (method->profile->optimization_failed || !optimize_method(vm, method, frame->class)) {
+        return NULL;
+    }
+    code = &method->inlined->code;
+    if (code->code == frame->code) {
+        return NULL;
+    }
+    pc = get_osr_pc(method->inlined, original_pc);
+    if (pc < 0) {
+        return NULL;
+    }
+    // the old frame is overwritten by the new one
+    replaced = replace_java_frame(vm, frame, code, pc);
+    if (replaced != NULL && vm->recorder != NULL) {
+        record_event(vm->recorder, RECORD_OSR, start, original_pc, get_method_name(name, method, replaced->class));
+    }
+    return replaced;
+}
+
+/**
+ * Record the class of the receiver of the call at the pc of the profiled method.
+ */
+static void profile_receiver(struct vm *vm, struct method_profile *profile, int pc, int receiver) {
+    struct receiver_profile *receivers = &profile->receivers[pc];
+    struct class_instance *instance;
+    int i;
+
+    // null is not a receiver
+    instance = get_instance(vm, receiver);
+    if (instance == NULL) {
+        return;
+    }
+    for (i = 0; i < RECEIVER_TYPES; i++) {
+        if (receivers->classes[i] == NULL || receivers->classes[i] == instance->class) {
+            receivers->classes[i] = instance->class;
+            receivers->counts[i]++;
+            return;
+        }
+    }
+    receivers->others++;
+}
+
+//
+// Frame Stack
+//
+
+// Java frames are pushed on a stack of the VM instead of the C stack, so calls between Java methods
+// do not nest calls of the interpreter. A frame is its locals, a java_frame and its operand stack.
+// Like interpreter frames of HotSpot, locals of a callee start at the arguments on the operand stack of
+// the caller, so arguments are passed without copying, and the return value is pushed into the same slot.
+// Each frame is checked against the limit when it is pushed, and the program stops by StackOverflowError
+// if it does not fit.
+
+#define FRAME_STACK_SIZE (8 * 1024 * 1024)
+
+static int create_frame_stack(struct vm *vm) {
+    vm->frame_stack = mmap(NULL, FRAME_STACK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (vm->frame_stack == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    vm->frame_stack_top = vm->frame_stack;
+    vm->frame_stack_limit = vm->frame_stack + FRAME_STACK_SIZE;
+    return 0;
+}
+
+static void destroy_frame_stack(struct vm *vm) {
+    munmap(vm->frame_stack, FRAME_STACK_SIZE);
+}
+
+#define ALIGN_FRAME(p) ((char *) (((uintptr_t) (p) + 7) & ~(uintptr_t) 7))
+
+/**
+ * Return the operand stack units of arguments of the method including 'this', or -1 if failed.
+ */
+static int get_arg_units(struct method_info *method, struct class_file *class) {
+    struct method_descriptor descriptor;
+
+    if (method->arg_units < 0) {
+        if (get_method_descriptor(&descriptor, method, class) != 0) {
+            fprintf(stderr, "failed to get descriptor\n");
             return -1;
-        case CONSTANT_NAME_AND_TYPE:
-            *cp_info = (struct cp_info *) malloc(sizeof(struct constant_name_and_type_info));
-            if (*cp_info == NULL) {
-                fprintf(stderr, "failed to prepare CONSTANT_NAME_AND_TYPE cp_info\n");
-                return -1;
+        }
+        // for 'this' reference
+        method->arg_units = descriptor.units + (is_static_method(method) ? 0 : 1);
+    }
+    return method->arg_units;
+}
+
+/**
+ * Replace the frame on the top of the frame stack by one running the code from the pc,
+ * with the locals and the operand stack of the frame. The code has at least as many locals as the frame.
+ * Return the new frame, or NULL if the frame stack overflows (the frame is left as it is).
+ */
+static struct java_frame *replace_java_frame(struct vm *vm, struct java_frame *frame, struct code_attribute *code,
+        int pc) {
+    struct java_frame old = *frame, *new_frame;
+    int32_t *stack;
+
+    new_frame = (struct java_frame *) ALIGN_FRAME(old.frame.locals + code->max_locals);
+    stack = (int32_t *) (new_frame + 1) + 1;
+    if (code->max_locals < old.frame.max_locals || code->max_stack < old.frame.stack_i
+            || (char *) (stack + code->max_stack) > vm->frame_stack_limit) {
+        return NULL;
+    }
+
+    // unlink the frame while it is moved, since a signal handler may walk the chain at any time
+    vm->top_frame = old.prev;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    // the new frame is above the old one, so the operand stack is moved before locals are added
+    memmove(stack, old.frame.stack, old.frame.stack_i * sizeof(int32_t));
+    memset(old.frame.locals + old.frame.max_locals, 0,
+           (code->max_locals - old.frame.max_locals) * sizeof(int32_t));
+    *new_frame = old;
+    new_frame->frame.max_locals = code->max_locals;
+    new_frame->frame.max_stack = code->max_stack;
+    new_frame->frame.stack = stack;
+    vm->frame_stack_top = ALIGN_FRAME(stack + code->max_stack);
+    new_frame->code = code->code;
+    new_frame->code_end = code->code + code->code_length;
+    new_frame->pc = code->code + pc;
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    vm->top_frame = new_frame;
+    return new_frame;
+}
+
+/**
+ * Push the frame of the method taking its arguments from the operand stack of args_frame.
+ * Return the frame, or NULL if failed (StackOverflowError is thrown if the frame stack overflows).
+ */
+static struct java_frame *push_java_frame(struct vm *vm, struct method_info *method, struct code_attribute *code,
+        struct class_file *class, struct frame *args_frame) {
+    struct java_frame *frame;
+    int32_t *args, *locals;
+    int units;
+
+    units = get_arg_units(method, class);
+    if (units < 0) {
+        return NULL;
+    }
+    if (args_frame->stack_i < units || code->max_locals < units) {
+        fprintf(stderr, "too few arguments\n");
+        return NULL;
+    }
+
+    // arguments on the frame stack become locals as they are, and others are copied to the top of it
+    args = args_frame->stack + args_frame->stack_i - units;
+    if ((char *) args >= vm->frame_stack && (char *) args < vm->frame_stack_limit) {
+        locals = args;
+    } else {
+        locals = (int32_t *) vm->frame_stack_top;
+    }
+    frame = (struct java_frame *) ALIGN_FRAME(locals + code->max_locals);
+    if ((char *) ((int32_t *) (frame + 1) + 1 + code->max_stack) > vm->frame_stack_limit) {
+        throw_vm_error(vm, "java/lang/StackOverflowError", "frame stack is full");
+        return NULL;
+    }
+    if (locals != args) {
+        memcpy(locals, args, units * sizeof(int32_t));
+    }
+    args_frame->stack_i -= units;
+    memset(locals + units, 0, (code->max_locals - units) * sizeof(int32_t));
+
+    frame->frame.max_locals = code->max_locals;
+    frame->frame.locals = locals;
+    frame->frame.max_stack = code->max_stack;
+    // stack[-1] is a scratch slot for the interpreter (see PUSH)
+    frame->frame.stack = (int32_t *) (frame + 1) + 1;
+    frame->frame.stack_i = 0;
+    frame->prev_stack_top = vm->frame_stack_top;
+    vm->frame_stack_top = ALIGN_FRAME(frame->frame.stack + code->max_stack);
+
+    frame->method = method;
+    frame->code = code->code;
+    frame->code_end = code->code + code->code_length;
+    frame->pc = code->code;
+    frame->class = class;
+
+    // link the frame after it is filled, since a signal handler may walk the chain at any time
+    frame->prev = vm->top_frame;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    vm->top_frame = frame;
+
+    if (vm->perf.enabled) {
+        perf_method_enter(&vm->perf, &frame->perf);
+    }
+    if (vm->stats != NULL) {
+        stats_method_enter(vm->stats, vm->executed_bytecodes, &frame->stats);
+    }
+    return frame;
+}
+
+static void pop_java_frame(struct vm *vm, struct java_frame *frame) {
+    if (vm->perf.enabled) {
+        perf_method_exit(&vm->perf, frame->method, &frame->perf);
+    }
+    if (vm->stats != NULL) {
+        stats_method_exit(vm->stats, vm->executed_bytecodes, frame->method, &frame->stats);
+    }
+    vm->top_frame = frame->prev;
+    vm->frame_stack_top = frame->prev_stack_top;
+}
+
+// The interpreter keeps the top of the operand stack (tos) and the stack pointer in registers.
+// Values below the top are in the memory of the stack, and sp points to the slot of the top in memory.
+// An empty stack has a garbage top in stack[-1], a slot reserved for this (see push_java_frame),
+// so pushes and pops need no check. Binary operations read only one value from memory.
+// The frame is stored (STORE_FRAME) before anything else accesses it, and loaded back after (LOAD_FRAME).
+
+#define PUSH(v) do { int32_t v_ = (v); *sp++ = tos; tos = v_; } while (0)
+#define POP(x) do { (x) = tos; tos = *--sp; } while (0)
+// pop two values and leave the slot of the result on the top
+#define POP_BINARY(x, y) do { (y) = tos; (x) = *--sp; } while (0)
+
+#define STORE_FRAME() do { \
+        *sp = tos; \
+        current_frame->stack_i = (int) (sp - current_frame->stack) + 1; \
+    } while (0)
+#define LOAD_FRAME() do { \
+        sp = current_frame->stack + current_frame->stack_i - 1; \
+        tos = *sp; \
+    } while (0)
+
+// switch the interpreter to the frame (on calls and returns)
+#define ENTER_FRAME(f, pc) do { \
+        current = (f); \
+        current_method = current->method; \
+        current_class = current->class; \
+        current_frame = &current->frame; \
+        locals = current_frame->locals; \
+        code_end = current->code_end; \
+        profile = current_method->profile; \
+        profiled = profile->tier == TIER_PROFILED ? profile : NULL; \
+        osr = inlining && profile->tier != TIER_OPTIMIZED; \
+        p = (pc); \
+        LOAD_FRAME(); \
+    } while (0)
+
+// count an iteration of a loop jumping back to p, and continue in the optimized code
+// if the loop promotes the method to it (see enter_optimized_code)
+#define COUNT_BACKEDGE() do { \
+        profile->backedges++; \
+        if (osr && profile->invocations + profile->backedges >= vm->tier_optimize_threshold) { \
+            STORE_FRAME(); \
+            callee = enter_optimized_code(vm, current, p); \
+            if (callee != NULL) { \
+                entry = current == entry ? callee : entry; \
+                ENTER_FRAME(callee, callee->pc); \
+            } \
+            osr = false; \
+        } \
+    } while (0)
+
+/**
+ * Run the method and the Java methods called by it in one loop.
+ * Frames of the callees are pushed on the frame stack, and the loop returns when the method returns.
+ */
+static int interpret_method(struct vm *vm, struct method_info *current_method, struct code_attribute *current_code,
+        struct frame *prev_frame, struct class_file *current_class) {
+    u_int8_t *p, *code_end;
+    struct java_frame *current, *entry, *caller, *callee;
+    struct frame *current_frame;
+    struct method_profile *profile, *profiled; // profiled is NULL unless branches and receivers are profiled
+    bool osr; // whether the frame runs the original code which may be replaced by the optimized code
+    int32_t *locals, *sp, tos;
+
+    int cp_index;
+    int opcode, operand1, operand2, stack_unit, offset;
+    bool branch;
+    char buf[1024];
+    struct field_info *field;
+    struct method_info *method2;
+    struct code_attribute *code2;
+    struct class_file *class2;
+    int instance_index;
+    struct class_instance *instance;
+    struct cp_cache_entry *resolved;
+    int *field_slot;
+    // callees are not inlined while calls of each method are counted or hooked
+    bool inlining = vm->inline_max_depth > 0 && vm->exec == interpret_method && vm->stats == NULL
+                    && !vm->perf.enabled;
+
+    current_code = get_tiered_code(vm, current_method, current_class, inlining);
+    if (current_code == NULL) {
+        return 1;
+    }
+    entry = push_java_frame(vm, current_method, current_code, current_class, prev_frame);
+    if (entry == NULL) {
+        return 1;
+    }
+    ENTER_FRAME(entry, entry->code);
+
+    // interpret code
+    while (p < code_end || current != entry) {
+        if (p >= code_end) {
+            // a callee without return instruction at the end
+            caller = current->prev;
+            pop_java_frame(vm, current);
+            ENTER_FRAME(caller, caller->return_pc);
+            continue;
+        }
+        current->pc = p;
+        if (vm->stats != NULL) {
+            vm->executed_bytecodes++;
+            vm->stats->opcodes[*p]++;
+        }
+        if (*p == 0x01) {
+            // aconst_null
+            p++;
+            TRACE(vm, "aconst_null\n");
+            PUSH(REFERENCE_NULL);
+        } else if (*p == 0x02) {
+            // iconst_m1
+            p++;
+            TRACE(vm, "iconst_m1\n");
+            PUSH(-1);
+        } else if (*p == 0x03) {
+            // iconst_0
+            p++;
+            TRACE(vm, "iconst_0\n");
+            PUSH(0);
+        } else if (*p == 0x04) {
+            // iconst_1
+            p++;
+            TRACE(vm, "iconst_1\n");
+            PUSH(1);
+        } else if (*p >= 0x05 && *p <= 0x08) {
+            // iconst_2, iconst_3, iconst_4, iconst_5
+            TRACE(vm, "iconst_%d\n", *p - 0x03);
+            PUSH(*p - 0x03);
+            p++;
+        } else if (*p == 0x10) {
+            // bipush
+            // the byte is sign-extended
+            p++;
+            TRACE(vm, "bipush %d\n", (int8_t) *p);
+            PUSH((int8_t) *p);
+            p++;
+        } else if (*p == 0x11) {
+            // sipush
+            operand1 = (int16_t) ((p[1] << 8) | p[2]);
+            p += 3;
+            TRACE(vm, "sipush %d\n", operand1);
+            PUSH(operand1);
+        } else if (*p == 0x15 || *p == 0x19) {
+            // iload (0x15) or aload (0x19)
+            // references are indices of instances, so they are loaded in the same way as int
+            opcode = *p;
+            p++;
+            TRACE(vm, "%s %d\n", opcode == 0x15 ? "iload" : "aload", *p);
+            PUSH(locals[*p]);
+            p++;
+        } else if (*p >= 0x1a && *p <= 0x1d) {
+            // iload_0, iload_1, iload_2, iload_3
+            TRACE(vm, "iload_%d\n", *p - 0x1a);
+            PUSH(locals[*p - 0x1a]);
+            p++;
+        } else if (*p >= 0x2a && *p <= 0x2d) {
+            // aload_0, aload_1, aload_2, aload_3
+            TRACE(vm, "aload_%d\n", *p - 0x2a);
+            PUSH(locals[*p - 0x2a]);
+            p++;
+        } else if (*p == 0x36 || *p == 0x3a) {
+            // istore (0x36) or astore (0x3a)
+            opcode = *p;
+            p++;
+            TRACE(vm, "%s %d\n", opcode == 0x36 ? "istore" : "astore", *p);
+            POP(locals[*p]);
+            p++;
+        } else if (*p >= 0x3b && *p <= 0x3e) {
+            // istore_0, istore_1, istore_2, istore_3
+            TRACE(vm, "istore_%d\n", *p - 0x3b);
+            POP(locals[*p - 0x3b]);
+            p++;
+        } else if (*p >= 0x4b && *p <= 0x4e) {
+            // astore_0, astore_1, astore_2, astore_3
+            TRACE(vm, "astore_%d\n", *p - 0x4b);
+            POP(locals[*p - 0x4b]);
+            p++;
+        } else if (*p == 0x57) {
+            // pop
+            p++;
+            TRACE(vm, "pop\n");
+            POP(operand1);
+        } else if (*p == 0x59) {
+            // dup
+            p++;
+            TRACE(vm, "dup\n");
+
+            PUSH(tos);
+        } else if (*p == 0x60) {
+            // iadd
+            p++;
+            POP_BINARY(operand1, operand2);
+            TRACE(vm, "iadd: %d + %d\n", operand1, operand2);
+            tos = (int32_t) ((u_int32_t) operand1 + (u_int32_t) operand2);
+        } else if (*p == 0x64) {
+            // isub
+            p++;
+            POP_BINARY(operand1, operand2);
+            TRACE(vm, "isub: %d - %d\n", operand1, operand2);
+            tos = (int32_t) ((u_int32_t) operand1 - (u_int32_t) operand2);
+        } else if (*p == 0x68) {
+            // imul
+            p++;
+            POP_BINARY(operand1, operand2);
+            TRACE(vm, "imul: %d * %d\n", operand1, operand2);
+            tos = (int32_t) ((u_int32_t) operand1 * (u_int32_t) operand2);
+        } else if (*p == 0x6c || *p == 0x70) {
+            // idiv (0x6c) or irem (0x70)
+            opcode = *p;
+            p++;
+            POP_BINARY(operand1, operand2);
+            TRACE(vm, "%s: %d, %d\n", opcode == 0x6c ? "idiv" : "irem", operand1, operand2);
+            if (operand2 == 0) {
+                throw_vm_error(vm, "java/lang/ArithmeticException", "/ by zero");
+                break;
             }
-            ((struct constant_name_and_type_info *) *cp_info)->tag = tag;
-            ((struct constant_name_and_type_info *) *cp_info)->name_index = read16(main_file);
-            ((struct constant_name_and_type_info *) *cp_info)->descriptor_index = read16(main_file);
-            return 0;
-        case CONSTANT_UTF8:
-            *cp_info = (struct cp_info *) malloc(sizeof(struct constant_utf8_info));
-            if (*cp_info == NULL) {
-                fprintf(stderr, "failed to prepare CONSTANT_UTF8 cp_info\n");
-                return -1;
+            // INT_MIN / -1 overflows to INT_MIN (6.5 idiv)
+            if (operand2 == -1) {
+                tos = opcode == 0x6c ? (int32_t) (0u - (u_int32_t) operand1) : 0;
+            } else {
+                tos = opcode == 0x6c ? operand1 / operand2 : operand1 % operand2;
             }
-            ((struct constant_utf8_info *) *cp_info)->tag = tag;
-            len = read16(main_file);
-            ((struct constant_utf8_info *) *cp_info)->length = len;
-            ((struct constant_utf8_info *) *cp_info)->bytes = (u_int8_t *) malloc(len);
-            readn(((struct constant_utf8_info *) *cp_info)->bytes, len, main_file);
+        } else if (*p == 0x74) {
+            // ineg
+            p++;
+            operand1 = tos;
+            TRACE(vm, "ineg: %d\n", operand1);
+            tos = (int32_t) (0u - (u_int32_t) operand1);
+        } else if (*p == 0x84) {
+            // iinc
+            // the const is sign-extended
+            TRACE(vm, "iinc %d %d\n", p[1], (int8_t) p[2]);
+            locals[p[1]] = (int32_t) ((u_int32_t) locals[p[1]] + (int8_t) p[2]);
+            p += 3;
+        } else if ((*p >= 0x99 && *p <= 0xa4) || *p == 0xc6 || *p == 0xc7) {
+            // if<cond> (0x99 - 0x9e), if_icmp<cond> (0x9f - 0xa4), ifnull (0xc6) or ifnonnull (0xc7)
+            // the offset is from the address of the opcode
+            opcode = *p;
+            offset = (int16_t) ((p[1] << 8) | p[2]);
+            POP(operand2);
+            if (opcode >= 0x9f && opcode <= 0xa4) {
+                POP(operand1);
+            } else {
+                operand1 = operand2;
+                operand2 = opcode >= 0xc6 ? REFERENCE_NULL : 0;
+            }
+            switch (opcode) {
+                case 0x99: case 0x9f: case 0xc6: branch = operand1 == operand2; break;
+                case 0x9a: case 0xa0: case 0xc7: branch = operand1 != operand2; break;
+                case 0x9b: case 0xa1: branch = operand1 < operand2; break;
+                case 0x9c: case 0xa2: branch = operand1 >= operand2; break;
+                case 0x9d: case 0xa3: branch = operand1 > operand2; break;
+                default: branch = operand1 <= operand2; break;
+            }
+            TRACE(vm, "if 0x%x: %d, %d %s\n", opcode, operand1, operand2, branch ? "taken" : "not taken");
+            if (profiled != NULL) {
+                if (branch) {
+                    profiled->branches[p - current->code].taken++;
+                } else {
+                    profiled->branches[p - current->code].not_taken++;
+                }
+            }
+            p += branch ? offset : 3;
+            if (branch && offset < 0) {
+                COUNT_BACKEDGE();
+                if (SAFEPOINT_POLL(vm)) {
+                    break;
+                }
+            }
+        } else if (*p == 0xa7) {
+            // goto
+            offset = (int16_t) ((p[1] << 8) | p[2]);
+            TRACE(vm, "goto %d\n", offset);
+            p += offset;
+            if (offset < 0) {
+                COUNT_BACKEDGE();
+                if (SAFEPOINT_POLL(vm)) {
+                    break;
+                }
+            }
+        } else if (*p == 0xac || *p == 0xb0 || *p == 0xb1) {
+            // ireturn (0xac), areturn (0xb0) or return (0xb1)
+            // pop value from the current frame and push to the invoker frame
+            opcode = *p;
+            p++;
+            if (opcode != 0xb1) {
+                POP(operand1);
+                TRACE(vm, "%s %d\n", opcode == 0xac ? "ireturn" : "areturn", operand1);
+            } else {
+                TRACE(vm, "return\n");
+            }
+            if (current == entry) {
+                if (opcode != 0xb1) {
+                    push_operand_stack((int32_t) operand1, prev_frame);
+                }
+                break;
+            }
+            caller = current->prev;
+            pop_java_frame(vm, current);
+            ENTER_FRAME(caller, caller->return_pc);
+            if (opcode != 0xb1) {
+                PUSH(operand1);
+            }
+            if (SAFEPOINT_POLL(vm)) {
+                break;
+            }
+        } else if (*p == 0xb2 || *p == 0xb3) {
+            // 0xb2: getstatic
+            // 0xb3: putstatic
+            opcode = *p;
+            p++;
+            cp_index = *p;
+            p++;
+            cp_index = (cp_index << 8) | *p;
+            p++;
+
+            if (opcode == 0xb2) {
+                TRACE(vm, "getstatic %d\n", cp_index);
+            } else {
+                TRACE(vm, "putstatic %d\n", cp_index);
+            }
+
+            resolved = resolve_field(vm, cp_index, current_class);
+            if (resolved == NULL) {
+                vm->status = 1;
+                break;
+            }
+            field = resolved->field;
+
+            if (opcode == 0xb2) {
+                // getstatic
+                PUSH(*(field->data));
+            } else {
+                // putstatic
+                POP(operand1);
+                *(field->data) = operand1;
+            }
+        } else if (*p == 0xb4 || *p == 0xb5) {
+            // getfield (0xb4) or putfield (0xb5)
+            opcode = *p;
+            p++;
+            cp_index = *p;
+            p++;
+            cp_index = (cp_index << 8) | *p;
+            p++;
+            if (opcode == 0xb4) {
+                TRACE(vm, "getfield %d\n", cp_index);
+            } else {
+                TRACE(vm, "putfield %d\n", cp_index);
+            }
+
+            // field is expected to belong to current_class (6.5 putfield)
+            resolved = resolve_field(vm, cp_index, current_class);
+            if (resolved == NULL) {
+                vm->status = 1;
+                break;
+            }
+            get_field_descriptor(buf, resolved->field, resolved->class);
+            stack_unit = get_operand_stack_units(buf[0]);
+
+            // TODO: handle types other than int
+            if (stack_unit != 1) {
+                fprintf(stderr, "not implemented for stack_unit other than 1\n");
+                vm->status = 1;
+                break;
+            }
+
+            if (opcode == 0xb4) {
+                // getfield
+                operand1 = tos; // objectref, replaced with the value
+
+                instance = get_instance(vm, operand1);
+                if (instance == NULL) {
+                    fprintf(stderr, "failed to get_instance\n");
+                    vm->status = 1;
+                    break;
+                }
+
+                field_slot = get_instance_field_slot(instance, resolved);
+                if (field_slot == NULL) {
+                    fprintf(stderr, "failed to get field\n");
+                    vm->status = 1;
+                    break;
+                }
+                tos = *field_slot;
+            } else {
+                // putfield
+                POP(operand1); // value
+                POP(operand2); // objectref
+
+                instance = get_instance(vm, operand2);
+                if (instance == NULL) {
+                    fprintf(stderr, "failed to get_instance\n");
+                    vm->status = 1;
+                    break;
+                }
+
+                field_slot = get_instance_field_slot(instance, resolved);
+                if (field_slot == NULL) {
+                    fprintf(stderr, "failed to put field\n");
+                    vm->status = 1;
+                    break;
+                }
+                *field_slot = operand1;
+            }
+        } else if (*p == 0xb6 || *p == 0xb7 || *p == 0xb8) {
+            // invokevirtual (0xb6), invokespecial (0xb7) or invokestatic (0xb8)
+            // TODO: follow spec (what should be checked respectively?)
+            opcode = *p;
+            p++;
+            cp_index = *p;
+            p++;
+            cp_index = (cp_index << 8) | *p;
+            p++;
+            if (opcode == 0xb6) {
+                TRACE(vm, "invokevirtual %d\n", cp_index);
+            } else if (opcode == 0xb7) {
+                TRACE(vm, "invokespecial %d\n", cp_index);
+            } else {
+                TRACE(vm, "invokestatic %d\n", cp_index);
+            }
+
+            resolved = resolve_method(vm, cp_index, current_class);
+            if (resolved == NULL) {
+                vm->status = 1;
+                break;
+            }
+            method2 = resolved->method;
+            class2 = resolved->class;
+
+            if (opcode == 0xb8 && !is_static_method(method2)) {
+                fprintf(stderr, "this is not static method\n");
+                vm->status = 1;
+                break;
+            }
+
+            STORE_FRAME();
+            if (profiled != NULL && opcode == 0xb6) {
+                // the receiver is under the arguments
+                stack_unit = get_arg_units(method2, class2);
+                if (stack_unit > 0 && stack_unit <= current_frame->stack_i) {
+                    profile_receiver(vm, profiled, current->pc - current->code,
+                                     current_frame->stack[current_frame->stack_i - stack_unit]);
+                }
+            }
+            if (is_native_method(method2)) {
+                vm->status = exec_native_method(vm, method2, current_frame, class2);
+            } else if (vm->exec == interpret_method) {
+                // call in this loop
+                code2 = get_tiered_code(vm, method2, class2, inlining);
+                if (code2 == NULL) {
+                    fprintf(stderr, "not found code\n");
+                    vm->status = 1;
+                    break;
+                }
+                current->return_pc = p;
+                callee = push_java_frame(vm, method2, code2, class2, current_frame);
+                if (callee == NULL) {
+                    vm->status = 1;
+                    break;
+                }
+                ENTER_FRAME(callee, callee->code);
+                continue;
+            } else {
+                // entries and hooks of methods are run by a call of exec_method for each method,
+                // and the invocation is counted there
+                code2 = get_code(method2, class2);
+                if (code2 == NULL) {
+                    fprintf(stderr, "not found code\n");
+                    vm->status = 1;
+                    break;
+                }
+                vm->status = exec_method(vm, method2, code2, current_frame, class2);
+            }
+            if (vm->status != 0) {
+                break;
+            }
+            LOAD_FRAME();
+        } else if (*p == 0xbb) {
+            // new
+            p++;
+            cp_index = *p;
+            p++;
+            cp_index = (cp_index << 8) | *p;
+            p++;
+            TRACE(vm, "new %d\n", cp_index);
+
+            // get class from constant pool
+            resolved = resolve_class(vm, cp_index, current_class);
+            if (resolved == NULL) {
+                vm->status = 1;
+                break;
+            }
+
+            // create instance
+            instance_index = create_instance(vm, find_cp_class(cp_index, current_class), resolved->class);
+            if (instance_index < 0) {
+                fprintf(stderr, "failed to create instance\n");
+                vm->status = 1;
+                break;
+            }
+
+            // push reference to operand stack
+            PUSH(instance_index);
+        } else {
+            fprintf(stderr, "unknown inst\n");
+            vm->status = 1;
+            break;
+        }
+    }
+    (void) SAFEPOINT_POLL(vm);
+
+    // frames of callees are left when failed
+    while (current != entry) {
+        caller = current->prev;
+        pop_java_frame(vm, current);
+        current = caller;
+    }
+    pop_java_frame(vm, entry);
+    return vm->status;
+}
+
+// calls of exec_method nested on the native stack, each with a frame of the interpreter (about a few KB)
+#define MAX_NESTED_CALLS 1024
+
+static int exec_method(struct vm *vm, struct method_info *current_method, struct code_attribute *current_code,
+        struct frame *prev_frame, struct class_file *current_class) {
+    int retval;
+
+    // Java calls nest here while entries or hooks of methods are enabled, or natives call Java methods,
+    // so the native stack overflows before the frame stack unless the nesting is limited
+    if (vm->nested_calls >= MAX_NESTED_CALLS) {
+        throw_vm_error(vm, "java/lang/StackOverflowError", "too many nested calls");
+        return 1;
+    }
+    vm->nested_calls++;
+    retval = vm->exec(vm, current_method, current_code, prev_frame, current_class);
+    vm->nested_calls--;
+    return retval;
+}
+
+// Enter the interpreter through the entry of the method, so that it is seen by native profilers.
+static int exec_mapped_method(struct vm *vm, struct method_info *current_method, struct code_attribute *current_code,
+        struct frame *prev_frame, struct class_file *current_class) {
+    method_entry entry;
+
+    entry = current_method->entry != NULL ? (method_entry) current_method->entry
+                                          : create_method_entry(vm->perf_map, current_method);
+    if (entry != NULL) {
+        return entry(vm, current_method, current_code, prev_frame, current_class);
+    }
+    return interpret_method(vm, current_method, current_code, prev_frame, current_class);
+}
+
+//
+// Agent
+//
+
+// Hooks of method entry and exit are installed by replacing the dispatch of Java methods (vm->exec),
+// so the interpreter runs without any check of them unless they are registered.
+// Other events are rare enough to be checked where they happen.
+
+static int exec_hooked_method(struct vm *vm, struct method_info *current_method, struct code_attribute *current_code,
+        struct frame *prev_frame, struct class_file *current_class) {
+    int retval;
+
+    if (vm->agent.method_entry != NULL) {
+        vm->agent.method_entry(vm, (jmethodID) current_method);
+    }
+    if (vm->perf_map != NULL) {
+        retval = exec_mapped_method(vm, current_method, current_code, prev_frame, current_class);
+    } else {
+        retval = interpret_method(vm, current_method, current_code, prev_frame, current_class);
+    }
+    if (vm->agent.method_exit != NULL) {
+        vm->agent.method_exit(vm, (jmethodID) current_method, retval);
+    }
+    return retval;
+}
+
+/**
+ * Choose the cheapest dispatch of Java methods serving enabled features.
+ */
+static void update_method_dispatch(struct vm *vm) {
+    if (vm->agent.method_entry != NULL || vm->agent.method_exit != NULL) {
+        vm->exec = exec_hooked_method;
+    } else if (vm->perf_map != NULL) {
+        vm->exec = exec_mapped_method;
+    } else {
+        vm->exec = interpret_method;
+    }
+}
+
+/**
+ * Replace char a in str to char b.
+ */
+static void strreplace(char *str, size_t len, char a, char b) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (str[i] == a) {
+            str[i] = b;
+        }
+    }
+}
+
+static void generate_native_method_name(char *native_method_name, char *class_name, char *method_name) {
+    char *replaced_class_name;
+    int class_name_len = strlen(class_name);
+
+    replaced_class_name = malloc(class_name_len + 1);
+    strcpy(replaced_class_name, class_name);
+
+    strreplace(replaced_class_name, class_name_len, '/', '_');
+    sprintf(native_method_name, "Java_%s_%s", replaced_class_name, method_name);
+
+    free(replaced_class_name);
+}
+
+//
+// Native Method Call
+//
+
+// Natives are called by placing arguments directly into registers (and stack slots) following the calling
+// convention, so every combination of argument types is handled by one call per return type.
+// Integral types and references go to integer registers, float and double go to floating-point registers.
+// The rest go to stack slots of 8 bytes in the order of arguments.
+#if defined(__x86_64__) && !defined(_WIN32)
+#define NATIVE_INT_REGS 6
+#define NATIVE_CALL_SUPPORTED
+#elif defined(__aarch64__) && !defined(__APPLE__)
+#define NATIVE_INT_REGS 8
+#define NATIVE_CALL_SUPPORTED
+#else
+#define NATIVE_INT_REGS 8
+#endif
+#define NATIVE_FP_REGS 8
+#define NATIVE_STACK_SLOTS 8
+
+// where an argument is placed
+#define NATIVE_LOC_INT 0
+#define NATIVE_LOC_FP 1
+#define NATIVE_LOC_STACK 2
+
+struct native_arg {
+    char type;      // descriptor of the argument
+    u_int8_t loc;   // NATIVE_LOC_*
+    u_int8_t index; // index of register or stack slot
+    u_int16_t unit; // offset from the first argument in operand stack
+};
+
+// Marshalling stub of a native method, prepared from the method descriptor when it is bound
+struct native_stub {
+    void *fn;
+    bool critical;
+    bool is_static;
+    char ret;
+    int units; // operand stack units of arguments including 'this'
+    int arg_num;
+    struct native_arg args[NATIVE_INT_REGS + NATIVE_FP_REGS + NATIVE_STACK_SLOTS];
+};
+
+struct native_regs {
+    int64_t g[NATIVE_INT_REGS];
+    double f[NATIVE_FP_REGS];
+    int64_t s[NATIVE_STACK_SLOTS];
+};
+
+#if NATIVE_INT_REGS == 6
+#define NATIVE_INT_PARAMS int64_t, int64_t, int64_t, int64_t, int64_t, int64_t
+#define NATIVE_INT_ARGS(r) (r).g[0], (r).g[1], (r).g[2], (r).g[3], (r).g[4], (r).g[5]
+#else
+#define NATIVE_INT_PARAMS int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t
+#define NATIVE_INT_ARGS(r) (r).g[0], (r).g[1], (r).g[2], (r).g[3], (r).g[4], (r).g[5], (r).g[6], (r).g[7]
+#endif
+#define NATIVE_PARAMS NATIVE_INT_PARAMS, \
+    double, double, double, double, double, double, double, double, \
+    int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t
+#define NATIVE_ARGS(r) NATIVE_INT_ARGS(r), \
+    (r).f[0], (r).f[1], (r).f[2], (r).f[3], (r).f[4], (r).f[5], (r).f[6], (r).f[7], \
+    (r).s[0], (r).s[1], (r).s[2], (r).s[3], (r).s[4], (r).s[5], (r).s[6], (r).s[7]
+
+typedef int64_t (*native_int_func)(NATIVE_PARAMS);
+typedef float (*native_float_func)(NATIVE_PARAMS);
+typedef double (*native_double_func)(NATIVE_PARAMS);
+
+/**
+ * Prepare native_stub of the method bound to fn.
+ * Return NULL if the method cannot be called.
+ */
+static struct native_stub *prepare_native_stub(void *fn, int critical, struct method_info *method, struct class_file *class) {
+    struct method_descriptor descriptor;
+    struct native_stub *stub;
+    struct native_arg *arg;
+    int i, int_i, fp_i, stack_i, unit;
+
+#ifndef NATIVE_CALL_SUPPORTED
+    fprintf(stderr, "native method call is not supported on this platform\n");
+    return NULL;
+#endif
+
+    if (get_method_descriptor(&descriptor, method, class) != 0) {
+        return NULL;
+    }
+
+    stub = calloc(1, sizeof(struct native_stub));
+    if (stub == NULL) {
+        return NULL;
+    }
+    stub->fn = fn;
+    stub->is_static = is_static_method(method);
+    // critical natives are allowed only for static methods
+    stub->critical = critical && stub->is_static;
+    stub->ret = descriptor.ret;
+
+    // JNIEnv and jclass (or this)
+    int_i = stub->critical ? 0 : 2;
+    fp_i = 0;
+    stack_i = 0;
+    unit = stub->is_static ? 0 : 1;
+
+    for (i = 0; i < descriptor.num; i++) {
+        arg = &stub->args[i];
+        arg->type = descriptor.args[i];
+        arg->unit = unit;
+        unit += get_operand_stack_units(arg->type);
+
+        if ((arg->type == 'F' || arg->type == 'D') && fp_i < NATIVE_FP_REGS) {
+            arg->loc = NATIVE_LOC_FP;
+            arg->index = fp_i++;
+        } else if (arg->type != 'F' && arg->type != 'D' && int_i < NATIVE_INT_REGS) {
+            arg->loc = NATIVE_LOC_INT;
+            arg->index = int_i++;
+        } else if (stack_i < NATIVE_STACK_SLOTS) {
+            arg->loc = NATIVE_LOC_STACK;
+            arg->index = stack_i++;
+        } else {
+            fprintf(stderr, "too many arguments for native method\n");
+            free(stub);
+            return NULL;
+        }
+    }
+    stub->arg_num = descriptor.num;
+    stub->units = unit;
+
+    return stub;
+}
+
+/**
+ * Call native method with arguments on the operand stack and push the return value.
+ */
+static int call_native_method(struct native_stub *stub, struct frame *frame, struct class_file *class, struct native_loader *loader) {
+    struct native_regs regs;
+    struct native_arg *arg;
+    int32_t *base;
+    int64_t value;
+    union {
+        double d;
+        float f;
+        int32_t i;
+        int64_t j;
+    } fp;
+    int i;
+
+    if (frame->stack_i < stub->units) {
+        fprintf(stderr, "operand stack underflow at native method call\n");
+        return -1;
+    }
+    base = &frame->stack[frame->stack_i - stub->units];
+
+    if (!stub->critical) {
+        regs.g[0] = (int64_t) (intptr_t) &loader->env;
+        regs.g[1] = stub->is_static ? (int64_t) (intptr_t) class : (int64_t) (intptr_t) TO_JOBJECT(base[0]);
+    }
+
+    for (i = 0; i < stub->arg_num; i++) {
+        arg = &stub->args[i];
+        switch (arg->type) {
+            case 'Z':
+                value = (jboolean) base[arg->unit];
+                break;
+            case 'B':
+                value = (jbyte) base[arg->unit];
+                break;
+            case 'C':
+                value = (jchar) base[arg->unit];
+                break;
+            case 'S':
+                value = (jshort) base[arg->unit];
+                break;
+            case 'I':
+                value = base[arg->unit];
+                break;
+            case 'J':
+                memcpy(&value, &base[arg->unit], sizeof(int64_t));
+                break;
+            case 'F':
+                // float is passed in the lower bits
+                fp.j = 0;
+                memcpy(&fp.f, &base[arg->unit], sizeof(float));
+                value = fp.j;
+                break;
+            case 'D':
+                memcpy(&value, &base[arg->unit], sizeof(double));
+                break;
+            default:
+                value = (int64_t) (intptr_t) TO_JOBJECT(base[arg->unit]);
+                break;
+        }
+
+        if (arg->loc == NATIVE_LOC_INT) {
+            regs.g[arg->index] = value;
+        } else if (arg->loc == NATIVE_LOC_FP) {
+            fp.j = value;
+            regs.f[arg->index] = fp.d;
+        } else {
+            regs.s[arg->index] = value;
+        }
+    }
+    frame->stack_i -= stub->units;
+
+    switch (stub->ret) {
+        case 'V':
+            ((native_int_func) stub->fn)(NATIVE_ARGS(regs));
             return 0;
-        case CONSTANT_METHOD_HANDLE:
-            fprintf(stderr, "not yet implemented cp_info: CONSTANT_METHOD_HANDLE\n");
-            return -1;
-        case CONSTANT_METHOD_TYPE:
-            fprintf(stderr, "not yet implemented cp_info: CONSTANT_METHOD_TYPE\n");
-            return -1;
-        case CONSTANT_INVOKE_DYNAMIC:
-            fprintf(stderr, "not yet implemented cp_info: CONSTANT_INVOKE_DYNAMIC\n");
-            return -1;
+        case 'Z':
+            return push_operand_stack((jboolean) ((native_int_func) stub->fn)(NATIVE_ARGS(regs)), frame);
+        case 'B':
+            return push_operand_stack((jbyte) ((native_int_func) stub->fn)(NATIVE_ARGS(regs)), frame);
+        case 'C':
+            return push_operand_stack((jchar) ((native_int_func) stub->fn)(NATIVE_ARGS(regs)), frame);
+        case 'S':
+            return push_operand_stack((jshort) ((native_int_func) stub->fn)(NATIVE_ARGS(regs)), frame);
+        case 'I':
+            return push_operand_stack((jint) ((native_int_func) stub->fn)(NATIVE_ARGS(regs)), frame);
+        case 'J':
+            return push_operand_stack_long(((native_int_func) stub->fn)(NATIVE_ARGS(regs)), frame);
+        case 'F':
+            fp.f = ((native_float_func) stub->fn)(NATIVE_ARGS(regs));
+            return push_operand_stack(fp.i, frame);
+        case 'D':
+            fp.d = ((native_double_func) stub->fn)(NATIVE_ARGS(regs));
+            return push_operand_stack_long(fp.j, frame);
         default:
-            fprintf(stderr, "unexpected tag: %d\n", tag);
+            value = ((native_int_func) stub->fn)(NATIVE_ARGS(regs));
+            return push_operand_stack(FROM_JOBJECT((jobject) (intptr_t) value), frame);
+    }
+}
+
+/**
+ * Find native function named like Java_<class>_<method> (or JavaCritical_<class>_<method>) in handler.
+ */
+static void *find_native_symbol(void *handler, char *class_name, char *method_name, int *critical) {
+    char native_method_name[1024], critical_method_name[1024];
+    void *fn;
+
+    generate_native_method_name(native_method_name, class_name, method_name);
+    fn = dlsym(handler, native_method_name);
+    if (fn != NULL) {
+        *critical = 0;
+        return fn;
+    }
+
+    snprintf(critical_method_name, sizeof(critical_method_name), "JavaCritical_%s",
+             native_method_name + strlen("Java_"));
+    fn = dlsym(handler, critical_method_name);
+    if (fn != NULL) {
+        *critical = 1;
+        return fn;
+    }
+
+    return NULL;
+}
+
+/**
+ * Find the function of the native method and prepare how to call it.
+ * Explicitly registered natives are searched first, then loaded libraries, and then the program itself.
+ * The result is cached in method->native_func and method->native_stub.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int bind_native_method(struct method_info *method, struct class_file *class, struct native_loader *loader) {
+    struct constant_utf8_info *cp_utf8;
+    struct constant_class_info *cp_class;
+    struct registered_native *entry;
+    char method_name[1024], class_name[1024], descriptor[1024];
+    void *fn = NULL;
+    int i, critical = 0;
+
+    cp_utf8 = find_cp_utf8(method->name_index, class);
+    read_utf8(method_name, cp_utf8);
+
+    cp_utf8 = find_cp_utf8(method->descriptor_index, class);
+    read_utf8(descriptor, cp_utf8);
+
+    cp_class = find_cp_class(class->this_class, class);
+    cp_utf8 = find_cp_utf8(cp_class->name_index, class);
+    read_utf8(class_name, cp_utf8);
+
+    // search from the last one so that natives can be re-registered
+    for (i = loader->registered_num - 1; i >= 0 && fn == NULL; i--) {
+        entry = &loader->registered[i];
+        if (strcmp(entry->class_name, class_name) == 0 && strcmp(entry->name, method_name) == 0
+                && (entry->signature == NULL || strcmp(entry->signature, descriptor) == 0)) {
+            fn = entry->fn_ptr;
+            critical = entry->critical;
+        }
+    }
+
+    for (i = 0; i < loader->library_num && fn == NULL; i++) {
+        fn = find_native_symbol(loader->libraries[i], class_name, method_name, &critical);
+    }
+
+    // natives linked into the program
+    if (fn == NULL) {
+        fn = find_native_symbol(RTLD_DEFAULT, class_name, method_name, &critical);
+    }
+
+    if (fn == NULL) {
+        fprintf(stderr, "not found native method: %s.%s\n", class_name, method_name);
+        return -1;
+    }
+
+    TRACE(loader->env.vm, "bind native method: %s.%s%s%s\n", class_name, method_name, descriptor,
+          critical ? " (critical)" : "");
+
+    method->native_stub = prepare_native_stub(fn, critical, method, class);
+    if (method->native_stub == NULL) {
+        fprintf(stderr, "failed to prepare native method: %s.%s\n", class_name, method_name);
+        return -1;
+    }
+    method->native_func = fn;
+
+    return 0;
+}
+
+static int exec_native_method(struct vm *vm, struct method_info *method, struct frame *frame, struct class_file *class) {
+    u_int64_t start;
+    char method_name[1024];
+
+    if (vm->stats != NULL) {
+        vm->stats->native_calls++;
+    }
+    if (method->native_stub == NULL) {
+        start = vm->recorder != NULL ? get_monotonic_time() : 0;
+        if (bind_native_method(method, class, &vm->native_loader) != 0) {
+            vm->status = 1;
+            return vm->status;
+        }
+        if (vm->recorder != NULL) {
+            get_method_name(method_name, method, class);
+            record_event(vm->recorder, RECORD_NATIVE_BIND, start, 0, method_name);
+        }
+    }
+
+    if (call_native_method(method->native_stub, frame, class, &vm->native_loader) != 0) {
+        vm->status = 1;
+    }
+
+    return vm->status;
+}
+
+//
+// JNI
+//
+
+#define JNI_VM(env) (((struct jni_env *) (env))->vm)
+
+/**
+ * Call method with arguments from native code.
+ * obj is ignored for static methods.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int invoke_method(struct vm *vm, struct method_info *method, jobject obj, const jvalue *args, jvalue *result) {
+    struct method_descriptor descriptor;
+    struct code_attribute *code;
+    struct frame *frame;
+    union {
+        float f;
+        int32_t i;
+        double d;
+        int64_t j;
+    } v;
+    int i, retval;
+
+    if (method == NULL || get_method_descriptor(&descriptor, method, method->class) != 0) {
+        return -1;
+    }
+
+    // 'this', arguments and the return value
+    frame = initialize_frame(1 + descriptor.units + 2, 0);
+    if (frame == NULL) {
+        return -1;
+    }
+
+    if (!is_static_method(method)) {
+        push_operand_stack(FROM_JOBJECT(obj), frame);
+    }
+    for (i = 0; i < descriptor.num; i++) {
+        switch (descriptor.args[i]) {
+            case 'Z':
+                push_operand_stack(args[i].z, frame);
+                break;
+            case 'B':
+                push_operand_stack(args[i].b, frame);
+                break;
+            case 'C':
+                push_operand_stack(args[i].c, frame);
+                break;
+            case 'S':
+                push_operand_stack(args[i].s, frame);
+                break;
+            case 'I':
+                push_operand_stack(args[i].i, frame);
+                break;
+            case 'J':
+                push_operand_stack_long(args[i].j, frame);
+                break;
+            case 'F':
+                v.f = args[i].f;
+                push_operand_stack(v.i, frame);
+                break;
+            case 'D':
+                v.d = args[i].d;
+                push_operand_stack_long(v.j, frame);
+                break;
+            default:
+                push_operand_stack(FROM_JOBJECT(args[i].l), frame);
+                break;
+        }
+    }
+
+    if (is_native_method(method)) {
+        retval = exec_native_method(vm, method, frame, method->class);
+    } else {
+        code = get_code(method, method->class);
+        if (code == NULL) {
+            fprintf(stderr, "not found code\n");
+            free_frame(frame);
             return -1;
+        }
+        retval = exec_method(vm, method, code, frame, method->class);
+    }
+
+    if (retval == 0 && result != NULL) {
+        switch (descriptor.ret) {
+            case 'V':
+                break;
+            case 'J':
+                pop_operand_stack_long(&result->j, frame);
+                break;
+            case 'D':
+                pop_operand_stack_long(&v.j, frame);
+                result->d = v.d;
+                break;
+            case 'F':
+                pop_operand_stack(&v.i, frame);
+                result->f = v.f;
+                break;
+            case 'L':
+            case '[':
+                pop_operand_stack(&v.i, frame);
+                result->l = TO_JOBJECT(v.i);
+                break;
+            default:
+                pop_operand_stack(&v.i, frame);
+                result->i = v.i;
+                break;
+        }
+    }
+
+    free_frame(frame);
+    return retval == 0 ? 0 : -1;
+}
+
+/**
+ * Read variable arguments of Call<type>Method into args.
+ */
+static void read_jni_varargs(jvalue *args, struct method_info *method, va_list ap) {
+    struct method_descriptor descriptor;
+    int i;
+
+    if (get_method_descriptor(&descriptor, method, method->class) != 0) {
+        return;
+    }
+    for (i = 0; i < descriptor.num; i++) {
+        switch (descriptor.args[i]) {
+            case 'Z':
+            case 'B':
+            case 'C':
+            case 'S':
+            case 'I':
+                args[i].i = va_arg(ap, jint);
+                break;
+            case 'J':
+                args[i].j = va_arg(ap, jlong);
+                break;
+            case 'F':
+                args[i].f = (jfloat) va_arg(ap, jdouble);
+                break;
+            case 'D':
+                args[i].d = va_arg(ap, jdouble);
+                break;
+            default:
+                args[i].l = va_arg(ap, jobject);
+                break;
+        }
     }
 }
 
-int parse_attribute(struct attribute_info **attr, struct class_file *main_class, FILE *main_file) {
-    struct constant_utf8_info *cp;
-    u_int16_t attr_name_index;
-    u_int32_t attr_length;
-    char attr_name[1024]; // FIXME: there is no limit in spec?
-    int attr_len;
+static jclass JNICALL jni_find_class(JNIEnv *env, const char *name) {
+    struct class_file *class = get_class(&JNI_VM(env)->loader, (char *) name);
+
+    return class != NULL && !class->initialization_failed ? (jclass) class : NULL;
+}
+
+static jclass JNICALL jni_get_object_class(JNIEnv *env, jobject obj) {
+    struct class_instance *instance = get_instance(JNI_VM(env), FROM_JOBJECT(obj));
+    return instance == NULL ? NULL : (jclass) instance->class;
+}
+
+static jobject JNICALL jni_new_object_a(JNIEnv *env, jclass clazz, jmethodID methodID, const jvalue *args) {
+    int ref = create_instance(JNI_VM(env), NULL, (struct class_file *) clazz);
+    if (ref < 0) {
+        return NULL;
+    }
+    if (invoke_method(JNI_VM(env), (struct method_info *) methodID, TO_JOBJECT(ref), args, NULL) != 0) {
+        return NULL;
+    }
+    return TO_JOBJECT(ref);
+}
+
+static jobject JNICALL jni_new_object(JNIEnv *env, jclass clazz, jmethodID methodID, ...) {
+    jvalue args[MAX_METHOD_ARGS];
+    va_list ap;
+
+    va_start(ap, methodID);
+    read_jni_varargs(args, (struct method_info *) methodID, ap);
+    va_end(ap);
+    return jni_new_object_a(env, clazz, methodID, args);
+}
+
+static jmethodID JNICALL jni_get_method_id(JNIEnv *env, jclass clazz, const char *name, const char *sig) {
+    return (jmethodID) find_method_by_descriptor((char *) name, (char *) sig, (struct class_file *) clazz);
+}
+
+#define DEFINE_JNI_CALL_METHOD(jtype, member, name_a, name) \
+    static jtype JNICALL name_a(JNIEnv *env, jobject obj, jmethodID methodID, const jvalue *args) { \
+        jvalue result; \
+        result.j = 0; \
+        invoke_method(JNI_VM(env), (struct method_info *) methodID, obj, args, &result); \
+        return result.member; \
+    } \
+    static jtype JNICALL name(JNIEnv *env, jobject obj, jmethodID methodID, ...) { \
+        jvalue args[MAX_METHOD_ARGS]; \
+        va_list ap; \
+        va_start(ap, methodID); \
+        read_jni_varargs(args, (struct method_info *) methodID, ap); \
+        va_end(ap); \
+        return name_a(env, obj, methodID, args); \
+    }
+
+DEFINE_JNI_CALL_METHOD(jobject, l, jni_call_object_method_a, jni_call_object_method)
+DEFINE_JNI_CALL_METHOD(jint, i, jni_call_int_method_a, jni_call_int_method)
+
+static void JNICALL jni_call_void_method_a(JNIEnv *env, jobject obj, jmethodID methodID, const jvalue *args) {
+    invoke_method(JNI_VM(env), (struct method_info *) methodID, obj, args, NULL);
+}
+
+static void JNICALL jni_call_void_method(JNIEnv *env, jobject obj, jmethodID methodID, ...) {
+    jvalue args[MAX_METHOD_ARGS];
+    va_list ap;
+
+    va_start(ap, methodID);
+    read_jni_varargs(args, (struct method_info *) methodID, ap);
+    va_end(ap);
+    jni_call_void_method_a(env, obj, methodID, args);
+}
+
+static jfieldID JNICALL jni_get_field_id(JNIEnv *env, jclass clazz, const char *name, const char *sig) {
+    return (jfieldID) find_field_by_descriptor((char *) name, (char *) sig, (struct class_file *) clazz);
+}
+
+static jobject JNICALL jni_get_object_field(JNIEnv *env, jobject obj, jfieldID fieldID) {
+    int *data = get_instance_field_data(get_instance(JNI_VM(env), FROM_JOBJECT(obj)), (struct field_info *) fieldID);
+    return data == NULL ? NULL : TO_JOBJECT(*data);
+}
+
+static jint JNICALL jni_get_int_field(JNIEnv *env, jobject obj, jfieldID fieldID) {
+    int *data = get_instance_field_data(get_instance(JNI_VM(env), FROM_JOBJECT(obj)), (struct field_info *) fieldID);
+    return data == NULL ? 0 : *data;
+}
+
+static void JNICALL jni_set_object_field(JNIEnv *env, jobject obj, jfieldID fieldID, jobject val) {
+    int *data = get_instance_field_data(get_instance(JNI_VM(env), FROM_JOBJECT(obj)), (struct field_info *) fieldID);
+    if (data != NULL) {
+        *data = FROM_JOBJECT(val);
+    }
+}
+
+static void JNICALL jni_set_int_field(JNIEnv *env, jobject obj, jfieldID fieldID, jint val) {
+    int *data = get_instance_field_data(get_instance(JNI_VM(env), FROM_JOBJECT(obj)), (struct field_info *) fieldID);
+    if (data != NULL) {
+        *data = val;
+    }
+}
+
+static jmethodID JNICALL jni_get_static_method_id(JNIEnv *env, jclass clazz, const char *name, const char *sig) {
+    struct method_info *method = find_method_by_descriptor((char *) name, (char *) sig, (struct class_file *) clazz);
+    return (method != NULL && is_static_method(method)) ? (jmethodID) method : NULL;
+}
+
+#define DEFINE_JNI_CALL_STATIC_METHOD(jtype, member, name_a, name) \
+    static jtype JNICALL name_a(JNIEnv *env, jclass clazz, jmethodID methodID, const jvalue *args) { \
+        jvalue result; \
+        result.j = 0; \
+        invoke_method(JNI_VM(env), (struct method_info *) methodID, NULL, args, &result); \
+        return result.member; \
+    } \
+    static jtype JNICALL name(JNIEnv *env, jclass clazz, jmethodID methodID, ...) { \
+        jvalue args[MAX_METHOD_ARGS]; \
+        va_list ap; \
+        va_start(ap, methodID); \
+        read_jni_varargs(args, (struct method_info *) methodID, ap); \
+        va_end(ap); \
+        return name_a(env, clazz, methodID, args); \
+    }
+
+DEFINE_JNI_CALL_STATIC_METHOD(jobject, l, jni_call_static_object_method_a, jni_call_static_object_method)
+DEFINE_JNI_CALL_STATIC_METHOD(jint, i, jni_call_static_int_method_a, jni_call_static_int_method)
+
+static void JNICALL jni_call_static_void_method_a(JNIEnv *env, jclass clazz, jmethodID methodID, const jvalue *args) {
+    invoke_method(JNI_VM(env), (struct method_info *) methodID, NULL, args, NULL);
+}
+
+static void JNICALL jni_call_static_void_method(JNIEnv *env, jclass clazz, jmethodID methodID, ...) {
+    jvalue args[MAX_METHOD_ARGS];
+    va_list ap;
+
+    va_start(ap, methodID);
+    read_jni_varargs(args, (struct method_info *) methodID, ap);
+    va_end(ap);
+    jni_call_static_void_method_a(env, clazz, methodID, args);
+}
+
+static jfieldID JNICALL jni_get_static_field_id(JNIEnv *env, jclass clazz, const char *name, const char *sig) {
+    return (jfieldID) find_field_by_descriptor((char *) name, (char *) sig, (struct class_file *) clazz);
+}
+
+static jobject JNICALL jni_get_static_object_field(JNIEnv *env, jclass clazz, jfieldID fieldID) {
+    return TO_JOBJECT(*((struct field_info *) fieldID)->data);
+}
+
+static jint JNICALL jni_get_static_int_field(JNIEnv *env, jclass clazz, jfieldID fieldID) {
+    return *((struct field_info *) fieldID)->data;
+}
+
+static void JNICALL jni_set_static_object_field(JNIEnv *env, jclass clazz, jfieldID fieldID, jobject value) {
+    *((struct field_info *) fieldID)->data = FROM_JOBJECT(value);
+}
+
+static void JNICALL jni_set_static_int_field(JNIEnv *env, jclass clazz, jfieldID fieldID, jint value) {
+    *((struct field_info *) fieldID)->data = value;
+}
+
+static jint JNICALL jni_get_java_vm(JNIEnv *env, JavaVM **vm) {
+    *vm = JNI_VM(env);
+    return JNI_OK;
+}
+
+static jint JNICALL jni_register_natives(JNIEnv *env, jclass clazz, const JNINativeMethod *methods, jint nMethods) {
+    struct class_file *class = (struct class_file *) clazz;
+    struct native_method native_method;
+    struct method_info *method;
+    char class_name[1024];
     int i;
 
-    attr_name_index = read16(main_file);
-    attr_length = read32(main_file);
+    read_utf8(class_name, get_this_class(class));
+    for (i = 0; i < nMethods; i++) {
+        native_method.name = methods[i].name;
+        native_method.signature = methods[i].signature;
+        native_method.fn_ptr = methods[i].fnPtr;
+        native_method.critical = 0;
+        if (register_natives(&JNI_VM(env)->native_loader, class_name, &native_method, 1) != 0) {
+            return JNI_ERR;
+        }
 
-    cp = (struct constant_utf8_info *) main_class->constant_pool[attr_name_index-1];
-    attr_len = read_utf8(attr_name, cp);
-    if (attr_len < 0) {
-        return -1;
+        // forget the current binding
+        method = methods[i].signature == NULL ? find_method(methods[i].name, class)
+                 : find_method_by_descriptor(methods[i].name, methods[i].signature, class);
+        if (method != NULL && method->native_stub != NULL) {
+            free(method->native_stub);
+            method->native_stub = NULL;
+            method->native_func = NULL;
+        }
     }
-    if (strncmp(attr_name, ATTR_CODE, attr_len) == 0) {
-        *attr = (struct attribute_info *) malloc(sizeof(struct code_attribute));
-        (*attr)->attribute_name_index = attr_name_index;
-        (*attr)->attribute_length = attr_length;
 
-        ATTR_CODE_INFO((*attr))->max_stack = read16(main_file);
-        ATTR_CODE_INFO((*attr))->max_locals = read16(main_file);
+    return JNI_OK;
+}
 
-        // code
-        ATTR_CODE_INFO((*attr))->code_length = read32(main_file);
-        if (ATTR_CODE_INFO((*attr))->code_length > 0) {
-            ATTR_CODE_INFO((*attr))->code = (u_int8_t *) malloc(ATTR_CODE_INFO((*attr))->code_length);
+static const struct JNINativeInterface_ jni_functions = {
+        jni_find_class,
+        jni_get_object_class,
+
+        jni_new_object,
+        jni_new_object_a,
+
+        jni_get_method_id,
+        jni_call_object_method,
+        jni_call_object_method_a,
+        jni_call_int_method,
+        jni_call_int_method_a,
+        jni_call_void_method,
+        jni_call_void_method_a,
+
+        jni_get_field_id,
+        jni_get_object_field,
+        jni_get_int_field,
+        jni_set_object_field,
+        jni_set_int_field,
+
+        jni_get_static_method_id,
+        jni_call_static_object_method,
+        jni_call_static_object_method_a,
+        jni_call_static_int_method,
+        jni_call_static_int_method_a,
+        jni_call_static_void_method,
+        jni_call_static_void_method_a,
+
+        jni_get_static_field_id,
+        jni_get_static_object_field,
+        jni_get_static_int_field,
+        jni_set_static_object_field,
+        jni_set_static_int_field,
+
+        jni_register_natives,
+
+        jni_get_java_vm,
+};
+
+/**
+ * Create a VM without any class.
+ */
+static struct vm *allocate_vm(void) {
+    pthread_mutexattr_t attr;
+    struct vm *vm = calloc(1, sizeof(struct vm));
+    if (vm == NULL) {
+        return NULL;
+    }
+
+    if (initialize_native_loader(&vm->native_loader, vm) < 0) {
+        fprintf(stderr, "failed to initialize native loader\n");
+        free(vm);
+        return NULL;
+    }
+
+    if (attach_safepoint(vm) != 0) {
+        fprintf(stderr, "failed to prepare polling page\n");
+        tear_down_native_loader(&vm->native_loader);
+        free(vm);
+        return NULL;
+    }
+    if (create_frame_stack(vm) != 0) {
+        detach_safepoint(vm);
+        tear_down_native_loader(&vm->native_loader);
+        free(vm);
+        return NULL;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&vm->running, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    initialize_class_loader(&vm->loader);
+    update_method_dispatch(vm);
+    vm->inline_max_size = INLINE_MAX_SIZE;
+    vm->inline_max_depth = INLINE_MAX_DEPTH;
+    vm->tier_profile_threshold = TIER_PROFILE_THRESHOLD;
+    vm->tier_optimize_threshold = TIER_OPTIMIZE_THRESHOLD;
+    return vm;
+}
+
+struct vm *create_vm(void) {
+    static char *stdlib_class_name[] = {"java/lang/Object.class", "java/lang/System.class"};
+    static int stdlib_class_len = (sizeof(stdlib_class_name) / sizeof (stdlib_class_name[0]));
+    int i;
+
+    struct vm *vm = allocate_vm();
+    if (vm == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < stdlib_class_len; i++) {
+        if (load_class(vm, stdlib_class_name[i]) == NULL) {
+            fprintf(stderr, "failed to load %s\n", stdlib_class_name[i]);
+            destroy_vm(vm);
+            return NULL;
         }
-        readn((ATTR_CODE_INFO((*attr)))->code, ATTR_CODE_INFO((*attr))->code_length, main_file);
+    }
 
-        // exception_table
-        ATTR_CODE_INFO((*attr))->exception_table_length = read16(main_file);
-        if (ATTR_CODE_INFO((*attr))->exception_table_length > 0) {
-            ATTR_CODE_INFO((*attr))->exception_table = calloc(
-                    ATTR_CODE_INFO((*attr))->exception_table_length,
-                    sizeof(struct exception_table_entry));
+    return vm;
+}
+
+void destroy_vm(struct vm *vm) {
+    int i, j;
+
+    // the VM never reaches a safepoint again, so operations still queued are dropped
+    detach_safepoint(vm);
+    discard_vm_operations(vm);
+
+    if (vm->agent.vm_death != NULL) {
+        vm->agent.vm_death(vm);
+    }
+
+    if (vm->allocation_profiler != NULL) {
+        print_allocation_sites(vm, vm->allocation_profiler->out);
+        if (vm->allocation_profiler->close_out) {
+            fclose(vm->allocation_profiler->out);
         }
-        for (i = 0; i < ATTR_CODE_INFO((*attr))->exception_table_length; i++) {
-            ATTR_CODE_INFO((*attr))->exception_table[i].start_pc = read16(main_file);
-            ATTR_CODE_INFO((*attr))->exception_table[i].end_pc = read16(main_file);
-            ATTR_CODE_INFO((*attr))->exception_table[i].handler_pc = read16(main_file);
-            ATTR_CODE_INFO((*attr))->exception_table[i].catch_type = read16(main_file);
+        free(vm->allocation_profiler->sites);
+        free(vm->allocation_profiler);
+    }
+
+    if (vm->recorder != NULL) {
+        timer_delete(vm->recorder->timer);
+        record_allocations(vm->recorder);
+        record_event(vm->recorder, RECORD_SHUTDOWN, get_monotonic_time(), vm->status, NULL);
+        flush_recorder(vm->recorder);
+        fclose(vm->recorder->out);
+        free(vm->recorder);
+    }
+
+    if (vm->profiler != NULL) {
+        timer_delete(vm->profiler->timer);
+        print_profile(vm, vm->profiler->out);
+        if (vm->profiler->close_out) {
+            fclose(vm->profiler->out);
+        }
+        free(vm->profiler->frames);
+        free(vm->profiler->samples);
+        free(vm->profiler);
+    }
+
+    if (vm->stats != NULL) {
+        print_stats(vm, vm->stats->out);
+        if (vm->stats->close_out) {
+            fclose(vm->stats->out);
         }
+        free(vm->stats);
+    }
 
-        // attributes
-        ATTR_CODE_INFO((*attr))->attributes_count = read16(main_file);
-        if (ATTR_CODE_INFO((*attr))->attributes_count > 0) {
-            /*
-            ATTR_CODE_INFO((*attr))->attributes = malloc(
-                    ATTR_CODE_INFO((*attr))->attributes_count * sizeof(void *));
-             */
-            ATTR_CODE_INFO((*attr))->attributes = (struct attribute_info **) calloc(
-                    ATTR_CODE_INFO((*attr))->attributes_count,
-                    sizeof(void *));
+    for (i = 0; i < vm->instance_count; i++) {
+        if (vm->instances[i] != NULL) {
+            free_instance(vm, vm->instances[i]);
         }
-        for (i = 0; i < ATTR_CODE_INFO((*attr))->attributes_count; i++) {
-            if (parse_attribute(&ATTR_CODE_INFO((*attr))->attributes[i], main_class, main_file) != 0) {
-                return -1;
+    }
+    free(vm->instances);
+    free(vm->free_slots);
+    free(vm->global_refs);
+    free(vm->heap_dump_path);
+    if (vm->perf_map != NULL) {
+        free_perf_map(vm->perf_map);
+    }
+    close_perf_counters(&vm->perf);
+    for (i = vm->loader.class_num - 1; i >= 0; i--) {
+        if (is_in_image(vm, vm->loader.classes[i])) {
+            for (j = 0; j < vm->loader.classes[i]->methods_count; j++) {
+                free_method_data(vm->loader.classes[i]->methods[j]);
             }
+            vm->loader.classes[i] = vm->loader.classes[--vm->loader.class_num];
+        }
+    }
+    tear_down_class_loader(&vm->loader);
+    tear_down_native_loader(&vm->native_loader);
+    if (vm->agent_library != NULL) {
+        dlclose(vm->agent_library);
+    }
+    destroy_frame_stack(vm);
+    if (vm->image != NULL) {
+        munmap(vm->image, vm->image_size);
+    }
+    pthread_mutex_destroy(&vm->running);
+    free(vm);
+}
+
+jclass load_class(struct vm *vm, char *file_name) {
+    struct class_file *class;
+    struct perf_values perf_start;
+    u_int64_t start, clinit_start;
+    char *name, *c, class_name[1024];
+    int retval;
+
+    // e.g. First.class -> First
+    name = malloc(strlen(file_name) + 1);
+    if (name == NULL) {
+        fprintf(stderr, "failed to malloc\n");
+        return NULL;
+    }
+    strcpy(name, file_name);
+    c = strrchr(name, '.');
+    if (c != NULL && strcmp(c, ".class") == 0) {
+        *c = '\0';
+    }
+
+    if (vm->stats != NULL) {
+        vm->stats->class_lookups++;
+    }
+    class = get_class(&vm->loader, name);
+    free(name);
+    if (class != NULL && class->initialization_failed) {
+        fprintf(stderr, "could not initialize class: %s\n", file_name);
+        return NULL;
+    }
+    if (class != NULL) {
+        return (jclass) class;
+    }
+
+    start = vm->recorder != NULL ? get_monotonic_time() : 0;
+    perf_phase_begin(&vm->perf, &perf_start);
+    class = define_class(&vm->loader, file_name, vm->trace);
+    perf_phase_end(&vm->perf, PERF_PHASE_PARSE, &perf_start);
+    if (class == NULL) {
+        return NULL;
+    }
+    if (vm->recorder != NULL) {
+        record_event(vm->recorder, RECORD_CLASS_LOAD, start, 0, file_name);
+    }
+    if (vm->agent.class_prepare != NULL) {
+        vm->agent.class_prepare(vm, (jclass) class);
+    }
+
+    vm->active_calls++;
+    vm->thread = pthread_self();
+    start = vm->recorder != NULL ? get_monotonic_time() : 0;
+    perf_phase_begin(&vm->perf, &perf_start);
+    clinit_start = get_monotonic_time();
+    retval = initialize_class(vm, class);
+    class->timings.clinit = get_monotonic_time() - clinit_start;
+    perf_phase_end(&vm->perf, PERF_PHASE_INIT, &perf_start);
+    if (vm->recorder != NULL) {
+        read_utf8(class_name, get_this_class(class));
+        record_event(vm->recorder, RECORD_CLASS_INIT, start, retval, class_name);
+    }
+    vm->active_calls--;
+    if (retval != 0) {
+        // kept in the loader, since objects and frames created by <clinit> may refer to it
+        class->initialization_failed = 1;
+        fprintf(stderr, "failed to initialize class: %s\n", file_name);
+        return NULL;
+    }
+    return (jclass) class;
+}
+
+JNIEnv *get_env(struct vm *vm) {
+    return (JNIEnv *) &vm->native_loader.env;
+}
+
+/**
+ * Start running the program on the thread. A VM runs on one thread at a time, since its heap, frames and buffers
+ * (e.g. of the recorder) are not locked. Calls from natives of the program nest on the same thread.
+ * Return 0 if success, or -1 if the VM is running on another thread.
+ */
+static int enter_vm(struct vm *vm) {
+    if (pthread_mutex_trylock(&vm->running) != 0) {
+        fprintf(stderr, "the VM is running on another thread\n");
+        return -1;
+    }
+    if (vm->recorder != NULL) {
+        vm->recorder->tid = (int32_t) syscall(SYS_gettid);
+    }
+    return 0;
+}
+
+static void leave_vm(struct vm *vm) {
+    pthread_mutex_unlock(&vm->running);
+}
+
+int call_method(struct vm *vm, jmethodID method_id, jobject obj, const jvalue *args, jvalue *result) {
+    struct method_info *method = (struct method_info *) method_id;
+    struct method_descriptor descriptor;
+    struct perf_values perf_start;
+    int roots[1 + 255];
+    int root_num = 0, i, retval;
+
+    if (method == NULL || get_method_descriptor(&descriptor, method, method->class) != 0) {
+        return -1;
+    }
+
+    // references passed to the method must survive GC
+    if (obj != NULL) {
+        roots[root_num++] = FROM_JOBJECT(obj);
+    }
+    for (i = 0; i < descriptor.num; i++) {
+        if ((descriptor.args[i] == 'L' || descriptor.args[i] == '[') && args[i].l != NULL) {
+            roots[root_num++] = FROM_JOBJECT(args[i].l);
+        }
+    }
+    if (enter_vm(vm) != 0) {
+        return -1;
+    }
+    maybe_collect_garbage(vm, roots, root_num);
+
+    vm->status = 0;
+    vm->error = NULL;
+    vm->active_calls++;
+    vm->thread = pthread_self();
+    perf_phase_begin(&vm->perf, &perf_start);
+    retval = invoke_method(vm, method, obj, args, result);
+    perf_phase_end(&vm->perf, PERF_PHASE_MAIN, &perf_start);
+    vm->active_calls--;
+    leave_vm(vm);
+    return retval;
+}
+
+jobject new_global_ref(struct vm *vm, jobject obj) {
+    int *refs;
+
+    if (obj == NULL) {
+        return NULL;
+    }
+    if (vm->global_ref_num >= vm->global_ref_cap) {
+        int cap = vm->global_ref_cap == 0 ? 16 : vm->global_ref_cap * 2;
+        refs = realloc(vm->global_refs, cap * sizeof(int));
+        if (refs == NULL) {
+            return NULL;
+        }
+        vm->global_refs = refs;
+        vm->global_ref_cap = cap;
+    }
+    vm->global_refs[vm->global_ref_num++] = FROM_JOBJECT(obj);
+    return obj;
+}
+
+void delete_global_ref(struct vm *vm, jobject obj) {
+    int i;
+
+    for (i = vm->global_ref_num - 1; i >= 0; i--) {
+        if (vm->global_refs[i] == FROM_JOBJECT(obj)) {
+            vm->global_refs[i] = vm->global_refs[--vm->global_ref_num];
+            return;
         }
+    }
+}
+
+//
+// Snapshot
+//
+
+// A snapshot is an image of the parsed classes and the objects of a VM, laid out as they are in memory,
+// so that restore_vm maps it and relocates its pointers instead of parsing class files and creating objects:
+//
+//   header:      SNAPSHOT_HEADER_WORDS int64 words (see enum snapshot_header)
+//   area:        classes and everything parsed into them, with statics and resolved cp_cache,
+//                and objects with their fields. Pointers hold offsets from the start of the area.
+//   relocations: int64 offsets of the pointers in the area, which are relocated by the address of the area
+//   global references: int32 words
+//
+// The area is mapped privately and written in place (e.g. statics), and unmapped when the VM is destroyed.
+// Bound natives, profiles and other state of methods collected at run time are not saved.
+
+#define SNAPSHOT_MAGIC 0x4d4a5653 // "MJVS"
+#define SNAPSHOT_VERSION 2
+// sizes of archived structures, to reject images of other builds
+#define SNAPSHOT_LAYOUT ((int64_t) sizeof(struct class_file) << 32 | sizeof(struct method_info) << 16 \
+                         | sizeof(struct class_instance) << 8 | sizeof(struct cp_cache_entry))
+
+enum snapshot_header {
+    SNAPSHOT_HEADER_MAGIC,
+    SNAPSHOT_HEADER_VERSION,
+    SNAPSHOT_HEADER_LAYOUT,
+    SNAPSHOT_HEADER_CLASS_NUM,
+    SNAPSHOT_HEADER_INSTANCE_COUNT,
+    SNAPSHOT_HEADER_GLOBAL_REF_NUM,
+    SNAPSHOT_HEADER_AREA_SIZE,
+    SNAPSHOT_HEADER_RELOCATION_NUM,
+    SNAPSHOT_HEADER_CLASSES,   // offset of the array of classes in the area
+    SNAPSHOT_HEADER_INSTANCES, // offset of the array of objects in the area (NULL for freed slots)
+    SNAPSHOT_HEADER_WORDS,
+};
+
+#define SNAPSHOT_INITIAL_AREA (64 * 1024)
+
+// the area being built, and the offsets of pointers in it
+struct snapshot_writer {
+    char *area;
+    size_t len;
+    size_t cap;
+    int64_t *relocations;
+    int relocation_num;
+    int relocation_cap;
+    bool failed;
+};
+
+// offsets of a class and its members in the area, to point to them from cp_cache and objects
+struct snapshot_class {
+    size_t class;
+    size_t cp_cache;
+    size_t *fields;
+    size_t *methods;
+};
+
+/**
+ * Copy size bytes of data (or zeros if data is NULL) into the area, aligned for pointers.
+ * Return the offset of the copy (meaningless if the writer failed).
+ */
+static size_t snapshot_copy(struct snapshot_writer *writer, const void *data, size_t size) {
+    size_t offset = (writer->len + sizeof(void *) - 1) & ~(sizeof(void *) - 1), cap;
+    char *area;
+
+    if (writer->failed) {
+        return 0;
+    }
+    if (offset + size > writer->cap) {
+        for (cap = writer->cap; cap < offset + size; cap *= 2);
+        area = realloc(writer->area, cap);
+        if (area == NULL) {
+            writer->failed = true;
+            return 0;
+        }
+        writer->area = area;
+        writer->cap = cap;
+    }
+    memset(writer->area + writer->len, 0, offset - writer->len);
+    if (data != NULL) {
+        memcpy(writer->area + offset, data, size);
+    } else {
+        memset(writer->area + offset, 0, size);
+    }
+    writer->len = offset + size;
+    return offset;
+}
+
+/**
+ * Make the pointer at the slot point to the target (both offsets in the area).
+ */
+static void snapshot_pointer(struct snapshot_writer *writer, size_t slot, size_t target) {
+    int64_t *relocations;
+    int cap;
+
+    if (writer->failed) {
+        return;
+    }
+    if (writer->relocation_num >= writer->relocation_cap) {
+        cap = writer->relocation_cap == 0 ? 1024 : writer->relocation_cap * 2;
+        relocations = realloc(writer->relocations, cap * sizeof(int64_t));
+        if (relocations == NULL) {
+            writer->failed = true;
+            return;
+        }
+        writer->relocations = relocations;
+        writer->relocation_cap = cap;
+    }
+    *(uintptr_t *) (writer->area + slot) = target;
+    writer->relocations[writer->relocation_num++] = (int64_t) slot;
+}
 
-        return 0;
-    } else if (strncmp(attr_name, ATTR_SOURCE_FILE, attr_len) == 0) {
-        *attr = (struct attribute_info *) malloc(sizeof(struct source_file_attribute));
-        (*attr)->attribute_name_index = attr_name_index;
-        (*attr)->attribute_length = attr_length;
+static size_t snapshot_attributes(struct snapshot_writer *writer, struct attribute_info **attributes, int count,
+        struct class_file *class);
+
+static size_t snapshot_attribute(struct snapshot_writer *writer, struct attribute_info *attr,
+        struct class_file *class) {
+    struct code_attribute code;
+    struct line_number_table_attribute line_numbers;
+    char attr_name[1024];
+    size_t offset;
+
+    read_utf8(attr_name, find_cp_utf8(attr->attribute_name_index, class));
+    if (strcmp(attr_name, ATTR_CODE) == 0) {
+        code = *ATTR_CODE_INFO(attr);
+        code.code = NULL;
+        code.exception_table = NULL;
+        code.attributes = NULL;
+        offset = snapshot_copy(writer, &code, sizeof(struct code_attribute));
+        if (code.code_length > 0) {
+            snapshot_pointer(writer, offset + offsetof(struct code_attribute, code),
+                             snapshot_copy(writer, ATTR_CODE_INFO(attr)->code, code.code_length));
+        }
+        if (code.exception_table_length > 0) {
+            snapshot_pointer(writer, offset + offsetof(struct code_attribute, exception_table),
+                             snapshot_copy(writer, ATTR_CODE_INFO(attr)->exception_table,
+                                           code.exception_table_length * sizeof(struct exception_table_entry)));
+        }
+        if (code.attributes_count > 0) {
+            snapshot_pointer(writer, offset + offsetof(struct code_attribute, attributes),
+                             snapshot_attributes(writer, ATTR_CODE_INFO(attr)->attributes, code.attributes_count,
+                                                 class));
+        }
+        return offset;
+    }
+    if (strcmp(attr_name, ATTR_LINE_NUMBER_TABLE) == 0) {
+        line_numbers = *ATTR_LINE_NUMBER_TABLE_INFO(attr);
+        line_numbers.line_number_table = NULL;
+        offset = snapshot_copy(writer, &line_numbers, sizeof(struct line_number_table_attribute));
+        snapshot_pointer(writer, offset + offsetof(struct line_number_table_attribute, line_number_table),
+                         snapshot_copy(writer, ATTR_LINE_NUMBER_TABLE_INFO(attr)->line_number_table,
+                                       line_numbers.line_number_table_length
+                                       * sizeof(struct line_number_table_entry)));
+        return offset;
+    }
+    // SourceFile (other attributes are not parsed)
+    return snapshot_copy(writer, attr, sizeof(struct source_file_attribute));
+}
 
-        ((struct source_file_attribute *) (*attr))->sourcefile_index = read16(main_file);
-        return 0;
-    } else if (strncmp(attr_name, ATTR_LINE_NUMBER_TABLE, attr_len) == 0) {
-        *attr = (struct attribute_info *) malloc(sizeof(struct line_number_table_attribute));
-        (*attr)->attribute_name_index = attr_name_index;
-        (*attr)->attribute_length = attr_length;
+static size_t snapshot_attributes(struct snapshot_writer *writer, struct attribute_info **attributes, int count,
+        struct class_file *class) {
+    size_t offset = snapshot_copy(writer, NULL, count * sizeof(void *));
+    int i;
 
-        ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table_length = read16(main_file);
-        ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table = calloc(
-                ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table_length,
-                sizeof(struct line_number_table_entry));
-        for (i = 0; i < ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table_length; i++) {
-            ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table[i].start_pc = read16(main_file);
-            ATTR_LINE_NUMBER_TABLE_INFO((*attr))->line_number_table[i].line_number = read16(main_file);
+    for (i = 0; i < count; i++) {
+        if (attributes[i] != NULL) {
+            snapshot_pointer(writer, offset + i * sizeof(void *), snapshot_attribute(writer, attributes[i], class));
         }
-        return 0;
-    } else {
-        fprintf(stderr, "not yet implemented for attr_name: %s\n", attr_name);
-        return -1;
     }
+    return offset;
 }
 
-int parse_field(struct field_info **field, struct class_file *main_class, FILE *main_file) {
-    u_int16_t access_flags, name_index, descriptor_index, attributes_count;
+static size_t snapshot_cp_info(struct snapshot_writer *writer, struct cp_info *cp) {
+    struct constant_utf8_info utf8;
+    size_t offset;
+
+    switch (cp->tag) {
+        case CONSTANT_CLASS:
+            return snapshot_copy(writer, cp, sizeof(struct constant_class_info));
+        case CONSTANT_FIELDREF:
+            return snapshot_copy(writer, cp, sizeof(struct constant_fieldref_info));
+        case CONSTANT_METHODREF:
+            return snapshot_copy(writer, cp, sizeof(struct constant_methodref_info));
+        case CONSTANT_NAME_AND_TYPE:
+            return snapshot_copy(writer, cp, sizeof(struct constant_name_and_type_info));
+        default:
+            // CONSTANT_UTF8 (other constants are not parsed)
+            utf8 = *(struct constant_utf8_info *) cp;
+            utf8.bytes = NULL;
+            offset = snapshot_copy(writer, &utf8, sizeof(struct constant_utf8_info));
+            snapshot_pointer(writer, offset + offsetof(struct constant_utf8_info, bytes),
+                             snapshot_copy(writer, ((struct constant_utf8_info *) cp)->bytes, utf8.length));
+            return offset;
+    }
+}
+
+/**
+ * Copy the class and everything parsed into it except cp_cache, which is filled by snapshot_cp_cache.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int snapshot_class(struct snapshot_writer *writer, struct class_file *class, struct snapshot_class *archived) {
+    struct class_file copy = *class;
+    struct field_info field;
+    struct method_info method;
+    size_t array;
     int i;
-    struct attribute_info **attributes;
 
-    access_flags = read16(main_file);
-    name_index = read16(main_file);
-    descriptor_index = read16(main_file);
+    archived->fields = calloc(class->fields_count + 1, sizeof(size_t));
+    archived->methods = calloc(class->methods_count + 1, sizeof(size_t));
+    if (archived->fields == NULL || archived->methods == NULL) {
+        return -1;
+    }
 
-    attributes_count = read16(main_file);
-    attributes = (struct attribute_info **) calloc(attributes_count, sizeof(void *));
-    for (i = 0; i < attributes_count; i++) {
-        if (parse_attribute(&attributes[i], main_class, main_file) != 0) {
-            return -1;
+    copy.constant_pool = NULL;
+    copy.interfaces = NULL;
+    copy.fields = NULL;
+    copy.methods = NULL;
+    copy.attributes = NULL;
+    copy.cp_cache = NULL;
+    copy.created_instances = 0;
+    memset(&copy.timings, 0, sizeof(struct class_timings));
+    archived->class = snapshot_copy(writer, &copy, sizeof(struct class_file));
+
+    array = snapshot_copy(writer, NULL, class->constant_pool_count * sizeof(void *));
+    snapshot_pointer(writer, archived->class + offsetof(struct class_file, constant_pool), array);
+    for (i = 0; i < class->constant_pool_count - 1; i++) {
+        if (class->constant_pool[i] != NULL) {
+            snapshot_pointer(writer, array + i * sizeof(void *), snapshot_cp_info(writer, class->constant_pool[i]));
         }
     }
 
-    // 4 u_int16_t fields, attributes pointers, and data
-    *field = (struct field_info *) malloc(sizeof(u_int16_t) * 4 + sizeof(void **) + sizeof(int *));
-    (*field)->access_flags = access_flags;
-    (*field)->name_index = name_index;
-    (*field)->descriptor_index = descriptor_index;
-    (*field)->attributes_count = attributes_count;
-    (*field)->attributes = attributes;
-    (*field)->data = calloc(1, sizeof(int *));
+    array = snapshot_copy(writer, NULL, class->fields_count * sizeof(void *));
+    snapshot_pointer(writer, archived->class + offsetof(struct class_file, fields), array);
+    for (i = 0; i < class->fields_count; i++) {
+        field = *class->fields[i];
+        field.attributes = NULL;
+        field.data = NULL;
+        archived->fields[i] = snapshot_copy(writer, &field, sizeof(struct field_info));
+        snapshot_pointer(writer, array + i * sizeof(void *), archived->fields[i]);
+        snapshot_pointer(writer, archived->fields[i] + offsetof(struct field_info, attributes),
+                         snapshot_attributes(writer, class->fields[i]->attributes, field.attributes_count, class));
+        snapshot_pointer(writer, archived->fields[i] + offsetof(struct field_info, data),
+                         snapshot_copy(writer, class->fields[i]->data, sizeof(int)));
+    }
+
+    array = snapshot_copy(writer, NULL, class->methods_count * sizeof(void *));
+    snapshot_pointer(writer, archived->class + offsetof(struct class_file, methods), array);
+    for (i = 0; i < class->methods_count; i++) {
+        memset(&method, 0, sizeof(struct method_info));
+        method.access_flags = class->methods[i]->access_flags;
+        method.name_index = class->methods[i]->name_index;
+        method.descriptor_index = class->methods[i]->descriptor_index;
+        method.attributes_count = class->methods[i]->attributes_count;
+        method.arg_units = -1;
+        archived->methods[i] = snapshot_copy(writer, &method, sizeof(struct method_info));
+        snapshot_pointer(writer, array + i * sizeof(void *), archived->methods[i]);
+        snapshot_pointer(writer, archived->methods[i] + offsetof(struct method_info, attributes),
+                         snapshot_attributes(writer, class->methods[i]->attributes, method.attributes_count, class));
+        snapshot_pointer(writer, archived->methods[i] + offsetof(struct method_info, class), archived->class);
+    }
 
+    snapshot_pointer(writer, archived->class + offsetof(struct class_file, attributes),
+                     snapshot_attributes(writer, class->attributes, class->attributes_count, class));
+
+    archived->cp_cache = snapshot_copy(writer, NULL, class->constant_pool_count * sizeof(struct cp_cache_entry));
+    snapshot_pointer(writer, archived->class + offsetof(struct class_file, cp_cache), archived->cp_cache);
     return 0;
 }
 
-int parse_method(struct method_info **method, struct class_file *main_class, FILE *main_file) {
-    u_int16_t access_flags, name_index, descriptor_index, attributes_count;
+static int get_class_index(struct vm *vm, struct class_file *class) {
     int i;
-    struct attribute_info **attributes;
 
-    access_flags = read16(main_file);
-    name_index = read16(main_file);
-    descriptor_index = read16(main_file);
+    for (i = 0; i < vm->loader.class_num; i++) {
+        if (vm->loader.classes[i] == class) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    attributes_count = read16(main_file);
-    attributes = (struct attribute_info **) calloc(attributes_count, sizeof(void *));
-    for (i = 0; i < attributes_count; i++) {
-        if (parse_attribute(&attributes[i], main_class, main_file) != 0) {
+/**
+ * Fill cp_cache of the archived class, pointing to archived classes and members.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int snapshot_cp_cache(struct snapshot_writer *writer, struct vm *vm, struct class_file *class,
+        struct snapshot_class *archived, struct snapshot_class *classes) {
+    struct cp_cache_entry *entry;
+    struct snapshot_class *target;
+    size_t slot;
+    int i, class_index, method_index;
+
+    for (i = 0; i < class->constant_pool_count - 1; i++) {
+        entry = &class->cp_cache[i];
+        if (entry->class == NULL) {
+            continue;
+        }
+        class_index = get_class_index(vm, entry->class);
+        if (class_index < 0) {
             return -1;
         }
+        target = &classes[class_index];
+        slot = archived->cp_cache + i * sizeof(struct cp_cache_entry);
+        snapshot_pointer(writer, slot + offsetof(struct cp_cache_entry, class), target->class);
+        if (entry->field != NULL) {
+            if (entry->field_index < 0 || entry->field_index >= entry->class->fields_count
+                    || entry->class->fields[entry->field_index] != entry->field) {
+                return -1;
+            }
+            snapshot_pointer(writer, slot + offsetof(struct cp_cache_entry, field), target->fields[entry->field_index]);
+            if (!writer->failed) {
+                ((struct cp_cache_entry *) (writer->area + slot))->field_index = entry->field_index;
+            }
+        }
+        if (entry->method != NULL) {
+            for (method_index = 0; method_index < entry->class->methods_count
+                    && entry->class->methods[method_index] != entry->method; method_index++);
+            if (method_index >= entry->class->methods_count) {
+                return -1;
+            }
+            snapshot_pointer(writer, slot + offsetof(struct cp_cache_entry, method), target->methods[method_index]);
+        }
     }
-
-    *method = (struct method_info *) malloc(sizeof(u_int16_t) * 4 + sizeof(void **));
-    (*method)->access_flags = access_flags;
-    (*method)->name_index = name_index;
-    (*method)->descriptor_index = descriptor_index;
-    (*method)->attributes_count = attributes_count;
-    (*method)->attributes = attributes;
-
     return 0;
 }
 
-int parse_class(struct class_file *main_class, FILE *main_file) {
-    unsigned char buf[256];
+/**
+ * Copy the object with its fields.
+ * Return the offset of the copy.
+ */
+static size_t snapshot_instance(struct snapshot_writer *writer, struct class_instance *instance,
+        struct snapshot_class *class) {
+    struct class_instance copy = *instance;
+    struct class_instance_field field;
+    size_t offset, array, field_offset;
     int i;
-    static unsigned char magic[4] = {0xca, 0xfe, 0xba, 0xbe};
 
-    // parse magic
-    fread(main_class->magic, 1, 4, main_file);
-    printf("%d\n", main_class->magic[0]);
-    printf("%d\n", main_class->magic[1]);
-    printf("%d\n", main_class->magic[2]);
-    printf("%d\n", main_class->magic[3]);
-    if (memcmp(main_class->magic, magic, 4) != 0) {
-        fprintf(stderr, "magic is illegal\n");
-        return -1;
+    copy.class = NULL;
+    copy.fields = NULL;
+    offset = snapshot_copy(writer, &copy, sizeof(struct class_instance));
+    snapshot_pointer(writer, offset + offsetof(struct class_instance, class), class->class);
+    array = snapshot_copy(writer, NULL, (instance->field_num + 1) * sizeof(void *));
+    snapshot_pointer(writer, offset + offsetof(struct class_instance, fields), array);
+    for (i = 0; i < instance->field_num; i++) {
+        if (instance->fields[i] == NULL) {
+            continue;
+        }
+        field.name = NULL;
+        field.descriptor = NULL;
+        field.data = NULL;
+        field_offset = snapshot_copy(writer, &field, sizeof(struct class_instance_field));
+        snapshot_pointer(writer, array + i * sizeof(void *), field_offset);
+        snapshot_pointer(writer, field_offset + offsetof(struct class_instance_field, name),
+                         snapshot_copy(writer, instance->fields[i]->name, strlen(instance->fields[i]->name) + 1));
+        snapshot_pointer(writer, field_offset + offsetof(struct class_instance_field, descriptor),
+                         snapshot_copy(writer, instance->fields[i]->descriptor,
+                                       strlen(instance->fields[i]->descriptor) + 1));
+        snapshot_pointer(writer, field_offset + offsetof(struct class_instance_field, data),
+                         snapshot_copy(writer, instance->fields[i]->data, sizeof(int32_t)));
     }
+    return offset;
+}
 
-    // parse minor_version and major_version
-    main_class->minor_version = read16(main_file);
-    main_class->major_version = read16(main_file);
-    printf("version: %d.%d\n", main_class->major_version, main_class->minor_version);
+/**
+ * Build the area of the classes and objects of the VM into the writer.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int build_snapshot(struct snapshot_writer *writer, struct vm *vm, int64_t *header) {
+    struct snapshot_class *classes;
+    size_t array;
+    int i, class_index, retval = -1;
 
-    // parse constant_pool_count
-    main_class->constant_pool_count = read16(main_file);
-    main_class->constant_pool = (struct cp_info **) calloc(main_class->constant_pool_count, sizeof(void *));
-    if (main_class->constant_pool == NULL) {
-        fprintf(stderr, "failed to prepare constant_pool\n");
+    classes = calloc(vm->loader.class_num + 1, sizeof(struct snapshot_class));
+    if (classes == NULL) {
         return -1;
     }
-
-    // parse constant_pool
-    for (i = 0; i < main_class->constant_pool_count - 1; i++) {
-        if (parse_cp_info(&main_class->constant_pool[i], main_file) != 0) {
-            return -1;
+    for (i = 0; i < vm->loader.class_num; i++) {
+        if (snapshot_class(writer, vm->loader.classes[i], &classes[i]) != 0) {
+            goto end;
         }
-        if (main_class->constant_pool[i] != NULL) {
-            printf("tag: %d\n", ((struct constant_class_info *) main_class->constant_pool[i])->tag);
+    }
+    // cp_cache may refer to classes archived after them
+    for (i = 0; i < vm->loader.class_num; i++) {
+        if (snapshot_cp_cache(writer, vm, vm->loader.classes[i], &classes[i], classes) != 0) {
+            fprintf(stderr, "cp_cache of class %d is broken\n", i);
+            goto end;
         }
     }
 
-    // parse access_flags
-    main_class->access_flags = read16(main_file);
-    printf("access_flags: %d\n", main_class->access_flags);
-
-    // parse this_class
-    main_class->this_class = read16(main_file);
-    printf("this_class: %d\n", main_class->this_class);
-
-    // parse super_class
-    main_class->super_class = read16(main_file);
-    printf("super_class: %d\n", main_class->super_class);
+    array = snapshot_copy(writer, NULL, vm->loader.class_num * sizeof(void *));
+    header[SNAPSHOT_HEADER_CLASSES] = (int64_t) array;
+    for (i = 0; i < vm->loader.class_num; i++) {
+        snapshot_pointer(writer, array + i * sizeof(void *), classes[i].class);
+    }
 
-    // parse interfaces_count
-    main_class->interfaces_count = read16(main_file);
-    printf("interfaces_count: %d\n", main_class->interfaces_count);
+    array = snapshot_copy(writer, NULL, vm->instance_count * sizeof(void *));
+    header[SNAPSHOT_HEADER_INSTANCES] = (int64_t) array;
+    for (i = 0; i < vm->instance_count; i++) {
+        if (vm->instances[i] == NULL) {
+            continue;
+        }
+        class_index = get_class_index(vm, vm->instances[i]->class);
+        if (class_index < 0) {
+            goto end;
+        }
+        snapshot_pointer(writer, array + i * sizeof(void *),
+                         snapshot_instance(writer, vm->instances[i], &classes[class_index]));
+    }
+    // the area is followed by relocations of int64
+    snapshot_copy(writer, NULL, 0);
+    retval = writer->failed ? -1 : 0;
+
+end:
+    for (i = 0; i < vm->loader.class_num; i++) {
+        free(classes[i].fields);
+        free(classes[i].methods);
+    }
+    free(classes);
+    return retval;
+}
 
-    // parse interfaces
-    // TODO
-    if (main_class->interfaces_count > 0) {
-        fprintf(stderr, "not yet implemented to parse interfaces\n");
+/**
+ * Write the snapshot of the VM, which is entered and runs no program.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int write_snapshot(struct vm *vm, char *path) {
+    struct snapshot_writer writer;
+    int64_t header[SNAPSHOT_HEADER_WORDS];
+    struct stat st;
+    FILE *f;
+    int failed;
+
+    // not to save unreachable objects
+    collect_garbage(vm, NULL, 0);
+
+    memset(&writer, 0, sizeof(writer));
+    writer.cap = SNAPSHOT_INITIAL_AREA;
+    writer.area = malloc(writer.cap);
+    memset(header, 0, sizeof(header));
+    if (writer.area == NULL || build_snapshot(&writer, vm, header) != 0) {
+        fprintf(stderr, "failed to build snapshot\n");
+        free(writer.area);
+        free(writer.relocations);
         return -1;
     }
-
-    // parse fields_count
-    main_class->fields_count = read16(main_file);
-    printf("fields_count: %d\n", main_class->fields_count);
-
-    // parse fields
-    main_class->fields = calloc(main_class->fields_count, sizeof(void *));
-    if (main_class->fields == NULL) {
-        fprintf(stderr, "failed to prepare fields\n");
+    header[SNAPSHOT_HEADER_MAGIC] = SNAPSHOT_MAGIC;
+    header[SNAPSHOT_HEADER_VERSION] = SNAPSHOT_VERSION;
+    header[SNAPSHOT_HEADER_LAYOUT] = SNAPSHOT_LAYOUT;
+    header[SNAPSHOT_HEADER_CLASS_NUM] = vm->loader.class_num;
+    header[SNAPSHOT_HEADER_INSTANCE_COUNT] = vm->instance_count;
+    header[SNAPSHOT_HEADER_GLOBAL_REF_NUM] = vm->global_ref_num;
+    header[SNAPSHOT_HEADER_AREA_SIZE] = (int64_t) writer.len;
+    header[SNAPSHOT_HEADER_RELOCATION_NUM] = writer.relocation_num;
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror("fopen");
+        free(writer.area);
+        free(writer.relocations);
         return -1;
     }
-    for (i = 0; i < main_class->fields_count; i++) {
-        if (parse_field(&main_class->fields[i], main_class, main_file) != 0) {
-            return -1;
+    failed = fwrite(header, sizeof(header), 1, f) != 1
+            || fwrite(writer.area, 1, writer.len, f) != writer.len
+            || fwrite(writer.relocations, sizeof(int64_t), writer.relocation_num, f) != (size_t) writer.relocation_num
+            || fwrite(vm->global_refs, sizeof(int32_t), vm->global_ref_num, f) != (size_t) vm->global_ref_num;
+    failed = fclose(f) != 0 || failed;
+    free(writer.area);
+    free(writer.relocations);
+    if (failed) {
+        perror("failed to write snapshot");
+        // a partial image is not left to be restored
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            unlink(path);
         }
+        return -1;
     }
+    return 0;
+}
 
-    // parse methods_count
-    main_class->methods_count = read16(main_file);
-    printf("methods_count: %d\n", main_class->methods_count);
+int save_snapshot(struct vm *vm, char *path) {
+    int retval;
 
-    // parse methods
-    main_class->methods = calloc(main_class->methods_count, sizeof(void *));
-    if (main_class->methods == NULL) {
-        fprintf(stderr, "failed to prepare methods\n");
+    if (enter_vm(vm) != 0) {
         return -1;
     }
-    for (i = 0; i < main_class->methods_count; i++) {
-        if (parse_method(&main_class->methods[i], main_class, main_file) != 0) {
+    // frames of the running program hold objects and classes not saved
+    if (vm->active_calls > 0) {
+        fprintf(stderr, "cannot save a snapshot while the program runs\n");
+        leave_vm(vm);
+        return -1;
+    }
+    retval = write_snapshot(vm, path);
+    leave_vm(vm);
+    return retval;
+}
+
+/**
+ * Relocate pointers in the area mapped at the address.
+ * Return 0 if success, return -1 if an offset is out of the area.
+ */
+static int relocate_snapshot(char *area, int64_t area_size, const int64_t *relocations, int64_t relocation_num) {
+    int64_t i;
+
+    for (i = 0; i < relocation_num; i++) {
+        if (relocations[i] < 0 || relocations[i] % sizeof(void *) != 0
+                || relocations[i] > area_size - (int64_t) sizeof(void *)) {
             return -1;
         }
+        *(uintptr_t *) (area + relocations[i]) += (uintptr_t) area;
     }
+    return 0;
+}
 
-    // parse attributes_count
-    main_class->attributes_count = read16(main_file);
-    printf("attributes_count: %d\n", main_class->attributes_count);
+/**
+ * Check the header of the image of size bytes.
+ * Return 0 if valid, return -1 otherwise.
+ */
+static int check_snapshot_header(const int64_t *header, size_t size) {
+    int64_t area_size = header[SNAPSHOT_HEADER_AREA_SIZE];
+    int64_t class_num = header[SNAPSHOT_HEADER_CLASS_NUM], instance_count = header[SNAPSHOT_HEADER_INSTANCE_COUNT];
 
-    // parse attributes
-    main_class->attributes = calloc(main_class->attributes_count, sizeof(void *));
-    if (main_class->attributes == NULL) {
-        fprintf(stderr, "failed to prepare methods\n");
+    if (header[SNAPSHOT_HEADER_MAGIC] != SNAPSHOT_MAGIC || header[SNAPSHOT_HEADER_VERSION] != SNAPSHOT_VERSION
+            || header[SNAPSHOT_HEADER_LAYOUT] != SNAPSHOT_LAYOUT) {
         return -1;
     }
-    for (i = 0; i < main_class->attributes_count; i++) {
-        if (parse_attribute(&main_class->attributes[i], main_class, main_file) != 0) {
-            return -1;
-        }
+    if (area_size < 0 || area_size % sizeof(int64_t) != 0 || class_num < 0 || class_num > INT_MAX
+            || instance_count < 0 || instance_count > INT_MAX || header[SNAPSHOT_HEADER_GLOBAL_REF_NUM] < 0
+            || header[SNAPSHOT_HEADER_GLOBAL_REF_NUM] > INT_MAX || header[SNAPSHOT_HEADER_RELOCATION_NUM] < 0) {
+        return -1;
+    }
+    if (header[SNAPSHOT_HEADER_CLASSES] < 0 || header[SNAPSHOT_HEADER_CLASSES] > area_size - class_num * 8
+            || header[SNAPSHOT_HEADER_INSTANCES] < 0
+            || header[SNAPSHOT_HEADER_INSTANCES] > area_size - instance_count * 8) {
+        return -1;
+    }
+    if ((size_t) area_size > size || header[SNAPSHOT_HEADER_RELOCATION_NUM] > (int64_t) (size / sizeof(int64_t))
+            || sizeof(int64_t) * SNAPSHOT_HEADER_WORDS + area_size
+               + header[SNAPSHOT_HEADER_RELOCATION_NUM] * sizeof(int64_t)
+               + header[SNAPSHOT_HEADER_GLOBAL_REF_NUM] * sizeof(int32_t) != size) {
+        return -1;
     }
-
     return 0;
 }
 
-static char *get_field_name(struct field_info *field, struct class_file *class) {
-    // TODO: not thread-safe
-    // TODO: should not limit the length of field name
-    static char name[1024];
-    u_int16_t name_index;
-    struct constant_utf8_info *utf8_info;
+struct vm *restore_vm(char *path) {
+    struct vm *vm;
+    struct stat st;
+    const int64_t *header;
+    const int32_t *refs;
+    char *image, *area;
+    int fd, i, cap;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+    // written in place (e.g. statics and objects), but not into the file
+    image = (size_t) st.st_size >= sizeof(int64_t) * SNAPSHOT_HEADER_WORDS
+            ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "failed to map %s\n", path);
+        return NULL;
+    }
 
-    name_index = field->name_index;
-    utf8_info = find_cp_utf8(name_index, class);
-    if (utf8_info == NULL) {
+    header = (const int64_t *) image;
+    area = image + sizeof(int64_t) * SNAPSHOT_HEADER_WORDS;
+    if (check_snapshot_header(header, st.st_size) != 0) {
+        fprintf(stderr, "%s is not a snapshot of this VM\n", path);
+        munmap(image, st.st_size);
         return NULL;
     }
+    if (relocate_snapshot(area, header[SNAPSHOT_HEADER_AREA_SIZE],
+                          (const int64_t *) (area + header[SNAPSHOT_HEADER_AREA_SIZE]),
+                          header[SNAPSHOT_HEADER_RELOCATION_NUM]) != 0) {
+        fprintf(stderr, "snapshot is broken\n");
+        munmap(image, st.st_size);
+        return NULL;
+    }
+    refs = (const int32_t *) (area + header[SNAPSHOT_HEADER_AREA_SIZE]
+                              + header[SNAPSHOT_HEADER_RELOCATION_NUM] * sizeof(int64_t));
 
-    read_utf8(name, utf8_info);
-    return name;
+    vm = allocate_vm();
+    if (vm == NULL) {
+        munmap(image, st.st_size);
+        return NULL;
+    }
+    vm->image = image;
+    vm->image_size = st.st_size;
+
+    // the arrays grow as classes are loaded and objects are created
+    cap = header[SNAPSHOT_HEADER_CLASS_NUM] + 16;
+    vm->loader.classes = malloc(cap * sizeof(struct class_file *));
+    cap = header[SNAPSHOT_HEADER_INSTANCE_COUNT] + 1024;
+    vm->instances = malloc(cap * sizeof(struct class_instance *));
+    vm->free_slots = malloc((header[SNAPSHOT_HEADER_INSTANCE_COUNT] + 1) * sizeof(int));
+    if (vm->loader.classes == NULL || vm->instances == NULL || vm->free_slots == NULL) {
+        destroy_vm(vm);
+        return NULL;
+    }
+    memcpy(vm->loader.classes, area + header[SNAPSHOT_HEADER_CLASSES],
+           header[SNAPSHOT_HEADER_CLASS_NUM] * sizeof(struct class_file *));
+    vm->loader.class_num = header[SNAPSHOT_HEADER_CLASS_NUM];
+    vm->loader.class_cap = header[SNAPSHOT_HEADER_CLASS_NUM] + 16;
+
+    memcpy(vm->instances, area + header[SNAPSHOT_HEADER_INSTANCES],
+           header[SNAPSHOT_HEADER_INSTANCE_COUNT] * sizeof(struct class_instance *));
+    vm->instance_count = header[SNAPSHOT_HEADER_INSTANCE_COUNT];
+    vm->instance_cap = cap;
+    for (i = vm->instance_count - 1; i >= 0; i--) {
+        if (vm->instances[i] == NULL) {
+            vm->free_slots[vm->free_slot_num++] = i;
+        }
+    }
+    vm->live_after_gc = vm->instance_count - vm->free_slot_num;
+
+    for (i = 0; i < header[SNAPSHOT_HEADER_GLOBAL_REF_NUM]; i++) {
+        if (new_global_ref(vm, TO_JOBJECT(refs[i])) == NULL) {
+            destroy_vm(vm);
+            return NULL;
+        }
+    }
+    return vm;
 }
 
-static char *get_field_descriptor(struct field_info *field, struct class_file *class) {
-    // TODO: not thread-safe
-    static char descriptor[2];
-    u_int16_t descriptor_index;
-    struct constant_utf8_info *utf8_info;
+//
+// Heap Dump
+//
 
-    descriptor_index = field->descriptor_index;
-    utf8_info = find_cp_utf8(descriptor_index, class);
-    if (utf8_info == NULL) {
-        return NULL;
-    }
+// Heap dumps in the HPROF binary format (JAVA PROFILE 1.0.2) with 8-byte identifiers:
+//
+//   UTF8 of names, LOAD_CLASS of classes, an empty TRACE,
+//   HEAP_DUMP_SEGMENTs of ROOT_STICKY_CLASS, ROOT_JNI_GLOBAL, CLASS_DUMP and INSTANCE_DUMP, HEAP_DUMP_END
+//
+// Sub-records are buffered up to HPROF_SEGMENT_SIZE and written as a segment, so the heap is streamed.
+// Identifiers are tagged in the low bits (see HPROF_OBJECT_ID etc.), and 0 is null.
+// References on operand stacks and in local variables are not known to be references, so they are not roots.
+
+#define HPROF_SEGMENT_SIZE (1 << 20)
+
+#define HPROF_UTF8 0x01
+#define HPROF_LOAD_CLASS 0x02
+#define HPROF_TRACE 0x05
+#define HPROF_HEAP_DUMP_SEGMENT 0x1c
+#define HPROF_HEAP_DUMP_END 0x2c
+
+#define HPROF_ROOT_JNI_GLOBAL 0x01
+#define HPROF_ROOT_STICKY_CLASS 0x05
+#define HPROF_CLASS_DUMP 0x20
+#define HPROF_INSTANCE_DUMP 0x21
+
+#define HPROF_TYPE_OBJECT 2
+#define HPROF_TYPE_INT 10
+
+#define HPROF_OBJECT_ID(ref) ((ref) == REFERENCE_NULL ? 0 : ((u_int64_t) (ref) + 1) << 2)
+#define HPROF_CLASS_ID(index) (((u_int64_t) (index) + 1) << 2 | 1)
+#define HPROF_STRING_ID(serial) (((u_int64_t) (serial) + 1) << 2 | 2)
+
+// signal to request a heap dump at the next safepoint (see enable_heap_dump)
+#define HEAP_DUMP_SIGNAL SIGUSR1
+
+static void heap_dump_handler(int sig) {
+    heap_dump_requests++;
+    arm_all_safepoints();
+}
+
+struct hprof_writer {
+    FILE *f;
+    u_int8_t *segment;
+    size_t len;
+    size_t cap;
+};
+
+static void hprof_put(struct hprof_writer *writer, u_int64_t value, int size) {
+    int i;
 
-    read_utf8(descriptor, utf8_info);
-    return descriptor;
+    // big endian
+    for (i = size - 1; i >= 0; i--) {
+        writer->segment[writer->len++] = (u_int8_t) (value >> (i * 8));
+    }
 }
 
-/**
- * Find field_info from fields.
- * Return NULL if not found.
- */
-static struct field_info *find_field(char *target_name, struct class_file *class) {
-    // TODO: Check field descriptor as well as name
+static void hprof_write(FILE *f, u_int64_t value, int size) {
     int i;
-    int target_name_len;
-    char *name;
-    int name_len;
 
-    target_name_len = strlen(target_name);
-    for (i = 0; i < class->fields_count; i++) {
-        name = get_field_name(class->fields[i], class);
-        if (name != NULL) {
-            name_len = strlen(name);
-            if (target_name_len == name_len && strncmp(name, target_name, name_len) == 0) {
-                return (struct field_info *) class->fields[i];
-            }
-        }
+    for (i = size - 1; i >= 0; i--) {
+        fputc((int) (u_int8_t) (value >> (i * 8)), f);
     }
+}
 
-    return NULL;
+static void hprof_write_record_header(FILE *f, int tag, u_int32_t length) {
+    hprof_write(f, tag, 1);
+    hprof_write(f, 0, 4); // microseconds since the header
+    hprof_write(f, length, 4);
+}
+
+static void hprof_write_utf8(FILE *f, u_int64_t id, struct constant_utf8_info *utf8) {
+    hprof_write_record_header(f, HPROF_UTF8, 8 + utf8->length);
+    hprof_write(f, id, 8);
+    fwrite(utf8->bytes, 1, utf8->length, f);
+}
+
+static void hprof_flush_segment(struct hprof_writer *writer) {
+    if (writer->len == 0) {
+        return;
+    }
+    hprof_write_record_header(writer->f, HPROF_HEAP_DUMP_SEGMENT, (u_int32_t) writer->len);
+    fwrite(writer->segment, 1, writer->len, writer->f);
+    writer->len = 0;
 }
 
 /**
- * Find method_info from methods.
- * Return NULL if not found.
+ * Make room for a sub-record of the size in the segment.
+ * Return 0 if success, return -1 otherwise.
  */
-static struct method_info *find_method(char *target_name, struct class_file *class) {
-    // TODO: Check method signature as well as name
-    int i;
-    int target_name_len;
-    char *name;
-    int name_len;
+static int hprof_begin_sub_record(struct hprof_writer *writer, size_t size) {
+    u_int8_t *segment;
 
-    target_name_len = strlen(target_name);
-    for (i = 0; i < class->methods_count; i++) {
-        name = get_method_name(class->methods[i], class);
-        if (name != NULL) {
-            name_len = strlen(name);
-            if (target_name_len == name_len && strncmp(name, target_name, name_len) == 0) {
-                return (struct method_info *) class->methods[i];
-            }
+    if (writer->len + size > writer->cap) {
+        hprof_flush_segment(writer);
+    }
+    if (size > writer->cap) {
+        segment = realloc(writer->segment, size);
+        if (segment == NULL) {
+            return -1;
         }
+        writer->segment = segment;
+        writer->cap = size;
     }
+    return 0;
+}
 
-    return NULL;
+static int get_hprof_type(char *descriptor) {
+    return descriptor[0] == FIELD_DESCRIPTOR_OBJECT || descriptor[0] == '[' ? HPROF_TYPE_OBJECT : HPROF_TYPE_INT;
 }
 
-/**
- * Return code_attribute of the passed method_info.
- * Return NULL if not found.
- */
-struct code_attribute *get_code(struct method_info *method, struct class_file *class) {
-    int j;
-    int attr_name_index;
+static u_int64_t get_hprof_value(int type, int32_t value) {
+    return type == HPROF_TYPE_OBJECT ? HPROF_OBJECT_ID(value) : (u_int32_t) value;
+}
+
+static int get_super_class_index(struct vm *vm, struct class_file *class) {
+    struct constant_class_info *cp_class;
+    struct constant_utf8_info *cp_utf8;
     char name[1024];
 
-    for (j = 0; j < method->attributes_count; j++) {
-        attr_name_index = method->attributes[j]->attribute_name_index;
-        read_utf8(name, (struct constant_utf8_info *) class->constant_pool[attr_name_index-1]);
-        if (strncmp(name, ATTR_CODE, 4) == 0) {
-            return (struct code_attribute *) method->attributes[j];
-        }
+    if (class->super_class == 0 || (cp_class = find_cp_class(class->super_class, class)) == NULL
+            || (cp_utf8 = find_cp_utf8(cp_class->name_index, class)) == NULL || read_utf8(name, cp_utf8) < 0) {
+        return -1;
     }
-
-    return NULL;
+    return get_class_index(vm, get_class(&vm->loader, name));
 }
 
-/**
- * Return name of the method.
- */
-static char *get_method_name(struct method_info *method, struct class_file *class) {
-    // TODO: not thread-safe
-    // TODO: should not limit the length of methods
-    static char name[1024];
-    u_int16_t name_index;
-    struct cp_info *cp_info;
-    struct constant_utf8_info *utf8_info;
+static int write_class_dump(struct hprof_writer *writer, struct vm *vm, int class_index, u_int64_t field_name_id) {
+    struct class_file *class = vm->loader.classes[class_index];
+    char descriptor[1024];
+    int i, type, super_index, static_num = 0, instance_size = 0;
 
-    name_index = method->name_index;
-    if (name_index > class->constant_pool_count) {
-        return NULL;
+    for (i = 0; i < class->fields_count; i++) {
+        if (is_static_field(class->fields[i])) {
+            static_num++;
+        }
+    }
+    if (hprof_begin_sub_record(writer, 1 + 8 + 4 + 8 * 6 + 4 + 2 + 2 + 2 + class->fields_count * (8 + 1 + 8)) != 0) {
+        return -1;
     }
 
-    cp_info = class->constant_pool[name_index - 1];
-    if (cp_info->tag != CONSTANT_UTF8) {
-        return NULL;
+    super_index = get_super_class_index(vm, class);
+    hprof_put(writer, HPROF_CLASS_DUMP, 1);
+    hprof_put(writer, HPROF_CLASS_ID(class_index), 8);
+    hprof_put(writer, 1, 4); // stack trace serial
+    hprof_put(writer, super_index >= 0 ? HPROF_CLASS_ID(super_index) : 0, 8);
+    hprof_put(writer, 0, 8); // class loader
+    hprof_put(writer, 0, 8); // signers
+    hprof_put(writer, 0, 8); // protection domain
+    hprof_put(writer, 0, 8); // reserved
+    hprof_put(writer, 0, 8); // reserved
+    for (i = 0; i < class->fields_count; i++) {
+        if (!is_static_field(class->fields[i])) {
+            get_field_descriptor(descriptor, class->fields[i], class);
+            instance_size += get_hprof_type(descriptor) == HPROF_TYPE_OBJECT ? 8 : 4;
+        }
     }
-    utf8_info = (struct constant_utf8_info *) cp_info;
+    hprof_put(writer, instance_size, 4);
+    hprof_put(writer, 0, 2); // constant pool
 
-    read_utf8(name, utf8_info);
+    hprof_put(writer, static_num, 2);
+    for (i = 0; i < class->fields_count; i++) {
+        if (is_static_field(class->fields[i])) {
+            get_field_descriptor(descriptor, class->fields[i], class);
+            type = get_hprof_type(descriptor);
+            hprof_put(writer, field_name_id + ((u_int64_t) i << 2), 8);
+            hprof_put(writer, type, 1);
+            hprof_put(writer, get_hprof_value(type, *class->fields[i]->data), type == HPROF_TYPE_OBJECT ? 8 : 4);
+        }
+    }
 
-    return name;
+    hprof_put(writer, class->fields_count - static_num, 2);
+    for (i = 0; i < class->fields_count; i++) {
+        if (!is_static_field(class->fields[i])) {
+            get_field_descriptor(descriptor, class->fields[i], class);
+            hprof_put(writer, field_name_id + ((u_int64_t) i << 2), 8);
+            hprof_put(writer, get_hprof_type(descriptor), 1);
+        }
+    }
+    return 0;
 }
 
-struct method_descriptor {
-    int num;
-};
+static int write_instance_dump(struct hprof_writer *writer, struct vm *vm, int ref) {
+    struct class_instance *instance = vm->instances[ref];
+    struct class_file *class = instance->class;
+    char descriptor[1024];
+    int i, type, size = 0;
 
-/**
- * Parse method descriptor and store it to descriptor.
- * The format of method descriptor is defined in 4.3.3.
- * Return 0 if success, return -1 otherwise.
- */
-static int get_method_descriptor(struct method_descriptor *descriptor, struct method_info *current_method, struct class_file *class) {
-    char desc[1024], *p;
-    struct constant_utf8_info *utf8 = find_cp_utf8(current_method->descriptor_index, class);
-    read_utf8(desc, utf8);
+    // the VM does not inherit instance fields, so only fields declared by the class have values
+    for (i = 0; i < class->fields_count; i++) {
+        if (!is_static_field(class->fields[i])) {
+            get_field_descriptor(descriptor, class->fields[i], class);
+            size += get_hprof_type(descriptor) == HPROF_TYPE_OBJECT ? 8 : 4;
+        }
+    }
+    if (hprof_begin_sub_record(writer, 1 + 8 + 4 + 8 + 4 + size) != 0) {
+        return -1;
+    }
 
-    descriptor->num = 0;
+    hprof_put(writer, HPROF_INSTANCE_DUMP, 1);
+    hprof_put(writer, HPROF_OBJECT_ID(ref), 8);
+    hprof_put(writer, 1, 4); // stack trace serial
+    hprof_put(writer, HPROF_CLASS_ID(get_class_index(vm, class)), 8);
+    hprof_put(writer, size, 4);
+    for (i = 0; i < class->fields_count; i++) {
+        if (is_static_field(class->fields[i])) {
+            continue;
+        }
+        get_field_descriptor(descriptor, class->fields[i], class);
+        type = get_hprof_type(descriptor);
+        if (i < instance->field_num && instance->fields[i] != NULL) {
+            hprof_put(writer, get_hprof_value(type, *(int32_t *) instance->fields[i]->data),
+                    type == HPROF_TYPE_OBJECT ? 8 : 4);
+        } else {
+            hprof_put(writer, 0, type == HPROF_TYPE_OBJECT ? 8 : 4);
+        }
+    }
+    return 0;
+}
 
-    p = desc;
-    if (*p != '(') {
+int dump_heap(struct vm *vm, char *path) {
+    struct hprof_writer writer;
+    struct class_file *class;
+    struct timespec now;
+    u_int64_t *field_name_ids;
+    u_int64_t serial = 0;
+    int i, j, failed = 0;
+
+    writer.f = fopen(path, "w");
+    if (writer.f == NULL) {
+        perror("fopen");
         return -1;
     }
-    p++;
-    while (*p != ')') {
-        switch(*p) {
-            case 'I':
-                descriptor->num++;
-                break;
-            case 'B':
-                fprintf(stderr, "not yet implemented for %c\n", *p);
-                return -1;
-            case 'C':
-                fprintf(stderr, "not yet implemented for %c\n", *p);
-                return -1;
-            case 'D':
-                fprintf(stderr, "not yet implemented for %c\n", *p);
-                return -1;
-            case 'F':
-                fprintf(stderr, "not yet implemented for %c\n", *p);
-                return -1;
-            case 'J':
-                fprintf(stderr, "not yet implemented for %c\n", *p);
-                return -1;
-            case 'L':
-                descriptor->num++;
-                while (*p != ';') {
-                    // skip for now
-                    p++;
-                }
-                break;
-            case 'S':
-                fprintf(stderr, "not yet implemented for %c\n", *p);
-                return -1;
-            case 'Z':
-                fprintf(stderr, "not yet implemented for %c\n", *p);
-                return -1;
-            case '[':
-                // ignore for now
-                break;
-            default:
-                fprintf(stderr, "unexpected character appears in method descriptor\n");
-                return -1;
+    writer.segment = malloc(HPROF_SEGMENT_SIZE);
+    writer.len = 0;
+    writer.cap = HPROF_SEGMENT_SIZE;
+    field_name_ids = calloc(vm->loader.class_num + 1, sizeof(u_int64_t));
+    if (writer.segment == NULL || field_name_ids == NULL) {
+        fprintf(stderr, "failed to malloc\n");
+        free(writer.segment);
+        free(field_name_ids);
+        fclose(writer.f);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    fwrite("JAVA PROFILE 1.0.2", 1, sizeof("JAVA PROFILE 1.0.2"), writer.f);
+    hprof_write(writer.f, 8, 4);
+    hprof_write(writer.f, (u_int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000, 8);
+
+    // names of classes and their fields (the name of the field j is field_name_ids[i] + (j << 2))
+    for (i = 0; i < vm->loader.class_num; i++) {
+        class = vm->loader.classes[i];
+        hprof_write_utf8(writer.f, HPROF_STRING_ID(serial++), get_this_class(class));
+        field_name_ids[i] = HPROF_STRING_ID(serial);
+        for (j = 0; j < class->fields_count; j++) {
+            hprof_write_utf8(writer.f, HPROF_STRING_ID(serial++), find_cp_utf8(class->fields[j]->name_index, class));
         }
-        p++;
     }
 
-    // ignore ReturnDescriptor for now
+    hprof_write_record_header(writer.f, HPROF_TRACE, 12);
+    hprof_write(writer.f, 1, 4); // serial
+    hprof_write(writer.f, 0, 4); // thread serial
+    hprof_write(writer.f, 0, 4); // number of frames
+
+    for (i = 0; i < vm->loader.class_num; i++) {
+        hprof_write_record_header(writer.f, HPROF_LOAD_CLASS, 4 + 8 + 4 + 8);
+        hprof_write(writer.f, i + 1, 4); // serial
+        hprof_write(writer.f, HPROF_CLASS_ID(i), 8);
+        hprof_write(writer.f, 1, 4); // stack trace serial
+        hprof_write(writer.f, field_name_ids[i] - 4, 8); // the name precedes the names of fields
+    }
+
+    for (i = 0; i < vm->loader.class_num && !failed; i++) {
+        failed = hprof_begin_sub_record(&writer, 1 + 8);
+        if (!failed) {
+            hprof_put(&writer, HPROF_ROOT_STICKY_CLASS, 1);
+            hprof_put(&writer, HPROF_CLASS_ID(i), 8);
+        }
+    }
+    for (i = 0; i < vm->global_ref_num && !failed; i++) {
+        failed = hprof_begin_sub_record(&writer, 1 + 8 + 8);
+        if (!failed) {
+            hprof_put(&writer, HPROF_ROOT_JNI_GLOBAL, 1);
+            hprof_put(&writer, HPROF_OBJECT_ID(vm->global_refs[i]), 8);
+            hprof_put(&writer, HPROF_OBJECT_ID(vm->global_refs[i]), 8); // JNI global ref ID
+        }
+    }
+    for (i = 0; i < vm->loader.class_num && !failed; i++) {
+        failed = write_class_dump(&writer, vm, i, field_name_ids[i]);
+    }
+    for (i = 0; i < vm->instance_count && !failed; i++) {
+        if (vm->instances[i] != NULL) {
+            failed = write_instance_dump(&writer, vm, i);
+        }
+    }
+    hprof_flush_segment(&writer);
+    hprof_write_record_header(writer.f, HPROF_HEAP_DUMP_END, 0);
 
+    free(writer.segment);
+    free(field_name_ids);
+    if (fclose(writer.f) != 0 || failed) {
+        fprintf(stderr, "failed to write heap dump: %s\n", path);
+        return -1;
+    }
     return 0;
 }
 
-#define ACC_PUBLIC       0x0001
-#define ACC_PRIVATE      0x0002
-#define ACC_PROTECTED    0x0004
-#define ACC_STATIC       0x0008
-#define ACC_FINAL        0x0010
-#define ACC_SYNCHRONIZED 0x0020
-#define ACC_BRIDGE       0x0040
-#define ACC_VARARGS      0x0080
-#define ACC_NATIVE       0x0100
-#define ACC_ABSTRACT     0x0400
-#define ACC_STRICT       0x0800
-#define ACC_SYNTHETIC    0x1000
+int enable_perf_map(struct vm *vm, char *jitdump_dir) {
+    if (vm->perf_map != NULL) {
+        return 0;
+    }
+#if !defined(__x86_64__) && !defined(__aarch64__)
+    fprintf(stderr, "entries of methods are not supported on this architecture\n");
+    return -1;
+#endif
+    if (open_perf_map_files(jitdump_dir) != 0) {
+        return -1;
+    }
+    vm->perf_map = calloc(1, sizeof(struct perf_map));
+    if (vm->perf_map == NULL) {
+        return -1;
+    }
+    update_method_dispatch(vm);
+    return 0;
+}
 
-static bool is_static_method(struct method_info *method) {
-    return ((method->access_flags & ACC_STATIC) != 0);
+int set_agent_callbacks(struct vm *vm, const struct agent_callbacks *callbacks) {
+    if (callbacks == NULL) {
+        memset(&vm->agent, 0, sizeof(vm->agent));
+    } else {
+        vm->agent = *callbacks;
+    }
+    update_method_dispatch(vm);
+    return 0;
 }
 
-static bool is_native_method(struct method_info *method) {
-    return ((method->access_flags & ACC_NATIVE) != 0);
+int load_agent(struct vm *vm, char *path, char *options) {
+    int (*on_load)(struct vm *vm, char *options);
+
+    if (vm->agent_library != NULL) {
+        fprintf(stderr, "agent is already loaded\n");
+        return -1;
+    }
+    vm->agent_library = dlopen(path, RTLD_NOW);
+    if (vm->agent_library == NULL) {
+        fprintf(stderr, "failed to load %s: %s\n", path, dlerror());
+        return -1;
+    }
+    on_load = (int (*)(struct vm *, char *)) dlsym(vm->agent_library, "Agent_OnLoad");
+    if (on_load == NULL) {
+        fprintf(stderr, "not found Agent_OnLoad in %s\n", path);
+    }
+    if (on_load == NULL || on_load(vm, options) != 0) {
+        set_agent_callbacks(vm, NULL);
+        dlclose(vm->agent_library);
+        vm->agent_library = NULL;
+        return -1;
+    }
+    return 0;
 }
 
-/**
- * Return this class name representing by constant_utf8_info.
- * This should not return NULL.
- */
-static struct constant_utf8_info *get_this_class(struct class_file *class) {
-    u_int16_t this_class_index = class->this_class;
-    struct constant_class_info *cp_class = find_cp_class(this_class_index, class);
-    if (cp_class == NULL) {
-        return NULL;
+int enable_heap_dump(struct vm *vm, char *path) {
+    struct sigaction action;
+    char *copied;
+
+    copied = strdup_or_null(path);
+    if (copied == NULL) {
+        return -1;
     }
-    return find_cp_utf8(cp_class->name_index, class);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = heap_dump_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(HEAP_DUMP_SIGNAL, &action, NULL) != 0) {
+        perror("sigaction");
+        free(copied);
+        return -1;
+    }
+    free(vm->heap_dump_path);
+    vm->heap_dump_path = copied;
+    vm->handled_heap_dumps = heap_dump_requests;
+    return 0;
 }
 
 /**
- * Return constant_class_info at the specified index of constant pool.
- * Return NULL if the item is not Class.
+ * Load the classes and run main of the first one on the thread, which has entered the VM.
+ * Return exit code.
  */
-static struct constant_class_info *find_cp_class(int index, struct class_file *class) {
-    struct cp_info *cp_info;
+static int run_main(struct vm *vm, char *user_class_name[], int user_class_len) {
+    struct class_file *main_class = NULL, *class;
+    struct perf_values perf_start;
+    struct method_info *method;
+    struct code_attribute *code;
+    struct frame *frame;
+    u_int64_t start;
+    int i, retval;
 
-    if (index > class->constant_pool_count) {
-        return NULL;
+    // the first class has the main method
+    for (i = 0; i < user_class_len; i++) {
+        class = (struct class_file *) load_class(vm, user_class_name[i]);
+        if (class == NULL) {
+            fprintf(stderr, "failed to load class: %s\n", user_class_name[i]);
+            return 1;
+        }
+        if (i == 0) {
+            main_class = class;
+        }
     }
 
-    cp_info = class->constant_pool[index-1];
-    if (cp_info->tag != CONSTANT_CLASS) {
-        return NULL;
+    if (main_class == NULL) {
+        fprintf(stderr, "no class to run\n");
+        return 1;
+    }
+
+    start = get_monotonic_time();
+    method = find_method("main", main_class);
+    if (method == NULL) {
+        fprintf(stderr, "not found method: %s\n", "main");
+        return 1;
+    }
+
+    code = get_code(method, main_class);
+    if (code == NULL) {
+        fprintf(stderr, "not found code of method: %s\n", "main");
+        return 1;
+    }
+    vm->main_lookup_time = get_monotonic_time() - start;
+
+    vm->status = 0;
+    vm->error = NULL;
+    vm->active_calls++;
+    vm->thread = pthread_self();
+    frame = initialize_frame(1, 0);
+    // args of main is null, since the VM has no arrays or strings to hold arguments (see run_vm in main.h)
+    push_operand_stack(REFERENCE_NULL, frame);
+    perf_phase_begin(&vm->perf, &perf_start);
+    start = get_monotonic_time();
+    if ((vm->status = exec_method(vm, method, code, frame, main_class)) != 0) {
+        retval = vm->status;
+    } else {
+        pop_operand_stack((int32_t *) &retval, frame);
     }
+    vm->main_time = get_monotonic_time() - start;
+    perf_phase_end(&vm->perf, PERF_PHASE_MAIN, &perf_start);
+    free_frame(frame);
+    vm->active_calls--;
 
-    return (struct constant_class_info *) cp_info;
+    return retval;
 }
 
-/**
- * Return constant_fieldref_info at the specified index of constant pool.
- * Return NULL if the item is not Fieldred.
- */
-static struct constant_fieldref_info *find_cp_fieldref(int index, struct class_file *class) {
-    struct cp_info *cp_info;
+int run_vm(struct vm *vm, char *user_class_name[], int user_class_len) {
+    int retval;
 
-    if (index > class->constant_pool_count) {
-        return NULL;
+    if (enter_vm(vm) != 0) {
+        return 1;
     }
+    retval = run_main(vm, user_class_name, user_class_len);
+    leave_vm(vm);
+    return retval;
+}
 
-    cp_info = class->constant_pool[index-1];
-    if (cp_info->tag != CONSTANT_FIELDREF) {
-        return NULL;
+int run(char *user_class_name[], int user_class_len) {
+    struct vm *vm;
+    int retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
     }
 
-    return (struct constant_fieldref_info *) cp_info;
+    retval = run_vm(vm, user_class_name, user_class_len);
+
+    destroy_vm(vm);
+    return retval;
 }
 
-/**
- * Return constant_methodref_info at the specified index of constant pool.
- * Return NULL if the item is not Methodref.
- */
-static struct constant_methodref_info *find_cp_methodref(int index, struct class_file *class) {
-    struct cp_info *cp_info;
+int enable_perf_counters(struct vm *vm) {
+    int i;
 
-    if (index > class->constant_pool_count) {
-        return NULL;
+    if (vm->perf.enabled) {
+        return 0;
     }
-
-    cp_info = class->constant_pool[index-1];
-    if (cp_info->tag != CONSTANT_METHODREF) {
-        return NULL;
+    if (open_perf_counters(&vm->perf) == 0) {
+        fprintf(stderr, "no performance counter is available\n");
+        return -1;
     }
-
-    return (struct constant_methodref_info *) cp_info;
+    for (i = 0; i < PERF_EVENT_NUM; i++) {
+        if (vm->perf.fds[i] < 0) {
+            fprintf(stderr, "performance counter is not available: %s\n", perf_events[i].name);
+        }
+    }
+    return 0;
 }
 
-/**
- * Return constant_name_and_type_info at the specified index of constant pool.
- * Return NULL if the item is not NameAndType
- */
-static struct constant_name_and_type_info *find_cp_name_and_type(int index, struct class_file *class) {
-    struct cp_info *cp_info;
+static int compare_method_perf(const void *a, const void *b) {
+    const struct method_info *x = *(struct method_info * const *) a, *y = *(struct method_info * const *) b;
+    int i;
 
-    if (index > class->constant_pool_count) {
-        return NULL;
+    // by self value of the first available event
+    for (i = 0; i < PERF_EVENT_NUM; i++) {
+        if (x->perf->self.v[i] != y->perf->self.v[i]) {
+            return x->perf->self.v[i] < y->perf->self.v[i] ? 1 : -1;
+        }
     }
+    return 0;
+}
 
-    cp_info = class->constant_pool[index-1];
-    if (cp_info->tag != CONSTANT_NAME_AND_TYPE) {
-        return NULL;
-    }
+static void print_perf_values(FILE *out, struct perf_counters *perf, struct perf_values *values) {
+    int i;
 
-    return (struct constant_name_and_type_info *) cp_info;
+    for (i = 0; i < PERF_EVENT_NUM; i++) {
+        if (perf->fds[i] >= 0) {
+            fprintf(out, " %14llu", (unsigned long long) values->v[i]);
+        }
+    }
 }
 
-/**
- * Return constant_utf8_info at the specified index of constant pool.
- * Return NULL if the item is not Utf8.
- */
-static struct constant_utf8_info *find_cp_utf8(int index, struct class_file *class) {
-    struct cp_info *cp_info;
+void print_perf_counters(struct vm *vm, FILE *out) {
+    struct perf_counters *perf = &vm->perf;
+    struct method_info **methods;
+    struct class_file *class;
+    char class_name[1024], method_name[1024], name[2048];
+    int i, j, method_num = 0;
 
-    if (index > class->constant_pool_count) {
-        return NULL;
+    if (!perf->enabled) {
+        return;
     }
 
-    cp_info = class->constant_pool[index-1];
-    if (cp_info->tag != CONSTANT_UTF8) {
-        return NULL;
+    fprintf(out, "%-40s %8s", "phase / method", "calls");
+    for (i = 0; i < PERF_EVENT_NUM; i++) {
+        if (perf->fds[i] >= 0) {
+            fprintf(out, " %14.14s", perf_events[i].name);
+        }
     }
+    fprintf(out, "\n");
 
-    return (struct constant_utf8_info *) cp_info;
-}
+    for (i = 0; i < PERF_PHASE_NUM; i++) {
+        fprintf(out, "%-40s %8s", perf_phase_names[i], "");
+        print_perf_values(out, perf, &perf->phases[i]);
+        fprintf(out, "\n");
+    }
 
-/**
- * Allocate and initialize frame.
- * Return NULL if failed to initialize.
- */
-struct frame *initialize_frame(int max_stack, int max_locals) {
-    struct frame *f = (struct frame *) malloc(sizeof(struct frame));
-    if (f == NULL) {
-        return NULL;
+    for (i = 0; i < vm->loader.class_num; i++) {
+        method_num += vm->loader.classes[i]->methods_count;
     }
-    f->max_stack = max_stack;
-    f->stack_i = 0;
-    f->stack = (int32_t *) calloc(max_stack, sizeof(u_int32_t));
-    if (max_stack > 0 && f->stack == NULL) {
-        free(f);
-        return NULL;
+    methods = calloc(method_num + 1, sizeof(struct method_info *));
+    if (methods == NULL) {
+        return;
     }
-    f->max_locals = max_locals;
-    f->locals = (int32_t *) calloc(max_locals, sizeof(u_int32_t));
-    if (max_locals > 0 && f->locals == NULL) {
-        free(f);
-        return NULL;
+    method_num = 0;
+    for (i = 0; i < vm->loader.class_num; i++) {
+        class = vm->loader.classes[i];
+        for (j = 0; j < class->methods_count; j++) {
+            if (class->methods[j]->perf != NULL) {
+                methods[method_num++] = class->methods[j];
+            }
+        }
     }
-    return f;
+    qsort(methods, method_num, sizeof(struct method_info *), compare_method_perf);
+
+    // self and total (including callees) of each method
+    for (i = 0; i < method_num; i++) {
+        read_utf8(class_name, get_this_class(methods[i]->class));
+        get_method_name(method_name, methods[i], methods[i]->class);
+        snprintf(name, sizeof(name), "%s.%s", class_name, method_name);
+        fprintf(out, "%-40.40s %8ld", name, methods[i]->perf->calls);
+        print_perf_values(out, perf, &methods[i]->perf->self);
+        fprintf(out, "\n%-40s %8s", "  (total)", "");
+        print_perf_values(out, perf, &methods[i]->perf->total);
+        fprintf(out, "\n");
+    }
+    free(methods);
 }
 
-/**
- * Free allocated frame.
- */
-void free_frame(struct frame *frame) {
-    free(frame->stack);
-    free(frame->locals);
-    free(frame);
-}
+void print_startup_timings(struct vm *vm, FILE *out, int json) {
+    struct class_timings *t, total = {0};
+    struct native_loader *native = &vm->native_loader;
+    char class_name[1024];
+    int i;
 
-#define DESC_INT ('I')
+    if (json) {
+        fprintf(out, "{\"native_loader\": {\"libraries\": %d, \"dlopen\": %llu}, \"classes\": [",
+                native->library_num, (unsigned long long) native->dlopen_time);
+        for (i = 0; i < vm->loader.class_num; i++) {
+            t = &vm->loader.classes[i]->timings;
+            // class names have neither quotes nor backslashes
+            read_utf8(class_name, get_this_class(vm->loader.classes[i]));
+            fprintf(out, "%s{\"name\": \"%s\", \"open\": %llu, \"read\": %llu, \"constant_pool\": %llu, "
+                         "\"fields\": %llu, \"methods\": %llu, \"attributes\": %llu, \"clinit\": %llu}",
+                    i == 0 ? "" : ", ", class_name, (unsigned long long) t->open, (unsigned long long) t->read,
+                    (unsigned long long) t->constant_pool, (unsigned long long) t->fields,
+                    (unsigned long long) t->methods, (unsigned long long) t->attributes,
+                    (unsigned long long) t->clinit);
+        }
+        fprintf(out, "], \"main_lookup\": %llu, \"main\": %llu}\n",
+                (unsigned long long) vm->main_lookup_time, (unsigned long long) vm->main_time);
+        return;
+    }
 
-/**
- * Return how many units are necessary for descriptor c
- */
-static int get_operand_stack_units(char c) {
-    switch (c) {
-        case DESC_INT:
-            return 1;
-        default:
-            fprintf(stderr, "not yet implemented for %c in get_operand_stack_units\n", c);
-            return -1;
+    fprintf(out, "%-32s %9s %9s %9s %9s %9s %9s %9s\n",
+            "startup (us)", "open", "read", "cpool", "fields", "methods", "attrs", "clinit");
+    for (i = 0; i < vm->loader.class_num; i++) {
+        t = &vm->loader.classes[i]->timings;
+        read_utf8(class_name, get_this_class(vm->loader.classes[i]));
+        fprintf(out, "%-32.32s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", class_name,
+                t->open / 1e3, t->read / 1e3, t->constant_pool / 1e3, t->fields / 1e3,
+                t->methods / 1e3, t->attributes / 1e3, t->clinit / 1e3);
+        total.open += t->open;
+        total.read += t->read;
+        total.constant_pool += t->constant_pool;
+        total.fields += t->fields;
+        total.methods += t->methods;
+        total.attributes += t->attributes;
+        total.clinit += t->clinit;
     }
+    fprintf(out, "%-32s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", "(classes)",
+            total.open / 1e3, total.read / 1e3, total.constant_pool / 1e3, total.fields / 1e3,
+            total.methods / 1e3, total.attributes / 1e3, total.clinit / 1e3);
+    fprintf(out, "dlopen %.1f (%d libraries), main lookup %.1f, main %.1f\n",
+            native->dlopen_time / 1e3, native->library_num, vm->main_lookup_time / 1e3, vm->main_time / 1e3);
 }
 
-// TODO: support other types than int
-int push_operand_stack(int32_t item, struct frame *frame) {
-    if (frame->stack_i >= frame->max_stack) {
+int enable_stats(struct vm *vm, char *path) {
+    if (vm->stats != NULL) {
+        return 0;
+    }
+    vm->stats = calloc(1, sizeof(struct vm_stats));
+    if (vm->stats == NULL) {
         return -1;
     }
-    frame->stack[frame->stack_i] = item;
-    frame->stack_i++;
-    return 0;
-}
 
-// TODO: support other types than int
-int pop_operand_stack(int32_t *item, struct frame *frame) {
-    if (frame->stack_i == 0) {
+    vm->stats->out = path == NULL ? stderr : fopen(path, "w");
+    if (vm->stats->out == NULL) {
+        perror("fopen");
+        free(vm->stats);
+        vm->stats = NULL;
         return -1;
     }
-    frame->stack_i--;
-    *item = frame->stack[frame->stack_i];
+    vm->stats->close_out = path != NULL;
     return 0;
 }
 
-static int status = 0;
+static int compare_opcode_count(const void *a, const void *b, void *counts) {
+    long long x = ((long long *) counts)[*(const int *) a], y = ((long long *) counts)[*(const int *) b];
+    return (x < y) - (x > y);
+}
 
-static int exec_method(struct method_info *current_method, struct code_attribute *current_code,
-        struct frame *prev_frame, struct class_file *current_class, struct class_loader *loader,
-                struct native_loader *native_loader) {
-    u_int8_t *p = current_code->code;
-    u_int16_t current_code_len = current_code->code_length;
-    struct method_descriptor current_descriptor;
+static int compare_method_stats(const void *a, const void *b) {
+    const struct method_info *x = *(struct method_info * const *) a, *y = *(struct method_info * const *) b;
+    if (x->stats->bytecodes != y->stats->bytecodes) {
+        return x->stats->bytecodes < y->stats->bytecodes ? 1 : -1;
+    }
+    return (x->stats->invocations < y->stats->invocations) - (x->stats->invocations > y->stats->invocations);
+}
 
-    int i, j;
-    int cp_index;
-    int opcode, operand1, operand2, stack_unit;
-    struct constant_fieldref_info *cp_fieldref;
-    struct constant_methodref_info *cp_methodref;
-    struct constant_class_info *cp_class;
-    struct constant_name_and_type_info *cp_name_and_type;
-    struct constant_utf8_info *cp_utf8;
-    char buf[1024];
-    struct field_info *field;
-    struct method_info *method2;
-    struct code_attribute *code2;
-    struct class_file *class2;
-    int instance_index;
-    struct class_instance *instance;
+static int compare_class_stats(const void *a, const void *b) {
+    const struct class_file *x = *(struct class_file * const *) a, *y = *(struct class_file * const *) b;
+    return (x->created_instances < y->created_instances) - (x->created_instances > y->created_instances);
+}
 
-    // prepare frame
-    struct frame *current_frame = initialize_frame(current_code->max_stack, current_code->max_locals);
-    if (current_frame == NULL) {
-        fprintf(stderr, "failed to prepare frame\n");
-        return 1;
+void print_stats(struct vm *vm, FILE *out) {
+    struct vm_stats *stats = vm->stats;
+    struct method_info **methods;
+    struct class_file **classes, *class;
+    char class_name[1024], method_name[1024];
+    int opcodes[256];
+    int i, j, method_num = 0, class_num = 0;
+    long long bytecodes = 0;
+
+    if (stats == NULL) {
+        return;
     }
-
-    if (get_method_descriptor(&current_descriptor, current_method, current_class) != 0) {
-        fprintf(stderr, "failed to get descriptor\n");
-        return 1;
+    for (i = 0; i < 256; i++) {
+        bytecodes += stats->opcodes[i];
     }
 
-    i = 0;
-    // for 'this' reference
-    if (!is_static_method(current_method)) {
-        i++;
-    }
-    for (j = current_descriptor.num; j > 0; j--) {
-        pop_operand_stack(&current_frame->locals[j - 1 + i], prev_frame);
+    fprintf(out, "== opcodes ==\n");
+    for (i = 0; i < 256; i++) {
+        opcodes[i] = i;
     }
-    if (!is_static_method(current_method)) {
-        pop_operand_stack(&current_frame->locals[0], prev_frame);
+    qsort_r(opcodes, 256, sizeof(int), compare_opcode_count, stats->opcodes);
+    for (i = 0; i < 256 && stats->opcodes[opcodes[i]] > 0; i++) {
+        fprintf(out, "%14lld %6.2f%% %s\n", stats->opcodes[opcodes[i]],
+                100.0 * stats->opcodes[opcodes[i]] / bytecodes,
+                opcode_names[opcodes[i]] != NULL ? opcode_names[opcodes[i]] : "(unknown)");
     }
 
-    // interpret code
-    while (p < current_code->code + current_code_len && status == 0) {
-        if (*p == 0x02) {
-            // iconst_m1
-            p++;
-            printf("iconst_m1\n");
-            push_operand_stack(-1, current_frame);
-        } else if (*p == 0x03) {
-            // iconst_0
-            p++;
-            printf("iconst_0\n");
-            push_operand_stack(0, current_frame);
-        } else if (*p == 0x04) {
-            // iconst_1
-            p++;
-            printf("iconst_1\n");
-            push_operand_stack(1, current_frame);
-        } else if (*p == 0x10) {
-            // bipush
-            p++;
-            printf("bipush %d\n", (int32_t) *p);
-            push_operand_stack((int32_t) *p, current_frame);
-            p++;
-        } else if (*p == 0x1a) {
-            // iload_0
-            p++;
-            printf("iload_0\n");
-            push_operand_stack((int32_t) current_frame->locals[0], current_frame);
-        } else if (*p == 0x1b) {
-            // iload_1
-            // push value to stack from local 1
-            p++;
-            printf("iload_1\n");
-            push_operand_stack((int32_t) current_frame->locals[1], current_frame);
-        } else if (*p == 0x2a) {
-            // aload_0
-            p++;
-            printf("aload_0\n");
-
-            push_operand_stack((int32_t) current_frame->locals[0], current_frame);
-        } else if (*p == 0x2b) {
-            // aload_1
-            p++;
-            printf("aload_1\n");
-
-            push_operand_stack((int32_t) current_frame->locals[1], current_frame);
-        } else if (*p == 0x3c) {
-            // istore_1
-            // pop value from stack and store it in local 1
-            p++;
-            printf("istore_1\n");
-            pop_operand_stack((int32_t *) &current_frame->locals[1], current_frame);
-        } else if (*p == 0x4c) {
-            // astore_1
-            p++;
-            printf("astore_1\n");
-
-            pop_operand_stack((int32_t *) &current_frame->locals[1], current_frame);
-        } else if (*p == 0x59) {
-            // dup
-            p++;
-            printf("dup\n");
-
-            pop_operand_stack(&operand1, current_frame);
-            push_operand_stack(operand1, current_frame);
-            push_operand_stack(operand1, current_frame);
-        } else if (*p == 0x60) {
-            // iadd
-            p++;
-            pop_operand_stack(&operand2, current_frame);
-            pop_operand_stack(&operand1, current_frame);
-            printf("iadd: %d + %d\n", operand1, operand2);
-            push_operand_stack((int32_t) (operand1 + operand2), current_frame);
-        } else if (*p == 0x64) {
-            // isub
-            p++;
-            pop_operand_stack(&operand2, current_frame);
-            pop_operand_stack(&operand1, current_frame);
-            printf("isub: %d - %d\n", operand1, operand2);
-            push_operand_stack((int32_t) (operand1 - operand2), current_frame);
-        } else if (*p == 0xac) {
-            // ireturn
-            // pop value from the current frame and push to the invoker frame
-            p++;
-            pop_operand_stack((int32_t *) &operand1, current_frame);
-            printf("ireturn %d\n", operand1);
-            push_operand_stack((int32_t) operand1, prev_frame);
-            break;
-        } else if (*p == 0xb1) {
-            // return
-            p++;
-            printf("return\n");
-            break;
-        } else if (*p == 0xb2 || *p == 0xb3) {
-            // 0xb2: getstatic
-            // 0xb3: putstatic
-            opcode = *p;
-            p++;
-            cp_index = *p;
-            p++;
-            cp_index = (cp_index << 8) | *p;
-            p++;
-
-            if (opcode == 0xb2) {
-                printf("getstatic %d\n", cp_index);
-            } else {
-                printf("putstatic %d\n", cp_index);
-            }
-
-            cp_fieldref = find_cp_fieldref(cp_index, current_class);
-            if (cp_fieldref == NULL) {
-                fprintf(stderr, "Fieldref is not found in constant pool\n");
-                status = 1;
-            }
-
-            cp_class = find_cp_class(cp_fieldref->class_index, current_class);
-            if (cp_class == NULL) {
-                fprintf(stderr, "Class is not found in constant pool\n");
-                status = 1;
-            }
-
-            // check class having field
-            cp_utf8 = find_cp_utf8(cp_class->name_index, current_class);
-            if (cp_utf8 == NULL) {
-                fprintf(stderr, "Utf8 is not found in constant pool\n");
-                status = 1;
-            }
-            read_utf8(buf, cp_utf8);
-            class2 = get_class(loader, buf);
-            if (class2 == NULL) {
-                fprintf(stderr, "class not found: %s\n", buf);
-                status = 1;
+    for (i = 0; i < vm->loader.class_num; i++) {
+        method_num += vm->loader.classes[i]->methods_count;
+    }
+    methods = calloc(method_num + 1, sizeof(struct method_info *));
+    classes = calloc(vm->loader.class_num + 1, sizeof(struct class_file *));
+    if (methods == NULL || classes == NULL) {
+        free(methods);
+        free(classes);
+        return;
+    }
+    method_num = 0;
+    for (i = 0; i < vm->loader.class_num; i++) {
+        class = vm->loader.classes[i];
+        for (j = 0; j < class->methods_count; j++) {
+            if (class->methods[j]->stats != NULL) {
+                methods[method_num++] = class->methods[j];
             }
+        }
+        if (class->created_instances > 0) {
+            classes[class_num++] = class;
+        }
+    }
 
-            cp_name_and_type = find_cp_name_and_type(cp_fieldref->name_and_type_index, current_class);
-            if (cp_name_and_type == NULL) {
-                fprintf(stderr, "NameAndType is not found in constant pool\n");
-                status = 1;
-            }
+    fprintf(out, "== methods (invocations, bytecodes) ==\n");
+    qsort(methods, method_num, sizeof(struct method_info *), compare_method_stats);
+    for (i = 0; i < method_num; i++) {
+        read_utf8(class_name, get_this_class(methods[i]->class));
+        get_method_name(method_name, methods[i], methods[i]->class);
+        fprintf(out, "%14ld %14lld %s.%s\n", methods[i]->stats->invocations, methods[i]->stats->bytecodes,
+                class_name, method_name);
+    }
 
-            cp_utf8 = find_cp_utf8(cp_name_and_type->name_index, current_class);
-            if (cp_utf8 == NULL) {
-                fprintf(stderr, "Utf8 is not found in constant pool\n");
-                status = 1;
-            }
-            read_utf8(buf, cp_utf8);
+    fprintf(out, "== objects ==\n");
+    qsort(classes, class_num, sizeof(struct class_file *), compare_class_stats);
+    for (i = 0; i < class_num; i++) {
+        read_utf8(class_name, get_this_class(classes[i]));
+        fprintf(out, "%14ld %s\n", classes[i]->created_instances, class_name);
+    }
 
-            field = find_field(buf, class2);
-            if (field == NULL) {
-                fprintf(stderr, "field %s is not found.\n", buf);
-                status = 1;
-            }
+    fprintf(out, "== others ==\n");
+    fprintf(out, "%14lld bytecodes\n", bytecodes);
+    fprintf(out, "%14ld frames\n", stats->frames);
+    fprintf(out, "%14ld native calls\n", stats->native_calls);
+    fprintf(out, "%14ld class lookups\n", stats->class_lookups);
+    fprintf(out, "%14ld method lookups\n", stats->method_lookups);
+    fprintf(out, "%14ld field lookups\n", stats->field_lookups);
+    fflush(out);
+
+    free(methods);
+    free(classes);
+}
 
-            if (opcode == 0xb2) {
-                // getstatic
-                push_operand_stack(*(field->data), current_frame);
-            } else {
-                // putstatic
-                pop_operand_stack(&operand1, current_frame);
-                *(field->data) = operand1;
-            }
-        } else if (*p == 0xb4 || *p == 0xb5) {
-            // getfield (0xb4) or putfield (0xb5)
-            opcode = *p;
-            p++;
-            cp_index = *p;
-            p++;
-            cp_index = (cp_index << 8) | *p;
-            p++;
-            if (opcode == 0xb4) {
-                printf("getfield %d\n", cp_index);
-            } else {
-                printf("putfield %d\n", cp_index);
-            }
+int enable_profiler(struct vm *vm, int frequency, char *path) {
+    struct profiler *profiler;
 
-            // field is expected to belong to current_class (6.5 putfield)
-            cp_fieldref = find_cp_fieldref(cp_index, current_class);
-            cp_name_and_type = find_cp_name_and_type(cp_fieldref->name_and_type_index, current_class);
-            read_utf8(buf, find_cp_utf8(cp_name_and_type->descriptor_index, current_class));
-            stack_unit = get_operand_stack_units(buf[0]);
-            read_utf8(buf, find_cp_utf8(cp_name_and_type->name_index, current_class));
+    if (vm->profiler != NULL) {
+        return 0;
+    }
+    if (frequency <= 0 || frequency > 1000000) {
+        fprintf(stderr, "invalid sampling frequency: %d\n", frequency);
+        return -1;
+    }
 
-            // TODO: handle types other than int
-            if (stack_unit != 1) {
-                fprintf(stderr, "not implemented for stack_unit other than 1\n");
-                status = 1;
-            }
+    profiler = calloc(1, sizeof(struct profiler));
+    if (profiler == NULL) {
+        return -1;
+    }
+    profiler->top_frame = &vm->top_frame;
+    profiler->frames = malloc(PROFILER_MAX_FRAMES * sizeof(struct sample_frame));
+    profiler->samples = malloc(PROFILER_MAX_SAMPLES * sizeof(struct sample));
+    if (profiler->frames == NULL || profiler->samples == NULL) {
+        fprintf(stderr, "failed to malloc\n");
+        goto error;
+    }
 
-            if (opcode == 0xb4) {
-                // getfield
-                pop_operand_stack(&operand1, current_frame); // objectref
+    profiler->out = path == NULL ? stderr : fopen(path, "w");
+    if (profiler->out == NULL) {
+        perror("fopen");
+        goto error;
+    }
+    profiler->close_out = path != NULL;
 
-                instance = get_instance(operand1);
-                if (instance == NULL) {
-                    fprintf(stderr, "failed to get_instance\n");
-                    status = 1;
-                }
+    if (start_profiler(profiler, frequency) != 0) {
+        if (profiler->close_out) {
+            fclose(profiler->out);
+        }
+        goto error;
+    }
+    vm->profiler = profiler;
+    return 0;
 
-                if (get_instance_field(instance, buf, &operand2) < 0) {
-                    fprintf(stderr, "failed to get_instance_field\n");
-                    status = 1;
-                }
-                push_operand_stack(operand2, current_frame);
-            } else {
-                // putfield
-                pop_operand_stack(&operand1, current_frame); // value
-                pop_operand_stack(&operand2, current_frame); // objectref
+error:
+    free(profiler->frames);
+    free(profiler->samples);
+    free(profiler);
+    return -1;
+}
 
-                instance = get_instance(operand2);
-                if (instance == NULL) {
-                    fprintf(stderr, "failed to get_instance\n");
-                    status = 1;
-                }
+/**
+ * Request a safepoint, where the recorder writes the chunk if it is old enough.
+ * Called on a thread of the timer, which only arms the page, since the VM may be destroyed meanwhile
+ * (see Safepoints).
+ */
+static void recorder_timer(union sigval value) {
+    mprotect(value.sival_ptr, page_size, PROT_NONE);
+}
 
-                if (put_instance_field(instance, buf, &operand1) < 0) {
-                    fprintf(stderr, "failed to put_instance_field\n");
-                    status = 1;
-                }
-            }
-        } else if (*p == 0xb6 || *p == 0xb7) {
-            // invokevirtual (0xb6) or invokespecial (0xb7)
-            // TODO: follow spec (what should be checked respectively?)
-            opcode = *p;
-            p++;
-            cp_index = *p;
-            p++;
-            cp_index = (cp_index << 8) | *p;
-            p++;
-            if (opcode == 0xb6) {
-                printf("invokevirtual %d\n", cp_index);
-            } else {
-                printf("invokespecial %d\n", cp_index);
-            }
+int enable_recorder(struct vm *vm, char *path) {
+    struct recorder *recorder;
+    struct recording_header header;
+    struct sigevent event;
+    struct itimerspec spec;
 
-            cp_methodref = find_cp_methodref(cp_index, current_class);
-            if (cp_methodref == NULL) {
-                fprintf(stderr, "Methodref is not found in constant pool\n");
-                status = 1;
-            }
+    if (vm->recorder != NULL) {
+        return 0;
+    }
+    recorder = calloc(1, sizeof(struct recorder));
+    if (recorder == NULL) {
+        return -1;
+    }
+    recorder->out = fopen(path, "w");
+    if (recorder->out == NULL) {
+        perror("fopen");
+        free(recorder);
+        return -1;
+    }
 
-            cp_class = find_cp_class(cp_methodref->class_index, current_class);
-            if (cp_class == NULL) {
-                fprintf(stderr, "Class is not found in constant pool\n");
-                status = 1;
-            }
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, RECORDING_MAGIC);
+    header.version = RECORDING_VERSION;
+    header.record_size = sizeof(struct record);
+    if (fwrite(&header, sizeof(header), 1, recorder->out) != 1 || fflush(recorder->out) != 0) {
+        fprintf(stderr, "failed to write recording\n");
+        fclose(recorder->out);
+        free(recorder);
+        return -1;
+    }
 
-            // check class having method
-            cp_utf8 = find_cp_utf8(cp_class->name_index, current_class);
-            if (cp_utf8 == NULL) {
-                fprintf(stderr, "Utf8 is not found in constant pool\n");
-                status = 1;
-            }
-            read_utf8(buf, cp_utf8);
-            class2 = get_class(loader, buf);
-            if (class2 == NULL) {
-                fprintf(stderr, "class not found: %s\n", buf);
-                status = 1;
-            }
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD;
+    event.sigev_notify_function = recorder_timer;
+    event.sigev_value.sival_ptr = vm->polling_page;
+    if (timer_create(CLOCK_MONOTONIC, &event, &recorder->timer) != 0) {
+        perror("timer_create");
+        fclose(recorder->out);
+        free(recorder);
+        return -1;
+    }
+    memset(&spec, 0, sizeof(spec));
+    spec.it_interval.tv_sec = RECORDER_FLUSH_INTERVAL_NS / 1000000000ULL;
+    spec.it_value = spec.it_interval;
+    if (timer_settime(recorder->timer, 0, &spec, NULL) != 0) {
+        perror("timer_settime");
+        timer_delete(recorder->timer);
+        fclose(recorder->out);
+        free(recorder);
+        return -1;
+    }
+    recorder->tid = (int32_t) syscall(SYS_gettid);
+    vm->recorder = recorder;
+    return 0;
+}
 
-            cp_name_and_type = find_cp_name_and_type(cp_methodref->name_and_type_index, current_class);
-            if (cp_name_and_type == NULL) {
-                fprintf(stderr, "NameAndType is not found in constant pool\n");
-                status = 1;
-            }
+int enable_allocation_profiler(struct vm *vm, long sample_bytes, char *path) {
+    struct allocation_profiler *profiler;
+    struct sigaction action;
 
-            cp_utf8 = find_cp_utf8(cp_name_and_type->name_index, current_class);
-            if (cp_utf8 == NULL) {
-                fprintf(stderr, "Utf8 is not found in constant pool\n");
-                status = 1;
-            }
-            read_utf8(buf, cp_utf8);
+    if (vm->allocation_profiler != NULL) {
+        return 0;
+    }
+    if (sample_bytes < 0) {
+        fprintf(stderr, "invalid sampling interval: %ld\n", sample_bytes);
+        return -1;
+    }
+    profiler = calloc(1, sizeof(struct allocation_profiler));
+    if (profiler == NULL) {
+        return -1;
+    }
+    profiler->sample_bytes = sample_bytes;
+    profiler->until_sample = sample_bytes;
+    profiler->handled_requests = allocation_report_requests;
+
+    profiler->out = path == NULL ? stderr : fopen(path, "w");
+    if (profiler->out == NULL) {
+        perror("fopen");
+        free(profiler);
+        return -1;
+    }
+    profiler->close_out = path != NULL;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = allocation_report_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(ALLOCATION_REPORT_SIGNAL, &action, NULL) != 0) {
+        perror("sigaction");
+        if (profiler->close_out) {
+            fclose(profiler->out);
+        }
+        free(profiler);
+        return -1;
+    }
+    vm->allocation_profiler = profiler;
+    return 0;
+}
 
-            method2 = find_method(buf, class2);
-            if (method2 == NULL) {
-                fprintf(stderr, "not found method: %s\n", buf);
-                status = 1;
-            }
+void print_allocation_sites(struct vm *vm, FILE *out) {
+    if (vm->allocation_profiler != NULL) {
+        print_allocation_sites_of(vm->allocation_profiler, out);
+    }
+}
 
-            code2 = get_code(method2, class2);
-            if (code2 == NULL) {
-                fprintf(stderr, "not found code\n");
-                status = 1;
-            }
+void print_profile(struct vm *vm, FILE *out) {
+    struct profiler *profiler = vm->profiler;
+    char **stacks;
+    size_t size;
+    FILE *stack;
+    int i, j, frame_index = 0, sample_num;
 
-            status = exec_method(method2, code2, current_frame, class2, loader, native_loader);
-        } else if (*p == 0xb8) {
-            // invokestatic
-            p++;
-            cp_index = *p;
-            p++;
-            cp_index = (cp_index << 8) | *p;
-            p++;
-            printf("invokestatic %d\n", cp_index);
+    if (profiler == NULL) {
+        return;
+    }
+    // samples may be added while printing
+    sample_num = profiler->sample_num;
 
-            cp_methodref = find_cp_methodref(cp_index, current_class);
-            if (cp_methodref == NULL) {
-                fprintf(stderr, "Methodref is not found in constant pool\n");
-                status = 1;
-            }
+    stacks = calloc(sample_num + 1, sizeof(char *));
+    if (stacks == NULL) {
+        return;
+    }
+    for (i = 0; i < sample_num; i++) {
+        stack = open_memstream(&stacks[i], &size);
+        if (stack == NULL) {
+            sample_num = i;
+            break;
+        }
+        write_folded_stack(stack, &profiler->samples[i], profiler->frames + frame_index);
+        fclose(stack);
+        frame_index += profiler->samples[i].depth;
+    }
 
-            cp_class = find_cp_class(cp_methodref->class_index, current_class);
-            if (cp_class == NULL) {
-                fprintf(stderr, "Class is not found in constant pool\n");
-                status = 1;
-            }
+    // fold the same stacks
+    qsort(stacks, sample_num, sizeof(char *), compare_stacks);
+    for (i = 0; i < sample_num; i = j) {
+        for (j = i + 1; j < sample_num && strcmp(stacks[i], stacks[j]) == 0; j++);
+        fprintf(out, "%s %d\n", stacks[i], j - i);
+    }
+    fflush(out);
+    if (profiler->dropped > 0) {
+        fprintf(stderr, "%ld samples are dropped (buffers are full)\n", profiler->dropped);
+    }
 
-            // check class having method
-            cp_utf8 = find_cp_utf8(cp_class->name_index, current_class);
-            if (cp_utf8 == NULL) {
-                fprintf(stderr, "Utf8 is not found in constant pool\n");
-                status = 1;
-            }
-            read_utf8(buf, cp_utf8);
-            class2 = get_class(loader, buf);
-            if (class2 == NULL) {
-                fprintf(stderr, "class not found: %s\n", buf);
-                status = 1;
-            }
+    for (i = 0; i < sample_num; i++) {
+        free(stacks[i]);
+    }
+    free(stacks);
+}
 
-            cp_name_and_type = find_cp_name_and_type(cp_methodref->name_and_type_index, current_class);
-            if (cp_name_and_type == NULL) {
-                fprintf(stderr, "NameAndType is not found in constant pool\n");
-                status = 1;
-            }
+long long get_executed_bytecodes(struct vm *vm) {
+    return vm->executed_bytecodes;
+}
 
-            cp_utf8 = find_cp_utf8(cp_name_and_type->name_index, current_class);
-            if (cp_utf8 == NULL) {
-                fprintf(stderr, "Utf8 is not found in constant pool\n");
-                status = 1;
-            }
-            read_utf8(buf, cp_utf8);
+long long get_allocated_objects(struct vm *vm) {
+    return vm->allocated_objects;
+}
 
-            method2 = find_method(buf, class2);
-            if (method2 == NULL) {
-                fprintf(stderr, "not found method: %s\n", buf);
-                status = 1;
-            }
+void set_inlining(struct vm *vm, int max_size, int max_depth) {
+    if (max_size >= 0) {
+        vm->inline_max_size = max_size;
+    }
+    if (max_depth >= 0) {
+        vm->inline_max_depth = max_depth;
+    }
+}
 
-            if (!is_static_method(method2)) {
-                fprintf(stderr, "this is not static method\n");
-                status = 1;
-            }
+void set_tier_thresholds(struct vm *vm, long profile_threshold, long optimize_threshold) {
+    if (profile_threshold >= 0) {
+        vm->tier_profile_threshold = profile_threshold;
+    }
+    if (optimize_threshold >= 0) {
+        vm->tier_optimize_threshold = optimize_threshold;
+    }
+}
 
-            if (is_native_method(method2)) {
-                status = exec_native_method(method2, current_frame, class2, native_loader);
-            } else {
-                code2 = get_code(method2, class2);
-                if (code2 == NULL) {
-                    fprintf(stderr, "not found code\n");
-                    status = 1;
-                }
-                status = exec_method(method2, code2, current_frame, class2, loader, native_loader);
+void print_method_profiles(struct vm *vm, FILE *out) {
+    struct class_file *class;
+    struct method_info *method;
+    struct method_profile *profile;
+    char class_name[1024];
+    int i, j, pc, k;
+
+    fprintf(out, "== thresholds ==\n");
+    fprintf(out, "%14ld profiled (invocations)\n", vm->tier_profile_threshold);
+    fprintf(out, "%14ld optimized (invocations and backedges)\n", vm->tier_optimize_threshold);
+
+    fprintf(out, "== methods (tier, invocations, backedges) ==\n");
+    for (i = 0; i < vm->loader.class_num; i++) {
+        class = vm->loader.classes[i];
+        for (j = 0; j < class->methods_count; j++) {
+            profile = class->methods[j]->profile;
+            if (profile != NULL) {
+                fprintf(out, "%-11s %14ld %14ld ", tier_names[profile->tier], profile->invocations,
+                        profile->backedges);
+                write_frame_name(out, class->methods[j], -1);
+                fprintf(out, "\n");
             }
-        } else if (*p == 0xbb) {
-            // new
-            p++;
-            cp_index = *p;
-            p++;
-            cp_index = (cp_index << 8) | *p;
-            p++;
-            printf("new %d\n", cp_index);
+        }
+    }
 
-            // get class from constant pool
-            cp_class = find_cp_class(cp_index, current_class);
-            if (cp_class == NULL) {
-                fprintf(stderr, "Class is not found in constant pool\n");
-                status = 1;
+    fprintf(out, "== branches (taken, not taken) ==\n");
+    for (i = 0; i < vm->loader.class_num; i++) {
+        class = vm->loader.classes[i];
+        for (j = 0; j < class->methods_count; j++) {
+            method = class->methods[j];
+            if (method->profile == NULL || method->profile->branches == NULL) {
+                continue;
             }
-            cp_utf8 = find_cp_utf8(cp_class->name_index, current_class);
-            if (cp_utf8 == NULL) {
-                fprintf(stderr, "Utf8 is not found in constant pool\n");
-                status = 1;
-            }
-            read_utf8(buf, cp_utf8);
-            class2 = get_class(loader, buf);
-            if (class2 == NULL) {
-                fprintf(stderr, "class not found: %s\n", buf);
-                status = 1;
+            for (pc = 0; pc < method->profile->code_length; pc++) {
+                if (method->profile->branches[pc].taken > 0 || method->profile->branches[pc].not_taken > 0) {
+                    fprintf(out, "%14ld %14ld ", method->profile->branches[pc].taken,
+                            method->profile->branches[pc].not_taken);
+                    write_frame_name(out, method, pc);
+                    fprintf(out, "\n");
+                }
             }
+        }
+    }
 
-            // create instance
-            instance_index = create_instance(cp_class, class2, loader);
-            if (instance_index < 0) {
-                fprintf(stderr, "failed to create instance\n");
-                status = 1;
+    fprintf(out, "== receivers (count, class) ==\n");
+    for (i = 0; i < vm->loader.class_num; i++) {
+        class = vm->loader.classes[i];
+        for (j = 0; j < class->methods_count; j++) {
+            method = class->methods[j];
+            if (method->profile == NULL || method->profile->receivers == NULL) {
+                continue;
+            }
+            for (pc = 0; pc < method->profile->code_length; pc++) {
+                for (k = 0; k < RECEIVER_TYPES && method->profile->receivers[pc].classes[k] != NULL; k++) {
+                    read_utf8(class_name, get_this_class(method->profile->receivers[pc].classes[k]));
+                    fprintf(out, "%14ld %s ", method->profile->receivers[pc].counts[k], class_name);
+                    write_frame_name(out, method, pc);
+                    fprintf(out, "\n");
+                }
+                if (method->profile->receivers[pc].others > 0) {
+                    fprintf(out, "%14ld (others) ", method->profile->receivers[pc].others);
+                    write_frame_name(out, method, pc);
+                    fprintf(out, "\n");
+                }
             }
-
-            // push reference to operand stack
-            push_operand_stack(instance_index, current_frame);
-        } else {
-            fprintf(stderr, "unknown inst\n");
-            status = 1;
         }
     }
-
-    free_frame(current_frame);
-    return status;
+    fflush(out);
 }
 
-/**
- * Replace char a in str to char b.
- */
-static void strreplace(char *str, size_t len, char a, char b) {
-    int i;
+const char *get_vm_error(struct vm *vm) {
+    return vm->error;
+}
 
-    for (i = 0; i < len; i++) {
-        if (str[i] == a) {
-            str[i] = b;
-        }
-    }
+void set_trace(struct vm *vm, int enabled) {
+    vm->trace = enabled;
 }
 
-static void generate_native_method_name(char *native_method_name, char *class_name, char *method_name) {
-    char *replaced_class_name;
-    int class_name_len = strlen(class_name);
+static void shutdown_operation(struct vm *vm, void *status) {
+    TRACE(vm, "set status as %d\n", (int) (intptr_t) status);
+    vm->status = (int) (intptr_t) status;
+}
 
-    replaced_class_name = malloc(class_name_len + 1);
-    strncpy(replaced_class_name, class_name, class_name_len);
+int submit_vm_operation(struct vm *vm, void (*operation)(struct vm *vm, void *arg), void *arg) {
+    struct vm_operation *op;
 
-    strreplace(replaced_class_name, class_name_len, '/', '_');
-    sprintf(native_method_name, "Java_%s_%s", replaced_class_name, method_name);
+    op = malloc(sizeof(struct vm_operation));
+    if (op == NULL) {
+        return -1;
+    }
+    op->run = operation;
+    op->arg = arg;
+    op->next = __atomic_load_n(&vm->operations, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&vm->operations, &op->next, op, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+    if (mprotect(vm->polling_page, page_size, PROT_NONE) != 0) {
+        perror("mprotect");
+        return -1;
+    }
+    return 0;
+}
 
-    free(replaced_class_name);
+void request_shutdown(struct vm *vm, int s) {
+    // called by a native of the program, which stops as soon as the native returns
+    if (vm->active_calls > 0 && pthread_equal(vm->thread, pthread_self())) {
+        shutdown_operation(vm, (void *) (intptr_t) s);
+        return;
+    }
+    submit_vm_operation(vm, shutdown_operation, (void *) (intptr_t) s);
 }
 
-static int exec_native_method(struct method_info *method, struct frame *frame, struct class_file *class, struct native_loader *loader) {
-    typedef void (*Func) (void *, void *, int);
-    Func f;
-    struct constant_utf8_info *cp_utf8;
-    struct constant_class_info *cp_class;
-    char method_name[1024], class_name[1024], native_method_name[1024];
-    int operand;
+//
+// Server
+//
 
-    cp_utf8 = find_cp_utf8(method->name_index, class);
-    read_utf8(method_name, cp_utf8);
+// A request is a message of SOCK_SEQPACKET: a command and class file names separated by '\0'
+// (e.g. "run\0First.class\0").
+// The stdout of the client is passed with "run" (SCM_RIGHTS), and the exit code is sent back as int.
+// Each request runs on a child process forked from the server, so it starts from the same initialized
+// classes with a fresh heap, and nothing is left in the server after it.
 
-    cp_class = find_cp_class(class->this_class, class);
-    cp_utf8 = find_cp_utf8(cp_class->name_index, class);
-    read_utf8(class_name, cp_utf8);
+#define SERVER_REQUEST_SIZE 4096
 
-    generate_native_method_name(native_method_name, class_name, method_name);
+static int open_socket(char *socket_path, struct sockaddr_un *addr) {
+    int sock;
 
-    printf("%s\n", native_method_name);
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "too long socket path: %s\n", socket_path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socket_path);
 
-    f = (Func) dlsym(loader->handler, native_method_name);
+    sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0) {
+        perror("socket");
+    }
+    return sock;
+}
 
-    pop_operand_stack(&operand, frame);
+/**
+ * Send the message with fd (if fd >= 0).
+ * Return 0 if success, return -1 otherwise.
+ */
+static int send_message(int sock, char *buf, int len, int fd) {
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
 
-    if (f != NULL) {
-        f(NULL, NULL, operand);
-    } else {
-        printf("not found native method: %s\n", native_method_name);
-        status = 1;
+    if (sendmsg(sock, &msg, 0) < 0) {
+        perror("sendmsg");
+        return -1;
     }
+    return 0;
+}
 
-    return status;
+/**
+ * Receive a message into buf, and fd if passed (-1 otherwise).
+ * Return length of the message, or -1 if failed.
+ */
+static int receive_message(int sock, char *buf, int cap, int *fd) {
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    ssize_t len;
+
+    iov.iov_base = buf;
+    iov.iov_len = cap;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *fd = -1;
+    len = recvmsg(sock, &msg, 0);
+    if (len < 0) {
+        perror("recvmsg");
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return (int) len;
 }
 
-int run(char *user_class_name[], int user_class_len) {
-    char *main_class_name;
-    struct class_file *main_class;
-    struct class_loader loader;
-    struct native_loader native_loader;
-    struct method_info *method;
-    struct code_attribute *code;
-    struct frame *frame;
-    int i, retval;
-    char *c;
+/**
+ * Run the request on a child process, and send the exit code to the client.
+ */
+static void serve_run(struct vm *vm, int conn, int out_fd, char *buf, int len) {
+    char *names[256];
+    int name_num = 0, i, status;
+    pid_t pid;
 
-    if (initialize_native_loader(&native_loader) < 0) {
-        fprintf(stderr, "failed to initialize native loader\n");
-        return 1;
+    for (i = strlen(buf) + 1; i < len && name_num < 256; i += strlen(buf + i) + 1) {
+        names[name_num++] = buf + i;
     }
 
-    static char *stdlib_class_name[] = {"java/lang/Object.class", "java/lang/System.class"};
-    static int stdlib_class_len = (sizeof(stdlib_class_name) / sizeof (stdlib_class_name[0]));
-
-    int class_len = user_class_len + stdlib_class_len;
-    char **class_name = calloc(class_len, sizeof(char *));
-    for (i = 0; i < class_len; i++) {
-        if (i < stdlib_class_len) {
-            class_name[i] = stdlib_class_name[i];
-        } else {
-            class_name[i] = user_class_name[i - stdlib_class_len];
-        }
+    // not to write buffered output twice
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        status = 1;
+        send_message(conn, (char *) &status, sizeof(int), -1);
+        return;
+    }
+    if (pid > 0) {
+        return;
     }
 
-    if (initialize_class_loader(&loader, class_name, class_len, &native_loader) < 0) {
-        fprintf(stderr, "failed to initiazlie class loader\n");
-        return 1;
+    if (out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0) {
+        perror("dup2");
+        _exit(1);
     }
+    status = run_vm(vm, names, name_num);
+    fflush(stdout);
+    send_message(conn, (char *) &status, sizeof(int), -1);
+    _exit(0);
+}
 
-    // Derive main class name without extension
-    // e.g. First.class -> First
-    main_class_name = malloc(strlen(user_class_name[0]) + 1);
-    if (main_class_name == NULL) {
-        fprintf(stderr, "failed to malloc\n");
-        return 1;
+int serve_vm(struct vm *vm, char *socket_path) {
+    struct sockaddr_un addr;
+    char buf[SERVER_REQUEST_SIZE];
+    int sock, conn, out_fd, len;
+    bool stop = false;
+
+    sock = open_socket(socket_path, &addr);
+    if (sock < 0) {
+        return -1;
     }
-    strcpy(main_class_name, user_class_name[0]);
-    c = strchr(main_class_name, '.');
-    if (c == NULL) {
-        fprintf(stderr, "failed to get main class name\n");
-        return 1;
+    unlink(socket_path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+        perror("bind");
+        close(sock);
+        return -1;
     }
-    *c = '\0';
 
-    main_class = get_class(&loader, main_class_name);
-    if (main_class == NULL) {
-        fprintf(stderr, "not found class: %s\n", main_class_name);
-        return 1;
-    }
+    while (!stop) {
+        conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
 
-    method = find_method("main", main_class);
-    if (method == NULL) {
-        fprintf(stderr, "not found method: %s\n", "main");
-        return 1;
+        // reap finished requests
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+
+        len = receive_message(conn, buf, sizeof(buf) - 1, &out_fd);
+        if (len > 0) {
+            buf[len] = '\0';
+            if (strcmp(buf, "run") == 0) {
+                serve_run(vm, conn, out_fd, buf, len);
+            } else if (strcmp(buf, "stop") == 0) {
+                stop = true;
+            } else {
+                fprintf(stderr, "unknown request: %s\n", buf);
+            }
+        }
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        close(conn);
     }
 
-    code = get_code(method, main_class);
-    if (code == NULL) {
-        fprintf(stderr, "not found code of method: %s\n", "main");
-        return 1;
+    close(sock);
+    unlink(socket_path);
+    while (wait(NULL) > 0);
+    return stop ? 0 : -1;
+}
+
+/**
+ * Send the request to the server.
+ * Return the exit code sent back, or -1 if failed.
+ */
+static int send_request(char *socket_path, char *command, char *names[], int len) {
+    struct sockaddr_un addr;
+    char buf[SERVER_REQUEST_SIZE];
+    int sock, size, i, status, fd;
+    bool is_run;
+
+    size = strlen(command) + 1;
+    if (size > sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, command);
+    for (i = 0; i < len; i++) {
+        if (size + strlen(names[i]) + 1 > sizeof(buf)) {
+            fprintf(stderr, "too long request\n");
+            return -1;
+        }
+        strcpy(buf + size, names[i]);
+        size += strlen(names[i]) + 1;
     }
 
-    frame = initialize_frame(1, 0);
-    if ((status = exec_method(method, code, frame, main_class, &loader, &native_loader)) != 0) {
-        retval = status;
-    } else {
-        pop_operand_stack((int32_t *) &retval, frame);
+    sock = open_socket(socket_path, &addr);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
     }
 
-    tear_down_class_loader(&loader);
+    // only "run" passes stdout and waits for the exit code
+    is_run = strcmp(command, "run") == 0;
+    fflush(stdout);
+    if (send_message(sock, buf, size, is_run ? STDOUT_FILENO : -1) != 0) {
+        status = -1;
+    } else if (!is_run) {
+        status = 0;
+    } else if (receive_message(sock, (char *) &status, sizeof(int), &fd) != sizeof(int)) {
+        fprintf(stderr, "no exit code from server\n");
+        status = -1;
+    }
+    close(sock);
+    return status;
+}
 
-    return retval;
+int request_run(char *socket_path, char *class_name[], int len) {
+    int status = send_request(socket_path, "run", class_name, len);
+    return status < 0 ? 1 : status;
 }
 
-void request_shutdown(int s) {
-    printf("set status as %d\n", s);
-    status = s;
+int request_stop(char *socket_path) {
+    return send_request(socket_path, "stop", NULL, 0);
 }
@@ -8,6 +8,8 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include "jni.h"
+
 // 4.4 The Constant Pool
 struct cp_info {
     u_int8_t tag;
@@ -84,6 +86,25 @@ struct method_info {
     u_int16_t descriptor_index;
     u_int16_t attributes_count;
     struct attribute_info **attributes;
+    // TODO: this is not in the spec.
+    // class declaring this method
+    struct class_file *class;
+    // function bound to a native method. NULL until the first call.
+    void *native_func;
+    // how to pass arguments to native_func (prepared with native_func)
+    struct native_stub *native_stub;
+    // performance counters of the method. NULL until measured.
+    struct method_perf *perf;
+    // statistics of the method. NULL until invoked with statistics enabled.
+    struct method_stats *stats;
+    // trampoline to the interpreter named in the perf map. NULL until invoked with the perf map enabled.
+    void *entry;
+    // operand stack units of arguments including 'this'. -1 until the first call.
+    int arg_units;
+    // code with small callees spliced in (see set_inlining). NULL until the first call with inlining.
+    struct inlined_code *inlined;
+    // counters and profile promoting the method through tiers (see set_tier_thresholds). NULL until the first call.
+    struct method_profile *profile;
 };
 
 // Table 4.6-A: Method access and property flags
@@ -157,6 +178,18 @@ struct line_number_table_attribute {
 
 #define ATTR_LINE_NUMBER_TABLE_INFO(attr) ((struct line_number_table_attribute *) attr)
 
+// TODO: this is not in the spec.
+// Time spent to load a class in nanoseconds (see print_startup_timings)
+struct class_timings {
+    u_int64_t open;
+    u_int64_t read;
+    u_int64_t constant_pool; // including magic and versions
+    u_int64_t fields;        // including access_flags, this_class, super_class and interfaces
+    u_int64_t methods;
+    u_int64_t attributes;
+    u_int64_t clinit;
+};
+
 // 4.1 The ClassFile Structure
 struct class_file {
     u_int8_t magic[4];
@@ -175,6 +208,14 @@ struct class_file {
     struct method_info **methods;
     u_int16_t attributes_count;
     struct attribute_info **attributes;
+    // TODO: this is not in the spec.
+    // resolved entries of constant_pool (at the same index)
+    struct cp_cache_entry *cp_cache;
+    // number of instances created while statistics are enabled
+    long created_instances;
+    struct class_timings timings;
+    // non-zero if <clinit> failed, so the class is never used (it is erroneous as in 5.5)
+    int initialization_failed;
 };
 
 int parse_class(struct class_file *main_class, FILE *main_file);
@@ -201,16 +242,341 @@ int push_operand_stack(int32_t item, struct frame *frame);
 
 int pop_operand_stack(int32_t *item, struct frame *frame);
 
+//
+// Native methods
+//
+
+struct native_loader;
+
+// An entry of native method table (like JNINativeMethod in jni.h)
+struct native_method {
+    char *name;
+    char *signature; // NULL matches any signature
+    void *fn_ptr;
+    // 1 for "critical" natives of static methods which take neither JNIEnv nor jclass.
+    // They cannot call back the VM.
+    int critical;
+};
+
+/**
+ * Register native methods of the class (e.g. "java/lang/System") explicitly.
+ * Registered methods are preferred to ones found in loaded libraries.
+ * Return 0 if success, return -1 otherwise.
+ */
+int register_natives(struct native_loader *loader, char *class_name, struct native_method *methods, int len);
+
+/**
+ * Load lib<name>.so (like System.loadLibrary).
+ * Native methods not registered explicitly are searched from loaded libraries.
+ * Return 0 if success, return -1 otherwise.
+ */
+int load_library(struct native_loader *loader, char *name);
+
+/**
+ * Register natives of stdlib which are linked statically (defined in nativelib).
+ */
+int register_builtin_natives(struct native_loader *loader);
+
 //
 // Run main class
 //
 
+// A VM runs one program. VMs share no state, so they can run on separate threads at the same time.
+struct vm;
+
+/**
+ * Create a VM.
+ * Return NULL if failed to create.
+ */
+struct vm *create_vm(void);
+
+/**
+ * Destroy the VM and release everything allocated by it.
+ */
+void destroy_vm(struct vm *vm);
+
+/**
+ * Run program on the VM by specifying class name which has a main method.
+ * main(String[] args) is called with null for args, since arrays and strings are not supported.
+ * Return exit code.
+ */
+int run_vm(struct vm *vm, char *user_class_name[], int user_class_len);
+
 /**
  * Run program by specifying class name which has a main method.
  * Return exit code.
  */
 int run(char *user_class_name[], int user_class_len);
 
-void request_shutdown(int status);
+//
+// Embedding
+//
+// A VM can be kept alive to run many calls. Classes stay loaded and initialized,
+// and references in their constant pools stay resolved between calls.
+// Objects not reachable from static fields or global references may be freed at the start of call_method,
+// so objects kept by the host across calls must be pinned with new_global_ref.
+// A VM runs on one thread at a time: run_vm and call_method fail while it is running on another thread,
+// and the other functions must not be called meanwhile. Natives of the program may call it on its thread.
+//
+
+/**
+ * Load the class file (e.g. "First.class") into the VM and initialize it.
+ * Return the class loaded before if it has the same name.
+ * Return NULL if failed to load.
+ */
+jclass load_class(struct vm *vm, char *file_name);
+
+/**
+ * Return JNIEnv of the VM to find classes, methods and fields, and to create objects.
+ */
+JNIEnv *get_env(struct vm *vm);
+
+/**
+ * Call the method with arguments. obj is ignored for static methods.
+ * The return value is stored in result unless it is NULL.
+ * Return 0 if success, return -1 otherwise (also if the VM is running on another thread).
+ */
+int call_method(struct vm *vm, jmethodID method, jobject obj, const jvalue *args, jvalue *result);
+
+/**
+ * Return the binary name of the class of the error which stopped the last run_vm or call_method
+ * (e.g. "java/lang/ArithmeticException"), or NULL if it was not stopped by an error.
+ */
+const char *get_vm_error(struct vm *vm);
+
+/**
+ * Pin the object so that it is not collected until delete_global_ref.
+ * Return obj, or NULL if failed.
+ */
+jobject new_global_ref(struct vm *vm, jobject obj);
+
+/**
+ * Unpin the object pinned by new_global_ref.
+ */
+void delete_global_ref(struct vm *vm, jobject obj);
+
+/**
+ * Count hardware events (cycles, instructions, cache misses...) by perf_event_open
+ * for each phase (parse, init and main) and each method executed on the VM after this.
+ * Events are counted on the calling thread.
+ * Return 0 if any counter is available, return -1 otherwise.
+ */
+int enable_perf_counters(struct vm *vm);
+
+/**
+ * Print counters of phases and methods (sorted by the counts in themselves) enabled by enable_perf_counters.
+ */
+void print_perf_counters(struct vm *vm, FILE *out);
+
+/**
+ * Print the time spent in each phase of startup: dlopen of native libraries, open, read, parse
+ * (constant pool, fields, methods and attributes) and <clinit> of each class, and lookup and execution of main
+ * by the last run_vm. Print in JSON (times in nanoseconds) if json is not 0, or in a table (microseconds) otherwise.
+ */
+void print_startup_timings(struct vm *vm, FILE *out, int json);
+
+/**
+ * Count executed opcodes, invocations and bytecodes of methods, frames, native calls,
+ * lookups by name and created objects of classes.
+ * The report is written to the file (stderr if path is NULL) when the VM is destroyed.
+ * Return 0 if success, return -1 otherwise.
+ */
+int enable_stats(struct vm *vm, char *path);
+
+/**
+ * Print the statistics enabled by enable_stats (sorted by counts).
+ */
+void print_stats(struct vm *vm, FILE *out);
+
+/**
+ * Sample Java frames of the calling thread at the frequency (Hz) of its CPU time by SIGPROF.
+ * The CPU-time timer fires on scheduler ticks, so the actual rate may be lower than the frequency.
+ * Folded stacks (for flame graphs) are written to the file (stderr if path is NULL) when the VM is destroyed.
+ * Return 0 if success, return -1 otherwise.
+ */
+int enable_profiler(struct vm *vm, int frequency, char *path);
+
+/**
+ * Print the samples taken so far as folded stacks (e.g. "Main.main:3;Main.fib:8 42").
+ */
+void print_profile(struct vm *vm, FILE *out);
+
+/**
+ * Record the allocating method, pc and class of created objects.
+ * Every allocation is counted if sample_bytes is 0, otherwise one allocation is sampled every sample_bytes bytes.
+ * Top sites are written to the file (stderr if path is NULL) at the next safepoint after SIGUSR2,
+ * and when the VM is destroyed.
+ * Return 0 if success, return -1 otherwise.
+ */
+int enable_allocation_profiler(struct vm *vm, long sample_bytes, char *path);
+
+/**
+ * Print top allocation sites by count and by bytes.
+ */
+void print_allocation_sites(struct vm *vm, FILE *out);
+
+/**
+ * Enter the interpreter through an entry generated for each method, and name the entries in /tmp/perf-<pid>.map.
+ * Entries are also written into jitdump_dir/jit-<pid>.dump unless jitdump_dir is NULL.
+ * Return 0 if success, return -1 otherwise.
+ */
+int enable_perf_map(struct vm *vm, char *jitdump_dir);
+
+/**
+ * Write the heap, classes and their static fields into the file in the HPROF format.
+ * Return 0 if success, return -1 otherwise.
+ */
+int dump_heap(struct vm *vm, char *path);
+
+/**
+ * Write heap dumps into the file when an allocation fails, and at the next safepoint after SIGUSR1.
+ * Return 0 if success, return -1 otherwise.
+ */
+int enable_heap_dump(struct vm *vm, char *path);
+
+/**
+ * Record VM events (class loading, <clinit>, resolution, native binding, allocations, GC, promotion to the optimized
+ * tier, on-stack replacement and shutdown) into the file in the format of recording.h, at least every second while
+ * the program runs. See dump_recording to read it.
+ * Return 0 if success, return -1 otherwise.
+ */
+int enable_recorder(struct vm *vm, char *path);
+
+/**
+ * Return the number of instructions executed by the VM so far while statistics are enabled (see enable_stats).
+ * Instructions are not counted otherwise, so that the interpreter does not pay for it.
+ */
+long long get_executed_bytecodes(struct vm *vm);
+
+/**
+ * Return the number of objects created by the VM so far.
+ * Objects replaced by locals of the methods creating them (see set_inlining) are not counted.
+ */
+long long get_allocated_objects(struct vm *vm);
+
+/**
+ * Splice bodies of small statically bound callees (static, private and final methods, and constructors)
+ * into the code of methods when they are promoted to the optimized tier (see set_tier_thresholds).
+ * Callees of at most max_size bytes of code are inlined up to max_depth levels, and max_depth 0 disables inlining
+ * (by default 35 bytes and 9 levels). A negative limit is left as it is.
+ * Objects which do not escape the code of a method (with its callees inlined) are not created, and their fields
+ * are kept in locals instead (scalar replacement). This is also disabled by max_depth 0, and is not applied
+ * to methods optimized while allocations are observed by the allocation profiler, the recorder or an agent.
+ * Profiles report inlined callees as frames of their own. Methods already optimized are not changed,
+ * and inlining is off while statistics, performance counters, the perf map or method hooks are enabled.
+ */
+void set_inlining(struct vm *vm, int max_size, int max_depth);
+
+/**
+ * Set the counts promoting methods through tiers. Methods are interpreted first. After profile_threshold invocations
+ * they are profiled: how often their branches are taken and the classes of receivers of their invokevirtual
+ * are counted. After optimize_threshold invocations and backedges (iterations of loops), they run with their callees
+ * inlined and objects replaced (see set_inlining) from the next invocation, and a frame whose loop reaches
+ * the threshold continues in the optimized code at the loop header (on-stack replacement). By default 200 and 5000.
+ * A negative threshold is left as it is.
+ */
+void set_tier_thresholds(struct vm *vm, long profile_threshold, long optimize_threshold);
+
+/**
+ * Print the thresholds of tiers, and the tier, the counters and the profile of each method run so far.
+ * This may be called while the VM is running.
+ */
+void print_method_profiles(struct vm *vm, FILE *out);
+
+/**
+ * Print parsed class files and executed instructions of the VM to stdout (disabled by default).
+ * Classes loaded by create_vm are not printed.
+ */
+void set_trace(struct vm *vm, int enabled);
+
+/**
+ * Run the operation on the thread of the VM at its next safepoint (a backward branch or a return of a Java method),
+ * where the VM can be inspected or changed consistently. This can be called from any thread.
+ * Operations still queued when the VM is destroyed are dropped without running.
+ * Return 0 if success, return -1 otherwise.
+ */
+int submit_vm_operation(struct vm *vm, void (*operation)(struct vm *vm, void *arg), void *arg);
+
+/**
+ * Stop the program running on the VM with the exit code (like System.exit).
+ * Called from other threads, the program stops at the next safepoint (see submit_vm_operation).
+ */
+void request_shutdown(struct vm *vm, int status);
+
+//
+// Agent
+//
+// An agent is a native library (like JVMTI agents) to trace or meter programs without changing the VM.
+// It exports `int Agent_OnLoad(struct vm *vm, char *options)` which registers callbacks and returns 0.
+//
+
+// Callbacks of VM events (like jvmtiEventCallbacks). Events of NULL callbacks cost nothing.
+struct agent_callbacks {
+    // after the class is parsed and before its <clinit>
+    void (*class_prepare)(struct vm *vm, jclass clazz);
+    // of Java methods (not natives). status is 0 unless the method failed.
+    void (*method_entry)(struct vm *vm, jmethodID method);
+    void (*method_exit)(struct vm *vm, jmethodID method, int status);
+    // after the object is created (its fields are initialized)
+    void (*object_alloc)(struct vm *vm, jobject object, jclass clazz);
+    // at the start of destroy_vm
+    void (*vm_death)(struct vm *vm);
+};
+
+/**
+ * Replace callbacks of the VM with the copy of specified ones (or clear them if NULL).
+ * Return 0 if success, return -1 otherwise.
+ */
+int set_agent_callbacks(struct vm *vm, const struct agent_callbacks *callbacks);
+
+/**
+ * Load the agent library of the path, and call its Agent_OnLoad with the options (may be NULL).
+ * One agent can be loaded into a VM. It is unloaded when the VM is destroyed.
+ * Return 0 if success, return -1 otherwise.
+ */
+int load_agent(struct vm *vm, char *path, char *options);
+
+//
+// Snapshot
+//
+
+/**
+ * Save statics, objects and resolved references of classes in the VM into the file,
+ * e.g. after loading and initializing classes. The VM must not be running a program (e.g. calling a native).
+ * Return 0 if success, return -1 otherwise.
+ */
+int save_snapshot(struct vm *vm, char *path);
+
+/**
+ * Create a VM from the file saved by save_snapshot without initializing classes again.
+ * The file is mapped with the classes and objects in it, so class files are not read.
+ * It is saved by the same build of the VM.
+ * Return NULL if failed to restore.
+ */
+struct vm *restore_vm(char *path);
+
+//
+// Server
+//
+
+/**
+ * Serve requests to run programs on the VM over the Unix domain socket until request_stop.
+ * Classes loaded (and initialized) before serving are shared by all requests,
+ * but each request runs with its own heap and statics, so requests do not affect each other.
+ * Return 0 if stopped by request_stop, return -1 otherwise.
+ */
+int serve_vm(struct vm *vm, char *socket_path);
+
+/**
+ * Run program on the server like run. Output of the program goes to stdout of the caller.
+ * Return exit code.
+ */
+int request_run(char *socket_path, char *class_name[], int len);
+
+/**
+ * Stop the server.
+ * Return 0 if success, return -1 otherwise.
+ */
+int request_stop(char *socket_path);
 
 #endif //MIN_JVM_MAIN_H
@@ -0,0 +1,6 @@
+// assembled with max_stack of main set to 1 (javac computes 2), so the class is rejected when it is loaded
+class BadMaxStack {
+    public static int main(String[] args) {
+        return 1 + 2;
+    }
+}
@@ -0,0 +1,17 @@
+// recursion deeper than the native stack allows if each call is a call of the interpreter
+class DeepRecursion {
+    static int depth(int n) {
+        if (n == 0) {
+            return 0;
+        }
+        return depth(n - 1) + 1;
+    }
+
+    static int infinite(int n) {
+        return infinite(n + 1);
+    }
+
+    public static int main(String[] args) {
+        return depth(10000) == 10000 ? 53 : 0;
+    }
+}
@@ -0,0 +1,39 @@
+// objects of loops, which are replaced by locals unless they escape
+class EscapeAnalysis {
+    static EscapeAnalysis kept;
+    int x;
+    int y;
+
+    private EscapeAnalysis(int x, int y) {
+        this.x = x;
+        this.y = y;
+    }
+
+    private int sum() {
+        return x + y;
+    }
+
+    static int local(int n) {
+        int total = 0;
+        for (int i = 0; i < n; i++) {
+            EscapeAnalysis p = new EscapeAnalysis(i, 1);
+            p.x = p.x + p.y;
+            total = total + p.sum();
+        }
+        return total;
+    }
+
+    static int escaping(int n) {
+        int total = 0;
+        for (int i = 0; i < n; i++) {
+            EscapeAnalysis p = new EscapeAnalysis(i, 2);
+            kept = p;
+            total = total + p.x;
+        }
+        return total + kept.y;
+    }
+
+    public static int main(String[] args) {
+        return local(10) + escaping(10);
+    }
+}
@@ -0,0 +1,8 @@
+// <clinit> throws ArithmeticException, so the class is never initialized
+class FailedInitialization {
+    static int x = 1 / 0;
+
+    public static int main(String[] args) {
+        return x;
+    }
+}
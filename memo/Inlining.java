@@ -0,0 +1,38 @@
+// small callees of a loop, which are inlined into it
+class Inlining {
+    int value;
+
+    private Inlining(int value) {
+        this.value = value;
+    }
+
+    private int getValue() {
+        return value;
+    }
+
+    private void setValue(int value) {
+        this.value = value;
+    }
+
+    static Inlining create(int value) {
+        return new Inlining(value);
+    }
+
+    static int twice(int x) {
+        return x + x;
+    }
+
+    static int run(int n) {
+        int sum = 0;
+        for (int i = 0; i < n; i++) {
+            Inlining a = create(i);
+            a.setValue(twice(a.getValue()));
+            sum = sum + a.getValue();
+        }
+        return sum;
+    }
+
+    public static int main(String[] args) {
+        return run(10);
+    }
+}
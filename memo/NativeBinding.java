@@ -0,0 +1,17 @@
+class NativeBinding {
+    // found in the program at the first call
+    static native int linked(int x);
+    // found in the program, and then replaced by RegisterNatives
+    static native int replaced(int x);
+    static native void replace();
+
+    public static int main(String[] args) {
+        int sum = 0;
+        for (int i = 0; i < 100; i++) {
+            sum += linked(i);
+        }
+        int before = replaced(1);
+        replace();
+        return sum + before + replaced(100);
+    }
+}
@@ -0,0 +1,36 @@
+class NativeMethods {
+    private int x;
+
+    public NativeMethods(int x) {
+        this.x = x;
+    }
+
+    // found first by name, so natives tell it from twice(int) by the descriptor
+    public static int twice(int x, int times) {
+        return x * times;
+    }
+
+    public static int twice(int x) {
+        return x + x;
+    }
+
+    static native NativeMethods create(int x);
+    static native double toDouble(int x);
+    static native double half(double x);
+    static native float toFloat(double x);
+    static native long toLong(float x);
+    static native int toInt(long x);
+    static native int sum(long a, int b, byte c, short d, char e, boolean f, float g, double h);
+    static native int critical(int a, int b, int c, int d, int e, int f, int g, int h);
+    static native int callTwice(int x);
+    native int getX();
+
+    public static int main(String[] args) {
+        NativeMethods nm = create(10);
+        return toInt(toLong(toFloat(half(toDouble(20)))))
+                + sum(toLong(toFloat(toDouble(1))), 2, (byte) 3, (short) 4, (char) 5, true, toFloat(toDouble(6)), toDouble(7))
+                + critical(1, 2, 3, 4, 5, 6, 7, 8)
+                + nm.getX()
+                + callTwice(21);
+    }
+}
@@ -0,0 +1,21 @@
+// a long loop of main, which continues in the optimized code
+class OnStackReplacement {
+    int value;
+
+    private OnStackReplacement(int value) {
+        this.value = value;
+    }
+
+    private int get() {
+        return value;
+    }
+
+    public static int main(String[] args) {
+        OnStackReplacement total = new OnStackReplacement(0);
+        for (int i = 0; i < 1000; i++) {
+            OnStackReplacement p = new OnStackReplacement(i % 7);
+            total.value = total.value + p.get();
+        }
+        return total.value;
+    }
+}
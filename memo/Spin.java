@@ -0,0 +1,10 @@
+// loops until the VM is stopped
+class Spin {
+    public static int count;
+
+    public static int main(String[] args) {
+        while (true) {
+            count++;
+        }
+    }
+}
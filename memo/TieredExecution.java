@@ -0,0 +1,36 @@
+// hot methods promoted through tiers
+class TieredExecution {
+    int value;
+
+    TieredExecution(int value) {
+        this.value = value;
+    }
+
+    int getValue() {
+        return value;
+    }
+
+    static int abs(int x) {
+        if (x < 0) {
+            return -x;
+        }
+        return x;
+    }
+
+    static int run(int n) {
+        int sum = 0;
+        TieredExecution t = new TieredExecution(-1);
+        for (int i = 0; i < n; i++) {
+            sum = sum + abs(t.getValue());
+        }
+        return sum;
+    }
+
+    public static int main(String[] args) {
+        int sum = 0;
+        for (int i = 0; i < 20; i++) {
+            sum = sum + run(5);
+        }
+        return sum;
+    }
+}
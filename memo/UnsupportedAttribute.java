@@ -0,0 +1,8 @@
+// the Exceptions attribute of main is not supported, so the class fails to be parsed after its fields and <init>
+class UnsupportedAttribute {
+    static int count;
+
+    public static int main(String[] args) throws Exception {
+        return 3;
+    }
+}
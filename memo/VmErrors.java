@@ -0,0 +1,14 @@
+// errors thrown by the VM, which stop the program since they are not caught
+class VmErrors {
+    static int divide(int a, int b) {
+        return a / b;
+    }
+
+    static int remainder(int a, int b) {
+        return a % b;
+    }
+
+    public static int main(String[] args) {
+        return divide(84, 2);
+    }
+}
@@ -1,19 +1,19 @@
 #include <stdio.h>
 #include "../main.h"
+#include "../jni.h"
 
-#define JNIEXPORT
-#define JNICALL
-
-typedef struct JNIEnv {
+JNIEXPORT void JNICALL Java_java_lang_System_halt0(JNIEnv *env, jclass class, jint status) {
+    JavaVM *vm;
 
-} JNIEnv;
+    (*env)->GetJavaVM(env, &vm);
+    request_shutdown(vm, status);
+}
 
-// ref. jni.h (/usr/lib/jvm/default/include/jni.h)
-struct _jobject {};
-typedef struct _jobject *jobject;
-typedef int32_t jint;
-typedef jobject jclass;
+static struct native_method system_methods[] = {
+        {"halt0", "(I)V", Java_java_lang_System_halt0},
+};
 
-JNIEXPORT void JNICALL Java_java_lang_System_halt0(JNIEnv *env, jclass class, jint status) {
-    request_shutdown(status);
+int register_builtin_natives(struct native_loader *loader) {
+    return register_natives(loader, "java/lang/System", system_methods,
+                            sizeof(system_methods) / sizeof(system_methods[0]));
 }
@@ -0,0 +1,57 @@
+//
+// File format of the event recorder (see enable_recorder).
+// Shared by the VM and the dump_recording tool.
+//
+// A recording is a header followed by chunks. Each chunk is a chunk header followed by
+// fixed-size records of events in the order of their end. Chunks are flushed when the buffer
+// is full or a while after the chunk starts, so a recording of a crashed VM ends with the last chunk.
+// Integers are in the byte order of the host.
+//
+
+#ifndef MIN_JVM_RECORDING_H
+#define MIN_JVM_RECORDING_H
+
+#include <stdint.h>
+
+#define RECORDING_MAGIC "MJVMREC"
+#define RECORDING_VERSION 1
+#define RECORDING_CHUNK_MAGIC 0x4b4e4843 // "CHNK"
+
+#define RECORD_NAME_LEN 32
+
+enum record_type {
+    RECORD_CLASS_LOAD = 1, // name: class file, duration: parse
+    RECORD_CLASS_INIT,     // name: class, value: 0 if succeeded, duration: <clinit>
+    RECORD_RESOLVE,        // name: class or member, value: index of constant pool
+    RECORD_NATIVE_BIND,    // name: method
+    RECORD_ALLOCATION,     // value: objects allocated in a burst, duration: since the first of them
+    RECORD_GC,             // value: freed objects
+    RECORD_SHUTDOWN,       // value: exit status
+    RECORD_OPTIMIZE,       // name: method, value: 0 if promoted to the optimized tier, duration: building its code
+    RECORD_OSR,            // name: method, value: pc of the loop header, duration: promotion and frame replacement
+    RECORD_TYPE_NUM,
+};
+
+struct recording_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct recording_chunk {
+    uint32_t magic;
+    uint32_t record_num;
+    uint64_t start_ns;
+    uint64_t end_ns;
+};
+
+struct record {
+    uint64_t start_ns; // CLOCK_MONOTONIC
+    uint64_t duration_ns;
+    uint64_t value;
+    uint32_t type;
+    int32_t tid;
+    char name[RECORD_NAME_LEN]; // truncated and NUL-terminated
+};
+
+#endif //MIN_JVM_RECORDING_H
@@ -0,0 +1,65 @@
+#include <dlfcn.h>
+#include "../main.h"
+
+enum {CLASS_PREPARE, METHOD_ENTRY, METHOD_EXIT, OBJECT_ALLOC, VM_DEATH, EVENT_NUM};
+
+static int run_with_agent(char *options) {
+    char *classes[1] = {"CreateInstance.class"};
+    struct vm *vm;
+    int retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return -1;
+    }
+    if (load_agent(vm, AGENT_PATH, options) != 0) {
+        destroy_vm(vm);
+        return -1;
+    }
+    retval = run_vm(vm, classes, 1);
+    destroy_vm(vm);
+    if (retval != 49) {
+        fprintf(stderr, "expect %d but actual %d\n", 49, retval);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    void *library;
+    int *events, i;
+
+    // keep the agent loaded to read its counts after the VM unloads it
+    library = dlopen(AGENT_PATH, RTLD_NOW);
+    if (library == NULL || (events = dlsym(library, "agent_events")) == NULL) {
+        fprintf(stderr, "failed to load %s\n", AGENT_PATH);
+        return 1;
+    }
+
+    if (run_with_agent(NULL) != 0) {
+        return 1;
+    }
+    if (events[CLASS_PREPARE] != 1 || events[OBJECT_ALLOC] < 1 || events[VM_DEATH] != 1) {
+        fprintf(stderr, "events are not reported: %d %d %d\n",
+                events[CLASS_PREPARE], events[OBJECT_ALLOC], events[VM_DEATH]);
+        return 1;
+    }
+    if (events[METHOD_ENTRY] != 0 || events[METHOD_EXIT] != 0) {
+        fprintf(stderr, "methods are reported without hooks\n");
+        return 1;
+    }
+
+    for (i = 0; i < EVENT_NUM; i++) {
+        events[i] = 0;
+    }
+    if (run_with_agent("methods") != 0) {
+        return 1;
+    }
+    if (events[METHOD_ENTRY] < 1 || events[METHOD_ENTRY] != events[METHOD_EXIT]) {
+        fprintf(stderr, "methods are not reported: %d %d\n", events[METHOD_ENTRY], events[METHOD_EXIT]);
+        return 1;
+    }
+
+    dlclose(library);
+    return 0;
+}
@@ -0,0 +1,46 @@
+//
+// Agent counting events for the test of agents.
+//
+
+#include <string.h>
+#include "../main.h"
+
+enum {CLASS_PREPARE, METHOD_ENTRY, METHOD_EXIT, OBJECT_ALLOC, VM_DEATH, EVENT_NUM};
+
+// read by the test
+int agent_events[EVENT_NUM];
+
+static void class_prepare(struct vm *vm, jclass clazz) {
+    agent_events[CLASS_PREPARE]++;
+}
+
+static void method_entry(struct vm *vm, jmethodID method) {
+    agent_events[METHOD_ENTRY]++;
+}
+
+static void method_exit(struct vm *vm, jmethodID method, int status) {
+    agent_events[METHOD_EXIT]++;
+}
+
+static void object_alloc(struct vm *vm, jobject object, jclass clazz) {
+    agent_events[OBJECT_ALLOC]++;
+}
+
+static void vm_death(struct vm *vm) {
+    agent_events[VM_DEATH]++;
+}
+
+int Agent_OnLoad(struct vm *vm, char *options) {
+    struct agent_callbacks callbacks;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.class_prepare = class_prepare;
+    callbacks.object_alloc = object_alloc;
+    callbacks.vm_death = vm_death;
+    // method hooks only if requested
+    if (options != NULL && strcmp(options, "methods") == 0) {
+        callbacks.method_entry = method_entry;
+        callbacks.method_exit = method_exit;
+    }
+    return set_agent_callbacks(vm, &callbacks);
+}
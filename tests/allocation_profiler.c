@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include "../main.h"
+
+int main(int argc, char *argv[]) {
+    char *classes[1] = {"CreateInstance.class"};
+    char path[] = "/tmp/min_jvm_allocationsXXXXXX";
+    char requested[4096];
+    char *report;
+    size_t report_size;
+    struct vm *vm;
+    FILE *out;
+    int fd, i, retval;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    if (enable_allocation_profiler(vm, 0, path) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+
+    // the report requested by the signal is written at the first safepoint of the second run, after its allocation
+    for (i = 0; i < 2; i++) {
+        retval = run_vm(vm, classes, 1);
+        if (retval != 49) {
+            fprintf(stderr, "expect %d but actual %d\n", 49, retval);
+            return 1;
+        }
+        if (i == 0) {
+            raise(SIGUSR2);
+        }
+    }
+
+    out = open_memstream(&report, &report_size);
+    print_allocation_sites(vm, out);
+    fclose(out);
+    fprintf(stderr, "%s", report);
+
+    out = fopen(path, "r");
+    memset(requested, 0, sizeof(requested));
+    if (out == NULL || fread(requested, 1, sizeof(requested) - 1, out) == 0) {
+        fprintf(stderr, "the requested report is not written\n");
+        return 1;
+    }
+    fclose(out);
+    destroy_vm(vm);
+    unlink(path);
+
+    // both objects are counted at the same site
+    if (strstr(report, " 2 ") == NULL || strstr(report, "CreateInstance.main:") == NULL) {
+        fprintf(stderr, "the allocation site is not reported\n");
+        return 1;
+    }
+    free(report);
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <string.h>
+#include "../main.h"
+#include "../jni.h"
+
+static void method_entry(struct vm *vm, jmethodID method) {
+}
+
+/**
+ * Check that infinite recursion fails with StackOverflowError, and the VM is still usable after it.
+ * Return 0 if success, return 1 otherwise.
+ */
+static int expect_stack_overflow(struct vm *vm) {
+    JNIEnv *env;
+    jclass class;
+    jmethodID infinite, depth;
+    jvalue args[1], result;
+
+    env = get_env(vm);
+    class = load_class(vm, "DeepRecursion.class");
+    infinite = (*env)->GetStaticMethodID(env, class, "infinite", "(I)I");
+    depth = (*env)->GetStaticMethodID(env, class, "depth", "(I)I");
+    args[0].i = 0;
+    if (call_method(vm, infinite, NULL, args, &result) == 0) {
+        fprintf(stderr, "infinite recursion did not fail\n");
+        return 1;
+    }
+    if (get_vm_error(vm) == NULL || strcmp(get_vm_error(vm), "java/lang/StackOverflowError") != 0) {
+        fprintf(stderr, "infinite recursion did not fail by StackOverflowError\n");
+        return 1;
+    }
+    args[0].i = 100;
+    if (call_method(vm, depth, NULL, args, &result) != 0 || result.i != 100) {
+        fprintf(stderr, "failed to call after stack overflow\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *classes[1] = {"DeepRecursion.class"};
+    struct agent_callbacks callbacks = {0};
+    struct vm *vm;
+    int retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+
+    // deep recursion runs on the frame stack of the VM
+    retval = run_vm(vm, classes, 1);
+    if (retval != 53) {
+        fprintf(stderr, "expect %d but actual %d\n", 53, retval);
+        return 1;
+    }
+    if (expect_stack_overflow(vm) != 0) {
+        return 1;
+    }
+
+    // with a hook of method entries, each Java call nests a call of the interpreter on the native stack
+    callbacks.method_entry = method_entry;
+    if (set_agent_callbacks(vm, &callbacks) != 0 || expect_stack_overflow(vm) != 0) {
+        return 1;
+    }
+
+    destroy_vm(vm);
+    return 0;
+}
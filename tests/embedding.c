@@ -0,0 +1,81 @@
+#include "../main.h"
+#include "../jni.h"
+
+// A VM is kept alive and called many times like an embedded engine.
+
+static int expect(char *what, int expected, int actual) {
+    if (expected != actual) {
+        fprintf(stderr, "%s: expect %d but actual %d\n", what, expected, actual);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct vm *vm;
+    JNIEnv *env;
+    jclass instance_fields, call_static, initialize;
+    jmethodID init, set_x, get_x, sub, main_method;
+    jobject pinned;
+    jvalue args[2], result;
+    int i;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    env = get_env(vm);
+
+    // an object pinned by the host survives objects created and dropped between calls
+    instance_fields = load_class(vm, "InstanceFields.class");
+    if (instance_fields == NULL) {
+        return 1;
+    }
+    init = (*env)->GetMethodID(env, instance_fields, "<init>", "()V");
+    set_x = (*env)->GetMethodID(env, instance_fields, "setX", "(I)V");
+    get_x = (*env)->GetMethodID(env, instance_fields, "getX", "()I");
+    pinned = new_global_ref(vm, (*env)->NewObject(env, instance_fields, init));
+    for (i = 0; i < 10000; i++) {
+        (*env)->NewObject(env, instance_fields, init);
+
+        args[0].i = i;
+        if (call_method(vm, set_x, pinned, args, NULL) != 0
+                || call_method(vm, get_x, pinned, NULL, &result) != 0
+                || expect("getX", i, result.i) != 0) {
+            return 1;
+        }
+    }
+    delete_global_ref(vm, pinned);
+
+    // static methods are resolved once and called repeatedly
+    call_static = load_class(vm, "CallStaticMethodTwoArg.class");
+    if (call_static == NULL) {
+        return 1;
+    }
+    sub = (*env)->GetStaticMethodID(env, call_static, "sub", "(II)I");
+    for (i = 0; i < 10000; i++) {
+        args[0].i = i;
+        args[1].i = 1;
+        if (call_method(vm, sub, NULL, args, &result) != 0 || expect("sub", i - 1, result.i) != 0) {
+            return 1;
+        }
+    }
+
+    // a class is initialized only once even if it is loaded again
+    initialize = load_class(vm, "InitializeClass.class");
+    if (initialize == NULL || load_class(vm, "InitializeClass.class") != initialize) {
+        fprintf(stderr, "class is loaded twice\n");
+        return 1;
+    }
+    main_method = (*env)->GetStaticMethodID(env, initialize, "main", "([Ljava/lang/String;)I");
+    args[0].l = NULL;
+    if (call_method(vm, main_method, NULL, args, &result) != 0 || expect("first main", 48, result.i) != 0) {
+        return 1;
+    }
+    if (call_method(vm, main_method, NULL, args, &result) != 0 || expect("second main", 49, result.i) != 0) {
+        return 1;
+    }
+
+    destroy_vm(vm);
+    return 0;
+}
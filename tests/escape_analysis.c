@@ -0,0 +1,52 @@
+#include <stdlib.h>
+#include "tiering.h"
+
+/**
+ * Run EscapeAnalysis with callees inlined up to max_depth levels, optionally with the allocation profiler.
+ * Return the number of created objects, or -1 if failed.
+ */
+static long long run_escape_analysis(int max_depth, int profiled) {
+    long long allocated;
+    struct vm *vm;
+
+    // methods are optimized at their first invocation
+    vm = create_tiered_vm(-1, 0, max_depth);
+    if (vm == NULL) {
+        return -1;
+    }
+    if (profiled && enable_allocation_profiler(vm, 0, "/dev/null") != 0) {
+        destroy_vm(vm);
+        return -1;
+    }
+    if (run_expected(vm, "EscapeAnalysis.class", 112) != 0) {
+        return -1;
+    }
+    allocated = get_allocated_objects(vm);
+    destroy_vm(vm);
+    return allocated;
+}
+
+int main(int argc, char *argv[]) {
+    long long allocated;
+
+
+    // objects of local do not escape, and the ones of escaping are stored into a static field
+    allocated = run_escape_analysis(9, 0);
+    if (allocated != 10) {
+        fprintf(stderr, "expect %d objects with scalar replacement but actual %lld\n", 10, allocated);
+        return 1;
+    }
+
+    // all objects are created without inlining, or while allocations are observed
+    allocated = run_escape_analysis(0, 0);
+    if (allocated != 20) {
+        fprintf(stderr, "expect %d objects without inlining but actual %lld\n", 20, allocated);
+        return 1;
+    }
+    allocated = run_escape_analysis(9, 1);
+    if (allocated != 20) {
+        fprintf(stderr, "expect %d objects with the allocation profiler but actual %lld\n", 20, allocated);
+        return 1;
+    }
+    return 0;
+}
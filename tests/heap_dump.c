@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../main.h"
+
+static u_int64_t read_u(const u_int8_t *p, int size) {
+    u_int64_t value = 0;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+/**
+ * Walk sub-records of a heap dump segment.
+ * Return the number of instances, or -1 if the segment is broken.
+ */
+static int count_instances(const u_int8_t *p, const u_int8_t *end, int *statics) {
+    int instances = 0, num, i, type;
+
+    while (p < end) {
+        switch (*p++) {
+            case 0x01: // ROOT_JNI_GLOBAL
+                p += 16;
+                break;
+            case 0x05: // ROOT_STICKY_CLASS
+                p += 8;
+                break;
+            case 0x20: // CLASS_DUMP
+                p += 8 + 4 + 8 * 6 + 4;
+                if (read_u(p, 2) != 0) {
+                    return -1;
+                }
+                p += 2;
+                num = (int) read_u(p, 2);
+                p += 2;
+                for (i = 0; i < num; i++) {
+                    type = p[8];
+                    if (type == 2 && read_u(p + 9, 8) != 0) {
+                        (*statics)++;
+                    }
+                    p += 9 + (type == 2 ? 8 : 4);
+                }
+                num = (int) read_u(p, 2);
+                p += 2 + num * 9;
+                break;
+            case 0x21: // INSTANCE_DUMP
+                p += 8 + 4 + 8;
+                p += 4 + read_u(p, 4);
+                instances++;
+                break;
+            default:
+                return -1;
+        }
+    }
+    return p == end ? instances : -1;
+}
+
+int main(int argc, char *argv[]) {
+    char *classes[1] = {"StaticReferenceField.class"};
+    char path[] = "/tmp/min_jvm_heapXXXXXX";
+    u_int8_t *dump;
+    long size, pos;
+    struct vm *vm;
+    FILE *f;
+    int fd, retval, instances = 0, statics = 0, n, ended = 0;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    retval = run_vm(vm, classes, 1);
+    if (retval != 51) {
+        fprintf(stderr, "expect %d but actual %d\n", 51, retval);
+        return 1;
+    }
+    if (dump_heap(vm, path) != 0) {
+        return 1;
+    }
+    destroy_vm(vm);
+
+    f = fopen(path, "r");
+    unlink(path);
+    if (f == NULL) {
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    dump = malloc(size);
+    if (dump == NULL || fread(dump, 1, size, f) != (size_t) size) {
+        return 1;
+    }
+    fclose(f);
+
+    if (strcmp((char *) dump, "JAVA PROFILE 1.0.2") != 0 || read_u(dump + 19, 4) != 8) {
+        fprintf(stderr, "invalid header\n");
+        return 1;
+    }
+    for (pos = 19 + 4 + 8; pos + 9 <= size && !ended; pos += 9 + read_u(dump + pos + 5, 4)) {
+        if (dump[pos] == 0x1c) {
+            n = count_instances(dump + pos + 9, dump + pos + 9 + read_u(dump + pos + 5, 4), &statics);
+            if (n < 0) {
+                fprintf(stderr, "broken segment at %ld\n", pos);
+                return 1;
+            }
+            instances += n;
+        }
+        ended = dump[pos] == 0x2c;
+    }
+    free(dump);
+
+    // the instance is referenced from the static field
+    fprintf(stderr, "%d instances, %d static references\n", instances, statics);
+    if (!ended || instances == 0 || statics == 0) {
+        fprintf(stderr, "heap is not dumped\n");
+        return 1;
+    }
+    return 0;
+}
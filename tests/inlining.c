@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tiering.h"
+
+/**
+ * Return the invocations of the method (e.g. "Inlining.twice") in the profiles, or 0 if it is not invoked.
+ */
+static long get_invocations(const char *profiles, const char *method) {
+    char tier[32];
+    long invocations, backedges;
+
+    return get_method_profile(profiles, method, tier, &invocations, &backedges) == 0 ? invocations : 0;
+}
+
+/**
+ * Run Inlining with callees inlined up to max_depth levels, and store the report of allocation sites
+ * and the profiles of methods.
+ * Return 0 if success, return -1 otherwise.
+ */
+static int run_inlining(int max_depth, char **report, char **profiles) {
+    struct vm *vm;
+
+    // methods are optimized at their first invocation
+    vm = create_tiered_vm(-1, 0, max_depth);
+    if (vm == NULL) {
+        return -1;
+    }
+    if (enable_allocation_profiler(vm, 0, "/dev/null") != 0) {
+        destroy_vm(vm);
+        return -1;
+    }
+    if (run_expected(vm, "Inlining.class", 90) != 0) {
+        return -1;
+    }
+    *report = print_report(vm, print_allocation_sites);
+    *profiles = print_report(vm, print_method_profiles);
+    destroy_vm(vm);
+    return *report != NULL && *profiles != NULL ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    char *inlined_report, *called_report, *inlined_profiles, *called_profiles;
+    char *callees[4] = {"Inlining.create", "Inlining.twice", "Inlining.getValue", "Inlining.setValue"};
+    int i;
+
+    if (run_inlining(9, &inlined_report, &inlined_profiles) != 0
+        || run_inlining(0, &called_report, &called_profiles) != 0) {
+        return 1;
+    }
+
+    // invocations of the accessors, the constructors and the helpers are gone
+    for (i = 0; i < 4; i++) {
+        if (get_invocations(inlined_profiles, callees[i]) != 0 || get_invocations(called_profiles, callees[i]) == 0) {
+            fprintf(stderr, "expect %s invoked only without inlining\n", callees[i]);
+            return 1;
+        }
+    }
+
+    // objects are allocated in create, even if it is inlined into run
+    if (strstr(inlined_report, "Inlining.create:18") == NULL || strstr(called_report, "Inlining.create:18") == NULL) {
+        fprintf(stderr, "the allocation site is not in the callee\n");
+        return 1;
+    }
+    free(inlined_report);
+    free(called_report);
+    free(inlined_profiles);
+    free(called_profiles);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#include "../main.h"
+
+int main(int argc, char *argv[]) {
+    char *classes[1] = {"BadMaxStack.class"};
+    struct vm *vm;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+
+    // the operand stack of main overflows its max_stack, which is found before it runs
+    if (load_class(vm, "BadMaxStack.class") != NULL) {
+        fprintf(stderr, "loaded a class exceeding max_stack\n");
+        return 1;
+    }
+    if (run_vm(vm, classes, 1) == 3) {
+        fprintf(stderr, "ran a class exceeding max_stack\n");
+        return 1;
+    }
+
+    destroy_vm(vm);
+    return 0;
+}
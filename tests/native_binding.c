@@ -0,0 +1,42 @@
+#include "../main.h"
+#include "../jni.h"
+
+// natives of NativeBinding are linked into this program, and found when they are called first
+
+static int linked_calls = 0;
+
+JNIEXPORT jint JNICALL Java_NativeBinding_linked(JNIEnv *env, jclass class, jint x) {
+    linked_calls++;
+    return x + 1;
+}
+
+JNIEXPORT jint JNICALL Java_NativeBinding_replaced(JNIEnv *env, jclass class, jint x) {
+    return -x;
+}
+
+static jint JNICALL registered_replaced(JNIEnv *env, jclass class, jint x) {
+    return x * 2;
+}
+
+// registered natives are preferred to the bound one from the next call
+JNIEXPORT void JNICALL Java_NativeBinding_replace(JNIEnv *env, jclass class) {
+    JNINativeMethod methods[1] = {{"replaced", "(I)I", (void *) registered_replaced}};
+    (*env)->RegisterNatives(env, class, methods, 1);
+}
+
+int main(int argc, char *argv[]) {
+    char *classes[1] = {"NativeBinding.class"};
+    int retval;
+
+    // 5050 by linked, -1 by replaced before replace, and 200 after
+    retval = run(classes, 1);
+    if (retval != 5249) {
+        fprintf(stderr, "expect %d but actual %d\n", 5249, retval);
+        return 1;
+    }
+    if (linked_calls != 100) {
+        fprintf(stderr, "expect %d calls but actual %d\n", 100, linked_calls);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "../main.h"
+#include "../jni.h"
+
+// natives of NativeMethods are linked into this program
+
+JNIEXPORT jobject JNICALL Java_NativeMethods_create(JNIEnv *env, jclass class, jint x) {
+    jmethodID init = (*env)->GetMethodID(env, class, "<init>", "(I)V");
+    return (*env)->NewObject(env, class, init, x);
+}
+
+JNIEXPORT jdouble JNICALL Java_NativeMethods_toDouble(JNIEnv *env, jclass class, jint x) {
+    return x;
+}
+
+JNIEXPORT jdouble JNICALL Java_NativeMethods_half(JNIEnv *env, jclass class, jdouble x) {
+    return x / 2;
+}
+
+JNIEXPORT jfloat JNICALL Java_NativeMethods_toFloat(JNIEnv *env, jclass class, jdouble x) {
+    return (jfloat) x;
+}
+
+JNIEXPORT jlong JNICALL Java_NativeMethods_toLong(JNIEnv *env, jclass class, jfloat x) {
+    return (jlong) x;
+}
+
+JNIEXPORT jint JNICALL Java_NativeMethods_toInt(JNIEnv *env, jclass class, jlong x) {
+    return (jint) x;
+}
+
+JNIEXPORT jint JNICALL Java_NativeMethods_sum(JNIEnv *env, jclass class,
+        jlong a, jint b, jbyte c, jshort d, jchar e, jboolean f, jfloat g, jdouble h) {
+    return (jint) (a + b + c + d + e + f + g + h);
+}
+
+// critical natives take neither JNIEnv nor jclass
+JNIEXPORT jint JNICALL JavaCritical_NativeMethods_critical(jint a, jint b, jint c, jint d, jint e, jint f, jint g, jint h) {
+    return a * 1 + b * 2 + c * 3 + d * 4 + e * 5 + f * 6 + g * 7 + h * 8;
+}
+
+JNIEXPORT jint JNICALL Java_NativeMethods_callTwice(JNIEnv *env, jclass class, jint x) {
+    jmethodID twice = (*env)->GetStaticMethodID(env, class, "twice", "(I)I");
+    return (*env)->CallStaticIntMethod(env, class, twice, x);
+}
+
+JNIEXPORT jint JNICALL Java_NativeMethods_getX(JNIEnv *env, jobject this) {
+    jfieldID x = (*env)->GetFieldID(env, (*env)->GetObjectClass(env, this), "x", "I");
+    return (*env)->GetIntField(env, this, x);
+}
+
+int main(int argc, char *argv[]) {
+    char *classes[1] = {"NativeMethods.class"};
+    int retval = run(classes, 1);
+
+    if (retval == 295) {
+        return 0;
+    } else {
+        fprintf(stderr, "expect %d but actual %d\n", 295, retval);
+        return 1;
+    }
+}
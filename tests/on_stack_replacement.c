@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tiering.h"
+
+/**
+ * Run OnStackReplacement with the threshold of the optimized tier, and store the profiles of methods.
+ * Return the number of created objects, or -1 if failed.
+ */
+static long long run_on_stack_replacement(long optimize_threshold, char **profiles) {
+    long long allocated;
+    struct vm *vm;
+
+    vm = create_tiered_vm(-1, optimize_threshold, -1);
+    if (vm == NULL || run_expected(vm, "OnStackReplacement.class", 2997) != 0) {
+        return -1;
+    }
+    allocated = get_allocated_objects(vm);
+    *profiles = print_report(vm, print_method_profiles);
+    destroy_vm(vm);
+    return *profiles != NULL ? allocated : -1;
+}
+
+/**
+ * Return whether main is invoked once in the tier, with all the 1000 backedges of its loop counted.
+ */
+static int main_runs_in(const char *profiles, const char *tier) {
+    char actual_tier[32];
+    long invocations, backedges;
+
+    return get_method_profile(profiles, "OnStackReplacement.main", actual_tier, &invocations, &backedges) == 0
+            && strcmp(actual_tier, tier) == 0 && invocations == 1 && backedges == 1000;
+}
+
+int main(int argc, char *argv[]) {
+    char *profiles;
+    long long allocated;
+
+    // main is invoked once, and its loop of 1000 iterations is not promoted by default
+    allocated = run_on_stack_replacement(-1, &profiles);
+    if (allocated != 1001 || !main_runs_in(profiles, "interpreted")) {
+        fprintf(stderr, "expect %d objects in the interpreted loop but actual %lld\n", 1001, allocated);
+        return 1;
+    }
+    free(profiles);
+
+    // the loop continues in the optimized code after 99 iterations, where objects of each iteration are not created.
+    // total is created before the loop, and is still used after the frame is replaced.
+    allocated = run_on_stack_replacement(100, &profiles);
+    if (allocated != 100 || !main_runs_in(profiles, "optimized")) {
+        fprintf(stderr, "expect %d objects with on-stack replacement but actual %lld\n", 100, allocated);
+        return 1;
+    }
+    free(profiles);
+    return 0;
+}
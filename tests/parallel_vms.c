@@ -0,0 +1,55 @@
+#include <pthread.h>
+#include "../main.h"
+
+#define REPEAT 20
+
+struct program {
+    char *class_name;
+    int expected;
+    pthread_t thread;
+    int failed;
+};
+
+// Each thread runs its program repeatedly on its own VM
+static void *run_program(void *arg) {
+    struct program *program = arg;
+    char *classes[1];
+    int i, retval;
+
+    classes[0] = program->class_name;
+    for (i = 0; i < REPEAT; i++) {
+        retval = run(classes, 1);
+        if (retval != program->expected) {
+            fprintf(stderr, "%s: expect %d but actual %d\n", program->class_name, program->expected, retval);
+            program->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    // InitializeClass updates a static field and JustReturn calls System.exit
+    struct program programs[] = {
+            {"First.class", 42},
+            {"InitializeClass.class", 48},
+            {"CreateInstance.class", 49},
+            {"InstanceFields.class", 50},
+            {"JustReturn.class", 52},
+            {"InitializeClass.class", 48},
+            {"JustReturn.class", 52},
+    };
+    int i, len = sizeof(programs) / sizeof(programs[0]), failed = 0;
+
+    for (i = 0; i < len; i++) {
+        if (pthread_create(&programs[i].thread, NULL, run_program, &programs[i]) != 0) {
+            fprintf(stderr, "failed to create thread\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < len; i++) {
+        pthread_join(programs[i].thread, NULL);
+        failed |= programs[i].failed;
+    }
+
+    return failed;
+}
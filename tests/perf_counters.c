@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include <string.h>
+#include "../main.h"
+
+// exit code to skip the test (see tests/CMakeLists.txt)
+#define SKIP 77
+
+int main(int argc, char *argv[]) {
+    char *classes[2] = {"CallStaticMethodCaller.class", "CallStaticMethodCallee.class"};
+    struct vm *vm;
+    char *report;
+    size_t report_size;
+    FILE *out;
+    int retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    if (enable_perf_counters(vm) != 0) {
+        // e.g. perf_event_open is not permitted
+        destroy_vm(vm);
+        return SKIP;
+    }
+
+    retval = run_vm(vm, classes, 2);
+    if (retval != 46) {
+        fprintf(stderr, "expect %d but actual %d\n", 46, retval);
+        return 1;
+    }
+
+    out = open_memstream(&report, &report_size);
+    print_perf_counters(vm, out);
+    fclose(out);
+    fprintf(stderr, "%s", report);
+    destroy_vm(vm);
+
+    // both the caller and the callee are measured
+    if (strstr(report, "CallStaticMethodCaller.main") == NULL || strstr(report, "CallStaticMethodCallee.") == NULL) {
+        fprintf(stderr, "methods are not reported\n");
+        return 1;
+    }
+    free(report);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include "../main.h"
+
+// JITDUMP_MAGIC in main.c
+#define JITDUMP_MAGIC 0x4A695444
+
+int main(int argc, char *argv[]) {
+    char *classes[2] = {"CallStaticMethodCaller.class", "CallStaticMethodCallee.class"};
+    char dir[] = "/tmp/min_jvm_jitdumpXXXXXX";
+    char map_path[1024], dump_path[1024], line[4096];
+    u_int32_t magic = 0;
+    bool named = false;
+    struct vm *vm;
+    FILE *f;
+    int retval;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(map_path, sizeof(map_path), "/tmp/perf-%d.map", (int) getpid());
+    snprintf(dump_path, sizeof(dump_path), "%s/jit-%d.dump", dir, (int) getpid());
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    if (enable_perf_map(vm, dir) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+
+    // methods are called through their entries
+    retval = run_vm(vm, classes, 2);
+    destroy_vm(vm);
+    if (retval != 46) {
+        fprintf(stderr, "expect %d but actual %d\n", 46, retval);
+        return 1;
+    }
+
+    f = fopen(map_path, "r");
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        fprintf(stderr, "%s", line);
+        named = named || strstr(line, " CallStaticMethodCallee.return46()I") != NULL;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    f = fopen(dump_path, "r");
+    if (f != NULL) {
+        if (fread(&magic, sizeof(magic), 1, f) != 1) {
+            magic = 0;
+        }
+        fclose(f);
+    }
+    unlink(map_path);
+    unlink(dump_path);
+    rmdir(dir);
+
+    if (!named) {
+        fprintf(stderr, "the method is not named in the perf map\n");
+        return 1;
+    }
+    if (magic != JITDUMP_MAGIC) {
+        fprintf(stderr, "jitdump is not written\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../main.h"
+
+/**
+ * Run OnStackReplacement for a while with the sampling profiler, and return the folded stacks of samples.
+ * main is optimized at its first invocation, with its callees inlined into it if inlining is not 0.
+ * The number of runs and of created objects are stored too.
+ * Return NULL if failed.
+ */
+static char *profile_program(int inlining, long long *runs, long long *allocated) {
+    char *classes[1] = {"OnStackReplacement.class"};
+    struct vm *vm;
+    char *report;
+    size_t report_size;
+    FILE *out;
+    clock_t start;
+    int retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return NULL;
+    }
+    set_tier_thresholds(vm, -1, 0);
+    set_inlining(vm, -1, inlining ? 9 : 0);
+    if (enable_profiler(vm, 10000, NULL) != 0) {
+        destroy_vm(vm);
+        return NULL;
+    }
+
+    // samples are taken at the ticks of the kernel (a few hundred a second), and a callee is on top of
+    // a few percent of them, so the program is repeated long enough to catch it
+    *runs = 0;
+    start = clock();
+    while (clock() - start < CLOCKS_PER_SEC) {
+        retval = run_vm(vm, classes, 1);
+        if (retval != 2997) {
+            fprintf(stderr, "expect %d but actual %d\n", 2997, retval);
+            destroy_vm(vm);
+            return NULL;
+        }
+        (*runs)++;
+    }
+    *allocated = get_allocated_objects(vm);
+
+    out = open_memstream(&report, &report_size);
+    print_profile(vm, out);
+    fclose(out);
+    fprintf(stderr, "%s", report);
+    destroy_vm(vm);
+    return report;
+}
+
+int main(int argc, char *argv[]) {
+    char *report;
+    long long runs, allocated;
+    int inlining;
+
+    // the constructor and get are sampled on top of main with source lines, whether they are called
+    // or inlined into main (where the objects of the loop are not created)
+    for (inlining = 0; inlining <= 1; inlining++) {
+        report = profile_program(inlining, &runs, &allocated);
+        if (report == NULL) {
+            return 1;
+        }
+        if (allocated != (inlining ? runs : runs * 1001)) {
+            fprintf(stderr, "expect callees %s but %lld objects in %lld runs\n", inlining ? "inlined" : "called",
+                    allocated, runs);
+            return 1;
+        }
+        if (strstr(report, "OnStackReplacement.main:16;OnStackReplacement.<init>:") == NULL
+            && strstr(report, "OnStackReplacement.main:17;OnStackReplacement.get:10") == NULL) {
+            fprintf(stderr, "no callee is sampled on top of the caller (inlining %d)\n", inlining);
+            return 1;
+        }
+        free(report);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../main.h"
+#include "../recording.h"
+
+static void *run_spin(void *arg) {
+    char *classes[1] = {"Spin.class"};
+
+    run_vm(arg, classes, 1);
+    return NULL;
+}
+
+/**
+ * Return 0 if the events of a running program are written within a few seconds, return 1 otherwise.
+ * Spin loops forever after loading, so its few records never fill the buffer.
+ */
+static int check_periodic_flush(void) {
+    char path[] = "/tmp/min_jvm_recordingXXXXXX";
+    struct vm *vm;
+    struct stat st;
+    pthread_t thread;
+    int fd, i, written = 0;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    vm = create_vm();
+    if (vm == NULL || enable_recorder(vm, path) != 0 || pthread_create(&thread, NULL, run_spin, vm) != 0) {
+        unlink(path);
+        return 1;
+    }
+    for (i = 0; i < 30 && !written; i++) {
+        usleep(100 * 1000);
+        written = stat(path, &st) == 0 && st.st_size > (off_t) sizeof(struct recording_header);
+    }
+    request_shutdown(vm, 1);
+    pthread_join(thread, NULL);
+    destroy_vm(vm);
+    unlink(path);
+    if (!written) {
+        fprintf(stderr, "no chunk is written while the program runs\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Run the program with the recorder and the threshold of the optimized tier, and count records of each type.
+ * The type of the last record is stored too.
+ * Return 0 if success, return 1 otherwise.
+ */
+static int record_program(char *class_file, long optimize_threshold, int expected, int *counts, int *last_type) {
+    char *classes[1] = {class_file};
+    char path[] = "/tmp/min_jvm_recordingXXXXXX";
+    struct vm *vm;
+    struct recording_header header;
+    struct recording_chunk chunk;
+    struct record record;
+    int fd, retval;
+    u_int32_t i;
+    FILE *f;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    set_tier_thresholds(vm, -1, optimize_threshold);
+    if (enable_recorder(vm, path) != 0) {
+        destroy_vm(vm);
+        return 1;
+    }
+    retval = run_vm(vm, classes, 1);
+    if (retval != expected) {
+        fprintf(stderr, "expect %d but actual %d\n", expected, retval);
+        return 1;
+    }
+    destroy_vm(vm);
+
+    f = fopen(path, "r");
+    unlink(path);
+    if (f == NULL || fread(&header, sizeof(header), 1, f) != 1 || strcmp(header.magic, RECORDING_MAGIC) != 0) {
+        fprintf(stderr, "recording is not written\n");
+        return 1;
+    }
+    memset(counts, 0, RECORD_TYPE_NUM * sizeof(int));
+    while (fread(&chunk, sizeof(chunk), 1, f) == 1 && chunk.magic == RECORDING_CHUNK_MAGIC) {
+        for (i = 0; i < chunk.record_num && fread(&record, sizeof(record), 1, f) == 1; i++) {
+            fprintf(stderr, "%u %s %llu\n", record.type, record.name, (unsigned long long) record.value);
+            if (record.type < RECORD_TYPE_NUM) {
+                counts[record.type]++;
+            }
+            *last_type = record.type;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int counts[RECORD_TYPE_NUM], last_type = 0;
+
+    // the class loaded by run_vm, its instance and the shutdown at last
+    if (record_program("CreateInstance.class", -1, 49, counts, &last_type) != 0) {
+        return 1;
+    }
+    if (counts[RECORD_CLASS_LOAD] == 0 || counts[RECORD_RESOLVE] == 0 || counts[RECORD_ALLOCATION] == 0) {
+        fprintf(stderr, "events are not recorded\n");
+        return 1;
+    }
+    if (last_type != RECORD_SHUTDOWN) {
+        fprintf(stderr, "shutdown is not recorded at last\n");
+        return 1;
+    }
+
+    // the loop of main is promoted after 99 iterations, and continues in the optimized code
+    if (record_program("OnStackReplacement.class", 100, 2997, counts, &last_type) != 0) {
+        return 1;
+    }
+    if (counts[RECORD_OPTIMIZE] == 0 || counts[RECORD_OSR] != 1) {
+        fprintf(stderr, "expect promotions and %d on-stack replacement but actual %d and %d\n", 1,
+                counts[RECORD_OPTIMIZE], counts[RECORD_OSR]);
+        return 1;
+    }
+    return check_periodic_flush();
+}
@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "../main.h"
+
+struct program {
+    struct vm *vm;
+    int retval;
+};
+
+static pthread_t vm_thread;
+static int operated_on_vm_thread = 0;
+static int dropped_operation_ran = 0;
+
+static void *run_program(void *arg) {
+    struct program *program = arg;
+    char *classes[1] = {"Spin.class"};
+
+    program->retval = run_vm(program->vm, classes, 1);
+    return NULL;
+}
+
+static void operation(struct vm *vm, void *arg) {
+    operated_on_vm_thread = pthread_equal(pthread_self(), vm_thread) && arg == (void *) vm;
+}
+
+static void dropped_operation(struct vm *vm, void *arg) {
+    dropped_operation_ran = 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct program program;
+    char *classes[1] = {"Spin.class"};
+
+    program.vm = create_vm();
+    if (program.vm == NULL) {
+        return 1;
+    }
+
+    // Spin loops forever, so it ends only by requests at safepoints
+    if (pthread_create(&vm_thread, NULL, run_program, &program) != 0) {
+        return 1;
+    }
+    usleep(100 * 1000);
+
+    // the VM runs on one thread at a time
+    if (run_vm(program.vm, classes, 1) != 1) {
+        fprintf(stderr, "ran the VM on two threads\n");
+        return 1;
+    }
+
+    if (submit_vm_operation(program.vm, operation, program.vm) != 0) {
+        return 1;
+    }
+    request_shutdown(program.vm, 42);
+    pthread_join(vm_thread, NULL);
+
+    if (program.retval != 42) {
+        fprintf(stderr, "expect %d but actual %d\n", 42, program.retval);
+        return 1;
+    }
+    if (!operated_on_vm_thread) {
+        fprintf(stderr, "operation did not run on the thread of the VM\n");
+        return 1;
+    }
+    destroy_vm(program.vm);
+
+    // a VM which never polls again drops its queued operations when destroyed
+    program.vm = create_vm();
+    if (program.vm == NULL || submit_vm_operation(program.vm, dropped_operation, NULL) != 0) {
+        return 1;
+    }
+    destroy_vm(program.vm);
+    if (dropped_operation_ran) {
+        fprintf(stderr, "operation ran after the VM stopped\n");
+        return 1;
+    }
+    return 0;
+}
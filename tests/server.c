@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../main.h"
+
+static int expect(char *what, int expected, int actual) {
+    if (expected != actual) {
+        fprintf(stderr, "%s: expect %d but actual %d\n", what, expected, actual);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char socket_path[108];
+    char *initialize[1] = {"InitializeClass.class"};
+    char *two_arg[1] = {"CallStaticMethodTwoArg.class"};
+    struct vm *vm;
+    pid_t pid;
+    int i, status, failed = 0;
+
+    snprintf(socket_path, sizeof(socket_path), "/tmp/min_jvm_test_server_%d.sock", getpid());
+    unlink(socket_path);
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        // InitializeClass is initialized once in the server
+        vm = create_vm();
+        if (vm == NULL || load_class(vm, initialize[0]) == NULL) {
+            _exit(1);
+        }
+        status = serve_vm(vm, socket_path);
+        destroy_vm(vm);
+        _exit(status == 0 ? 0 : 1);
+    }
+
+    // wait for the server
+    for (i = 0; i < 500 && access(socket_path, F_OK) != 0; i++) {
+        usleep(10000);
+    }
+
+    // each request starts from the initialized statics
+    failed |= expect("first request", 48, request_run(socket_path, initialize, 1));
+    failed |= expect("second request", 48, request_run(socket_path, initialize, 1));
+    // classes not loaded by the server are loaded by the request
+    failed |= expect("other class", 44, request_run(socket_path, two_arg, 1));
+
+    failed |= expect("stop", 0, request_stop(socket_path));
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+        return 1;
+    }
+    failed |= expect("server exit", 0, WEXITSTATUS(status));
+
+    return failed;
+}
@@ -0,0 +1,87 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "../main.h"
+#include "../jni.h"
+
+static int expect(char *what, int expected, int actual) {
+    if (expected != actual) {
+        fprintf(stderr, "%s: expect %d but actual %d\n", what, expected, actual);
+        return 1;
+    }
+    return 0;
+}
+
+static void *run_spin(void *arg) {
+    char *classes[1] = {"Spin.class"};
+
+    run_vm(arg, classes, 1);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    char image_path[1024];
+    char *initialize[1] = {"InitializeClass.class"};
+    char *reference[1] = {"StaticReferenceField.class"};
+    struct vm *vm, *running;
+    pthread_t thread;
+    JNIEnv *env;
+    jclass initialize_class, reference_class;
+    jmethodID main_method;
+    jfieldID srf, x;
+    jvalue args[1], result;
+    int failed = 0;
+
+    snprintf(image_path, sizeof(image_path), "/tmp/min_jvm_test_snapshot_%d.img", getpid());
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    env = get_env(vm);
+    initialize_class = load_class(vm, initialize[0]);
+    reference_class = load_class(vm, reference[0]);
+    if (initialize_class == NULL || reference_class == NULL) {
+        return 1;
+    }
+
+    // change statics and objects after initialization: count = 48, srf.x = 60
+    main_method = (*env)->GetStaticMethodID(env, initialize_class, "main", "([Ljava/lang/String;)I");
+    args[0].l = NULL;
+    if (call_method(vm, main_method, NULL, args, &result) != 0) {
+        return 1;
+    }
+    srf = (*env)->GetStaticFieldID(env, reference_class, "srf", "LStaticReferenceField;");
+    x = (*env)->GetFieldID(env, reference_class, "x", "I");
+    (*env)->SetIntField(env, (*env)->GetStaticObjectField(env, reference_class, srf), x, 60);
+
+    if (save_snapshot(vm, image_path) != 0) {
+        return 1;
+    }
+    destroy_vm(vm);
+
+    // a running program is not saved
+    running = create_vm();
+    if (running == NULL || pthread_create(&thread, NULL, run_spin, running) != 0) {
+        return 1;
+    }
+    usleep(100 * 1000);
+    failed |= expect("saved while running", -1, save_snapshot(running, image_path));
+    request_shutdown(running, 1);
+    pthread_join(thread, NULL);
+    destroy_vm(running);
+
+    // <clinit> is not executed again, and the state is restored from the image without reading class files
+    if (chdir("/") != 0) {
+        return 1;
+    }
+    vm = restore_vm(image_path);
+    if (vm == NULL) {
+        return 1;
+    }
+    failed |= expect("statics", 49, run_vm(vm, initialize, 1));
+    failed |= expect("objects", 60, run_vm(vm, reference, 1));
+    destroy_vm(vm);
+
+    unlink(image_path);
+    return failed;
+}
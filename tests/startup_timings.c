@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <string.h>
+#include "../main.h"
+
+int main(int argc, char *argv[]) {
+    char *classes[2] = {"InitializeClass.class", "CreateInstance.class"};
+    struct class_file *class;
+    struct vm *vm;
+    char *report;
+    size_t report_size;
+    FILE *out;
+    int retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+
+    retval = run_vm(vm, classes, 2);
+    if (retval != 48) {
+        fprintf(stderr, "expect %d but actual %d\n", 48, retval);
+        return 1;
+    }
+
+    // each phase of a loaded class is timed
+    class = (struct class_file *) load_class(vm, "InitializeClass.class");
+    if (class == NULL || class->timings.open == 0 || class->timings.read == 0 || class->timings.constant_pool == 0
+            || class->timings.methods == 0 || class->timings.clinit == 0) {
+        fprintf(stderr, "phases are not timed\n");
+        return 1;
+    }
+
+    out = open_memstream(&report, &report_size);
+    print_startup_timings(vm, out, 0);
+    fclose(out);
+    fprintf(stderr, "%s", report);
+    if (strstr(report, "InitializeClass") == NULL || strstr(report, "main lookup") == NULL) {
+        fprintf(stderr, "phases are not reported\n");
+        return 1;
+    }
+    free(report);
+
+    out = open_memstream(&report, &report_size);
+    print_startup_timings(vm, out, 1);
+    fclose(out);
+    fprintf(stderr, "%s", report);
+    destroy_vm(vm);
+    if (report[0] != '{' || strstr(report, "{\"name\": \"CreateInstance\", \"open\": ") == NULL
+            || strstr(report, "\"main\": ") == NULL) {
+        fprintf(stderr, "phases are not reported in JSON\n");
+        return 1;
+    }
+    free(report);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tiering.h"
+
+/**
+ * Run TieredExecution with the thresholds of tiers, and return the profiles of methods, or NULL if failed.
+ */
+static char *run_tiered_execution(long profile_threshold, long optimize_threshold) {
+    struct vm *vm;
+    char *report;
+
+    vm = create_tiered_vm(profile_threshold, optimize_threshold, -1);
+    if (vm == NULL || run_expected(vm, "TieredExecution.class", 100) != 0) {
+        return NULL;
+    }
+    report = print_report(vm, print_method_profiles);
+    destroy_vm(vm);
+    return report;
+}
+
+/**
+ * Return whether the report has the tier and the counters of the method.
+ */
+static int has_method(char *report, char *tier, long invocations, long backedges, char *method) {
+    char actual_tier[32];
+    long actual_invocations, actual_backedges;
+
+    if (get_method_profile(report, method, actual_tier, &actual_invocations, &actual_backedges) != 0
+            || strcmp(actual_tier, tier) != 0 || actual_invocations != invocations || actual_backedges != backedges) {
+        fprintf(stderr, "not found: %s %ld %ld %s\n", tier, invocations, backedges, method);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    char *report;
+
+
+    // main is run once, run 20 times, and abs and getValue 100 times
+    report = run_tiered_execution(10, 1000);
+    if (report == NULL) {
+        return 1;
+    }
+    if (!has_method(report, "interpreted", 1, 20, "TieredExecution.main")
+            || !has_method(report, "profiled", 20, 100, "TieredExecution.run")
+            || !has_method(report, "profiled", 100, 0, "TieredExecution.abs")
+            || !has_method(report, "profiled", 100, 0, "TieredExecution.getValue")) {
+        return 1;
+    }
+    // the branch of abs (x >= 0) is never taken after it is profiled, and the receiver of getValue is always the same
+    if (strstr(report, " 0             91 TieredExecution.abs:14\n") == NULL
+            || strstr(report, "55 TieredExecution TieredExecution.run:24\n") == NULL) {
+        fprintf(stderr, "branches or receivers are not profiled\n");
+        return 1;
+    }
+    free(report);
+
+    // backedges count toward the optimized tier
+    report = run_tiered_execution(10, 50);
+    if (report == NULL) {
+        return 1;
+    }
+    if (!has_method(report, "interpreted", 1, 20, "TieredExecution.main")
+            || !has_method(report, "optimized", 20, 100, "TieredExecution.run")
+            || !has_method(report, "optimized", 100, 0, "TieredExecution.abs")) {
+        return 1;
+    }
+    free(report);
+
+    report = run_tiered_execution(-1, -1);
+    if (report == NULL) {
+        return 1;
+    }
+    if (strstr(report, "           200 profiled") == NULL || strstr(report, "          5000 optimized") == NULL
+            || !has_method(report, "interpreted", 100, 0, "TieredExecution.abs")) {
+        return 1;
+    }
+    free(report);
+    return 0;
+}
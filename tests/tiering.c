@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tiering.h"
+
+struct vm *create_tiered_vm(long profile_threshold, long optimize_threshold, int max_depth) {
+    struct vm *vm;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return NULL;
+    }
+    set_tier_thresholds(vm, profile_threshold, optimize_threshold);
+    set_inlining(vm, -1, max_depth);
+    return vm;
+}
+
+int run_expected(struct vm *vm, char *class_file, int expected) {
+    char *classes[1] = {class_file};
+    int retval;
+
+    retval = run_vm(vm, classes, 1);
+    if (retval != expected) {
+        fprintf(stderr, "expect %d but actual %d\n", expected, retval);
+        destroy_vm(vm);
+        return -1;
+    }
+    return 0;
+}
+
+char *print_report(struct vm *vm, void (*print)(struct vm *vm, FILE *out)) {
+    char *report;
+    size_t report_size;
+    FILE *out;
+
+    out = open_memstream(&report, &report_size);
+    if (out == NULL) {
+        perror("open_memstream");
+        return NULL;
+    }
+    print(vm, out);
+    fclose(out);
+    fprintf(stderr, "%s", report);
+    return report;
+}
+
+int get_method_profile(const char *profiles, const char *method, char *tier, long *invocations, long *backedges) {
+    char name[1024];
+    const char *line;
+
+    line = strstr(profiles, "== methods");
+    for (line = line == NULL ? NULL : strchr(line, '\n'); line != NULL; line = strchr(line, '\n')) {
+        line++;
+        if (sscanf(line, "%31s %ld %ld %1023s", tier, invocations, backedges, name) != 4) {
+            break;
+        }
+        if (strcmp(name, method) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,35 @@
+//
+// Helpers of the tests of tiers, on-stack replacement, inlining and escape analysis (see tiering.c).
+//
+
+#ifndef MIN_JVM_TESTS_TIERING_H
+#define MIN_JVM_TESTS_TIERING_H
+
+#include "../main.h"
+
+/**
+ * Create a VM with the thresholds of tiers and the depth of inlining (-1 keeps the default of each).
+ * Return NULL if failed.
+ */
+struct vm *create_tiered_vm(long profile_threshold, long optimize_threshold, int max_depth);
+
+/**
+ * Run the class file on the VM, which is destroyed unless the program returns expected.
+ * Return 0 if success, return -1 otherwise.
+ */
+int run_expected(struct vm *vm, char *class_file, int expected);
+
+/**
+ * Print a report of the VM (e.g. print_method_profiles) into a string, which is also dumped to stderr.
+ * Return the string to be freed, or NULL if failed.
+ */
+char *print_report(struct vm *vm, void (*print)(struct vm *vm, FILE *out));
+
+/**
+ * Read the tier and the counters of the method (e.g. "Inlining.twice") in the report of print_method_profiles.
+ * tier has at least 32 bytes.
+ * Return 0 if found, return -1 if the method is not invoked.
+ */
+int get_method_profile(const char *profiles, const char *method, char *tier, long *invocations, long *backedges);
+
+#endif //MIN_JVM_TESTS_TIERING_H
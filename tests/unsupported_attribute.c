@@ -0,0 +1,24 @@
+#include "../main.h"
+
+int main(int argc, char *argv[]) {
+    char *classes[1] = {"UnsupportedAttribute.class"};
+    struct vm *vm;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+
+    // the class fails to be parsed at the Exceptions attribute of main, after its fields and <init>
+    if (load_class(vm, "UnsupportedAttribute.class") != NULL) {
+        fprintf(stderr, "loaded a class with an attribute not supported\n");
+        return 1;
+    }
+    if (run_vm(vm, classes, 1) == 3) {
+        fprintf(stderr, "ran a class with an attribute not supported\n");
+        return 1;
+    }
+
+    destroy_vm(vm);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <limits.h>
+#include <string.h>
+#include "../main.h"
+#include "../jni.h"
+
+/**
+ * Call the static method taking two ints.
+ * Return 0 if it returns expected without errors, or if it fails by the expected error. Return 1 otherwise.
+ */
+static int expect_call(struct vm *vm, jmethodID method, int a, int b, int expected, const char *error) {
+    jvalue args[2], result;
+    const char *actual;
+
+    args[0].i = a;
+    args[1].i = b;
+    if ((call_method(vm, method, NULL, args, &result) == 0) != (error == NULL)) {
+        fprintf(stderr, "expect %s for (%d, %d)\n", error == NULL ? "success" : "failure", a, b);
+        return 1;
+    }
+    actual = get_vm_error(vm);
+    if (error == NULL ? actual != NULL : actual == NULL || strcmp(actual, error) != 0) {
+        fprintf(stderr, "expect error %s but actual %s\n", error == NULL ? "(none)" : error,
+                actual == NULL ? "(none)" : actual);
+        return 1;
+    }
+    if (error == NULL && result.i != expected) {
+        fprintf(stderr, "expect %d but actual %d\n", expected, result.i);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *classes[1] = {"VmErrors.class"};
+    struct vm *vm;
+    JNIEnv *env;
+    jclass class;
+    jmethodID divide, remainder;
+    int retval;
+
+    vm = create_vm();
+    if (vm == NULL) {
+        return 1;
+    }
+    retval = run_vm(vm, classes, 1);
+    if (retval != 42 || get_vm_error(vm) != NULL) {
+        fprintf(stderr, "expect %d but actual %d\n", 42, retval);
+        return 1;
+    }
+
+    // division by zero stops the call by ArithmeticException, and the next call runs without the error
+    env = get_env(vm);
+    class = load_class(vm, "VmErrors.class");
+    divide = (*env)->GetStaticMethodID(env, class, "divide", "(II)I");
+    remainder = (*env)->GetStaticMethodID(env, class, "remainder", "(II)I");
+    if (expect_call(vm, divide, 1, 0, 0, "java/lang/ArithmeticException") != 0
+        || expect_call(vm, remainder, 1, 0, 0, "java/lang/ArithmeticException") != 0
+        || expect_call(vm, divide, INT_MIN, -1, INT_MIN, NULL) != 0
+        || expect_call(vm, remainder, -7, 2, -1, NULL) != 0) {
+        return 1;
+    }
+
+    // a class whose <clinit> failed is not initialized at the next load either
+    if (load_class(vm, "FailedInitialization.class") != NULL || load_class(vm, "FailedInitialization.class") != NULL) {
+        fprintf(stderr, "loaded a class whose <clinit> failed\n");
+        return 1;
+    }
+
+    destroy_vm(vm);
+    return 0;
+}